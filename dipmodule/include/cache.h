@@ -17,40 +17,13 @@ struct CacheEntry
 {
 	u32 Sector;
 	u32 Count;
-	u32 LastAccess;
 	u8* Data;
-	
-	CacheEntry()
-	{
-		Sector = CACHE_FREE;
-		Count = 0;
-		LastAccess = 0;
-		Data = NULL;
-	}
-	
-	void SetSize(u32 size)
-	{
-		if (Data)
-			delete[] Data;
-		Data = new u8[size];
-	}
-	
-	void Clear()
-	{
-		if (Data)
-			delete[] Data;
-		Data = NULL;
-		LastAccess = 0;
-		Count = 0;
-		Sector = CACHE_FREE;
-	}
-
-	~CacheEntry()
-	{
-		Clear();
-	}
+	u32 NextHash; // the next entry in the same bucket, or Pages
 };
 
+// Pages are found through a hash of their first sector. They're reused
+// in turn rather than by last access, so the pages read-ahead fills in one
+// go lie next to each other in Data and can be read straight into it.
 class Cache
 {
 private:
@@ -60,10 +33,19 @@ private:
 	u32 SectorsPerPage;
 	CacheEntry* Entries;
 	u32 SectorSize;
+	u32 ReadAhead;
+	u8* Data;
+	u32* Buckets;
+	u32 BucketMask;
+	u32 NextPage; // the next one to be reused
+	u32 NextSector; // where the last read ended, to tell when it's streaming
+	CacheEntry* FindPage(u32 sector);
+	void RemovePage(u32 page);
+	void InsertPage(u32 page, u32 sector);
 	CacheEntry* GetPage(u32 sector);
 	
 public:
-	Cache(u32 pages, u32 sectorsPerPage, u32 sectorSize, ReadSectorsFunction readsectors, void* userdata);
+	Cache(u32 pages, u32 sectorsPerPage, u32 sectorSize, ReadSectorsFunction readsectors, void* userdata, u32 readAhead = 0);
 	~Cache();
 	
 	bool ReadPartialSector(void* buffer, u32 sector, u32 offset, u32 size);
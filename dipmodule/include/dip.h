@@ -4,7 +4,10 @@
 
 #include <diprovider.h>
 
-#define MAX_OPEN_FILES 8
+#include <patchindex.h>
+
+#define MAX_OPEN_FILES 8 // file handles kept open until the launcher asks for more
+#define MAX_FILE_HANDLES 32
 #define MAX_FOUND MAX_OPEN_FILES
 
 namespace ProxiIOS { namespace DIP {
@@ -61,7 +64,9 @@ namespace ProxiIOS { namespace DIP {
 			SetFileProvider              = 0xC7,
 			SetShiftBase                 = 0xC8,
 			BanTitle                     = 0xC9,
-			DLCDir                       = 0xCA
+			DLCDir                       = 0xCA,
+			SetFileHandles               = 0xCB,
+			GetFileHandleStats           = 0xCC
 		};
 	}
 
@@ -96,6 +101,15 @@ namespace ProxiIOS { namespace DIP {
 		};
 	}
 
+	struct FileHandleStats {
+		u32 Handles;
+		u32 Open;
+		u32 Hits;
+		u32 Misses; // File_Open calls
+		u32 Evictions; // closed to make room for another file
+		u32 Expired; // closed by the idle timer
+	};
+
 	class DIP : public ProxiIOS::ProxyModule
 	{
 		private:
@@ -105,12 +119,20 @@ namespace ProxiIOS { namespace DIP {
 				s16 fileid;
 				s32 fd;
 				u32 lastaccess;
+				struct DIPFile *prev; // LRU order, OpenFiles is the most recent
 				struct DIPFile *next;
-			} DIPFiles[MAX_OPEN_FILES];
+				struct DIPFile *hashnext;
+			} *DIPFiles;
 
+			struct DIPFile **FileHash;
+			u32 FileHashMask;
 			struct DIPFile *OpenFiles;
+			struct DIPFile *OldestFile;
 			struct DIPFile *FreeFiles;
+			FileHandleStats HandleStats;
 			struct DIPFile* GetFile(s16 fileid);
+			void CloseFile(struct DIPFile *file);
+			bool SetFileHandles(u32 handles);
 
 			int CopyDir(const char *in_dir, const char *out_dir);
 			int DoEmu(const char* nand_dir, const char* ext_dir, const int* clone);
@@ -122,6 +144,8 @@ namespace ProxiIOS { namespace DIP {
 			u32 AllocatedPatches[PatchType::Max];
 			u32 PatchCount[PatchType::Max];
 			void* Patches[PatchType::Max];
+			PatchIndex Index[PatchType::Max];
+			u32 FoundFallback[MAX_FOUND];
 
 			bool Clusters;
 #ifdef YARR
@@ -140,7 +164,7 @@ namespace ProxiIOS { namespace DIP {
 			int ForwardIoctlv(ipcmessage* message, bool bypass);
 
 			int GetPatchSize(int index);
-			int FindPatch(int index, s64 pos, u32 len, void** found, int limit);
+			int FindPatch(int index, s64 pos, u32 len, u32** found);
 			bool Reallocate(int index, int toadd);
 			int AddPatch(int index, void* data);
 
@@ -5,6 +5,11 @@
 
 #ifdef YARR
 
+// decrypted clusters kept, and how many more come in with a miss while
+// streaming; they're 0x7C00 bytes each out of the module's 256KB
+#define FILEPROVIDER_CACHE_PAGES	4
+#define FILEPROVIDER_READAHEAD		2
+
 namespace ProxiIOS { namespace DIP {
 	class FileProvider : public DiProvider
 	{
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <gctypes.h>
+
+namespace ProxiIOS { namespace DIP {
+	/* Interval index over a table of OffsetPatch records (Patch or Shift).
+	 * The intervals are sorted by start once and laid out as an implicit
+	 * binary tree where every node also holds the largest end below it, so
+	 * a read only visits the nodes that can overlap it: O(log n + k).
+	 * Matches are returned as indices into the table, in table order, so
+	 * overlapping patches are still applied in the order they were added.
+	 */
+	class PatchIndex
+	{
+		private:
+			struct Node {
+				u32 Start; // words, like OffsetPatch::Offset
+				u32 End;
+				u32 Max;
+				u32 Index;
+			};
+
+			Node* Nodes;
+			u32* Found;
+			u32 Count;
+			int Levels;
+			bool Valid;
+
+			void Clear();
+			static void SiftDown(Node* nodes, u32 root, u32 count);
+		public:
+			PatchIndex();
+			~PatchIndex();
+
+			bool IsValid() { return Valid; }
+			void Invalidate();
+			bool Build(const void* patches, u32 count, int size);
+			int Find(s64 pos, u32 len, u32** found);
+	};
+} }
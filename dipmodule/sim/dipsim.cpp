@@ -0,0 +1,351 @@
+/* dipsim - runs the DIP module's patched read path on a PC
+ *
+ * dip.cpp is built unchanged against the stubs in ios.cpp/files.cpp, set up
+ * through the same ioctls the launcher sends, and then fed a trace of disc
+ * reads. Prints reads/s, patch lookups/s and how often patch files had to be
+ * reopened, plus a hash of everything read so changes to the patch engine
+ * can be checked for the same output.
+ *
+ * Usage: dipsim [-c] [-h handles] [-n passes] <disc image> <file root> <patch list> <trace>
+ *        dipsim -g <dir> [patches] [reads]
+ *
+ * The patch list has one entry per line, numbers in decimal or 0x hex:
+ *   file <path>                          (AddFile, numbered from 0)
+ *   patch <file> <disc offset> <length>  (AddPatch)
+ *   shift <length> <original> <offset>   (AddShift)
+ * The trace has a "<disc offset> <length>" pair per line. -c adds files by
+ * identifier like the launcher does on FAT, -h sizes the file handle pool
+ * (by default one per file, as the launcher asks for), -g writes a made up disc image,
+ * patch files, patch list and trace to <dir> to run it on.
+ */
+
+#include <dip.h>
+#include <patch.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <vector>
+#include <string>
+
+#include "sim.h"
+
+using namespace std;
+using namespace ProxiIOS::DIP;
+
+struct Entry
+{
+	char Kind;
+	string Path;
+	u64 Args[3];
+};
+
+struct TraceRead
+{
+	u64 Offset;
+	u32 Length;
+};
+
+static u32 Input[8] ATTRIBUTE_ALIGN(32);
+
+static double Now()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static int SendIoctl(DIP* dip, u32 command, const void* in, u32 in_length, void* io, u32 io_length)
+{
+	ipcmessage message;
+	memset(&message, 0, sizeof(message));
+	message.command = IOS_IOCTL;
+	message.ioctl.command = command;
+	message.ioctl.buffer_in = in;
+	message.ioctl.length_in = in_length;
+	message.ioctl.buffer_io = io;
+	message.ioctl.length_io = io_length;
+	return dip->HandleIoctl(&message);
+}
+
+static bool LoadPatches(const char* path, vector<Entry>& entries)
+{
+	FILE* list = fopen(path, "r");
+	if (!list)
+		return false;
+
+	char line[0x400];
+	while (fgets(line, sizeof(line), list)) {
+		char kind[0x10], text[0x300];
+		Entry entry;
+		if (line[0] == '#' || sscanf(line, "%15s", kind) != 1)
+			continue;
+		entry.Kind = kind[0];
+		if (!strcmp(kind, "file") && sscanf(line, "%*s %767s", text) == 1)
+			entry.Path = text;
+		else if ((strcmp(kind, "patch") && strcmp(kind, "shift")) ||
+			sscanf(line, "%*s %lli %lli %lli", (long long*)&entry.Args[0], (long long*)&entry.Args[1], (long long*)&entry.Args[2]) != 3) {
+			printf("%s: can't make sense of \"%s\"\n", path, line);
+			fclose(list);
+			return false;
+		}
+		entries.push_back(entry);
+	}
+
+	fclose(list);
+	return true;
+}
+
+static bool LoadTrace(const char* path, vector<TraceRead>& trace)
+{
+	FILE* file = fopen(path, "r");
+	if (!file)
+		return false;
+
+	long long offset, length;
+	while (fscanf(file, "%lli %lli", &offset, &length) == 2) {
+		TraceRead read = { (u64)offset & ~3ULL, (u32)length };
+		trace.push_back(read);
+	}
+
+	fclose(file);
+	return !trace.empty();
+}
+
+// the ioctls the launcher sends once it has worked out the patches
+static bool Setup(DIP* dip, const vector<Entry>& entries, bool clusters, int handles)
+{
+	u32 counts[PatchType::Max] = { 0 };
+	for (size_t i = 0; i < entries.size(); i++)
+		counts[entries[i].Kind == 'f' ? PatchType::File : entries[i].Kind == 's' ? PatchType::Shift : PatchType::Patch]++;
+	for (int type = 0; type < PatchType::Max; type++) {
+		Input[0] = type;
+		Input[1] = counts[type];
+		if (counts[type] && SendIoctl(dip, Ioctl::Allocate, Input, 8, NULL, 0) < 0)
+			return false;
+	}
+
+	Input[0] = clusters;
+	SendIoctl(dip, Ioctl::SetClusters, Input, 4, NULL, 0);
+
+	for (size_t i = 0; i < entries.size(); i++) {
+		const Entry& entry = entries[i];
+		int ret;
+		if (entry.Kind == 'f')
+			ret = SendIoctl(dip, Ioctl::AddFile, entry.Path.c_str(), entry.Path.length() + 1, NULL, 0);
+		else if (entry.Kind == 's') {
+			Input[0] = entry.Args[0];
+			Input[1] = entry.Args[1] >> 32;
+			Input[2] = entry.Args[1];
+			Input[3] = entry.Args[2] >> 32;
+			Input[4] = entry.Args[2];
+			ret = SendIoctl(dip, Ioctl::AddShift, Input, 0x20, NULL, 0);
+		} else {
+			Input[0] = entry.Args[0];
+			Input[1] = 0;
+			Input[2] = entry.Args[1] >> 32;
+			Input[3] = entry.Args[1];
+			Input[4] = entry.Args[2];
+			ret = SendIoctl(dip, Ioctl::AddPatch, Input, 0x20, NULL, 0);
+		}
+		if (ret < 0) {
+			printf("Entry %u was refused (%d)\n", (u32)i, ret);
+			return false;
+		}
+	}
+
+	Input[0] = handles ? handles : counts[PatchType::File];
+	return SendIoctl(dip, Ioctl::SetFileHandles, Input, 4, NULL, 0) >= 0;
+
+	return true;
+}
+
+static u32 Random(u64& state)
+{
+	state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+	return (u32)(state >> 33);
+}
+
+// a 64MB disc, patch files carved out of it and reads like a game loading levels
+static int Generate(const char* dir, u32 patches, u32 reads)
+{
+	const u64 disc_size = 0x4000000;
+	const u32 files = 32;
+	u64 state = 1;
+	string root = dir;
+	mkdir(dir, 0755);
+	mkdir((root + "/files").c_str(), 0755);
+
+	FILE* disc = fopen((root + "/disc.img").c_str(), "wb");
+	if (!disc)
+		return -1;
+	vector<u32> block(0x4000);
+	for (u64 i = 0; i < disc_size; i += block.size() * 4) {
+		for (size_t j = 0; j < block.size(); j++)
+			block[j] = Random(state);
+		fwrite(&block[0], 4, block.size(), disc);
+	}
+	fclose(disc);
+
+	FILE* list = fopen((root + "/patches.txt").c_str(), "w");
+	for (u32 i = 0; i < files; i++) {
+		char name[0x20];
+		sprintf(name, "/files/%02u.bin", i);
+		FILE* file = fopen((root + name).c_str(), "wb");
+		for (u32 j = 0; j < 0x40000 / 4; j++) {
+			u32 word = Random(state);
+			fwrite(&word, 4, 1, file);
+		}
+		fclose(file);
+		fprintf(list, "file %s\n", name);
+	}
+	for (u32 i = 0; i < patches; i++) {
+		u64 offset = (Random(state) % (disc_size / 4)) << 2;
+		fprintf(list, "patch %u 0x%llx 0x%x\n", Random(state) % files, (unsigned long long)offset, 0x20 + Random(state) % 0x3FE0);
+	}
+	// a few files moved past the end of the disc
+	for (u32 i = 0; i < patches / 16; i++) {
+		u64 original = (Random(state) % (disc_size / 4)) << 2;
+		fprintf(list, "shift 0x8000 0x%llx 0x%llx\n", (unsigned long long)original, 0x200000000ULL + i * 0x8000ULL);
+	}
+	fclose(list);
+
+	FILE* trace = fopen((root + "/trace.txt").c_str(), "w");
+	u64 position = 0;
+	for (u32 i = 0; i < reads; i++) {
+		// mostly sequential runs, sometimes a seek somewhere else or into a shifted file
+		u32 seek = Random(state) % 64;
+		if (seek < 2)
+			position = (Random(state) % (disc_size / 0x8000)) * 0x8000;
+		else if (seek == 2 && patches >= 16)
+			position = 0x200000000ULL + (Random(state) % (patches / 16)) * 0x8000ULL;
+		u32 length = 0x20 << (Random(state) % 11);
+		fprintf(trace, "0x%llx 0x%x\n", (unsigned long long)position, length);
+		position = (position + length) % disc_size;
+	}
+	fclose(trace);
+
+	printf("Wrote %s/disc.img, files/, patches.txt and trace.txt\n", dir);
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	bool clusters = false;
+	int passes = 1;
+	int handles = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "ch:n:g:")) != -1) {
+		switch (opt) {
+			case 'c':
+				clusters = true;
+				break;
+			case 'h':
+				handles = MAX(atoi(optarg), 1);
+				break;
+			case 'n':
+				passes = MAX(atoi(optarg), 1);
+				break;
+			case 'g':
+				return Generate(optarg, optind < argc ? atoi(argv[optind]) : 2000, optind + 1 < argc ? atoi(argv[optind + 1]) : 20000);
+			default:
+				return -1;
+		}
+	}
+	if (argc - optind != 4) {
+		printf("Usage: dipsim [-c] [-h handles] [-n passes] <disc image> <file root> <patch list> <trace>\n");
+		printf("       dipsim -g <dir> [patches] [reads]\n");
+		return -1;
+	}
+
+	vector<Entry> entries;
+	vector<TraceRead> trace;
+	if (!Sim_OpenDisc(argv[optind])) {
+		printf("Can't open %s\n", argv[optind]);
+		return -1;
+	}
+	Sim_SetFileRoot(argv[optind + 1]);
+	if (!LoadPatches(argv[optind + 2], entries)) {
+		printf("Can't load %s\n", argv[optind + 2]);
+		return -1;
+	}
+	if (!LoadTrace(argv[optind + 3], trace)) {
+		printf("Can't load %s\n", argv[optind + 3]);
+		return -1;
+	}
+
+	DIP* dip = new DIP();
+	ipcmessage open;
+	memset(&open, 0, sizeof(open));
+	open.command = IOS_OPEN;
+	open.open.device = "/dev/do";
+	if (dip->HandleOpen(&open) < 0 || !Setup(dip, entries, clusters, handles))
+		return -1;
+	// patches are only applied to the partition that was open when they were added
+	dip->CurrentPartition = dip->PatchPartition;
+
+	u32 largest = 0;
+	for (size_t i = 0; i < trace.size(); i++)
+		largest = MAX(largest, trace[i].Length);
+	u8* buffer = (u8*)Memalign(32, ROUND_UP(largest, 32));
+
+	u64 hash = 0xCBF29CE484222325ULL;
+	u64 patched = 0;
+	memset(&Counters, 0, sizeof(Counters));
+	double start = Now();
+	for (int pass = 0; pass < passes; pass++) {
+		for (size_t i = 0; i < trace.size(); i++) {
+			u64 filereads = Counters.FileReads;
+			Input[0] = Ioctl::Read << 24;
+			Input[1] = trace[i].Length;
+			Input[2] = trace[i].Offset >> 2;
+			int ret = SendIoctl(dip, Ioctl::Read, Input, 0x20, buffer, trace[i].Length);
+			if (ret != 1) {
+				printf("Read of 0x%x at 0x%llx failed (%d)\n", trace[i].Length, (unsigned long long)trace[i].Offset, ret);
+				return -1;
+			}
+			if (Counters.FileReads != filereads)
+				patched++;
+			if (pass == 0) {
+				for (u32 j = 0; j < trace[i].Length; j++)
+					hash = (hash ^ buffer[j]) * 0x100000001B3ULL;
+			}
+		}
+	}
+	double elapsed = Now() - start;
+
+	// the lookups alone, as Ioctl::Read does them
+	u64 lookups = 0;
+	u64 found = 0;
+	double lookup_start = Now();
+	for (int pass = 0; pass < passes; pass++) {
+		for (size_t i = 0; i < trace.size(); i++) {
+			u32* indices;
+			found += dip->FindPatch(PatchType::Shift, trace[i].Offset, trace[i].Length, &indices);
+			found += dip->FindPatch(PatchType::Patch, trace[i].Offset, trace[i].Length, &indices);
+			lookups += 2;
+		}
+	}
+	double lookup_elapsed = Now() - lookup_start;
+
+	u64 reads = (u64)trace.size() * passes;
+	printf("%llu reads in %.3fs: %.0f reads/s, %.1f MB/s\n", (unsigned long long)reads, elapsed,
+		reads / elapsed, (Counters.DiscBytes + Counters.FileBytes) / elapsed / 1048576);
+	printf("%llu patched, %llu disc reads, %llu file reads\n", (unsigned long long)patched,
+		(unsigned long long)Counters.DiscReads, (unsigned long long)Counters.FileReads);
+	printf("%llu file opens, %llu closes (%.2f opens per 1000 patched reads)\n", (unsigned long long)Counters.FileOpens,
+		(unsigned long long)Counters.FileCloses, patched ? Counters.FileOpens * 1000.0 / patched : 0.0);
+	FileHandleStats* stats = (FileHandleStats*)Memalign(32, ROUND_UP(sizeof(FileHandleStats), 32));
+	if (SendIoctl(dip, Ioctl::GetFileHandleStats, Input, 0, stats, sizeof(FileHandleStats)) == 1) {
+		printf("%u handles, %u open: %u hits, %u misses, %u evicted, %u expired\n", stats->Handles, stats->Open,
+			stats->Hits, stats->Misses, stats->Evictions, stats->Expired);
+	}
+	printf("%llu patch lookups in %.3fs: %.0f lookups/s, %llu matches\n", (unsigned long long)lookups, lookup_elapsed,
+		lookups / lookup_elapsed, (unsigned long long)found);
+	printf("Data hash %016llx\n", (unsigned long long)hash);
+
+	return 0;
+}
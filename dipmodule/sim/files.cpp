@@ -0,0 +1,91 @@
+/* The file module calls dip.cpp makes, on the host's filesystem below the
+ * replacement file root. Paths the launcher would pass ("/riivolution/...")
+ * are taken relative to it.
+ */
+
+#include <files.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include <map>
+#include <string>
+
+#include "sim.h"
+
+using namespace std;
+
+static string Root = ".";
+// File_Open_ID needs the path back for an identifier File_Stat gave out
+static map<u64, string> Identifiers;
+
+void Sim_SetFileRoot(const char* path)
+{
+	Root = path;
+}
+
+static string HostPath(const char* path)
+{
+	return Root + (path[0] == '/' ? "" : "/") + path;
+}
+
+extern "C" {
+	int File_Stat(const char* path, Stats* st)
+	{
+		struct stat hst;
+		string host = HostPath(path);
+		if (stat(host.c_str(), &hst))
+			return -1;
+		st->Identifier = hst.st_ino;
+		st->Size = hst.st_size;
+		st->Device = hst.st_dev;
+		st->Mode = hst.st_mode;
+		Identifiers[hst.st_ino] = host;
+		return 0;
+	}
+
+	int File_Open(const char* path, int mode)
+	{
+		Counters.FileOpens++;
+		return open(HostPath(path).c_str(), mode & O_ACCMODE);
+	}
+
+	int File_Open_ID(u64 id, int mode)
+	{
+		Counters.FileOpens++;
+		map<u64, string>::iterator iter = Identifiers.find(id);
+		if (iter == Identifiers.end())
+			return -1;
+		return open(iter->second.c_str(), mode & O_ACCMODE);
+	}
+
+	int File_Close(int fd)
+	{
+		Counters.FileCloses++;
+		return close(fd);
+	}
+
+	int File_Read(int fd, void* buffer, int length)
+	{
+		Counters.FileReads++;
+		int ret = read(fd, buffer, length);
+		if (ret > 0)
+			Counters.FileBytes += ret;
+		return ret;
+	}
+
+	// the prototype's names are swapped, callers pass (fd, offset, origin)
+	int File_Seek(int fd, int where, int whence)
+	{
+		return lseek(fd, where, whence) < 0 ? -1 : 0;
+	}
+
+	int File_Write(int fd, const void* buffer, int length) { return -1; }
+	int File_CreateDir(const char* path) { return -1; }
+	int File_OpenDir(const char* path) { return -1; }
+	int File_NextDir(int dir, char* path, Stats* st) { return -1; }
+	int File_CloseDir(int dir) { return -1; }
+	int File_Log(const void* buffer, int length) { return length; }
+}
@@ -0,0 +1,168 @@
+/* A stand-in for the IOS kernel and the ProxiIOS base classes, just enough
+ * for dip.cpp to run as a normal Linux process. /dev/di is served from a
+ * disc image, the heap is malloc and timers never fire.
+ */
+
+#include <proxiios.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "sim.h"
+
+#define DI_FD 1
+#define DI_READ 0x71
+#define DI_UNENCRYPTEDREAD 0x8D
+
+SimCounters Counters;
+
+static int Disc = -1;
+
+bool Sim_OpenDisc(const char* path)
+{
+	Disc = open(path, O_RDONLY);
+	return Disc >= 0;
+}
+
+static int DiscRead(void* buffer, u32 length, u64 offset)
+{
+	Counters.DiscReads++;
+	u32 done = 0;
+	while (done < length) {
+		ssize_t ret = pread(Disc, (u8*)buffer + done, length - done, offset + done);
+		if (ret < 0)
+			return 0x20; // error, like a drive that couldn't read
+		if (ret == 0) { // past the end of the image reads as zeroes
+			memset((u8*)buffer + done, 0, length - done);
+			break;
+		}
+		done += ret;
+	}
+	Counters.DiscBytes += length;
+	return 1;
+}
+
+extern "C" {
+	bool InitializeHeap(void* heapspace, u32 size, u32 pagesize) { return true; }
+	void* Alloc(u32 size) { return malloc(size); }
+	bool Dealloc(void* data) { free(data); return true; }
+	void* Realloc(void* data, u32 size, u32 oldsize) { return realloc(data, size); }
+	u32 HeapInfo() { return 0; }
+
+	void* Memalign(u32 align, u32 size)
+	{
+		void* data;
+		if (posix_memalign(&data, MAX(align, sizeof(void*)), size))
+			return NULL;
+		return data;
+	}
+
+	int os_thread_set_priority(int thread, u32 priority) { return 0; }
+	osqueue_t os_message_queue_create(void* ptr, u32 n_msgs) { return 0; }
+	u32 os_device_register(const char* devicename, osqueue_t queuehandle) { return 0; }
+	ostimer_t os_create_timer(s32 time_us, s32 repeat_time_us, osqueue_t message_queue, u32 message) { return 0; }
+	s32 os_restart_timer(ostimer_t timer_id, s32 time_us, s32 repeat_time_us) { return 0; }
+	s32 os_stop_timer(ostimer_t timer_id) { return 0; }
+	void os_sync_before_read(const void* ptr, u32 size) { }
+	void os_sync_after_write(const void* ptr, u32 size) { }
+
+	// the starlet timer runs at 1.898MHz
+	u32 os_time_now()
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return (u32)((u64)now.tv_sec * 1898437 + (u64)now.tv_nsec * 1898437 / 1000000000);
+	}
+
+	s32 os_open(const char* device, s32 mode)
+	{
+		if (!strcmp(device, "/dev/di"))
+			return DI_FD;
+		return IPC_ENOENT;
+	}
+
+	s32 os_close(s32 fd) { return 0; }
+
+	s32 os_ioctl(s32 fd, s32 request, const void* buffer_in, s32 bytes_in, void* buffer_io, s32 bytes_io)
+	{
+		if (fd != DI_FD)
+			return IPC_EINVAL;
+		const u32* in = (const u32*)buffer_in;
+		switch (request) {
+			case DI_READ:
+			case DI_UNENCRYPTEDREAD:
+				return DiscRead(buffer_io, in[1], (u64)in[2] << 2);
+		}
+		return 1;
+	}
+
+	s32 os_ioctlv(s32 fd, s32 request, s32 count_in, s32 count_out, const ioctlv* vector)
+	{
+		return fd == DI_FD ? 1 : IPC_EINVAL;
+	}
+
+	s32 os_read(s32 fd, void* buffer, s32 length) { return IPC_EINVAL; }
+	s32 os_write(s32 fd, const void* buffer, s32 length) { return IPC_EINVAL; }
+	s32 os_seek(s32 fd, s32 where, s32 whence) { return IPC_EINVAL; }
+}
+
+namespace ProxiIOS {
+	Module::Module(const char* device)
+	{
+		strncpy(Device, device, 0x20);
+		Device[0x20 - 1] = '\0';
+		Fd = -1;
+		queuehandle = os_message_queue_create(queue, 8);
+	}
+
+	// messages are handed to the Handle* methods directly, there is no queue to run
+	int Module::Loop()
+	{
+		return 0;
+	}
+
+	int Module::HandleOpen(ipcmessage* message)
+	{
+		if (strcmp(message->open.device, Device))
+			return Errors::OpenFailure;
+		Fd = 1;
+		return Fd;
+	}
+
+	int ProxyModule::HandleOpen(ipcmessage* message)
+	{
+		int ret = Module::HandleOpen(message);
+		if (ret == Errors::OpenFailure)
+			return ret;
+
+		ProxyHandle = os_open((char*)ProxyDevice, 0);
+		if (ProxyHandle < 0)
+			return Errors::OpenProxyFailure;
+		return ret;
+	}
+
+	int ProxyModule::HandleClose(ipcmessage* message)
+	{
+		os_close(ProxyHandle);
+		return Module::HandleClose(message);
+	}
+
+	int ProxyModule::ForwardIoctl(ipcmessage* message)
+	{
+		return os_ioctl(ProxyHandle, message->ioctl.command, message->ioctl.buffer_in,
+						message->ioctl.length_in, message->ioctl.buffer_io, message->ioctl.length_io);
+	}
+
+	int ProxyModule::ForwardIoctlv(ipcmessage* message)
+	{
+		return os_ioctlv(ProxyHandle, message->ioctlv.command, message->ioctlv.num_in,
+						message->ioctlv.num_io, message->ioctlv.vector);
+	}
+
+	int ProxyModule::ForwardRead(ipcmessage* message) { return IPC_EINVAL; }
+	int ProxyModule::ForwardWrite(ipcmessage* message) { return IPC_EINVAL; }
+	int ProxyModule::ForwardSeek(ipcmessage* message) { return IPC_EINVAL; }
+	int ProxyModule::ForwardOpen(ipcmessage* message) { return IPC_EINVAL; }
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <gctypes.h>
+
+// what the stub IOS layer saw, read by the benchmark between passes
+struct SimCounters
+{
+	u64 DiscReads;  // reads forwarded to /dev/di
+	u64 DiscBytes;
+	u64 FileOpens;  // File_Open/File_Open_ID calls
+	u64 FileCloses;
+	u64 FileReads;
+	u64 FileBytes;
+};
+
+extern SimCounters Counters;
+
+// the disc image /dev/di reads come from and the directory patch files are opened in
+bool Sim_OpenDisc(const char* path);
+void Sim_SetFileRoot(const char* path);
@@ -6,62 +6,106 @@
 
 #ifdef YARR
 
-Cache::Cache(u32 pages, u32 sectorsPerPage, u32 sectorSize, ReadSectorsFunction readsectors, void* userdata) :
-	ReadDiskSectors(readsectors), UserData(userdata), Pages(pages), SectorsPerPage(sectorsPerPage), SectorSize(sectorSize) {
+Cache::Cache(u32 pages, u32 sectorsPerPage, u32 sectorSize, ReadSectorsFunction readsectors, void* userdata, u32 readAhead) :
+	ReadDiskSectors(readsectors), UserData(userdata), Pages(pages), SectorsPerPage(sectorsPerPage), SectorSize(sectorSize), ReadAhead(readAhead) {
 
 	if (Pages < 2)
 		Pages = 2;
 
+	// more than half would push out the pages being read ahead of
+	if (ReadAhead > Pages / 2)
+		ReadAhead = Pages / 2;
+
+	for (BucketMask = 1; BucketMask < Pages * 2; BucketMask <<= 1)
+		;
+	BucketMask--;
+
 	Entries = new CacheEntry[Pages];
+	Data = new u8[Pages * SectorsPerPage * SectorSize];
+	Buckets = new u32[BucketMask + 1];
 
-	for (u32 i = 0; i < Pages; i++) {
-		Entries[i].SetSize(SectorSize * SectorsPerPage);
-	}
+	for (u32 i = 0; i < Pages; i++)
+		Entries[i].Data = Data + i * SectorsPerPage * SectorSize;
+
+	Clear();
 }
 
 Cache::~Cache()
 {
+	delete[] Buckets;
+	delete[] Data;
 	delete[] Entries;
 }
 
-static u32 accessCounter = 0;
-static u32 AccessTime()
+CacheEntry* Cache::FindPage(u32 sector)
 {
-	accessCounter++;
-	return accessCounter;
+	sector -= sector % SectorsPerPage;
+
+	for (u32 i = Buckets[(sector / SectorsPerPage) & BucketMask]; i < Pages; i = Entries[i].NextHash) {
+		if (Entries[i].Sector == sector)
+			return Entries + i;
+	}
+
+	return NULL;
+}
+
+void Cache::RemovePage(u32 page)
+{
+	CacheEntry* entry = Entries + page;
+	if (entry->Sector == CACHE_FREE)
+		return;
+
+	u32* link = Buckets + ((entry->Sector / SectorsPerPage) & BucketMask);
+	while (*link != page)
+		link = &Entries[*link].NextHash;
+	*link = entry->NextHash;
+
+	entry->Sector = CACHE_FREE;
+	entry->Count = 0;
+	entry->NextHash = Pages;
 }
 
+void Cache::InsertPage(u32 page, u32 sector)
+{
+	CacheEntry* entry = Entries + page;
+	u32* bucket = Buckets + ((sector / SectorsPerPage) & BucketMask);
+
+	entry->Sector = sector;
+	entry->Count = SectorsPerPage;
+	entry->NextHash = *bucket;
+	*bucket = page;
+}
 
 CacheEntry* Cache::GetPage(u32 sector)
 {
-	bool found = false;
-	u32 oldUsed = 0;
-	u32 oldAccess = UINT_MAX;
+	CacheEntry* entry = FindPage(sector);
+	if (entry)
+		return entry;
 
-	for (u32 i = 0; i < Pages; i++) {
-		if (sector >= Entries[i].Sector && sector < (Entries[i].Sector + Entries[i].Count)) {
-			Entries[i].LastAccess = AccessTime();
-			return Entries + i;
-		}
+	// a miss right where the last read ended is a stream, so the pages after it come in the same read
+	bool streaming = ReadAhead && sector == NextSector;
+	sector -= sector % SectorsPerPage;
 
-		if (!found && (Entries[i].Sector == CACHE_FREE || Entries[i].LastAccess < oldAccess)) {
-			if (Entries[i].Sector == CACHE_FREE)
-				found = true;
-			oldUsed = i;
-			oldAccess = Entries[i].LastAccess;
-		}
-	}
+	u32 count = 1;
+	while (streaming && count <= ReadAhead && !FindPage(sector + count * SectorsPerPage))
+		count++;
+
+	// they have to be together, so a batch that would run off the end starts over at the front
+	if (NextPage + count > Pages)
+		NextPage = 0;
 
-	sector = SectorsPerPage * (sector / SectorsPerPage); // Align to page size
+	u32 page = NextPage;
+	for (u32 i = 0; i < count; i++)
+		RemovePage(page + i);
 
-	if (!ReadDiskSectors(UserData, sector, SectorsPerPage, Entries[oldUsed].Data))
+	if (!ReadDiskSectors(UserData, sector, count * SectorsPerPage, Entries[page].Data))
 		return NULL;
 
-	Entries[oldUsed].Sector = sector;
-	Entries[oldUsed].Count = SectorsPerPage;
-	Entries[oldUsed].LastAccess = AccessTime();
+	for (u32 i = 0; i < count; i++)
+		InsertPage(page + i, sector + i * SectorsPerPage);
+	NextPage = (page + count) % Pages;
 
-	return Entries + oldUsed;
+	return Entries + page;
 }
 
 bool Cache::ReadSectors(u32 sector, u32 numSectors, void* buffer)
@@ -69,16 +113,22 @@ bool Cache::ReadSectors(u32 sector, u32 numSectors, void* buffer)
 	u8* dest = (u8*)buffer;
 
 	while (numSectors > 0) {
-		CacheEntry* entry = GetPage(sector);
-		if (!entry)
-			return false;
+		CacheEntry* entry = FindPage(sector);
+		u32 secs_to_read;
+
+		if (entry) {
+			u32 sec = sector - entry->Sector;
+			secs_to_read = MIN(entry->Count - sec, numSectors);
 
-		u32 sec = sector - entry->Sector;
-		u32 secs_to_read = entry->Count - sec;
-		if (secs_to_read > numSectors)
-			secs_to_read = numSectors;
+			memcpy(dest, entry->Data + (sec * SectorSize), secs_to_read * SectorSize);
+		} else {
+			// everything up to the next cached page goes straight into the buffer in one read
+			for (secs_to_read = 1; secs_to_read < numSectors && !FindPage(sector + secs_to_read); secs_to_read++)
+				;
 
-		memcpy(dest, entry->Data + (sec * SectorSize), secs_to_read * SectorSize);
+			if (!ReadDiskSectors(UserData, sector, secs_to_read, dest))
+				return false;
+		}
 		os_sync_after_write(dest, secs_to_read * SectorSize);
 
 		dest += secs_to_read * SectorSize;
@@ -86,6 +136,8 @@ bool Cache::ReadSectors(u32 sector, u32 numSectors, void* buffer)
 		numSectors -= secs_to_read;
 	}
 
+	NextSector = sector;
+
 	return true;
 }
 
@@ -102,6 +154,8 @@ bool Cache::ReadPartialSector(void* buffer, u32 sector, u32 offset, u32 size)
 	memcpy(buffer, entry->Data + (sec * SectorSize) + offset, size);
 	os_sync_after_write(buffer, size);
 
+	NextSector = offset + size < SectorSize ? sector : sector + 1;
+
 	return true;
 }
 
@@ -121,9 +175,10 @@ bool Cache::Read(void* buffer, u64 offset, u32 size)
 		sector++;
 	}
 
-	if (size > SectorSize) {
+	if (size >= SectorSize) {
 		u32 sectors = (u32)(size >> 2) / (SectorSize >> 2);
-		ReadSectors(sector, sectors, data);
+		if (!ReadSectors(sector, sectors, data))
+			return false;
 		sector += sectors;
 
 		sectors *= SectorSize;
@@ -141,11 +196,16 @@ bool Cache::Read(void* buffer, u64 offset, u32 size)
 void Cache::Clear()
 {
 	for (u32 i = 0; i < Pages; i++) {
-		Entries[i].LastAccess = 0;
 		Entries[i].Count = 0;
 		Entries[i].Sector = CACHE_FREE;
+		Entries[i].NextHash = Pages;
 	}
+
+	for (u32 i = 0; i <= BucketMask; i++)
+		Buckets[i] = Pages;
+
+	NextPage = 0;
+	NextSector = CACHE_FREE;
 }
 
 #endif
-
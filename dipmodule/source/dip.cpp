@@ -30,17 +30,28 @@ struct TemporaryPatch
 	s64 FileOffset;
 };
 
+// the part of a patch that lands in a read of len bytes at pos
+static void ClipPatch(const ProxiIOS::DIP::Patch* patch, s64 pos, u32 len, TemporaryPatch* clipped)
+{
+	clipped->Length = patch->Length;
+	clipped->Offset = ((s64)patch->Offset << 2) - pos;
+	clipped->FileOffset = 0;
+	if (clipped->Offset < 0) { // Patch starts before the read
+		clipped->Length += clipped->Offset; // Reduce the length
+		clipped->FileOffset -= clipped->Offset; // Increase the file offset
+		clipped->Offset = 0;
+	}
+	clipped->Length = MIN(clipped->Length, len - clipped->Offset);
+}
+
 namespace ProxiIOS { namespace DIP {
 	DIP::DIP() : ProxyModule("/dev/do", "/dev/di")
 	{
-		FreeFiles = DIPFiles;
-		OpenFiles = NULL;
-		for (int i = 0; i < MAX_OPEN_FILES-1; i++) {
-			DIPFiles[i].fd = -1;
-			DIPFiles[i].next = DIPFiles+i+1;
-		}
-		DIPFiles[MAX_OPEN_FILES-1].fd = -1;
-		DIPFiles[MAX_OPEN_FILES-1].next = NULL;
+		DIPFiles = NULL;
+		FileHash = NULL;
+		OpenFiles = OldestFile = FreeFiles = NULL;
+		memset(&HandleStats, 0, sizeof(HandleStats));
+		SetFileHandles(MAX_OPEN_FILES);
 
 		Idle_Timer = os_create_timer(DIPIDLE_TICK, 0, queuehandle, DIPIDLE_MSG);
 
@@ -64,28 +75,11 @@ namespace ProxiIOS { namespace DIP {
 		if (message == DIPIDLE_MSG) {
 			os_stop_timer(Idle_Timer);
 			u32 time_now = os_time_now();
-			struct DIPFile *PrevFile = NULL;
-			struct DIPFile *ThisFile = OpenFiles;
-
-			// look for "expired" open files
-			// they're sorted, so all files after the first expired one will be closed
-			while (ThisFile && (time_now - ThisFile->lastaccess) < DIPIDLE_TIMEOUT) {
-				PrevFile = ThisFile;
-				ThisFile = ThisFile->next;
-			}
 
-			if (PrevFile) // close the tail of the OpenFiles list
-				PrevFile->next = NULL;
-			else // else all files will be closed
-				OpenFiles = NULL;
-
-			while (ThisFile) {
-				PrevFile = ThisFile;
-				File_Close(ThisFile->fd);
-				ThisFile->fd = -1;
-				ThisFile = ThisFile->next;
-				PrevFile->next = FreeFiles;
-				FreeFiles = PrevFile;
+			// close "expired" open files, they're sorted so start with the oldest
+			while (OldestFile && (time_now - OldestFile->lastaccess) >= DIPIDLE_TIMEOUT) {
+				CloseFile(OldestFile);
+				HandleStats.Expired++;
 			}
 
 			os_restart_timer(Idle_Timer, DIPIDLE_TICK, 0);
@@ -116,6 +110,7 @@ namespace ProxiIOS { namespace DIP {
 
 		int size = GetPatchSize(index);
 		memcpy((u8*)Patches[index] + PatchCount[index] * size, data, size);
+		Index[index].Invalidate();
 
 		return PatchCount[index]++;
 	}
@@ -199,6 +194,15 @@ namespace ProxiIOS { namespace DIP {
 					return -1;
 				return 1;
 #endif
+			case Ioctl::SetFileHandles:
+				LogPrintf("IOCTL: SetFileHandles(%d);\n", buffer_in[0]);
+				return SetFileHandles(buffer_in[0]) ? 1 : -1;
+			case Ioctl::GetFileHandleStats:
+				if (message->ioctl.length_io < sizeof(FileHandleStats))
+					return -1;
+				memcpy(message->ioctl.buffer_io, &HandleStats, sizeof(FileHandleStats));
+				os_sync_after_write(message->ioctl.buffer_io, sizeof(FileHandleStats));
+				return 1;
 			case Ioctl::SetShiftBase:
 				ShiftBase = ((u64)buffer_in[0] << 32) | buffer_in[1];
 				LogPrintf("IOCTL: SetShiftBase(0x%08x%08x);\n", (u32)(ShiftBase >> 32), (u32)ShiftBase);
@@ -223,8 +227,8 @@ namespace ProxiIOS { namespace DIP {
 					return ret;
 				}
 
-				Shift* shifts[MAX_FOUND];
-				int foundshifts = FindPatch(PatchType::Shift, pos, len, (void**)shifts, MAX_FOUND);
+				u32* shifts;
+				int foundshifts = FindPatch(PatchType::Shift, pos, len, &shifts);
 				STACK_ALIGN(ipcmessage, tempmessage, 1, 0x20);
 				STACK_ALIGN(u8, tempmessagebufferin, 0x20, 0x20);
 				if (foundshifts) {
@@ -236,7 +240,7 @@ namespace ProxiIOS { namespace DIP {
 					os_sync_after_write(message, sizeof(ipcmessage));
 
 					for (int i = 0; i < foundshifts; i++) {
-						Shift* shift = shifts[i];
+						Shift* shift = (Shift*)Patches[PatchType::Shift] + shifts[i];
 						s64 offset = pos - ((s64)shift->Offset << 2);
 						u32* bufferoffset = (u32*)message->ioctl.buffer_in + 2;
 						*bufferoffset = (offset + ((u64)shift->OriginalOffset << 2)) >> 2;
@@ -246,8 +250,8 @@ namespace ProxiIOS { namespace DIP {
 					os_sync_after_write(message->ioctl.buffer_in, message->ioctl.length_in);
 				}
 
-				Patch* found[MAX_FOUND];
-				int foundpatches = FindPatch(PatchType::Patch, pos, len, (void**)found, MAX_FOUND);
+				u32* found;
+				int foundpatches = FindPatch(PatchType::Patch, pos, len, &found);
 				if (foundpatches == 0) {
 					int ret = ForwardIoctl(message);
 					//LogPrintf("\tForward %d\n", ret);
@@ -256,23 +260,16 @@ namespace ProxiIOS { namespace DIP {
 
 				LogPrintf("\tFound 0x%08x patches\n", foundpatches);
 
-				TemporaryPatch patches[MAX_FOUND];
+				TemporaryPatch clipped;
 				bool filecover = false;
 				for (int i = 0; i < foundpatches; i++) {
-					Patch* patch = found[i];
-					patches[i].Length = patch->Length;
-					patches[i].Offset = ((s64)patch->Offset << 2) - pos;
-					patches[i].FileOffset = 0;
-					if (patches[i].Offset < 0) { // Patch starts before the read
-						patches[i].Length += patches[i].Offset; // Reduce the length
-						patches[i].FileOffset -= patches[i].Offset; // Increase the file offset
-						patches[i].Offset = 0;
-					}
-					patches[i].Length = MIN(patches[i].Length, len - patches[i].Offset);
+					ClipPatch((Patch*)Patches[PatchType::Patch] + found[i], pos, len, &clipped);
 
 					// Fuck it, too lazy to map every patch
-					if (patches[i].Offset == 0 && patches[i].Length == len)
+					if (clipped.Offset == 0 && clipped.Length == len) {
 						filecover = true;
+						break;
+					}
 				}
 				if (!filecover) {
 					if ((u64)pos < ShiftBase || foundshifts)
@@ -280,8 +277,10 @@ namespace ProxiIOS { namespace DIP {
 					os_sync_before_read(message->ioctl.buffer_io, message->ioctl.length_io);
 				}
 				for (int i = 0; i < foundpatches; i++) {
-					LogPrintf("\tBuffer Offset: 0x%08x%08x\n", (u32)(patches[i].Offset >> 32), (u32)patches[i].Offset);
-					if (!ReadFile(found[i]->File, patches[i].FileOffset, (u8*)message->ioctl.buffer_io + patches[i].Offset, patches[i].Length))
+					Patch* patch = (Patch*)Patches[PatchType::Patch] + found[i];
+					ClipPatch(patch, pos, len, &clipped);
+					LogPrintf("\tBuffer Offset: 0x%08x%08x\n", (u32)(clipped.Offset >> 32), (u32)clipped.Offset);
+					if (!ReadFile(patch->File, clipped.FileOffset, (u8*)message->ioctl.buffer_io + clipped.Offset, clipped.Length))
 						return 2; // File error
 				}
 
@@ -529,18 +528,24 @@ namespace ProxiIOS { namespace DIP {
 		return true;
 	}
 
-	int DIP::FindPatch(int index, s64 pos, u32 len, void** found, int limit)
+	// indices of the patches overlapping a read, in the order they were added
+	int DIP::FindPatch(int index, s64 pos, u32 len, u32** found)
 	{
 		int size = GetPatchSize(index);
 
+		// (re)build after patches were added, the launcher adds them all before the game starts
+		if (Index[index].IsValid() || Index[index].Build(Patches[index], PatchCount[index], size))
+			return Index[index].Find(pos, len, found);
+
+		// no memory for the index, scan the table for as many as fit
 		int count = 0;
+		*found = FoundFallback;
 		for (u32 i = 0; i < PatchCount[index]; i++) {
-			void* pointer = (u8*)Patches[index] + i * size;
-			OffsetPatch* patch = (OffsetPatch*)pointer;
+			OffsetPatch* patch = (OffsetPatch*)((u8*)Patches[index] + i * size);
 			s64 offset = pos - ((s64)patch->Offset << 2);
 			if ((offset == 0) || (offset < 0 && offset + len > 0) || (offset > 0 && offset < patch->Length)) {
-				found[count++] = pointer;
-				if (count == limit)
+				FoundFallback[count++] = i;
+				if (count == MAX_FOUND)
 					break;
 			}
 		}
@@ -554,30 +559,13 @@ namespace ProxiIOS { namespace DIP {
 
 		LogPrintf("\tReadFile(0x%04x, 0x%08x, 0x%08x) : ", (u32)fileid, offset, length);
 
-		FileDesc* file = (FileDesc*)Patches[PatchType::File] + fileid;
 		struct DIPFile *ThisFile = GetFile(fileid);
 		if (ThisFile==NULL) {
-			LogPrintf("\t\tGetFile failed! (PANIC)\n");
+			LogPrintf("\t\tGetFile failed!\n");
 			return false;
 		}
-		if (ThisFile->fd < 0) {
-			if (Clusters)
-				ThisFile->fd = File_Open_ID(file->Cluster, O_RDONLY);
-			else
-				ThisFile->fd = File_Open(file->Filename, O_RDONLY);
-
-			if (ThisFile->fd < 0) { // move it back to the free list
-				LogPrintf("0x%08x\n\t\tFile_Open failed!\n", ThisFile->fd);
-				OpenFiles = ThisFile->next;
-				ThisFile->next = FreeFiles;
-				FreeFiles = ThisFile;
-				return false;
-			}
-
-			ThisFile->fileid = fileid;
-		}
 
-		if ((int)buffer & 0x1F) { // Just in case...
+		if ((unsigned long)buffer & 0x1F) { // Just in case...
 			data = Memalign(0x20, ROUND_UP(length, 0x20));
 			if (!data)
 				data = buffer;
@@ -604,40 +592,114 @@ namespace ProxiIOS { namespace DIP {
 		return ret >= 0;
 	}
 
+	// an open handle for a patch file, opening it (and closing the least recently used) if needed
 	struct DIP::DIPFile* DIP::GetFile(s16 fileid)
 	{
-		struct DIPFile *ThisFile = NULL;
-		if (OpenFiles==NULL) { // take the head of the free list
-			OpenFiles = ThisFile = FreeFiles;
-			FreeFiles = FreeFiles->next;
-			ThisFile->next = NULL;
-		} else if (OpenFiles->fileid == fileid)
-			ThisFile = OpenFiles;
-		else {
-			struct DIPFile* PrevFile = OpenFiles;
-			for (ThisFile=OpenFiles->next; ThisFile->next; PrevFile=ThisFile, ThisFile=ThisFile->next) {
-				if (ThisFile->fileid == fileid)
-					break;
+		struct DIPFile **bucket = FileHash + (fileid & FileHashMask);
+		struct DIPFile *ThisFile = *bucket;
+		while (ThisFile && ThisFile->fileid != fileid)
+			ThisFile = ThisFile->hashnext;
+
+		if (ThisFile) {
+			HandleStats.Hits++;
+			if (ThisFile == OpenFiles)
+				return ThisFile;
+			// unlink and move to the front
+			ThisFile->prev->next = ThisFile->next;
+			if (ThisFile->next)
+				ThisFile->next->prev = ThisFile->prev;
+			else
+				OldestFile = ThisFile->prev;
+		} else {
+			HandleStats.Misses++;
+			if (FreeFiles==NULL && OldestFile) {
+				CloseFile(OldestFile);
+				HandleStats.Evictions++;
 			}
-			if (ThisFile->fileid != fileid) { // need to open it
-				if (FreeFiles==NULL) { // close oldest open file and move it to the free list
-					PrevFile->next = ThisFile->next;
-					File_Close(ThisFile->fd);
-					ThisFile->fd = -1;
-					ThisFile->next = FreeFiles;
-					FreeFiles = ThisFile;
-				}
+			if (FreeFiles==NULL)
+				return NULL;
 
-				ThisFile = FreeFiles;
-				FreeFiles = FreeFiles->next;
-			} else
-				PrevFile->next = ThisFile->next;
-			ThisFile->next = OpenFiles;
-			OpenFiles = ThisFile;
+			FileDesc* file = (FileDesc*)Patches[PatchType::File] + fileid;
+			ThisFile = FreeFiles;
+			if (Clusters)
+				ThisFile->fd = File_Open_ID(file->Cluster, O_RDONLY);
+			else
+				ThisFile->fd = File_Open(file->Filename, O_RDONLY);
+			if (ThisFile->fd < 0) {
+				LogPrintf("0x%08x\n\t\tFile_Open failed!\n", ThisFile->fd);
+				return NULL;
+			}
+
+			FreeFiles = ThisFile->next;
+			ThisFile->fileid = fileid;
+			ThisFile->hashnext = *bucket;
+			*bucket = ThisFile;
+			HandleStats.Open++;
+			if (OldestFile==NULL)
+				OldestFile = ThisFile;
 		}
+
+		ThisFile->prev = NULL;
+		ThisFile->next = OpenFiles;
+		if (OpenFiles)
+			OpenFiles->prev = ThisFile;
+		OpenFiles = ThisFile;
 		return ThisFile;
 	}
 
+	void DIP::CloseFile(struct DIPFile *file)
+	{
+		struct DIPFile **bucket = FileHash + (file->fileid & FileHashMask);
+		while (*bucket != file)
+			bucket = &(*bucket)->hashnext;
+		*bucket = file->hashnext;
+
+		if (file->prev)
+			file->prev->next = file->next;
+		else
+			OpenFiles = file->next;
+		if (file->next)
+			file->next->prev = file->prev;
+		else
+			OldestFile = file->prev;
+
+		File_Close(file->fd);
+		file->fd = -1;
+		file->next = FreeFiles;
+		FreeFiles = file;
+		HandleStats.Open--;
+	}
+
+	// resize the handle pool, every open file is closed
+	bool DIP::SetFileHandles(u32 handles)
+	{
+		handles = MAX(1, MIN(handles, MAX_FILE_HANDLES));
+		u32 buckets = 1;
+		while (buckets < handles * 2)
+			buckets <<= 1;
+
+		struct DIPFile *pool = (struct DIPFile*)Alloc(handles * sizeof(struct DIPFile) + buckets * sizeof(struct DIPFile*));
+		if (pool==NULL)
+			return false;
+
+		while (OpenFiles)
+			CloseFile(OpenFiles);
+		Dealloc(DIPFiles);
+
+		DIPFiles = pool;
+		FileHash = (struct DIPFile**)(pool + handles);
+		FileHashMask = buckets - 1;
+		memset(FileHash, 0, buckets * sizeof(struct DIPFile*));
+		for (u32 i = 0; i < handles; i++) {
+			DIPFiles[i].fd = -1;
+			DIPFiles[i].next = i+1 < handles ? DIPFiles+i+1 : NULL;
+		}
+		FreeFiles = DIPFiles;
+		HandleStats.Handles = handles;
+
+		return true;
+	}
+
 	int DIP::ForwardIoctl(ipcmessage* message)
 	{
 		return ForwardIoctl(message, false);
@@ -1,6 +1,6 @@
 #include "fileprovider.h"
 #include "dip.h"
-#include "rijndael.h"
+#include <aes.h>
 
 #include <files.h>
 
@@ -52,18 +52,37 @@ namespace ProxiIOS { namespace DIP {
 
 		u64 offset = provider->Module->CurrentPartition + ((u64)provider->Partition.DataOffset << 2) + (u64)sector * 0x8000;
 		LogPrintf("\tOffset: 0x%08x%08x\n", (u32)(offset >> 32), (u32)offset);
-		for (sec_t i = 0; i < numSectors; i++, offset += 0x8000, buffer = (u8*)buffer + 0x7C00) {
-			if (provider->UnencryptedRead(iv, 0x10, offset + 0x3D0) != 1)
-				return false;
-			if (provider->UnencryptedRead((u8*)buffer, 0x7C00, offset + 0x400) != 1)
-				return false;
-			aes_decrypt(iv, (u8*)buffer, (u8*)buffer, 0x7C00);
+		u8* data = (u8*)buffer;
+		while (numSectors) {
+			// Whole clusters are read in one go into the space their data will take and decrypted
+			// down over themselves. That space is 0x400 short per cluster, so every 32nd cluster
+			// (and the last if there are fewer) has its IV and data read on their own.
+			sec_t count = MIN(numSectors * 0x7C00 / 0x8000, (0x80000000 - ((u32)offset & 0x7FFFFFFF)) / 0x8000);
+			if (count) {
+				if (provider->UnencryptedRead(data, count * 0x8000, offset) != 1)
+					return false;
+				for (sec_t i = 0; i < count; i++) {
+					memcpy(iv, data + i * 0x8000 + 0x3D0, 0x10);
+					aes_decrypt(iv, data + i * 0x8000 + 0x400, data + i * 0x7C00, 0x7C00);
+				}
+			} else {
+				count = 1;
+				if (provider->UnencryptedRead(iv, 0x10, offset + 0x3D0) != 1)
+					return false;
+				if (provider->UnencryptedRead(data, 0x7C00, offset + 0x400) != 1)
+					return false;
+				aes_decrypt(iv, data, data, 0x7C00);
+			}
+
+			data += count * 0x7C00;
+			offset += (u64)count * 0x8000;
+			numSectors -= count;
 		}
 
 		return true;
 	}
 
-	FileProvider::FileProvider(DIP* module, const char* path) : DiProvider(module), Kash(3, 1, 0x7C00, ReadSectors, this)
+	FileProvider::FileProvider(DIP* module, const char* path) : DiProvider(module), Kash(FILEPROVIDER_CACHE_PAGES, 1, 0x7C00, ReadSectors, this, FILEPROVIDER_READAHEAD)
 	{
 		int i = strlen(path);
 		char *ex_path = (char*)Alloc(i+3);
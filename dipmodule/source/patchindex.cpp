@@ -0,0 +1,175 @@
+#include <string.h>
+#include <mem.h>
+
+#include "patch.h"
+#include "patchindex.h"
+
+namespace ProxiIOS { namespace DIP {
+	PatchIndex::PatchIndex()
+	{
+		Nodes = NULL;
+		Found = NULL;
+		Count = 0;
+		Levels = -1;
+		Valid = false;
+	}
+
+	PatchIndex::~PatchIndex()
+	{
+		Clear();
+	}
+
+	void PatchIndex::Clear()
+	{
+		if (Nodes)
+			Dealloc(Nodes);
+		Nodes = NULL;
+		Found = NULL;
+		Count = 0;
+		Levels = -1;
+	}
+
+	// the table changed, rebuilt on the next Find
+	void PatchIndex::Invalidate()
+	{
+		Clear();
+		Valid = false;
+	}
+
+	void PatchIndex::SiftDown(Node* nodes, u32 root, u32 count)
+	{
+		while (root * 2 + 1 < count) {
+			u32 child = root * 2 + 1;
+			if (child + 1 < count && nodes[child + 1].Start > nodes[child].Start)
+				child++;
+			if (nodes[root].Start >= nodes[child].Start)
+				return;
+			Node temp = nodes[root];
+			nodes[root] = nodes[child];
+			nodes[child] = temp;
+			root = child;
+		}
+	}
+
+	bool PatchIndex::Build(const void* patches, u32 count, int size)
+	{
+		Clear();
+		Valid = true;
+		if (count == 0)
+			return true;
+
+		// nodes and the results buffer share one allocation
+		Nodes = (Node*)Alloc(count * (sizeof(Node) + sizeof(u32)));
+		if (!Nodes) {
+			Valid = false;
+			return false;
+		}
+		Found = (u32*)(Nodes + count);
+		Count = count;
+
+		for (u32 i = 0; i < count; i++) {
+			const OffsetPatch* patch = (const OffsetPatch*)((const u8*)patches + i * size);
+			u32 words = (u32)(((u64)patch->Length + 3) >> 2);
+			Nodes[i].Start = patch->Offset;
+			// a patch always covers its first word: a read starting on an empty patch still hits it
+			Nodes[i].End = (u32)MIN((u64)patch->Offset + MAX(words, 1), 0xFFFFFFFFULL);
+			Nodes[i].Index = i;
+		}
+
+		// heapsort by start, Find puts the matches back in table order
+		for (u32 i = count / 2; i > 0; i--)
+			SiftDown(Nodes, i - 1, count);
+		for (u32 i = count - 1; i > 0; i--) {
+			Node temp = Nodes[0];
+			Nodes[0] = Nodes[i];
+			Nodes[i] = temp;
+			SiftDown(Nodes, 0, i);
+		}
+
+		// fill in the subtree maxima bottom up, node i sits at the level of its trailing 1 bits
+		u32 last_i = 0, last = 0;
+		for (u32 i = 0; i < count; i += 2) {
+			last_i = i;
+			last = Nodes[i].Max = Nodes[i].End;
+		}
+		int k;
+		for (k = 1; (1UL << k) <= count; k++) {
+			u32 x = 1UL << (k - 1);
+			u32 step = x << 2;
+			for (u32 i = (x << 1) - 1; i < count; i += step) {
+				u32 left = Nodes[i - x].Max;
+				u32 right = i + x < count ? Nodes[i + x].Max : last;
+				Nodes[i].Max = MAX(Nodes[i].End, MAX(left, right));
+			}
+			last_i = (last_i >> k & 1) ? last_i - x : last_i + x;
+			if (last_i < count && Nodes[last_i].Max > last)
+				last = Nodes[last_i].Max;
+		}
+		Levels = k - 1;
+
+		return true;
+	}
+
+	int PatchIndex::Find(s64 pos, u32 len, u32** found)
+	{
+		struct {
+			u32 Node;
+			int Level;
+			bool LeftDone;
+		} stack[64];
+		int depth = 0;
+		int hits = 0;
+
+		*found = Found;
+		if (Count == 0 || pos < 0)
+			return 0;
+
+		// the read in words, never empty for the same reason patches aren't
+		u32 start = (u32)(pos >> 2);
+		u32 end = (u32)MIN((pos + MAX(len, 1) + 3) >> 2, 0xFFFFFFFFLL);
+
+		stack[0].Node = (1UL << Levels) - 1;
+		stack[0].Level = Levels;
+		stack[0].LeftDone = false;
+		depth = 1;
+		while (depth) {
+			u32 node = stack[--depth].Node;
+			int level = stack[depth].Level;
+			if (level <= 3) {
+				// small subtree, just walk it in order
+				u32 first = node >> level << level;
+				u32 last = MIN(first + (1UL << (level + 1)) - 1, Count);
+				for (u32 i = first; i < last && Nodes[i].Start < end; i++) {
+					if (start < Nodes[i].End)
+						Found[hits++] = Nodes[i].Index;
+				}
+			} else if (!stack[depth].LeftDone) {
+				u32 left = node - (1UL << (level - 1));
+				stack[depth++].LeftDone = true;
+				// the left child may be past the end of the array, then only its own subtree's nodes exist
+				if (left >= Count || Nodes[left].Max > start) {
+					stack[depth].Node = left;
+					stack[depth].Level = level - 1;
+					stack[depth++].LeftDone = false;
+				}
+			} else if (node < Count && Nodes[node].Start < end) {
+				if (start < Nodes[node].End)
+					Found[hits++] = Nodes[node].Index;
+				stack[depth].Node = node + (1UL << (level - 1));
+				stack[depth].Level = level - 1;
+				stack[depth++].LeftDone = false;
+			}
+		}
+
+		// back into table order, there are rarely more than a couple
+		for (int i = 1; i < hits; i++) {
+			u32 index = Found[i];
+			int j = i - 1;
+			for (; j >= 0 && Found[j] > index; j--)
+				Found[j + 1] = Found[j];
+			Found[j + 1] = index;
+		}
+
+		return hits;
+	}
+} }
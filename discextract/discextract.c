@@ -0,0 +1,652 @@
+/* discextract - pulls the files out of a Wii disc image on a PC
+ *
+ * The disc is read the way rawksd's fst.c sees it: the partition table,
+ * each partition's ticket for the title key, its header, the boot block
+ * and the FST. Partition n's files end up in <output>/n and the ticket,
+ * TMD, header, apploader, main.dol and fst.bin in <output>/n_metadata, the
+ * same tree the fst: device shows.
+ *
+ * The image, a plain ISO or a .wbfs file holding one disc, is mapped into
+ * memory. The clusters a partition's files live in are split into runs
+ * that a pool of threads decrypt straight out of the mapping, and each
+ * file's part of a run is written with one pwrite. All the files are made
+ * at their full size first so the threads can write them in any order.
+ *
+ * Usage: discextract [-j threads] [-p partition] <image> <output folder>
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdint.h>
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef int32_t s32;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#include <aes.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CLUSTER_HEADER_SIZE 0x400
+#define ENCRYPTED_CLUSTER_SIZE 0x8000
+#define PLAINTEXT_CLUSTER_SIZE (ENCRYPTED_CLUSTER_SIZE - CLUSTER_HEADER_SIZE)
+#define JOB_CLUSTERS 64 // what a thread decrypts at once, just under 2MB of file data
+
+#define MAX_THREADS 64
+
+#define DISC_MAGIC_OFFSET 0x18
+#define DISC_MAGIC 0x5D1C9EA3
+#define PARTITION_TABLES_OFFSET 0x40000
+
+// offsets into a partition, from the start of its signed ticket
+#define TICKET_TITLE_KEY 0x1BF
+#define TICKET_TITLE_ID 0x1DC
+#define TICKET_KOREAN_KEY 0x1F1
+#define STD_SIGNED_TIK_SIZE 0x2A4
+#define PARTITION_INFO_OFFSET STD_SIGNED_TIK_SIZE
+
+#define COMMON_AES_KEY ((u8 *)"\xeb\xe4\x2a\x22\x5e\x85\x93\xe4\x48\xd9\xc5\x45\x73\x81\xaa\xf7")
+#define KOREAN_AES_KEY ((u8 *)"\x63\xb8\x2b\xb4\xf4\x61\x4e\x2e\x13\xf2\xfe\xfb\xba\x4c\x9b\x7e")
+
+#define WBFS_MAGIC 0x57424653
+#define WII_DISC_CLUSTERS (143432 * 2)
+
+typedef struct {
+	const u8 *map;
+	u64 size;
+	// a .wbfs file keeps the disc in blocks, found through a table of where each one is
+	u32 block_shift;
+	const u8 *blocks;
+	u32 block_count;
+} IMAGE;
+
+typedef struct {
+	u32 dol_offset;
+	u32 fst_offset;
+	u32 fst_size;
+} FST_INFO;
+
+typedef struct {
+	u32 tmd_size;
+	u32 tmd_offset;
+	u32 data_offset;
+	u32 data_size;
+} PARTITION_INFO;
+
+typedef struct {
+	char *path;
+	u64 offset; // from the start of the partition's data, as plaintext
+	u32 size;
+} FILE_ENTRY;
+
+typedef struct {
+	u32 cluster;
+	u32 count;
+	u32 first_file;
+} JOB;
+
+typedef struct {
+	const IMAGE *image;
+	u64 data_offset;
+	FILE_ENTRY *files;
+	u32 file_count;
+	JOB *jobs;
+	u32 job_count;
+	u32 next_job;
+	u64 written;
+	volatile int failed;
+} EXTRACT;
+
+static u32 be32(const u8 *p) {
+	return ((u32)p[0] << 24) | ((u32)p[1] << 16) | ((u32)p[2] << 8) | p[3];
+}
+
+static u16 be16(const u8 *p) {
+	return (p[0] << 8) | p[1];
+}
+
+static double now() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static int open_image(IMAGE *image, const char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size < 0x100) {
+		fprintf(stderr, "%s: not a disc image\n", path);
+		close(fd);
+		return -1;
+	}
+	memset(image, 0, sizeof(IMAGE));
+	image->size = st.st_size;
+	image->map = mmap(NULL, image->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (image->map == MAP_FAILED) {
+		perror(path);
+		return -1;
+	}
+
+	if (be32(image->map) == WBFS_MAGIC) {
+		u32 sector_shift = image->map[8];
+		image->block_shift = image->map[9];
+		image->blocks = image->map + (1 << sector_shift) + 0x100;
+		image->block_count = (u32)(((u64)WII_DISC_CLUSTERS * ENCRYPTED_CLUSTER_SIZE) >> image->block_shift);
+		if (image->block_shift < 15 || image->block_shift > 30 || !image->map[12] ||
+			(u64)(image->blocks - image->map) + image->block_count * 2 > image->size) {
+			fprintf(stderr, "%s: not a single disc .wbfs file\n", path);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// len bytes of the disc at offset, NULL if they aren't in the image; they can't cross a .wbfs block
+static const u8 *image_at(const IMAGE *image, u64 offset, u32 len) {
+	if (image->blocks) {
+		u64 block = offset >> image->block_shift;
+		u64 mask = ((u64)1 << image->block_shift) - 1;
+		if (block >= image->block_count || (offset & mask) + len > mask + 1)
+			return NULL;
+		u16 where = be16(image->blocks + block * 2);
+		if (!where)
+			return NULL;
+		offset = ((u64)where << image->block_shift) + (offset & mask);
+	}
+	if (offset + len > image->size)
+		return NULL;
+	return image->map + offset;
+}
+
+static int decrypt_cluster(const IMAGE *image, u64 data_offset, u32 cluster, u8 *out) {
+	const u8 *in = image_at(image, data_offset + (u64)cluster * ENCRYPTED_CLUSTER_SIZE, ENCRYPTED_CLUSTER_SIZE);
+	if (!in)
+		return -1;
+	u8 iv[16];
+	memcpy(iv, in + 0x3D0, sizeof(iv));
+	aes_decrypt(iv, in + CLUSTER_HEADER_SIZE, out, PLAINTEXT_CLUSTER_SIZE);
+	return 0;
+}
+
+// for the small things read before the threads start, the key has to be set
+static int read_plaintext(const IMAGE *image, u64 data_offset, u64 offset, u8 *buf, u32 len) {
+	static u8 cluster_buffer[PLAINTEXT_CLUSTER_SIZE];
+	while (len) {
+		u32 offset_from_cluster = offset % PLAINTEXT_CLUSTER_SIZE;
+		u32 chunk = PLAINTEXT_CLUSTER_SIZE - offset_from_cluster;
+		if (chunk > len)
+			chunk = len;
+		if (decrypt_cluster(image, data_offset, offset / PLAINTEXT_CLUSTER_SIZE, cluster_buffer))
+			return -1;
+		memcpy(buf, cluster_buffer + offset_from_cluster, chunk);
+		buf += chunk;
+		offset += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+static int write_file(const char *path, const u8 *data, u32 size) {
+	FILE *out = fopen(path, "wb");
+	if (!out || fwrite(data, 1, size, out) != size) {
+		perror(path);
+		if (out)
+			fclose(out);
+		return -1;
+	}
+	fclose(out);
+	return 0;
+}
+
+static char *join_path(const char *dir, const char *name) {
+	char *path = malloc(strlen(dir) + strlen(name) + 2);
+	if (path)
+		sprintf(path, "%s/%s", dir, name);
+	return path;
+}
+
+static int make_dir(const char *path) {
+	if (mkdir(path, 0755) && errno != EEXIST) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+static int add_file(EXTRACT *extract, char *path, u64 offset, u32 size) {
+	if (!path)
+		return -1;
+	FILE_ENTRY *files = realloc(extract->files, (extract->file_count + 1) * sizeof(FILE_ENTRY));
+	if (!files) {
+		free(path);
+		return -1;
+	}
+	extract->files = files;
+	files[extract->file_count].path = path;
+	files[extract->file_count].offset = offset;
+	files[extract->file_count].size = size;
+	extract->file_count++;
+	return 0;
+}
+
+// as fst.c's read_fst, but the directories are made and the files listed
+static s32 read_fst(EXTRACT *extract, const u8 *fst, u32 entries, const char *name_table, u32 names_size, s32 index, const char *path) {
+	const u8 *fst_entry = fst + index * 12;
+	u32 name_offset = be32(fst_entry) & 0x00FFFFFF;
+	u32 fileoffset = be32(fst_entry + 4);
+	u32 filelen = be32(fst_entry + 8);
+	char *entry_path = NULL;
+
+	if (index > 0) {
+		if (name_offset >= names_size || !memchr(name_table + name_offset, 0, names_size - name_offset))
+			return -1;
+		const char *name = name_table + name_offset;
+		if (!*name || !strcmp(name, ".") || !strcmp(name, "..") || strchr(name, '/'))
+			return -1;
+		entry_path = join_path(path, name);
+		if (!entry_path)
+			return -1;
+	}
+
+	if (index == 0 || (fst_entry[0] & 1)) {
+		if (filelen > entries || (index > 0 && filelen <= (u32)index))
+			goto error;
+		if (entry_path && make_dir(entry_path))
+			goto error;
+		s32 next;
+		for (next = index + 1; next < (s32)filelen;) {
+			next = read_fst(extract, fst, entries, name_table, names_size, next, entry_path ? entry_path : path);
+			if (next == -1)
+				goto error;
+		}
+		free(entry_path);
+		return filelen;
+	}
+
+	if (add_file(extract, entry_path, (u64)fileoffset << 2, filelen))
+		return -1;
+	return index + 1;
+
+error:
+	free(entry_path);
+	return -1;
+}
+
+static int compare_files(const void *a, const void *b) {
+	const FILE_ENTRY *fa = a, *fb = b;
+	if (fa->offset != fb->offset)
+		return fa->offset < fb->offset ? -1 : 1;
+	return 0;
+}
+
+// runs of at most JOB_CLUSTERS clusters over everything the files take up
+static int plan_jobs(EXTRACT *extract) {
+	u32 first_file = 0;
+	u32 i;
+
+	qsort(extract->files, extract->file_count, sizeof(FILE_ENTRY), compare_files);
+
+	for (i = 0; i < extract->file_count; i++) {
+		FILE_ENTRY *file = extract->files + i;
+		if (!file->size)
+			continue;
+		u32 cluster = file->offset / PLAINTEXT_CLUSTER_SIZE;
+		u32 end = (file->offset + file->size - 1) / PLAINTEXT_CLUSTER_SIZE + 1;
+		JOB *last = extract->job_count ? extract->jobs + extract->job_count - 1 : NULL;
+		if (last && last->cluster + last->count > cluster)
+			cluster = last->cluster + last->count;
+		while (cluster < end) {
+			if (last && last->cluster + last->count == cluster && last->count < JOB_CLUSTERS) {
+				u32 count = end - cluster;
+				if (count > JOB_CLUSTERS - last->count)
+					count = JOB_CLUSTERS - last->count;
+				last->count += count;
+				cluster += count;
+				continue;
+			}
+			JOB *jobs = realloc(extract->jobs, (extract->job_count + 1) * sizeof(JOB));
+			if (!jobs)
+				return -1;
+			extract->jobs = jobs;
+			last = jobs + extract->job_count++;
+			last->cluster = cluster;
+			last->count = 0;
+			// everything before it ends before this run, so the writes can start looking here
+			u64 start = (u64)cluster * PLAINTEXT_CLUSTER_SIZE;
+			while (first_file < extract->file_count && extract->files[first_file].offset + extract->files[first_file].size <= start)
+				first_file++;
+			last->first_file = first_file;
+		}
+	}
+
+	return 0;
+}
+
+static int write_part(const FILE_ENTRY *file, const u8 *data, u64 offset, u32 len) {
+	int fd = open(file->path, O_WRONLY);
+	if (fd < 0) {
+		perror(file->path);
+		return -1;
+	}
+	while (len) {
+		ssize_t written = pwrite(fd, data, len, offset);
+		if (written <= 0) {
+			perror(file->path);
+			close(fd);
+			return -1;
+		}
+		data += written;
+		offset += written;
+		len -= written;
+	}
+	close(fd);
+	return 0;
+}
+
+static void *extract_thread(void *arg) {
+	EXTRACT *extract = arg;
+	u8 *buffer = malloc(JOB_CLUSTERS * PLAINTEXT_CLUSTER_SIZE);
+	if (!buffer) {
+		extract->failed = 1;
+		return NULL;
+	}
+
+	while (!extract->failed) {
+		u32 index = __sync_fetch_and_add(&extract->next_job, 1);
+		if (index >= extract->job_count)
+			break;
+		const JOB *job = extract->jobs + index;
+
+		u32 i;
+		for (i = 0; i < job->count; i++) {
+			if (decrypt_cluster(extract->image, extract->data_offset, job->cluster + i, buffer + i * PLAINTEXT_CLUSTER_SIZE)) {
+				fprintf(stderr, "cluster 0x%x isn't in the image\n", job->cluster + i);
+				extract->failed = 1;
+				break;
+			}
+		}
+		if (extract->failed)
+			break;
+
+		u64 start = (u64)job->cluster * PLAINTEXT_CLUSTER_SIZE;
+		u64 end = start + (u64)job->count * PLAINTEXT_CLUSTER_SIZE;
+		for (i = job->first_file; i < extract->file_count && extract->files[i].offset < end; i++) {
+			const FILE_ENTRY *file = extract->files + i;
+			u64 from = file->offset > start ? file->offset : start;
+			u64 to = file->offset + file->size < end ? file->offset + file->size : end;
+			if (from >= to)
+				continue;
+			if (write_part(file, buffer + (from - start), from - file->offset, to - from)) {
+				extract->failed = 1;
+				break;
+			}
+			__sync_fetch_and_add(&extract->written, to - from);
+		}
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+static int read_title_key(const IMAGE *image, u64 partition_offset, u8 *key) {
+	const u8 *ticket = image_at(image, partition_offset, STD_SIGNED_TIK_SIZE);
+	if (!ticket)
+		return -1;
+	u8 iv[16];
+	memset(iv, 0, sizeof(iv));
+	memcpy(iv, ticket + TICKET_TITLE_ID, 8);
+	aes_set_key(ticket[TICKET_KOREAN_KEY] ? KOREAN_AES_KEY : COMMON_AES_KEY);
+	aes_decrypt(iv, ticket + TICKET_TITLE_KEY, key, 16);
+	return 0;
+}
+
+static int write_metadata(const char *dir, const char *name, const u8 *data, u32 size) {
+	char *path = join_path(dir, name);
+	int ret = path ? write_file(path, data, size) : -1;
+	free(path);
+	return ret;
+}
+
+// a file of the partition's data that isn't in the FST
+static int write_plaintext(const IMAGE *image, u64 data_offset, const char *dir, const char *name, u64 offset, u32 size) {
+	u8 *data = malloc(size ? size : 1);
+	int ret = -1;
+	if (data && !read_plaintext(image, data_offset, offset, data, size))
+		ret = write_metadata(dir, name, data, size);
+	free(data);
+	return ret;
+}
+
+// fst.c's <n>_metadata folder
+static int extract_metadata(const IMAGE *image, u64 partition_offset, const PARTITION_INFO *info, u64 data_offset, const FST_INFO *fst_info, const u8 *fst, const char *dir) {
+	u8 buffer[0x100];
+
+	if (make_dir(dir))
+		return -1;
+
+	const u8 *ticket = image_at(image, partition_offset, STD_SIGNED_TIK_SIZE);
+	const u8 *tmd = image_at(image, partition_offset + ((u64)info->tmd_offset << 2), info->tmd_size);
+	if (!ticket || !tmd || write_metadata(dir, "ticket", ticket, STD_SIGNED_TIK_SIZE) || write_metadata(dir, "TMD", tmd, info->tmd_size))
+		return -1;
+
+	if (write_plaintext(image, data_offset, dir, "header", 0, 0x400))
+		return -1;
+
+	// the apploader's size and trailer size follow its date and entry point
+	if (read_plaintext(image, data_offset, 0x2440 + 0x14, buffer, 8))
+		return -1;
+	u32 size = be32(buffer) + be32(buffer + 4);
+	if (size)
+		size += 32;
+	if (write_plaintext(image, data_offset, dir, "appldr.bin", 0x2440, size))
+		return -1;
+
+	if (fst_info->dol_offset) {
+		u64 dol_offset = (u64)fst_info->dol_offset << 2;
+		if (read_plaintext(image, data_offset, dol_offset, buffer, 0x100))
+			return -1;
+		// 7 text and 11 data sections, the offsets first and the sizes at 0x90
+		u32 max = 0, i;
+		for (i = 0; i < 18; i++) {
+			u32 offset = be32(buffer + i * 4);
+			u32 section = be32(buffer + i * 4 + 0x90);
+			if (offset + section > max)
+				max = offset + section;
+		}
+		if (write_plaintext(image, data_offset, dir, "main.dol", dol_offset, max))
+			return -1;
+	}
+
+	if (fst && write_metadata(dir, "fst.bin", fst, fst_info->fst_size))
+		return -1;
+
+	return 0;
+}
+
+static int extract_partition(const IMAGE *image, u32 number, u64 partition_offset, const char *output, u32 threads, u64 *total) {
+	EXTRACT extract;
+	PARTITION_INFO info;
+	FST_INFO fst_info;
+	u8 key[16], buffer[12];
+	u8 *fst = NULL;
+	char name[32], *dir = NULL;
+	int ret = -1;
+	u32 i;
+
+	memset(&extract, 0, sizeof(extract));
+
+	const u8 *header = image_at(image, partition_offset + PARTITION_INFO_OFFSET, 0x1C);
+	if (!header || read_title_key(image, partition_offset, key)) {
+		fprintf(stderr, "partition %u isn't in the image\n", number);
+		return -1;
+	}
+	info.tmd_size = be32(header);
+	info.tmd_offset = be32(header + 4);
+	info.data_offset = be32(header + 0x14);
+	info.data_size = be32(header + 0x18);
+
+	extract.image = image;
+	extract.data_offset = partition_offset + ((u64)info.data_offset << 2);
+	aes_set_key(key);
+
+	if (read_plaintext(image, extract.data_offset, 0x420, buffer, sizeof(buffer)))
+		goto error;
+	fst_info.dol_offset = be32(buffer);
+	fst_info.fst_offset = be32(buffer + 4);
+	fst_info.fst_size = be32(buffer + 8) << 2;
+
+	sprintf(name, "%u", number);
+	if (!(dir = join_path(output, name)) || make_dir(dir))
+		goto error;
+
+	if (fst_info.fst_offset && fst_info.fst_size >= 12) {
+		if (!(fst = malloc(fst_info.fst_size)) || read_plaintext(image, extract.data_offset, (u64)fst_info.fst_offset << 2, fst, fst_info.fst_size))
+			goto error;
+		u32 entries = be32(fst + 8);
+		if (!entries || (u64)entries * 12 > fst_info.fst_size)
+			goto error;
+		if (read_fst(&extract, fst, entries, (const char *)fst + entries * 12, fst_info.fst_size - entries * 12, 0, dir) == -1)
+			goto error;
+	}
+
+	sprintf(name, "%u_metadata", number);
+	char *metadata = join_path(output, name);
+	if (!metadata || extract_metadata(image, partition_offset, &info, extract.data_offset, &fst_info, fst, metadata)) {
+		free(metadata);
+		goto error;
+	}
+	free(metadata);
+
+	// all there at full size before any thread writes to them
+	for (i = 0; i < extract.file_count; i++) {
+		int fd = open(extract.files[i].path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0 || ftruncate(fd, extract.files[i].size)) {
+			perror(extract.files[i].path);
+			if (fd >= 0)
+				close(fd);
+			goto error;
+		}
+		close(fd);
+	}
+
+	if (plan_jobs(&extract))
+		goto error;
+
+	pthread_t thread[MAX_THREADS];
+	u32 started;
+	for (started = 0; started < threads; started++) {
+		if (pthread_create(thread + started, NULL, extract_thread, &extract))
+			break;
+	}
+	if (!started)
+		extract_thread(&extract);
+	for (i = 0; i < started; i++)
+		pthread_join(thread[i], NULL);
+	if (extract.failed)
+		goto error;
+
+	printf("partition %u: %u files, %.1f MB\n", number, extract.file_count, extract.written / 1e6);
+	*total += extract.written;
+	ret = 0;
+
+error:
+	if (ret)
+		fprintf(stderr, "partition %u couldn't be extracted\n", number);
+	for (i = 0; i < extract.file_count; i++)
+		free(extract.files[i].path);
+	free(extract.files);
+	free(extract.jobs);
+	free(fst);
+	free(dir);
+	return ret;
+}
+
+static void usage() {
+	fprintf(stderr, "Usage: discextract [-j threads] [-p partition] <image> <output folder>\n");
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	long only = -1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "j:p:")) != -1) {
+		switch (opt) {
+			case 'j':
+				threads = strtol(optarg, NULL, 0);
+				break;
+			case 'p':
+				only = strtol(optarg, NULL, 0);
+				break;
+			default:
+				usage();
+		}
+	}
+	if (optind + 2 != argc)
+		usage();
+	if (threads < 1)
+		threads = 1;
+	if (threads > MAX_THREADS)
+		threads = MAX_THREADS;
+
+	IMAGE image;
+	if (open_image(&image, argv[optind]))
+		return 1;
+	const u8 *disc = image_at(&image, 0, 0x20);
+	if (!disc || be32(disc + DISC_MAGIC_OFFSET) != DISC_MAGIC) {
+		fprintf(stderr, "%s: not a Wii disc\n", argv[optind]);
+		return 1;
+	}
+	const char *output = argv[optind + 1];
+	if (make_dir(output))
+		return 1;
+
+	const u8 *tables = image_at(&image, PARTITION_TABLES_OFFSET, 0x20);
+	if (!tables) {
+		fprintf(stderr, "%s: no partition table\n", argv[optind]);
+		return 1;
+	}
+
+	double start = now();
+	u64 total = 0;
+	u32 number = 0, table_index, failed = 0;
+	for (table_index = 0; table_index < 4; table_index++) {
+		u32 count = be32(tables + table_index * 8);
+		u64 table_offset = (u64)be32(tables + table_index * 8 + 4) << 2;
+		const u8 *entries = count ? image_at(&image, table_offset, count * 8) : NULL;
+		if (count && !entries) {
+			fprintf(stderr, "%s: partition table %u isn't in the image\n", argv[optind], table_index);
+			return 1;
+		}
+		u32 i;
+		for (i = 0; i < count; i++, number++) {
+			if (only >= 0 && number != only)
+				continue;
+			if (extract_partition(&image, number, (u64)be32(entries + i * 8) << 2, output, threads, &total))
+				failed = 1;
+		}
+	}
+
+	double elapsed = now() - start;
+	printf("%.2f GB in %.2f s with %ld threads, %.2f GB/s\n", total / 1e9, elapsed, threads, total / 1e9 / elapsed);
+
+	munmap((void *)image.map, image.size);
+	return failed;
+}
@@ -39,6 +39,7 @@ public:
 	int Seek(FileInfo* file, int where, int whence);
 	int Tell(FileInfo* file);
 	int Sync(FileInfo* file);
+	int Reserve(FileInfo* file, u32 length);
 	int Close(FileInfo* file);
 
 	int Stat(const char* path, Stats* st);
@@ -51,6 +52,7 @@ public:
 	int CloseDir(FileInfo* dir);
 	int IdleTick();
 	int GetFreeSpace(u64 *free_bytes);
+	int GetLookupStats(LookupStats* stats);
 };
 
 } }
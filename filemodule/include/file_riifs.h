@@ -5,6 +5,7 @@
 // Actions
 #define RII_SEND 0x01
 #define RII_RECEIVE 0x02
+#define RII_COMPOUND 0x03
 
 // Commands
 #define RII_HANDSHAKE			0x00
@@ -21,6 +22,8 @@
 #define RII_FILE_CREATE			0x18
 #define RII_FILE_DELETE			0x19
 #define RII_FILE_RENAME			0x1A
+#define RII_FILE_READ_AT		0x1B
+#define RII_FILE_WRITE_AT		0x1C
 #define RII_FILE_CREATEDIR		0x20
 #define RII_FILE_OPENDIR		0x21
 #define RII_FILE_CLOSEDIR		0x22
@@ -38,18 +41,22 @@
 #define RII_OPTION_SEEK_WHENCE			0x07
 #define RII_OPTION_RENAME_SOURCE		0x08
 #define RII_OPTION_RENAME_DESTINATION	0x09
+#define RII_OPTION_OFFSET				0x0A
 #define RII_OPTION_PING					0x10
 
 #define RII_IDLE_TIME 30*1000*1000
 
 #define RIIFS_LOCAL_OPTIONS
 #define RIIFS_LOCAL_SEEKING
-//#define RIIFS_LOCAL_DIRNEXT
+#define RIIFS_LOCAL_DIRNEXT
 #define RIIFS_LOCAL_DIRNEXT_SIZE 0x1000
 
-#define RII_VERSION 		"1.03"
+#define RII_VERSION 		"1.04"
+#define RII_VERSION_LEGACY	"1.03"
 
 #define RII_VERSION_RET		0x03
+// servers from this version take whole requests in one RII_COMPOUND frame
+#define RII_VERSION_COMPOUND	0x05
 
 namespace ProxiIOS { namespace Filesystem {
 	struct RiiFileInfo : public FileInfo
@@ -76,6 +83,13 @@ namespace ProxiIOS { namespace Filesystem {
 		int File;
 	};
 
+	struct RiiOption
+	{
+		int Type;
+		const void* Data;
+		int Size;
+	};
+
 	class RiiHandler : public FilesystemHandler
 	{
 		protected:
@@ -84,6 +98,7 @@ namespace ProxiIOS { namespace Filesystem {
 			int Socket;
 			int ServerVersion;
 			int IdleCount;
+			int PendingReplies;
 			u8 *LogBuffer;
 			int LogSize;
 
@@ -94,6 +109,10 @@ namespace ProxiIOS { namespace Filesystem {
 
 			bool SendCommand(int type, const void* data=NULL, int size=0);
 			int ReceiveCommand(int type, void* data=NULL, int size=0);
+			bool SendRequest(int type, const RiiOption* options, int count);
+			int ReceiveReply(void* data=NULL, int size=0);
+			int Request(int type, const RiiOption* options, int count, void* data=NULL, int size=0);
+			bool Compound() { return ServerVersion >= RII_VERSION_COMPOUND; }
 
 		public:
 			RiiHandler(Filesystem* fs) : FilesystemHandler(fs) {
@@ -103,6 +122,7 @@ namespace ProxiIOS { namespace Filesystem {
 #endif
 				Socket = -1;
 				IdleCount = -1;
+				PendingReplies = 0;
 				LogBuffer = NULL;
 				LogSize = 0;
 			}
@@ -50,6 +50,8 @@ namespace ProxiIOS { namespace Filesystem {
 			// Because we need IOS to translate the FD for us
 			Tell			= SEEK_Tell,
 			Sync			= SEEK_Sync,
+			// Allocate space for a file about to be written
+			Reserve			= SEEK_Reserve,
 
 			// Directory Operations
 			CreateDir		= IOCTL_CreateDir,
@@ -71,6 +73,8 @@ namespace ProxiIOS { namespace Filesystem {
 			GetFreeSpace    = IOCTL_GetFreeSpace,
 			// Set slot LED activity indicator
 			SetSlotLED      = IOCTL_SetSlotLED,
+			// Get directory entry cache hits and misses
+			GetLookupStats  = IOCTL_GetLookupStats,
 		};
 	}
 
@@ -138,6 +142,7 @@ namespace ProxiIOS { namespace Filesystem {
 			virtual int Seek(FileInfo* file, int where, int whence) { return -1; };
 			virtual int Tell(FileInfo* file) { return -1; };
 			virtual int Sync(FileInfo* file) { return -1; };
+			virtual int Reserve(FileInfo* file, u32 length) { return -1; };
 			virtual int Close(FileInfo* file) { return -1; };
 
 			virtual int Stat(const char* path, Stats* st) { return -1; };
@@ -151,6 +156,7 @@ namespace ProxiIOS { namespace Filesystem {
 			virtual int IdleTick() { return -1; };
 			virtual int Log(const void* buffer, int length) { return 0; };
 			virtual int GetFreeSpace(u64 *free_bytes) {return -1; };
+			virtual int GetLookupStats(LookupStats* stats) { return -1; };
 	};
 
 	class Filesystem : public ProxiIOS::Module
@@ -20,6 +20,12 @@ typedef struct _stats
 	s32 Mode;
 } Stats;
 
+typedef struct _lookupstats
+{
+	u32 Hits;   // path components found in the directory entry cache
+	u32 Misses; // components that had to be read from the directory
+} LookupStats;
+
 typedef enum {
 	SD_DISK,
 	USB_DISK,
@@ -52,6 +58,7 @@ typedef enum {
 	IOCTL_Rename,
 	SEEK_Tell,
 	SEEK_Sync,
+	SEEK_Reserve,
 	IOCTL_CreateDir =	0x50,
 	IOCTL_OpenDir,
 	IOCTL_NextDir,
@@ -62,6 +69,7 @@ typedef enum {
 	IOCTL_CheckPhys,
 	IOCTL_GetFreeSpace,
 	IOCTL_SetSlotLED,
+	IOCTL_GetLookupStats,
 } file_ioctl;
 
 typedef enum {
@@ -106,8 +114,10 @@ int File_Write(int fd, const void* buffer, int length);
 int File_Seek(int fd, int whence, int where);
 int File_Tell(int fd);
 int File_Sync(int fd);
+int File_Reserve(int fd, u32 length);
 int File_Log(const void* buffer, int length);
 int File_GetFreeSpace(int fs, u64 *free_bytes);
+int File_GetLookupStats(int fs, LookupStats* stats);
 
 // Filesystem-specific Prototypes
 #define FILE_ID_PATH "/mnt/identifier/"
@@ -39,22 +39,18 @@
 #include "common.h"
 #include "disc.h"
 
-#define EVICTION_HISTORY 14
+#define CACHE_WRITEBACK_SIZE 0x4000	// Bytes of contiguous writes gathered before going to the disc
 
-typedef struct {
+typedef struct CACHE_ENTRY {
 	sec_t        sector;
 	unsigned int count;
-	unsigned int last_access;
 	bool         dirty;
 	uint8_t*     cache;
+	struct CACHE_ENTRY* hashNext;  // next page in the same hash bucket
+	struct CACHE_ENTRY* prev;      // towards the most recently used page
+	struct CACHE_ENTRY* next;      // towards the least recently used page
 } CACHE_ENTRY;
 
-typedef struct {
-	sec_t        sector;
-	unsigned int count;
-	unsigned int last_access;
-} EVICTION_ENTRY;
-
 typedef struct {
 	const DISC_INTERFACE* disc;
 	sec_t		          endOfPartition;
@@ -63,7 +59,14 @@ typedef struct {
 	unsigned int          bytesPerSector;
 	unsigned int          bytesPerSectorLog;
 	CACHE_ENTRY*          cacheEntries;
-	EVICTION_ENTRY        evictions[EVICTION_HISTORY];
+	CACHE_ENTRY**         hashTable;       // loaded pages by page number
+	unsigned int          hashShift;
+	CACHE_ENTRY*          newest;          // head of the LRU list
+	CACHE_ENTRY*          oldest;          // tail, the next page to be replaced
+	uint8_t*              writeBuffer;     // contiguous sectors waiting to be written, allocated on the first write
+	sec_t                 writeSector;
+	sec_t                 writeCount;
+	sec_t                 writeMax;        // 0 if there was no memory for the buffer
 } CACHE;
 
 /*
@@ -121,7 +124,7 @@ static inline bool _FAT_cache_writeSector (CACHE* cache, const void* buffer, sec
 bool _FAT_cache_writeSectors (CACHE* cache, sec_t sector, sec_t numSectors, const void* buffer);
 
 /*
-Write any dirty sectors back to disc and clear out the contents of the cache
+Write any dirty sectors and gathered writes back to disc
 */
 bool _FAT_cache_flush (CACHE* cache);
 
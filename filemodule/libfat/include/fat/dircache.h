@@ -0,0 +1,65 @@
+/*
+ dircache.h
+ Remembers the directory entries path lookups found, so looking the same
+ names up again doesn't read and scan the directories on the way.
+*/
+
+#ifndef _DIRCACHE_H
+#define _DIRCACHE_H
+
+#include "common.h"
+#include "directory.h"
+
+#define DIRCACHE_ENTRIES 64
+#define DIRCACHE_HASH_SIZE 128		// Power of two
+#define DIRCACHE_NAME_LENGTH 40		// Longer names are looked up the slow way
+
+typedef struct DIRCACHE_ENTRY {
+	uint32_t           dirCluster;	// Directory the name was looked up in, CLUSTER_ERROR if unused
+	uint32_t           hash;
+	char               name[DIRCACHE_NAME_LENGTH];		// As looked up, ASCII lower cased
+	char               filename[DIRCACHE_NAME_LENGTH];	// As stored in the directory
+	uint8_t            entryData[DIR_ENTRY_DATA_SIZE];
+	DIR_ENTRY_POSITION dataStart;
+	DIR_ENTRY_POSITION dataEnd;
+	struct DIRCACHE_ENTRY* hashNext;
+	struct DIRCACHE_ENTRY* prev;	// towards the most recently used entry
+	struct DIRCACHE_ENTRY* next;
+} DIRCACHE_ENTRY;
+
+typedef struct _DIRCACHE {
+	DIRCACHE_ENTRY  entries[DIRCACHE_ENTRIES];
+	DIRCACHE_ENTRY* hashTable[DIRCACHE_HASH_SIZE];
+	DIRCACHE_ENTRY* newest;
+	DIRCACHE_ENTRY* oldest;
+	uint32_t        hits;
+	uint32_t        misses;
+} DIRCACHE;
+
+DIRCACHE* _FAT_dircache_constructor (void);
+
+void _FAT_dircache_destructor (DIRCACHE* dircache);
+
+/*
+Fills in entry for the name (nameLength bytes, not terminated) in dirCluster
+Returns false if it isn't cached
+*/
+bool _FAT_dircache_find (DIRCACHE* dircache, uint32_t dirCluster, const char* name, size_t nameLength, DIR_ENTRY* entry);
+
+/*
+Remembers that looking name up in dirCluster found entry
+*/
+void _FAT_dircache_add (DIRCACHE* dircache, uint32_t dirCluster, const char* name, size_t nameLength, const DIR_ENTRY* entry);
+
+/*
+Updates the cached copies of the alias entry at position, after it was
+rewritten without changing its name
+*/
+void _FAT_dircache_update (DIRCACHE* dircache, const DIR_ENTRY_POSITION* position, const uint8_t* entryData);
+
+/*
+Forgets everything, for when entries are added to or removed from a directory
+*/
+void _FAT_dircache_invalidate (DIRCACHE* dircache);
+
+#endif // _DIRCACHE_H
@@ -40,6 +40,7 @@
 #include "directory.h"
 
 #define FILE_MAX_SIZE ((uint32_t)0xFFFFFFFF)	// 4GiB - 1B
+#define FILE_MAX_EXTENTS 512	// More fragmented files than this walk the FAT chain instead
 
 typedef struct {
 	u32   cluster;
@@ -47,6 +48,13 @@ typedef struct {
 	s32   byte;
 } FILE_POSITION;
 
+// A run of contiguous clusters in a file's chain
+typedef struct {
+	uint32_t fileCluster;	// Index of the run's first cluster within the file
+	uint32_t cluster;		// Its cluster number on the partition
+	uint32_t length;		// Clusters in the run
+} FILE_EXTENT;
+
 struct _FILE_STRUCT;
 
 struct _FILE_STRUCT {
@@ -60,6 +68,10 @@ struct _FILE_STRUCT {
 	PARTITION*           partition;
 	struct _FILE_STRUCT* prevOpenFile;		// The previous entry in a double-linked list of open files
 	struct _FILE_STRUCT* nextOpenFile;		// The next entry in a double-linked list of open files
+	FILE_EXTENT*         extents;			// The cluster chain as runs, built on first use for read-only files
+	uint32_t             extentCount;
+	bool                 extentsBuilt;		// Set once building was tried, extents stays NULL if it failed
+	bool                 reserved;			// The chain may run past filesize, see _FAT_reserve_r
 	bool                 read;
 	bool                 write;
 	bool                 append;
@@ -95,6 +107,14 @@ extern int _FAT_ftruncate_r (struct _reent *r, int fd, off_t len);
 
 extern int _FAT_fsync_r (struct _reent *r, int fd);
 
+/*
+Links enough clusters onto a file opened for writing to hold len bytes,
+without clearing them or changing the file's size. Writes then follow the
+chain instead of allocating a cluster at a time, and whatever they don't
+reach is given back when the file is closed.
+*/
+extern int _FAT_reserve_r (struct _reent *r, int fd, uint32_t len);
+
 /*
 Synchronizes the file data to disc.
 Does no locking of its own -- lock the partition before calling.
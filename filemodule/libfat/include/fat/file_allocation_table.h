@@ -57,6 +57,10 @@ uint32_t _FAT_fat_lastCluster (PARTITION* partition, uint32_t cluster);
 
 unsigned int _FAT_fat_freeClusterCount (PARTITION* partition);
 
+bool _FAT_fat_buildFreeMap (PARTITION* partition);
+
+void _FAT_fat_freeFreeMap (PARTITION* partition);
+
 static inline sec_t _FAT_fat_clusterToSector (PARTITION* partition, uint32_t cluster) {
 	return (cluster >= CLUSTER_FIRST) ?
 		((cluster - CLUSTER_FIRST) * (sec_t)partition->sectorsPerCluster) + partition->dataStart :
@@ -46,6 +46,10 @@ typedef struct {
 	uint32_t firstFree;
 	uint32_t numberFreeCluster;
 	uint32_t numberLastAllocCluster;
+	uint16_t* freeMap;					// Free clusters in each group of 1 << freeMapShift
+	uint32_t freeMapShift;
+	uint32_t freeMapGroups;
+	bool     freeMapTried;				// Don't rebuild a map that couldn't be allocated
 } FAT;
 
 typedef struct {
@@ -69,6 +73,7 @@ typedef struct {
 	uint32_t              cwdCluster;			// Current working directory cluster
 	int                   openFileCount;
 	struct _FILE_STRUCT*  firstOpenFile;		// The start of a linked list of files
+	struct _DIRCACHE*     dirCache;				// Entries found by path lookups, NULL if there's no memory for it
 	mutex_t               lock;					// A lock for partition operations
 	bool                  readOnly;				// If this is set, then do not try writing to the disc
 	char                  label[12];			// Volume label
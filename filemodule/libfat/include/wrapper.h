@@ -27,6 +27,7 @@ s32 FAT_Read(s32 fd, void *buffer, u32 len);
 s32 FAT_Write(s32 fd, void *buffer, u32 len);
 s32 FAT_Seek(s32 fd, u32 where, u32 whence);
 s32 FAT_Tell(s32 fd);
+s32 FAT_Reserve(s32 fd, u32 length);
 s32 FAT_CreateDir(const char *dirpath);
 s32 FAT_CreateFile(const char *filepath);
 s32 FAT_ReadDir(const char *dirpath, char *outbuf, u32 *outlen, u32 maxlen);
@@ -35,6 +36,7 @@ s32 FAT_DeleteDir(const char *dirpath);
 s32 FAT_Rename(const char *oldname, const char *newname);
 s32 FAT_Stat(const char *path, struct stat *stats);
 s32 FAT_GetVfsStats(const char *path, struct statvfs *stats);
+s32 FAT_GetLookupStats(const char *path, u32 *hits, u32 *misses);
 s32 FAT_GetFileStats(s32 fd, fstats *stats);
 s32 FAT_GetUsage(const char *dirpath, u64 *size, u32 *files);
 s32 FAT_Flush(s32 fd);
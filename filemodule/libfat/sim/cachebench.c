@@ -0,0 +1,406 @@
+/* cachebench - times libfat's sector cache on a PC
+ *
+ * cache.c is built unchanged over a disc interface that reads a FAT32 image
+ * with pread. For each page count given it prints how long a lookup of an
+ * already loaded sector takes, then walks cluster chains through the FAT
+ * the way _FAT_fat_nextCluster does and prints the time per FAT entry and
+ * how many of them had to go to the disc. The chain sum printed with each
+ * walk has to come out the same for every page count.
+ *
+ * Then a file is written into the data area in chunks of a few sizes,
+ * split into cache calls the way _FAT_write_r does, once from a buffer at
+ * a MEM1 address and once from one at a MEM2 address, which is allowed to
+ * skip the cache. It prints how many writes reached the disc, their average
+ * size and the reads it took, and reads the file back from the image to
+ * check it.
+ *
+ * Usage: cachebench <image> [pages...]
+ *        cachebench -g <image>
+ *
+ * -g writes a sparse 2GB FAT32 image whose FAT is made of fragmented files,
+ * 8 sectors to a page like the file module mounts with.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "cache.h"
+
+#define SECTORS_PER_PAGE 8
+#define SECTORS_PER_CLUSTER 8
+#define RESERVED_SECTORS 32
+#define CLUSTERS 0x80000
+#define HIT_LOOKUPS 4000000
+#define WALKS 20000
+#define WRITE_SIZE (32 << 20)
+#define MEM1_BUFFER 0x08000000
+#define MEM2_BUFFER 0x20000000
+#define MAX_CHUNK 0x40000
+
+static int Image = -1;
+static unsigned long DiscReads;
+static unsigned long DiscWrites;
+static unsigned long SectorsWritten;
+static sec_t DataStart;
+
+// what libios' heap would provide
+void* Alloc(u32 size) { return malloc(size); }
+bool Dealloc(void* data) { free(data); return true; }
+
+void* Memalign(u32 align, u32 size)
+{
+	void* data;
+	if (posix_memalign(&data, align, size))
+		return NULL;
+	return data;
+}
+
+static bool ImageStartup(void) { return true; }
+static bool ImageIsInserted(void) { return true; }
+static bool ImageClearStatus(void) { return true; }
+static bool ImageShutdown(void) { return true; }
+
+static bool ImageReadSectors(sec_t sector, sec_t numSectors, void* buffer)
+{
+	DiscReads++;
+	return pread(Image, buffer, numSectors << 9, (off_t)sector << 9) == (ssize_t)(numSectors << 9);
+}
+
+// only the file written below belongs in the data area, keep the FAT as it was generated
+static bool ImageWriteSectors(sec_t sector, sec_t numSectors, const void* buffer)
+{
+	if (sector < DataStart)
+		return false;
+	DiscWrites++;
+	SectorsWritten += numSectors;
+	return pwrite(Image, buffer, numSectors << 9, (off_t)sector << 9) == (ssize_t)(numSectors << 9);
+}
+
+static const DISC_INTERFACE ImageInterface = {
+	0, FEATURE_MEDIUM_CANREAD,
+	ImageStartup, ImageIsInserted, ImageReadSectors, ImageWriteSectors, ImageClearStatus, ImageShutdown
+};
+
+static double Now()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void Put16(uint8_t* p, uint16_t value) { p[0] = value; p[1] = value >> 8; }
+static void Put32(uint8_t* p, uint32_t value) { Put16(p, value); Put16(p + 2, value >> 16); }
+static uint32_t Get32(const uint8_t* p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24); }
+
+/* The cache calls _FAT_write_r makes to append len bytes at *position to a
+ * file whose clusters all follow on from each other starting at base.
+ */
+static bool FileWrite(CACHE* cache, sec_t base, uint32_t* position, const uint8_t* ptr, size_t len)
+{
+	const size_t clusterSize = SECTORS_PER_CLUSTER << 9;
+	sec_t sector = base + (*position >> 9);
+	unsigned int byte = *position & 511;
+	size_t size;
+
+	*position += len;
+
+	// partial sector
+	if (byte) {
+		size = 512 - byte;
+		if (size > len)
+			size = len;
+		if (!_FAT_cache_writePartialSector(cache, ptr, sector, byte, size))
+			return false;
+		ptr += size;
+		len -= size;
+		if (byte + size < 512)
+			return true;
+		sector++;
+	}
+
+	// up to the end of the cluster
+	size = SECTORS_PER_CLUSTER - (sector - base) % SECTORS_PER_CLUSTER;
+	if (len <= size << 9)
+		size = len >> 9;
+	if (size > 0 && size < SECTORS_PER_CLUSTER) {
+		if (!_FAT_cache_writeSectors(cache, sector, size, ptr))
+			return false;
+		ptr += size << 9;
+		len -= size << 9;
+		sector += size;
+	}
+
+	// whole clusters, grouped while there's more than the group left
+	while (len >= clusterSize) {
+		size = clusterSize;
+		while (size + clusterSize < len)
+			size += clusterSize;
+		if (!_FAT_cache_writeSectors(cache, sector, size >> 9, ptr))
+			return false;
+		ptr += size;
+		len -= size;
+		sector += size >> 9;
+	}
+
+	// remaining sectors, then the start of the last one
+	if (len >= 512) {
+		if (!_FAT_cache_writeSectors(cache, sector, len >> 9, ptr))
+			return false;
+		ptr += len & ~511;
+		sector += len >> 9;
+		len &= 511;
+	}
+	if (len > 0 && !_FAT_cache_eraseWritePartialSector(cache, ptr, sector, 0, len))
+		return false;
+	return true;
+}
+
+static uint8_t* MapBuffer(uint32_t address, size_t size)
+{
+	void* buffer = mmap((void*)(uintptr_t)address, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+	if (buffer != (void*)(uintptr_t)address) {
+		printf("can't map a buffer at %08x\n", address);
+		exit(1);
+	}
+	return (uint8_t*)buffer;
+}
+
+#define OPEN_FILES 64
+
+static int Generate(const char* path)
+{
+	uint32_t* fat = (uint32_t*)calloc(CLUSTERS + 2, 4);
+	uint32_t tail[OPEN_FILES];
+	uint32_t remain[OPEN_FILES];
+	uint32_t next = 2;
+	uint32_t fatSectors = ((CLUSTERS + 2) * 4 + 511) / 512;
+	uint8_t boot[512];
+	int i;
+
+	srand(1);
+	for (i = 0; i < OPEN_FILES; i++)
+		tail[i] = 0;
+
+	// files grow a few clusters at a time, interleaved with each other
+	while (next < CLUSTERS + 2) {
+		int file = rand() % OPEN_FILES;
+		uint32_t run = 1 + rand() % 32;
+		if (tail[file] == 0)
+			remain[file] = 1 + rand() % 2000;
+		for (; run > 0 && remain[file] > 0 && next < CLUSTERS + 2; run--, remain[file]--) {
+			if (tail[file])
+				fat[tail[file]] = next;
+			fat[next] = 0x0FFFFFFF;
+			tail[file] = next++;
+		}
+		if (remain[file] == 0)
+			tail[file] = 0;
+	}
+	fat[0] = 0x0FFFFFF8;
+	fat[1] = 0x0FFFFFFF;
+	for (i = 0; i < CLUSTERS + 2; i++)
+		Put32((uint8_t*)&fat[i], fat[i]);
+
+	memset(boot, 0, sizeof(boot));
+	boot[0] = 0xEB; boot[1] = 0x58; boot[2] = 0x90;
+	memcpy(boot + 3, "MSWIN4.1", 8);
+	Put16(boot + 11, 512);
+	boot[13] = SECTORS_PER_CLUSTER;
+	Put16(boot + 14, RESERVED_SECTORS);
+	boot[16] = 2;
+	boot[21] = 0xF8;
+	Put32(boot + 32, RESERVED_SECTORS + fatSectors * 2 + CLUSTERS * SECTORS_PER_CLUSTER);
+	Put32(boot + 36, fatSectors);
+	Put32(boot + 44, 2);
+	memcpy(boot + 82, "FAT32   ", 8);
+	boot[510] = 0x55; boot[511] = 0xAA;
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(path);
+		return 1;
+	}
+	if (pwrite(fd, boot, 512, 0) != 512 ||
+		pwrite(fd, fat, (CLUSTERS + 2) * 4, RESERVED_SECTORS * 512) != (CLUSTERS + 2) * 4 ||
+		pwrite(fd, fat, (CLUSTERS + 2) * 4, (off_t)(RESERVED_SECTORS + fatSectors) * 512) != (CLUSTERS + 2) * 4 ||
+		ftruncate(fd, (off_t)Get32(boot + 32) * 512)) {
+		perror(path);
+		return 1;
+	}
+	close(fd);
+	free(fat);
+	printf("wrote %s, %u clusters\n", path, next - 2);
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	uint8_t boot[512];
+	uint32_t fatStart, fatSectors, clusters;
+	uint32_t* heads;
+	uint32_t headCount = 0;
+	uint32_t* fat;
+	uint32_t i;
+	int arg;
+
+	if (argc == 3 && !strcmp(argv[1], "-g"))
+		return Generate(argv[2]);
+	if (argc < 2) {
+		printf("Usage: cachebench <image> [pages...]\n       cachebench -g <image>\n");
+		return 1;
+	}
+
+	Image = open(argv[1], O_RDWR);
+	if (Image < 0 || pread(Image, boot, 512, 0) != 512 || boot[510] != 0x55 || boot[511] != 0xAA) {
+		printf("%s is not a FAT image\n", argv[1]);
+		return 1;
+	}
+	fatStart = boot[14] | (boot[15] << 8);
+	fatSectors = Get32(boot + 36);
+	clusters = fatSectors * 128;
+	sec_t endOfPartition = Get32(boot + 32);
+	DataStart = fatStart + fatSectors * boot[16];
+	// pages start on a multiple of their size, keep them clear of the FAT
+	sec_t fileStart = (DataStart + SECTORS_PER_PAGE - 1) & ~(SECTORS_PER_PAGE - 1);
+
+	// start the walks at clusters nothing else points to, the first cluster of each file
+	fat = (uint32_t*)malloc(fatSectors * 512);
+	heads = (uint32_t*)malloc(clusters * 4);
+	uint8_t* pointed = (uint8_t*)calloc(clusters, 1);
+	if (pread(Image, fat, fatSectors * 512, (off_t)fatStart * 512) != fatSectors * 512) {
+		printf("can't read the FAT\n");
+		return 1;
+	}
+	for (i = 2; i < clusters; i++) {
+		uint32_t value = Get32((uint8_t*)&fat[i]) & 0x0FFFFFFF;
+		if (value >= 2 && value < clusters)
+			pointed[value] = 1;
+	}
+	for (i = 2; i < clusters; i++) {
+		if (fat[i] && !pointed[i])
+			heads[headCount++] = i;
+	}
+	free(pointed);
+	free(fat);
+	printf("%u files in the FAT\n", headCount);
+
+	// what gets written, and room to read it back
+	static const unsigned int chunks[] = { 1000, 4096, 0x8000, 0x40000 };
+	uint8_t* pattern = (uint8_t*)malloc(WRITE_SIZE);
+	uint8_t* check = (uint8_t*)malloc(WRITE_SIZE);
+	uint8_t* mem1 = MapBuffer(MEM1_BUFFER, MAX_CHUNK);
+	uint8_t* mem2 = MapBuffer(MEM2_BUFFER, MAX_CHUNK);
+	srand(4);
+	for (i = 0; i < WRITE_SIZE; i++)
+		pattern[i] = rand();
+
+	const char* defaults[] = { "8", "64", "512" };
+	int pageArgs = argc > 2 ? argc - 2 : 3;
+	for (arg = 0; arg < pageArgs; arg++) {
+		unsigned int pages = atoi(argc > 2 ? argv[arg + 2] : defaults[arg]);
+		CACHE* cache = _FAT_cache_constructor(pages, SECTORS_PER_PAGE, &ImageInterface, endOfPartition, 512);
+		uint32_t value;
+		uint64_t sum = 0;
+		unsigned long entries = 0;
+		double start;
+
+		if (!cache) {
+			printf("%u pages: no cache\n", pages);
+			continue;
+		}
+
+		// every page loaded, then lookups that all hit
+		for (i = 0; i < pages; i++)
+			_FAT_cache_readLittleEndianValue(cache, &value, i * SECTORS_PER_PAGE, 0, 4);
+		unsigned long loaded = DiscReads;
+		srand(2);
+		start = Now();
+		for (i = 0; i < HIT_LOOKUPS; i++) {
+			_FAT_cache_readLittleEndianValue(cache, &value, rand() % (pages * SECTORS_PER_PAGE), (i & 127) * 4, 4);
+			sum += value;
+		}
+		double hit = (Now() - start) / HIT_LOOKUPS;
+		if (DiscReads != loaded)
+			printf("%u pages: %lu lookups missed\n", pages, DiscReads - loaded);
+
+		// follow whole chains, next cluster by next cluster
+		_FAT_cache_invalidate(cache);
+		DiscReads = 0;
+		sum = 0;
+		srand(3);
+		start = Now();
+		for (i = 0; i < WALKS; i++) {
+			uint32_t cluster = heads[rand() % headCount];
+			while (cluster >= 2 && cluster < clusters) {
+				if (!_FAT_cache_readLittleEndianValue(cache, &value, fatStart + (cluster >> 7), (cluster & 127) * 4, 4)) {
+					printf("%u pages: read failed\n", pages);
+					return 1;
+				}
+				sum += cluster;
+				entries++;
+				cluster = value & 0x0FFFFFFF;
+			}
+		}
+		double walk = (Now() - start) / entries;
+
+		printf("%4u pages: %6.1f ns/hit, %6.1f ns/FAT entry, %5.2f%% from disc, chain sum %016llx\n",
+			pages, hit * 1e9, walk * 1e9, 100.0 * DiscReads / entries, (unsigned long long)sum);
+
+		// the same file written a chunk at a time, MEM1 then MEM2 sources
+		for (i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++) {
+			int mem;
+			for (mem = 0; mem < 2; mem++) {
+				uint8_t* source = mem ? mem2 : mem1;
+				uint32_t position = 0;
+
+				memset(check, 0, WRITE_SIZE);
+				if (pwrite(Image, check, WRITE_SIZE, (off_t)fileStart << 9) != WRITE_SIZE) {
+					printf("can't clear the data area\n");
+					return 1;
+				}
+				_FAT_cache_invalidate(cache);
+				DiscReads = 0;
+				DiscWrites = 0;
+				SectorsWritten = 0;
+				start = Now();
+				while (position < WRITE_SIZE) {
+					size_t length = chunks[i];
+					if (length > WRITE_SIZE - position)
+						length = WRITE_SIZE - position;
+					memcpy(source, pattern + position, length);
+					if (!FileWrite(cache, fileStart, &position, source, length)) {
+						printf("%u pages: write failed\n", pages);
+						return 1;
+					}
+				}
+				if (!_FAT_cache_flush(cache)) {
+					printf("%u pages: flush failed\n", pages);
+					return 1;
+				}
+				double elapsed = Now() - start;
+
+				if (pread(Image, check, WRITE_SIZE, (off_t)fileStart << 9) != WRITE_SIZE || memcmp(check, pattern, WRITE_SIZE)) {
+					printf("%u pages: %u byte writes from MEM%d came back different\n", pages, chunks[i], mem + 1);
+					return 1;
+				}
+				printf("            %6u byte writes from MEM%d: %7.1f MB/s, %6lu disc writes of %6.1f sectors, %5lu reads\n",
+					chunks[i], mem + 1, WRITE_SIZE / elapsed / (1 << 20), DiscWrites, (double)SectorsWritten / DiscWrites, DiscReads);
+			}
+		}
+		_FAT_cache_destructor(cache);
+	}
+
+	munmap(mem1, MAX_CHUNK);
+	munmap(mem2, MAX_CHUNK);
+	free(pattern);
+	free(check);
+	free(heads);
+	close(Image);
+	return 0;
+}
@@ -3,11 +3,16 @@
  The cache is not visible to the user. It should be flushed
  when any file is closed or changes are made to the filesystem.
 
- This cache implements a least-used-page replacement policy. This will
- distribute sectors evenly over the pages, so if less than the maximum
- pages are used at once, they should all eventually remain in the cache.
- This also has the benefit of throwing out old sectors, so as not to keep
- too many stale pages around.
+ Pages are found through a hash table on the page number and replaced
+ least recently used first, so a lookup costs the same however many pages
+ the cache has. Unused pages sit at the old end of the LRU list and are
+ taken before any loaded page is thrown out.
+
+ Writes of whole sectors that no page holds, and dirty pages on their way
+ out, are gathered in a write-back buffer while they follow on from each
+ other, and go to the disc as one transfer when something else comes
+ along. No page ever holds a sector that is waiting in the buffer: a page
+ that would is only loaded after the buffer has been written.
 
  Copyright (c) 2006 Michael "Chishm" Chisholm
 
@@ -46,9 +51,54 @@
 
 #define CACHE_FREE UINT_MAX
 
+// Fibonacci hashing, consecutive page numbers land in different buckets
+static inline CACHE_ENTRY** _FAT_cache_bucket (CACHE* cache, sec_t sector) {
+	return &cache->hashTable[((uint32_t)(sector / cache->sectorsPerPage) * 2654435761u) >> cache->hashShift];
+}
+
+static void _FAT_cache_unlink (CACHE* cache, CACHE_ENTRY* entry) {
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		cache->newest = entry->next;
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		cache->oldest = entry->prev;
+}
+
+static void _FAT_cache_makeNewest (CACHE* cache, CACHE_ENTRY* entry) {
+	if (cache->newest == entry)
+		return;
+	_FAT_cache_unlink (cache, entry);
+	entry->prev = NULL;
+	entry->next = cache->newest;
+	cache->newest->prev = entry;
+	cache->newest = entry;
+}
+
+static void _FAT_cache_unhash (CACHE* cache, CACHE_ENTRY* entry) {
+	CACHE_ENTRY** link = _FAT_cache_bucket (cache, entry->sector);
+	while (*link != entry)
+		link = &(*link)->hashNext;
+	*link = entry->hashNext;
+	entry->hashNext = NULL;
+}
+
+/*
+Returns the loaded page whose first sector is sector, which must be page aligned
+*/
+static CACHE_ENTRY* _FAT_cache_lookup (CACHE* cache, sec_t sector) {
+	CACHE_ENTRY* entry = *_FAT_cache_bucket (cache, sector);
+	while (entry && entry->sector != sector)
+		entry = entry->hashNext;
+	return entry;
+}
+
 CACHE* _FAT_cache_constructor (unsigned int numberOfPages, unsigned int sectorsPerPage, const DISC_INTERFACE* discInterface, sec_t endOfPartition, unsigned int bytesPerSector) {
 	CACHE* cache;
 	unsigned int i;
+	unsigned int hashSize;
 	CACHE_ENTRY* cacheEntries;
 
 	if (numberOfPages < 2) {
@@ -83,27 +133,45 @@ CACHE* _FAT_cache_constructor (unsigned int numberOfPages, unsigned int sectorsP
 	cache->sectorsPerPage = sectorsPerPage;
 	cache->bytesPerSector = bytesPerSector;
 
+	// At least two buckets per page keeps the chains short
+	cache->hashShift = 31;
+	for (hashSize = 2; hashSize < numberOfPages * 2; hashSize <<= 1) {
+		cache->hashShift--;
+	}
+
 	cacheEntries = (CACHE_ENTRY*) _FAT_mem_allocate ( sizeof(CACHE_ENTRY) * numberOfPages);
 	if (cacheEntries == NULL) {
 		_FAT_mem_free (cache);
 		return NULL;
 	}
 
+	cache->hashTable = (CACHE_ENTRY**) _FAT_mem_allocate ( sizeof(CACHE_ENTRY*) * hashSize);
+	if (cache->hashTable == NULL) {
+		_FAT_mem_free (cacheEntries);
+		_FAT_mem_free (cache);
+		return NULL;
+	}
+	memset (cache->hashTable, 0, sizeof(CACHE_ENTRY*) * hashSize);
+
 	for (i = 0; i < numberOfPages; i++) {
 		cacheEntries[i].sector = CACHE_FREE;
 		cacheEntries[i].count = 0;
-		cacheEntries[i].last_access = 0;
 		cacheEntries[i].dirty = false;
 		cacheEntries[i].cache = (uint8_t*) _FAT_mem_align ( sectorsPerPage << cache->bytesPerSectorLog );
-	}
-
-	for (i=0; i < EVICTION_HISTORY; i++) {
-		cache->evictions[i].sector = CACHE_FREE;
-		cache->evictions[i].count = 0;
-		cache->evictions[i].last_access = 0;
+		cacheEntries[i].hashNext = NULL;
+		cacheEntries[i].prev = i > 0 ? &cacheEntries[i-1] : NULL;
+		cacheEntries[i].next = i < numberOfPages - 1 ? &cacheEntries[i+1] : NULL;
 	}
 
 	cache->cacheEntries = cacheEntries;
+	cache->newest = &cacheEntries[0];
+	cache->oldest = &cacheEntries[numberOfPages - 1];
+
+	// Read only mounts never need the write-back buffer
+	cache->writeMax = CACHE_WRITEBACK_SIZE >> cache->bytesPerSectorLog;
+	cache->writeBuffer = NULL;
+	cache->writeSector = 0;
+	cache->writeCount = 0;
 
 	return cache;
 }
@@ -117,113 +185,123 @@ void _FAT_cache_destructor (CACHE* cache) {
 	for (i = 0; i < cache->numberOfPages; i++) {
 		_FAT_mem_free (cache->cacheEntries[i].cache);
 	}
+	if (cache->writeBuffer) {
+		_FAT_mem_free (cache->writeBuffer);
+	}
+	_FAT_mem_free (cache->hashTable);
 	_FAT_mem_free (cache->cacheEntries);
 	_FAT_mem_free (cache);
 }
 
+/*
+Writes out whatever is waiting in the write-back buffer
+*/
+static bool _FAT_cache_writeBack (CACHE* cache) {
+	sec_t count = cache->writeCount;
 
-static u32 accessCounter = 0;
+	if (count == 0) {
+		return true;
+	}
+	cache->writeCount = 0;
+	return _FAT_disc_writeSectors (cache->disc, cache->writeSector, count, cache->writeBuffer);
+}
 
-static u32 accessTime(){
-	accessCounter++;
-	return accessCounter;
+static inline bool _FAT_cache_writeBackOverlaps (CACHE* cache, sec_t sector, sec_t count) {
+	return (cache->writeCount > 0) && (sector < cache->writeSector + cache->writeCount) && (cache->writeSector < sector + count);
 }
 
-static int _FAT_cache_getEvictionIndex(CACHE *cache, sec_t sector)
-{
-	int i;
-	EVICTION_ENTRY *entries = cache->evictions;
+/*
+Adds sectors to the write-back buffer, first writing out what's already
+there if they don't follow straight on from it, and writing it whenever
+it fills up.
+Returns false if there is no buffer, without having written anything.
+*/
+static bool _FAT_cache_queueWrite (CACHE* cache, sec_t sector, sec_t numSectors, const uint8_t* src, bool* ok) {
+	sec_t count;
 
-	for(i=0;i<EVICTION_HISTORY;i++) {
-		if (entries[i].sector == sector)
-			return i;
+	*ok = true;
+	if (cache->writeMax == 0) {
+		return false;
 	}
 
-	return -1;
-}
-
-static CACHE_ENTRY* _FAT_cache_getPage(CACHE *cache,sec_t sector)
-{
-	unsigned int i;
-	CACHE_ENTRY* cacheEntries = cache->cacheEntries;
-	unsigned int numberOfPages = cache->numberOfPages;
-	unsigned int sectorsPerPage = cache->sectorsPerPage;
-	EVICTION_ENTRY* Evictions = cache->evictions;
-
-	bool foundFree = false;
-	unsigned int oldUsed = 0;
-	unsigned int oldAccess = UINT_MAX;
-	unsigned int oldEvicted = UINT_MAX;
-	unsigned int oldEvictedAccess = 0;
-
-	for(i=0;i<numberOfPages;i++) {
-		int eviction_index = _FAT_cache_getEvictionIndex(cache, cacheEntries[i].sector);
-
-		if(sector>=cacheEntries[i].sector && sector<(cacheEntries[i].sector + cacheEntries[i].count)) {
-			cacheEntries[i].last_access = accessTime();
-			if (eviction_index>=0)
-				Evictions[eviction_index].last_access = cacheEntries[i].last_access;
-			return &(cacheEntries[i]);
+	if (cache->writeBuffer == NULL) {
+		cache->writeBuffer = (uint8_t*) _FAT_mem_align (CACHE_WRITEBACK_SIZE);
+		if (cache->writeBuffer == NULL) {
+			// Works without it, just with more, smaller writes
+			cache->writeMax = 0;
+			return false;
 		}
+	}
 
-		if (cacheEntries[i].sector==CACHE_FREE) {
-			oldUsed = i;
-			foundFree = true;
-			break;
-		}
+	if ((cache->writeCount > 0) && (sector != cache->writeSector + cache->writeCount)) {
+		*ok = _FAT_cache_writeBack (cache);
+	}
 
-		if(cacheEntries[i].last_access<oldAccess) {
-			if (eviction_index>=0) {
-				EVICTION_ENTRY *evicted = Evictions+eviction_index;
-				if (evicted->count >= oldEvicted && evicted->last_access >= oldEvictedAccess)
-					continue;
-				oldAccess = UINT_MAX; // set this so any pages without eviction history will be preferred
-				oldEvicted = evicted->count;
-				oldEvictedAccess = evicted->last_access;
-			} else {
-				oldAccess = cacheEntries[i].last_access;
-				oldEvicted = 0; // prefer this page over any with eviction history
-				oldEvictedAccess = 0;
-			}
-			oldUsed = i;
+	while (*ok && numSectors > 0) {
+		if (cache->writeCount == 0) {
+			cache->writeSector = sector;
+		}
+		count = cache->writeMax - cache->writeCount;
+		if (count > numSectors) {
+			count = numSectors;
+		}
+		memcpy (cache->writeBuffer + (cache->writeCount << cache->bytesPerSectorLog), src, count << cache->bytesPerSectorLog);
+		cache->writeCount += count;
+		sector += count;
+		numSectors -= count;
+		src += count << cache->bytesPerSectorLog;
+
+		if (cache->writeCount == cache->writeMax) {
+			*ok = _FAT_cache_writeBack (cache);
 		}
 	}
+	return true;
+}
 
-	if (foundFree==false) { // something is being evicted, keep track of it
-		int eviction_index = _FAT_cache_getEvictionIndex(cache, cacheEntries[oldUsed].sector);
+static CACHE_ENTRY* _FAT_cache_getPage(CACHE *cache,sec_t sector)
+{
+	CACHE_ENTRY* entry;
+	unsigned int sectorsPerPage = cache->sectorsPerPage;
 
-		if (eviction_index<0) { // no eviction history for this page, overwrite the oldest record
-			oldEvictedAccess = UINT_MAX;
-			for (i=0;i<EVICTION_HISTORY;i++) {
-				if (cache->evictions[i].last_access < oldEvictedAccess) {
-					oldEvictedAccess = Evictions[i].last_access;
-					eviction_index = i;
-				}
-			}
-			Evictions[eviction_index].sector = cacheEntries[oldUsed].sector;
-			Evictions[eviction_index].count = 0;
-		}
+	sector = (sector/sectorsPerPage)*sectorsPerPage; // align base sector to page size
 
-		Evictions[eviction_index].count++;
-		Evictions[eviction_index].last_access = accessTime();
+	entry = _FAT_cache_lookup(cache, sector);
+	if (entry) {
+		_FAT_cache_makeNewest(cache, entry);
+		return entry;
 	}
 
-	if(foundFree==false && cacheEntries[oldUsed].dirty==true) {
-		if(!_FAT_disc_writeSectors(cache->disc,cacheEntries[oldUsed].sector,cacheEntries[oldUsed].count,cacheEntries[oldUsed].cache)) return NULL;
-		cacheEntries[oldUsed].dirty = false;
+	// Replace the least recently used page, free ones are kept at that end
+	entry = cache->oldest;
+	if (entry->sector != CACHE_FREE) {
+		if (entry->dirty) {
+			bool ok;
+			if (!_FAT_cache_queueWrite(cache, entry->sector, entry->count, entry->cache, &ok))
+				ok = _FAT_disc_writeSectors(cache->disc,entry->sector,entry->count,entry->cache);
+			if (!ok) return NULL;
+			entry->dirty = false;
+		}
+		_FAT_cache_unhash(cache, entry);
+		entry->sector = CACHE_FREE;
+		entry->count = 0;
 	}
 
-	sector = (sector/sectorsPerPage)*sectorsPerPage; // align base sector to page size
 	sec_t next_page = sector + sectorsPerPage;
 	if(next_page > cache->endOfPartition)	next_page = cache->endOfPartition;
 
-	if(!_FAT_disc_readSectors(cache->disc,sector,next_page-sector,cacheEntries[oldUsed].cache)) return NULL;
+	// The disc is behind on anything still in the write-back buffer
+	if (_FAT_cache_writeBackOverlaps(cache, sector, next_page-sector) && !_FAT_cache_writeBack(cache)) return NULL;
 
-	cacheEntries[oldUsed].sector = sector;
-	cacheEntries[oldUsed].count = next_page-sector;
-	cacheEntries[oldUsed].last_access = accessTime();
+	if(!_FAT_disc_readSectors(cache->disc,sector,next_page-sector,entry->cache)) return NULL;
 
-	return &(cacheEntries[oldUsed]);
+	entry->sector = sector;
+	entry->count = next_page-sector;
+	CACHE_ENTRY** bucket = _FAT_cache_bucket(cache, sector);
+	entry->hashNext = *bucket;
+	*bucket = entry;
+	_FAT_cache_makeNewest(cache, entry);
+
+	return entry;
 }
 
 bool _FAT_cache_readSectors(CACHE *cache,sec_t sector,sec_t numSectors,void *buffer)
@@ -344,9 +422,24 @@ static CACHE_ENTRY* _FAT_cache_findPage(CACHE *cache, sec_t sector, sec_t count)
 	unsigned int i;
 	CACHE_ENTRY* cacheEntries = cache->cacheEntries;
 	unsigned int numberOfPages = cache->numberOfPages;
+	unsigned int sectorsPerPage = cache->sectorsPerPage;
+	sec_t first = sector / sectorsPerPage;
+	sec_t last = (sector + count - 1) / sectorsPerPage;
+
+	// Look up each page the range covers, unless there are more of those than loaded pages
+	if (last - first < numberOfPages) {
+		for (; first <= last; first++) {
+			CACHE_ENTRY* entry = _FAT_cache_lookup(cache, first * sectorsPerPage);
+			if (entry)
+				return entry;
+		}
+		return NULL;
+	}
 
 	for (i=0;i<numberOfPages;i++) {
 		bool intersect;
+		if (cacheEntries[i].sector == CACHE_FREE)
+			continue;
 		if (sector > cacheEntries[i].sector)
 			intersect = sector - cacheEntries[i].sector < cacheEntries[i].count;
 		else
@@ -366,8 +459,23 @@ bool _FAT_cache_writeSectors (CACHE* cache, sec_t sector, sec_t numSectors, cons
 	CACHE_ENTRY* entry;
 	const uint8_t *src = (const uint8_t *)buffer;
 
-	if ((u32)src >= 0x10000000 && ((u32)src & 0x1F)==0 && _FAT_cache_findPage(cache,sector,numSectors)==NULL)
-		return _FAT_disc_writeSectors(cache->disc,sector,numSectors,src);
+	if (_FAT_cache_findPage(cache,sector,numSectors)==NULL) {
+		bool ok;
+		bool direct = (u32)src >= 0x10000000 && ((u32)src & 0x1F)==0;
+		if (direct && numSectors >= cache->writeMax) {
+			// Big enough on its own, but what's gathered can't be written over it afterwards
+			if (_FAT_cache_writeBackOverlaps(cache,sector,numSectors) && !_FAT_cache_writeBack(cache))
+				return false;
+			return _FAT_disc_writeSectors(cache->disc,sector,numSectors,src);
+		}
+		// A few sectors that don't follow on are likely to have their page written
+		// to around them, so they go through the page
+		if ((numSectors >= cache->sectorsPerPage || (cache->writeCount > 0 && sector == cache->writeSector + cache->writeCount)) &&
+			_FAT_cache_queueWrite(cache,sector,numSectors,src,&ok))
+			return ok;
+		if (direct && cache->writeMax == 0)
+			return _FAT_disc_writeSectors(cache->disc,sector,numSectors,src);
+	}
 
 	while(numSectors>0)
 	{
@@ -392,20 +500,35 @@ bool _FAT_cache_writeSectors (CACHE* cache, sec_t sector, sec_t numSectors, cons
 
 /*
 Flushes all dirty pages to disc, clearing the dirty flag.
+Goes through them lowest sector first, so pages that follow on from each
+other are written together.
 */
 bool _FAT_cache_flush (CACHE* cache) {
 	unsigned int i;
+	CACHE_ENTRY* entry;
+	bool ok;
 
-	for (i = 0; i < cache->numberOfPages; i++) {
-		if (cache->cacheEntries[i].dirty) {
-			if (!_FAT_disc_writeSectors (cache->disc, cache->cacheEntries[i].sector, cache->cacheEntries[i].count, cache->cacheEntries[i].cache)) {
-				return false;
+	for (;;) {
+		entry = NULL;
+		for (i = 0; i < cache->numberOfPages; i++) {
+			if (cache->cacheEntries[i].dirty && (entry == NULL || cache->cacheEntries[i].sector < entry->sector)) {
+				entry = &cache->cacheEntries[i];
 			}
 		}
-		cache->cacheEntries[i].dirty = false;
+		if (entry == NULL) {
+			break;
+		}
+
+		if (!_FAT_cache_queueWrite (cache, entry->sector, entry->count, entry->cache, &ok)) {
+			ok = _FAT_disc_writeSectors (cache->disc, entry->sector, entry->count, entry->cache);
+		}
+		if (!ok) {
+			return false;
+		}
+		entry->dirty = false;
 	}
 
-	return true;
+	return _FAT_cache_writeBack (cache);
 }
 
 void _FAT_cache_invalidate (CACHE* cache) {
@@ -413,8 +536,9 @@ void _FAT_cache_invalidate (CACHE* cache) {
 	_FAT_cache_flush(cache);
 	for (i = 0; i < cache->numberOfPages; i++) {
 		cache->cacheEntries[i].sector = CACHE_FREE;
-		cache->cacheEntries[i].last_access = 0;
 		cache->cacheEntries[i].count = 0;
 		cache->cacheEntries[i].dirty = false;
+		cache->cacheEntries[i].hashNext = NULL;
 	}
+	memset (cache->hashTable, 0, sizeof(CACHE_ENTRY*) << (32 - cache->hashShift));
 }
@@ -0,0 +1,171 @@
+/*
+ dircache.c
+ A small cache of directory entries, keyed on the directory's cluster and
+ the name a path lookup asked for. Entries live in a fixed array, are found
+ through a hash table and are reused least recently used first.
+
+ Names are only matched when they are byte for byte the same after ASCII
+ lower casing. Anything _FAT_directory_mbsncasecmp would match beyond that
+ just misses and gets scanned for.
+*/
+
+#include <string.h>
+
+#include "dircache.h"
+#include "mem_allocate.h"
+#include "file_allocation_table.h"
+
+static inline char _FAT_dircache_lower (char c) {
+	return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+// FNV-1a over the lower cased name and the cluster
+static uint32_t _FAT_dircache_hash (uint32_t dirCluster, const char* name, size_t nameLength) {
+	uint32_t hash = 2166136261u ^ dirCluster;
+	size_t i;
+
+	for (i = 0; i < nameLength; i++) {
+		hash = (hash ^ (uint8_t)_FAT_dircache_lower(name[i])) * 16777619u;
+	}
+	return hash;
+}
+
+static void _FAT_dircache_unlink (DIRCACHE* dircache, DIRCACHE_ENTRY* entry) {
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		dircache->newest = entry->next;
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		dircache->oldest = entry->prev;
+}
+
+static void _FAT_dircache_makeNewest (DIRCACHE* dircache, DIRCACHE_ENTRY* entry) {
+	if (dircache->newest == entry)
+		return;
+	_FAT_dircache_unlink (dircache, entry);
+	entry->prev = NULL;
+	entry->next = dircache->newest;
+	dircache->newest->prev = entry;
+	dircache->newest = entry;
+}
+
+DIRCACHE* _FAT_dircache_constructor (void) {
+	DIRCACHE* dircache = (DIRCACHE*) _FAT_mem_allocate (sizeof(DIRCACHE));
+	int i;
+
+	if (dircache == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < DIRCACHE_ENTRIES; i++) {
+		dircache->entries[i].prev = i > 0 ? &dircache->entries[i-1] : NULL;
+		dircache->entries[i].next = i < DIRCACHE_ENTRIES - 1 ? &dircache->entries[i+1] : NULL;
+	}
+	dircache->newest = &dircache->entries[0];
+	dircache->oldest = &dircache->entries[DIRCACHE_ENTRIES - 1];
+	dircache->hits = 0;
+	dircache->misses = 0;
+	_FAT_dircache_invalidate (dircache);
+
+	return dircache;
+}
+
+void _FAT_dircache_destructor (DIRCACHE* dircache) {
+	_FAT_mem_free (dircache);
+}
+
+bool _FAT_dircache_find (DIRCACHE* dircache, uint32_t dirCluster, const char* name, size_t nameLength, DIR_ENTRY* entry) {
+	uint32_t hash;
+	DIRCACHE_ENTRY* cached;
+	size_t i;
+
+	if (nameLength >= DIRCACHE_NAME_LENGTH) {
+		return false;
+	}
+
+	hash = _FAT_dircache_hash (dirCluster, name, nameLength);
+	for (cached = dircache->hashTable[hash & (DIRCACHE_HASH_SIZE - 1)]; cached; cached = cached->hashNext) {
+		if (cached->hash != hash || cached->dirCluster != dirCluster || cached->name[nameLength] != '\0') {
+			continue;
+		}
+		for (i = 0; i < nameLength && cached->name[i] == _FAT_dircache_lower(name[i]); i++)
+			;
+		if (i == nameLength) {
+			break;
+		}
+	}
+
+	if (cached == NULL) {
+		dircache->misses++;
+		return false;
+	}
+
+	dircache->hits++;
+	_FAT_dircache_makeNewest (dircache, cached);
+	memcpy (entry->entryData, cached->entryData, DIR_ENTRY_DATA_SIZE);
+	entry->dataStart = cached->dataStart;
+	entry->dataEnd = cached->dataEnd;
+	memset (entry->filename, '\0', MAX_FILENAME_LENGTH);
+	strcpy (entry->filename, cached->filename);
+	return true;
+}
+
+void _FAT_dircache_add (DIRCACHE* dircache, uint32_t dirCluster, const char* name, size_t nameLength, const DIR_ENTRY* entry) {
+	DIRCACHE_ENTRY* cached;
+	DIRCACHE_ENTRY** link;
+	size_t i;
+
+	if (nameLength >= DIRCACHE_NAME_LENGTH || strnlen (entry->filename, DIRCACHE_NAME_LENGTH) >= DIRCACHE_NAME_LENGTH) {
+		return;
+	}
+
+	// Take the least recently used entry out of its hash chain
+	cached = dircache->oldest;
+	if (cached->dirCluster != CLUSTER_ERROR) {
+		for (link = &dircache->hashTable[cached->hash & (DIRCACHE_HASH_SIZE - 1)]; *link != cached; link = &(*link)->hashNext)
+			;
+		*link = cached->hashNext;
+	}
+
+	cached->dirCluster = dirCluster;
+	cached->hash = _FAT_dircache_hash (dirCluster, name, nameLength);
+	for (i = 0; i < nameLength; i++) {
+		cached->name[i] = _FAT_dircache_lower(name[i]);
+	}
+	cached->name[nameLength] = '\0';
+	strcpy (cached->filename, entry->filename);
+	memcpy (cached->entryData, entry->entryData, DIR_ENTRY_DATA_SIZE);
+	cached->dataStart = entry->dataStart;
+	cached->dataEnd = entry->dataEnd;
+
+	link = &dircache->hashTable[cached->hash & (DIRCACHE_HASH_SIZE - 1)];
+	cached->hashNext = *link;
+	*link = cached;
+	_FAT_dircache_makeNewest (dircache, cached);
+}
+
+void _FAT_dircache_update (DIRCACHE* dircache, const DIR_ENTRY_POSITION* position, const uint8_t* entryData) {
+	int i;
+
+	for (i = 0; i < DIRCACHE_ENTRIES; i++) {
+		DIRCACHE_ENTRY* cached = &dircache->entries[i];
+		if (cached->dirCluster != CLUSTER_ERROR &&
+			cached->dataEnd.cluster == position->cluster && cached->dataEnd.sector == position->sector &&
+			cached->dataEnd.offset == position->offset)
+		{
+			memcpy (cached->entryData, entryData, DIR_ENTRY_DATA_SIZE);
+		}
+	}
+}
+
+void _FAT_dircache_invalidate (DIRCACHE* dircache) {
+	int i;
+
+	for (i = 0; i < DIRCACHE_ENTRIES; i++) {
+		dircache->entries[i].dirCluster = CLUSTER_ERROR;
+		dircache->entries[i].hashNext = NULL;
+	}
+	memset (dircache->hashTable, 0, sizeof(dircache->hashTable));
+}
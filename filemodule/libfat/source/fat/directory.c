@@ -40,6 +40,7 @@
 #include "file_allocation_table.h"
 #include "bit_ops.h"
 #include "filetime.h"
+#include "dircache.h"
 
 // Directory entry codes
 #define DIR_ENTRY_LAST 0x00
@@ -587,8 +588,17 @@ bool _FAT_directory_entryFromPath (PARTITION* partition, DIR_ENTRY* entry, const
 			return false;
 		}
 
-		// Look for the directory within the path
-		foundFile = _FAT_directory_getFirstEntry (partition, entry, dirCluster);
+		// Names looked up before don't need the directory read again,
+		// unless a file was found where the path needs a directory
+		if (partition->dirCache && _FAT_dircache_find (partition->dirCache, dirCluster, pathPosition, dirnameLength, entry)
+			&& ((entry->entryData[DIR_ENTRY_attributes] & ATTRIB_DIR) || (nextPathPosition == NULL)))
+		{
+			foundFile = true;
+			found = true;
+		} else {
+			// Look for the directory within the path
+			foundFile = _FAT_directory_getFirstEntry (partition, entry, dirCluster);
+		}
 
 		while (foundFile && !found && !notFound) {			// It hasn't already found the file
 			// Check if the filename matches
@@ -611,6 +621,8 @@ bool _FAT_directory_entryFromPath (PARTITION* partition, DIR_ENTRY* entry, const
 
 			if (!found) {
 				foundFile = _FAT_directory_getNextEntry (partition, entry);
+			} else if (partition->dirCache) {
+				_FAT_dircache_add (partition->dirCache, dirCluster, pathPosition, dirnameLength, entry);
 			}
 		}
 
@@ -658,6 +670,10 @@ bool _FAT_directory_removeEntry (PARTITION* partition, DIR_ENTRY* entry) {
 	bool finished;
 	uint8_t entryData[DIR_ENTRY_DATA_SIZE];
 
+	if (partition->dirCache) {
+		_FAT_dircache_invalidate (partition->dirCache);
+	}
+
 	// Create an empty directory entry to overwrite the old ones with
 	for ( entryStillValid = true, finished = false;
 		entryStillValid && !finished;
@@ -908,6 +924,10 @@ bool _FAT_directory_addEntry (PARTITION* partition, DIR_ENTRY* entry, uint32_t d
 	int aliasLen;
 	int lfnLen;
 
+	if (partition->dirCache) {
+		_FAT_dircache_invalidate (partition->dirCache);
+	}
+
 	// Make sure the filename is not 0 length
 	if (strnlen (entry->filename, MAX_FILENAME_LENGTH) < 1) {
 		return false;
@@ -43,6 +43,7 @@
 #include "filetime.h"
 #include "lock.h"
 #include "mem_allocate.h"
+#include "dircache.h"
 
 int _FAT_open_r (struct _reent *r, void *fileStruct, const char *path, int flags, int mode) {
 	PARTITION* partition = NULL;
@@ -232,6 +233,12 @@ int _FAT_open_r (struct _reent *r, void *fileStruct, const char *path, int flags
 
 	file->inUse = true;
 
+	// The extent map is built when it's first needed
+	file->extents = NULL;
+	file->extentCount = 0;
+	file->extentsBuilt = false;
+	file->reserved = false;
+
 	// Insert this file into the double-linked list of open files
 	partition->openFileCount += 1;
 	if (partition->firstOpenFile) {
@@ -288,6 +295,9 @@ int _FAT_syncToDisc (FILE_STRUCT* file) {
 		_FAT_cache_writePartialSector (file->partition->cache, dirEntryData,
 			_FAT_fat_clusterToSector(file->partition, file->dirEntryEnd.cluster) + file->dirEntryEnd.sector,
 			file->dirEntryEnd.offset * DIR_ENTRY_DATA_SIZE, DIR_ENTRY_DATA_SIZE);
+		if (file->partition->dirCache) {
+			_FAT_dircache_update (file->partition->dirCache, &file->dirEntryEnd, dirEntryData);
+		}
 
 		// Flush any sectors in the disc cache
 		if (!_FAT_cache_flush(file->partition->cache)) {
@@ -301,6 +311,26 @@ int _FAT_syncToDisc (FILE_STRUCT* file) {
 }
 
 
+/*
+Gives back the clusters _FAT_reserve_r linked past the end of the file,
+keeping the first one so the file still has a start.
+Does no locking of its own -- lock the partition before calling.
+*/
+static void _FAT_file_trimReserved (FILE_STRUCT* file) {
+	PARTITION* partition = file->partition;
+	unsigned int chainLength = 1;
+
+	file->reserved = false;
+	if (file->startCluster == CLUSTER_FREE) {
+		return;
+	}
+
+	if (file->filesize > 0) {
+		chainLength = ((file->filesize - 1) >> partition->bytesPerClusterLog) + 1;
+	}
+	_FAT_fat_trimChain (partition, file->startCluster, chainLength);
+}
+
 int _FAT_close_r (struct _reent *r, int fd) {
 	FILE_STRUCT* file = (FILE_STRUCT*)  fd;
 	int ret = 0;
@@ -312,6 +342,16 @@ int _FAT_close_r (struct _reent *r, int fd) {
 
 	_FAT_lock(&file->partition->lock);
 
+	if (file->reserved) {
+		_FAT_file_trimReserved (file);
+		if (file->filesize == 0) {
+			// Nothing was written, so the file doesn't keep a cluster either
+			_FAT_fat_clearLinks (file->partition, file->startCluster);
+			file->startCluster = CLUSTER_FREE;
+		}
+		file->modified = true;
+	}
+
 	if (file->write) {
 		ret = _FAT_syncToDisc (file);
 		if (ret != 0) {
@@ -322,6 +362,12 @@ int _FAT_close_r (struct _reent *r, int fd) {
 
 	file->inUse = false;
 
+	if (file->extents) {
+		_FAT_mem_free (file->extents);
+		file->extents = NULL;
+	}
+	file->extentsBuilt = false;
+
 	// Remove this file from the double-linked list of open files
 	file->partition->openFileCount -= 1;
 	if (file->nextOpenFile) {
@@ -338,6 +384,90 @@ int _FAT_close_r (struct _reent *r, int fd) {
 	return ret;
 }
 
+/*
+Builds the extent map of a file that isn't open for writing, so seeks and
+reads can find clusters without following the FAT chain. Leaves extents
+NULL if the file is too fragmented, the chain is broken or there is no
+memory; callers then walk the chain as before.
+Does no locking of its own -- lock the partition before calling.
+*/
+static void _FAT_file_buildExtents (FILE_STRUCT* file) {
+	PARTITION* partition = file->partition;
+	FILE_EXTENT* extents;
+	uint32_t count = 0;
+	uint32_t index = 0;
+	uint32_t cluster = file->startCluster;
+
+	file->extentsBuilt = true;
+	if (file->write || !_FAT_fat_isValidCluster(partition, cluster)) {
+		return;
+	}
+
+	extents = (FILE_EXTENT*) _FAT_mem_allocate (FILE_MAX_EXTENTS * sizeof(FILE_EXTENT));
+	if (!extents) {
+		return;
+	}
+
+	// A chain can't be longer than the partition, stop there if it loops
+	while (_FAT_fat_isValidCluster(partition, cluster) && index <= partition->fat.lastCluster) {
+		if ((count > 0) && (cluster == extents[count-1].cluster + extents[count-1].length)) {
+			extents[count-1].length++;
+		} else if (count < FILE_MAX_EXTENTS) {
+			extents[count].fileCluster = index;
+			extents[count].cluster = cluster;
+			extents[count].length = 1;
+			count++;
+		} else {
+			break;
+		}
+		index++;
+		cluster = _FAT_fat_nextCluster (partition, cluster);
+	}
+
+	if (cluster != CLUSTER_EOF) {
+		_FAT_mem_free (extents);
+		return;
+	}
+
+	// Keep only as much as is used
+	file->extents = (FILE_EXTENT*) _FAT_mem_allocate (count * sizeof(FILE_EXTENT));
+	if (file->extents) {
+		memcpy (file->extents, extents, count * sizeof(FILE_EXTENT));
+		_FAT_mem_free (extents);
+	} else {
+		file->extents = extents;
+	}
+	file->extentCount = count;
+}
+
+/*
+Looks up the cluster at index (counted from the start of the file) in the
+extent map. Returns false if the file has fewer clusters. run is set to the
+number of contiguous clusters starting there.
+*/
+static bool _FAT_file_extentCluster (FILE_STRUCT* file, uint32_t index, uint32_t* cluster, uint32_t* run) {
+	uint32_t low = 0;
+	uint32_t high = file->extentCount;
+	FILE_EXTENT* extent;
+
+	while (high - low > 1) {
+		uint32_t mid = (low + high) / 2;
+		if (file->extents[mid].fileCluster <= index) {
+			low = mid;
+		} else {
+			high = mid;
+		}
+	}
+
+	extent = &file->extents[low];
+	if (index - extent->fileCluster >= extent->length) {
+		return false;
+	}
+	*cluster = extent->cluster + (index - extent->fileCluster);
+	*run = extent->length - (index - extent->fileCluster);
+	return true;
+}
+
 ssize_t _FAT_read_r (struct _reent *r, int fd, char *ptr, size_t len) {
 	FILE_STRUCT* file = (FILE_STRUCT*)  fd;
 	PARTITION* partition;
@@ -436,21 +566,47 @@ ssize_t _FAT_read_r (struct _reent *r, int fd, char *ptr, size_t len) {
 		}
 	}
 
+	if (!file->extentsBuilt && (remain > partition->bytesPerClusterMask)) {
+		_FAT_file_buildExtents (file);
+	}
+
 	// Read in whole clusters, contiguous blocks at a time
 	while ((remain > partition->bytesPerClusterMask) && flagNoError) {
 		uint32_t chunkEnd;
 		uint32_t nextChunkStart = position.cluster;
 		size_t chunkSize = 0;
+		uint32_t index = (file->currentPosition + (len - remain)) >> partition->bytesPerClusterLog;
+		uint32_t run;
 
-		do {
-			chunkEnd = nextChunkStart;
-			nextChunkStart = _FAT_fat_nextCluster (partition, chunkEnd);
-			chunkSize += partition->bytesPerClusterMask+1;
-		} while ((nextChunkStart == chunkEnd + 1) &&
+		if (file->extents && _FAT_file_extentCluster (file, index, &chunkEnd, &run) && (chunkEnd == position.cluster)) {
+			// The extent says how far the chunk goes, no need to look at the FAT
+			if (run > (remain >> partition->bytesPerClusterLog)) {
+				run = remain >> partition->bytesPerClusterLog;
+			}
+#ifdef LIMIT_SECTORS
+			if (run > (LIMIT_SECTORS >> (partition->bytesPerClusterLog - partition->bytesPerSectorLog))) {
+				run = LIMIT_SECTORS >> (partition->bytesPerClusterLog - partition->bytesPerSectorLog);
+			}
+			if (run == 0) {
+				run = 1;
+			}
+#endif
+			chunkEnd = position.cluster + run - 1;
+			chunkSize = run << partition->bytesPerClusterLog;
+			if (!_FAT_file_extentCluster (file, index + run, &nextChunkStart, &run)) {
+				nextChunkStart = CLUSTER_EOF;
+			}
+		} else {
+			do {
+				chunkEnd = nextChunkStart;
+				nextChunkStart = _FAT_fat_nextCluster (partition, chunkEnd);
+				chunkSize += partition->bytesPerClusterMask+1;
+			} while ((nextChunkStart == chunkEnd + 1) &&
 #ifdef LIMIT_SECTORS
-		 	(chunkSize + partition->bytesPerClusterMask < LIMIT_SECTORS << partition->bytesPerSectorLog) &&
+			 	(chunkSize + partition->bytesPerClusterMask < LIMIT_SECTORS << partition->bytesPerSectorLog) &&
 #endif
-			(chunkSize + partition->bytesPerClusterMask < remain));
+				(chunkSize + partition->bytesPerClusterMask < remain));
+		}
 
 		if (!_FAT_cache_readSectors (cache, _FAT_fat_clusterToSector (partition, position.cluster),
 				chunkSize >> partition->bytesPerSectorLog, ptr))
@@ -560,6 +716,11 @@ static bool _FAT_file_extend_r (struct _reent *r, FILE_STRUCT* file) {
 	uint32_t tempNextCluster;
 	unsigned int sector;
 
+	// The zeroes go after the last cluster, so a reservation can't be left past it
+	if (file->reserved) {
+		_FAT_file_trimReserved (file);
+	}
+
 	position.byte = file->filesize & partition->bytesPerSectorMask;
 
 	position.sector = (file->filesize & partition->bytesPerClusterMask) >> partition->bytesPerSectorLog;
@@ -918,7 +1079,21 @@ off_t _FAT_seek_r (struct _reent *r, int fd, off_t pos, int dir) {
 		// how many clusters from start of file
 		clusCount = position >> partition->bytesPerClusterLog;
 		cluster = file->startCluster;
-		if (position >= file->currentPosition) {
+		if (!file->extentsBuilt) {
+			_FAT_file_buildExtents (file);
+		}
+		if (file->extents) {
+			// Look the cluster up in the extent map
+			FILE_EXTENT* last = &file->extents[file->extentCount - 1];
+			uint32_t run;
+			if (_FAT_file_extentCluster (file, clusCount, &cluster, &run)) {
+				clusCount = 0;
+			} else {
+				// Past the end, leave it where walking the chain would have
+				clusCount -= last->fileCluster + last->length - 1;
+				cluster = last->cluster + last->length - 1;
+			}
+		} else if (position >= file->currentPosition) {
 			// start from current cluster
 			int currentCount = file->currentPosition >> partition->bytesPerClusterLog;
 			if (file->rwPosition.sector == partition->sectorsPerCluster) {
@@ -932,11 +1107,13 @@ off_t _FAT_seek_r (struct _reent *r, int fd, off_t pos, int dir) {
 		file->rwPosition.sector = (position & partition->bytesPerClusterMask) >> partition->bytesPerSectorLog;
 		file->rwPosition.byte = position & partition->bytesPerSectorMask;
 
-		nextCluster = _FAT_fat_nextCluster (partition, cluster);
-		while ((clusCount > 0) && (nextCluster != CLUSTER_FREE) && (nextCluster != CLUSTER_EOF)) {
-			clusCount--;
-			cluster = nextCluster;
+		if (!file->extents) {
 			nextCluster = _FAT_fat_nextCluster (partition, cluster);
+			while ((clusCount > 0) && (nextCluster != CLUSTER_FREE) && (nextCluster != CLUSTER_EOF)) {
+				clusCount--;
+				cluster = nextCluster;
+				nextCluster = _FAT_fat_nextCluster (partition, cluster);
+			}
 		}
 
 		// Check if ran out of clusters and it needs to allocate a new one
@@ -1132,3 +1309,73 @@ int _FAT_fsync_r (struct _reent *r, int fd) {
 
 	return ret;
 }
+
+int _FAT_reserve_r (struct _reent *r, int fd, uint32_t len) {
+	FILE_STRUCT* file = (FILE_STRUCT*)  fd;
+	PARTITION* partition;
+	uint32_t cluster, nextCluster;
+	unsigned int chainLength, clusters;
+	int ret = 0;
+
+	if (!file || !file->inUse) {
+		r->_errno = EBADF;
+		return -1;
+	}
+
+	if (!file->write) {
+		r->_errno = EINVAL;
+		return -1;
+	}
+
+	if (len == 0) {
+		return 0;
+	}
+
+	partition = file->partition;
+	_FAT_lock(&partition->lock);
+
+	// Get a new cluster for the start of the file if required
+	if (file->startCluster == CLUSTER_FREE) {
+		cluster = _FAT_fat_linkFreeCluster (partition, CLUSTER_FREE);
+		if (!_FAT_fat_isValidCluster(partition, cluster)) {
+			_FAT_unlock(&partition->lock);
+			r->_errno = ENOSPC;
+			return -1;
+		}
+		file->startCluster = cluster;
+
+		file->appendPosition.cluster = file->startCluster;
+		file->appendPosition.sector = 0;
+		file->appendPosition.byte = 0;
+
+		file->rwPosition.cluster = file->startCluster;
+		file->rwPosition.sector =  0;
+		file->rwPosition.byte = 0;
+	}
+
+	// Find the end of the chain the file already has
+	cluster = file->startCluster;
+	chainLength = 1;
+	nextCluster = _FAT_fat_nextCluster (partition, cluster);
+	while (_FAT_fat_isValidCluster(partition, nextCluster)) {
+		cluster = nextCluster;
+		chainLength++;
+		nextCluster = _FAT_fat_nextCluster (partition, cluster);
+	}
+
+	// Link on the rest, only the FAT is written
+	clusters = ((len - 1) >> partition->bytesPerClusterLog) + 1;
+	file->reserved = true;
+	for (; chainLength < clusters; chainLength++) {
+		cluster = _FAT_fat_linkFreeCluster (partition, cluster);
+		if (!_FAT_fat_isValidCluster(partition, cluster)) {
+			// What was linked is still trimmed on close
+			r->_errno = ENOSPC;
+			ret = -1;
+			break;
+		}
+	}
+
+	_FAT_unlock(&partition->lock);
+	return ret;
+}
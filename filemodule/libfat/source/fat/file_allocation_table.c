@@ -31,6 +31,7 @@
 #include "file_allocation_table.h"
 #include "partition.h"
 #include "mem_allocate.h"
+#include "bit_ops.h"
 #include <string.h>
 
 /*
@@ -198,6 +199,42 @@ static bool _FAT_fat_writeFatEntry (PARTITION* partition, uint32_t cluster, uint
 	return true;
 }
 
+/*
+Finds a free cluster at or after firstFree, wrapping around to the start
+of the FAT. Only looks through groups the free map says have free clusters.
+Returns CLUSTER_ERROR if there are none.
+*/
+static uint32_t _FAT_fat_findFreeCluster (PARTITION* partition, uint32_t firstFree) {
+	uint32_t lastCluster = partition->fat.lastCluster;
+	uint32_t shift = partition->fat.freeMapShift;
+	uint32_t groups = partition->fat.freeMapGroups;
+	uint32_t group = firstFree >> shift;
+	uint32_t i;
+
+	// One extra group to get back to the part of the first one before firstFree
+	for (i = 0; i <= groups; i++, group = (group + 1 < groups) ? group + 1 : 0) {
+		uint32_t cluster = (i == 0) ? firstFree : group << shift;
+		uint32_t end = ((group + 1) << shift) - 1;
+
+		if (partition->fat.freeMap[group] == 0) {
+			continue;
+		}
+		if (cluster < CLUSTER_FIRST) {
+			cluster = CLUSTER_FIRST;
+		}
+		if (end > lastCluster) {
+			end = lastCluster;
+		}
+		for (; cluster <= end; cluster++) {
+			if (_FAT_fat_nextCluster(partition, cluster) == CLUSTER_FREE) {
+				return cluster;
+			}
+		}
+	}
+
+	return CLUSTER_ERROR;
+}
+
 /*-----------------------------------------------------------------
 gets the first available free cluster, sets it
 to end of file, links the input cluster to it then returns the
@@ -225,23 +262,35 @@ uint32_t _FAT_fat_linkFreeCluster(PARTITION* partition, uint32_t cluster) {
 	// Get a free cluster
 	firstFree = partition->fat.firstFree;
 	// Start at first valid cluster
-	if (firstFree < CLUSTER_FIRST) {
+	if (firstFree < CLUSTER_FIRST || firstFree > lastCluster) {
 		firstFree = CLUSTER_FIRST;
 	}
 
-	// Search until a free cluster is found
-	while (_FAT_fat_nextCluster(partition, firstFree) != CLUSTER_FREE) {
-		firstFree++;
-		if (firstFree > lastCluster) {
-			if (loopedAroundFAT) {
-				// If couldn't get a free cluster then return an error
-				partition->fat.firstFree = firstFree;
-				return CLUSTER_ERROR;
-			} else {
-				// Try looping back to the beginning of the FAT
-				// This was suggested by loopy
-				firstFree = CLUSTER_FIRST;
-				loopedAroundFAT = true;
+	if (!partition->fat.freeMapTried) {
+		_FAT_fat_buildFreeMap (partition);
+	}
+
+	if (partition->fat.freeMap) {
+		// Skip over the parts of the FAT with nothing free
+		firstFree = _FAT_fat_findFreeCluster (partition, firstFree);
+		if (firstFree == CLUSTER_ERROR) {
+			return CLUSTER_ERROR;
+		}
+	} else {
+		// Search until a free cluster is found
+		while (_FAT_fat_nextCluster(partition, firstFree) != CLUSTER_FREE) {
+			firstFree++;
+			if (firstFree > lastCluster) {
+				if (loopedAroundFAT) {
+					// If couldn't get a free cluster then return an error
+					partition->fat.firstFree = firstFree;
+					return CLUSTER_ERROR;
+				} else {
+					// Try looping back to the beginning of the FAT
+					// This was suggested by loopy
+					firstFree = CLUSTER_FIRST;
+					loopedAroundFAT = true;
+				}
 			}
 		}
 	}
@@ -249,6 +298,8 @@ uint32_t _FAT_fat_linkFreeCluster(PARTITION* partition, uint32_t cluster) {
 	if(partition->fat.numberFreeCluster)
 		partition->fat.numberFreeCluster--;
 	partition->fat.numberLastAllocCluster = firstFree;
+	if (partition->fat.freeMap && partition->fat.freeMap[firstFree >> partition->fat.freeMapShift])
+		partition->fat.freeMap[firstFree >> partition->fat.freeMapShift]--;
 
 	if ((cluster >= CLUSTER_FIRST) && (cluster <= lastCluster))
 	{
@@ -321,6 +372,8 @@ bool _FAT_fat_clearLinks (PARTITION* partition, uint32_t cluster) {
 
 		if(partition->fat.numberFreeCluster < (partition->numberOfSectors/partition->sectorsPerCluster))
 			partition->fat.numberFreeCluster++;
+		if (partition->fat.freeMap)
+			partition->fat.freeMap[cluster >> partition->fat.freeMapShift]++;
 		// Move onto next cluster
 		cluster = nextCluster;
 	}
@@ -384,6 +437,11 @@ unsigned int _FAT_fat_freeClusterCount (PARTITION* partition) {
 	unsigned int count = 0;
 	uint32_t curCluster;
 
+	// Counted when the map was built and kept up to date since
+	if (partition->fat.freeMap || (!partition->fat.freeMapTried && _FAT_fat_buildFreeMap (partition))) {
+		return partition->fat.numberFreeCluster;
+	}
+
 	for (curCluster = CLUSTER_FIRST; curCluster <= partition->fat.lastCluster; curCluster++) {
 		if (_FAT_fat_nextCluster(partition, curCluster) == CLUSTER_FREE) {
 			count++;
@@ -393,3 +451,103 @@ unsigned int _FAT_fat_freeClusterCount (PARTITION* partition) {
 	return count;
 }
 
+#define FREE_MAP_MAX_GROUPS 4096
+#define FREE_MAP_READ_SECTORS 16
+
+/*-----------------------------------------------------------------
+_FAT_fat_buildFreeMap
+Count the free clusters in each group of the FAT, reading it straight
+from the disc a few sectors at a time rather than through the cache.
+Sets numberFreeCluster to the total. Returns false if there wasn't
+memory for the map or the FAT couldn't be read.
+-----------------------------------------------------------------*/
+bool _FAT_fat_buildFreeMap (PARTITION* partition) {
+	uint32_t lastCluster = partition->fat.lastCluster;
+	uint32_t shift = 7;
+	uint32_t groups;
+	uint32_t count = 0;
+	uint32_t cluster;
+	uint16_t* freeMap;
+
+	_FAT_fat_freeFreeMap (partition);
+	partition->fat.freeMapTried = true;
+
+	// Groups big enough to keep the map small, small enough to count in 16 bits
+	while (((lastCluster >> shift) + 1 > FREE_MAP_MAX_GROUPS) && (shift < 15)) {
+		shift++;
+	}
+	groups = (lastCluster >> shift) + 1;
+
+	freeMap = (uint16_t*) _FAT_mem_allocate (groups * sizeof(uint16_t));
+	if (freeMap == NULL) {
+		return false;
+	}
+	memset (freeMap, 0, groups * sizeof(uint16_t));
+
+	if (partition->filesysType == FS_FAT12) {
+		// Small enough to go through the cache
+		for (cluster = CLUSTER_FIRST; cluster <= lastCluster; cluster++) {
+			if (_FAT_fat_nextCluster(partition, cluster) == CLUSTER_FREE) {
+				freeMap[cluster >> shift]++;
+				count++;
+			}
+		}
+	} else {
+		uint32_t entryLog = (partition->filesysType == FS_FAT32) ? 2 : 1;
+		uint32_t entriesPerSector = (partition->bytesPerSectorMask + 1) >> entryLog;
+		uint32_t sector;
+		uint8_t* buffer = (uint8_t*) _FAT_mem_align (FREE_MAP_READ_SECTORS << partition->bytesPerSectorLog);
+
+		// The disc has to be up to date with the FAT in the cache
+		if (buffer == NULL || !_FAT_cache_flush (partition->cache)) {
+			if (buffer)
+				_FAT_mem_free (buffer);
+			_FAT_mem_free (freeMap);
+			return false;
+		}
+
+		cluster = 0;
+		for (sector = 0; (sector < partition->fat.sectorsPerFat) && (cluster <= lastCluster); sector += FREE_MAP_READ_SECTORS) {
+			uint32_t numSectors = partition->fat.sectorsPerFat - sector;
+			uint32_t entries, i;
+			if (numSectors > FREE_MAP_READ_SECTORS) {
+				numSectors = FREE_MAP_READ_SECTORS;
+			}
+			if (!_FAT_disc_readSectors (partition->disc, partition->fat.fatStart + sector, numSectors, buffer)) {
+				_FAT_mem_free (buffer);
+				_FAT_mem_free (freeMap);
+				return false;
+			}
+
+			entries = numSectors * entriesPerSector;
+			for (i = 0; (i < entries) && (cluster <= lastCluster); i++, cluster++) {
+				uint32_t value = (entryLog == 2) ? (u8array_to_u32(buffer, i << 2) & 0x0FFFFFFF) : u8array_to_u16(buffer, i << 1);
+				if ((cluster >= CLUSTER_FIRST) && (value == CLUSTER_FREE)) {
+					freeMap[cluster >> shift]++;
+					count++;
+				}
+			}
+		}
+
+		_FAT_mem_free (buffer);
+	}
+
+	partition->fat.freeMap = freeMap;
+	partition->fat.freeMapShift = shift;
+	partition->fat.freeMapGroups = groups;
+	partition->fat.numberFreeCluster = count;
+
+	return true;
+}
+
+/*-----------------------------------------------------------------
+_FAT_fat_freeFreeMap
+Drop the free map, it will be built again when next needed
+-----------------------------------------------------------------*/
+void _FAT_fat_freeFreeMap (PARTITION* partition) {
+	if (partition->fat.freeMap) {
+		_FAT_mem_free (partition->fat.freeMap);
+	}
+	partition->fat.freeMap = NULL;
+	partition->fat.freeMapTried = false;
+}
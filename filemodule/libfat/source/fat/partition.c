@@ -33,6 +33,7 @@
 #include "directory.h"
 #include "mem_allocate.h"
 #include "fatfile.h"
+#include "dircache.h"
 
 #include <string.h>
 #include <ctype.h>
@@ -353,6 +354,8 @@ PARTITION* _FAT_partition_constructor_buf (const DISC_INTERFACE* disc, uint32_t
 	partition->fat.firstFree = CLUSTER_FIRST;
 	partition->fat.numberFreeCluster = 0;
 	partition->fat.numberLastAllocCluster = 0;
+	partition->fat.freeMap = NULL;
+	partition->fat.freeMapTried = false;
 
 	if (clusterCount < CLUSTERS_PER_FAT12) {
 		partition->filesysType = FS_FAT12;	// FAT12 volume
@@ -387,6 +390,8 @@ PARTITION* _FAT_partition_constructor_buf (const DISC_INTERFACE* disc, uint32_t
 	partition->openFileCount = 0;
 	partition->firstOpenFile = NULL;
 
+	partition->dirCache = _FAT_dircache_constructor();
+
 	_FAT_partition_readFSinfo(partition);
 
 	return partition;
@@ -421,6 +426,12 @@ void _FAT_partition_destructor (PARTITION* partition) {
 	// Free memory used by the cache, writing it to disc at the same time
 	_FAT_cache_destructor (partition->cache);
 
+	_FAT_fat_freeFreeMap (partition);
+
+	if (partition->dirCache) {
+		_FAT_dircache_destructor (partition->dirCache);
+	}
+
 	// Unlock the partition and destroy the lock
 	_FAT_unlock(&partition->lock);
 	_FAT_lock_deinit(&partition->lock);
@@ -457,7 +468,9 @@ void _FAT_partition_createFSinfo(PARTITION * partition)
 		sectorBuffer[FSIB_SIG2+i] = FS_INFO_SIG2[i];
 	}
 
-	partition->fat.numberFreeCluster = _FAT_fat_freeClusterCount(partition);
+	// Recount from the FAT, not what the map or the old fs info says
+	if (!_FAT_fat_buildFreeMap(partition))
+		partition->fat.numberFreeCluster = _FAT_fat_freeClusterCount(partition);
 	u32_to_u8array(sectorBuffer, FSIB_numberOfFreeCluster, partition->fat.numberFreeCluster);
 	u32_to_u8array(sectorBuffer, FSIB_numberLastAllocCluster, partition->fat.numberLastAllocCluster);
 
@@ -485,13 +498,17 @@ void _FAT_partition_readFSinfo(PARTITION * partition)
 
 	if(memcmp(sectorBuffer+FSIB_SIG1, FS_INFO_SIG1, 4) != 0 ||
 		memcmp(sectorBuffer+FSIB_SIG2, FS_INFO_SIG2, 4) != 0 ||
-		u8array_to_u32(sectorBuffer, FSIB_numberOfFreeCluster) == 0)
+		u8array_to_u32(sectorBuffer, FSIB_numberOfFreeCluster) == 0 ||
+		u8array_to_u32(sectorBuffer, FSIB_numberOfFreeCluster) > partition->fat.lastCluster - CLUSTER_FIRST + 1)
 	{
 		//sector does not yet exist, create one!
 		_FAT_partition_createFSinfo(partition);
 	} else {
 		partition->fat.numberFreeCluster = u8array_to_u32(sectorBuffer, FSIB_numberOfFreeCluster);
 		partition->fat.numberLastAllocCluster = u8array_to_u32(sectorBuffer, FSIB_numberLastAllocCluster);
+		// Carry on allocating from where the last writer left off
+		if (_FAT_fat_isValidCluster(partition, partition->fat.numberLastAllocCluster + 1))
+			partition->fat.firstFree = partition->fat.numberLastAllocCluster + 1;
 	}
 	_FAT_mem_free(sectorBuffer);
 }
@@ -9,6 +9,7 @@
 
 #include "fatdir.h"
 #include "fatfile.h"
+#include "dircache.h"
 
 /* Variables */
 static struct _reent fReent;
@@ -207,6 +208,21 @@ s32 FAT_Seek(s32 fd, u32 where, u32 whence)
 	return ret;
 }
 
+s32 FAT_Reserve(s32 fd, u32 length)
+{
+	s32 ret;
+
+	/* Clear error code */
+	fReent._errno = 0;
+
+	/* Link clusters for the rest of the file */
+	ret = _FAT_reserve_r(&fReent, fd, length);
+	if (ret < 0)
+		ret = __FAT_GetError();
+
+	return ret;
+}
+
 s32 FAT_Tell(s32 fd)
 {
 	//return (s32)FAT_Seek(fd, 0, SEEK_CUR);
@@ -404,6 +420,21 @@ s32 FAT_GetVfsStats(const char *path, struct statvfs *stats)
 	return ret;
 }
 
+s32 FAT_GetLookupStats(const char *path, u32 *hits, u32 *misses)
+{
+	PARTITION* partition = _FAT_partition_getPartitionFromPath(path);
+
+	if (partition == NULL)
+		return -1;
+
+	_FAT_lock(&partition->lock);
+	*hits = partition->dirCache ? partition->dirCache->hits : 0;
+	*misses = partition->dirCache ? partition->dirCache->misses : 0;
+	_FAT_unlock(&partition->lock);
+
+	return 0;
+}
+
 s32 FAT_GetFileStats(s32 fd, fstats *stats)
 {
 	FILE_STRUCT *fs = (FILE_STRUCT *)fd;
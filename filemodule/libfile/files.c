@@ -286,6 +286,11 @@ int File_Sync(int fd)
 	return os_seek(fd, 0, SEEK_Sync);
 }
 
+int File_Reserve(int fd, u32 length)
+{
+	return os_seek(fd, (int)length, SEEK_Reserve);
+}
+
 int File_Log(const void* buffer, int length)
 {
 	if (file_fd >= 0 && length>0)
@@ -311,6 +316,21 @@ int File_GetFreeSpace(int fs, u64 *free_bytes)
 	return ret;
 }
 
+int File_GetLookupStats(int fs, LookupStats* stats)
+{
+	int ret;
+	if (file_fd<0)
+		return -1;
+
+	ioctlbuffer[0] = fs;
+	os_sync_after_write(ioctlbuffer, 4);
+	ret = os_ioctl(file_fd, IOCTL_GetLookupStats, ioctlbuffer, 4, ioctlbuffer+8, sizeof(LookupStats));
+	os_sync_before_read(ioctlbuffer+8, sizeof(LookupStats));
+	memcpy(stats, ioctlbuffer+8, sizeof(LookupStats));
+
+	return ret;
+}
+
 int File_CheckPhysical(int fs)
 {
 	ioctlbuffer[0] = fs;
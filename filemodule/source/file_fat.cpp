@@ -6,6 +6,12 @@ namespace ProxiIOS { namespace Filesystem {
 
 static const char __fatName[] = "fat";
 
+// Cache pages of 8 sectors. Lookups no longer scan the pages, so USB drives,
+// which are slower to seek and usually hold bigger FATs, get more of them.
+#define FAT_CACHE_PAGES 5
+#define FAT_CACHE_PAGES_USB 12
+#define FAT_CACHE_SECTORS 8
+
 static u64 HexToInt(const char* hex, int length)
 {
 	u64 ret = 0;
@@ -28,6 +34,9 @@ static inline FILE_STRUCT* GenerateReadonlyFile(FatHandler* fs, u32 cluster) {
 	ffile->append = false;
 	ffile->inUse = true;
 	ffile->modified = false;
+	ffile->extents = NULL;
+	ffile->extentCount = 0;
+	ffile->extentsBuilt = false;
 
 	return ffile;
 }
@@ -51,7 +60,8 @@ int FatHandler::Mount(const void* options, int length)
 	} else
 		strcpy(Name, __fatName);
 
-	if (fatMount(Name, Module->Disk[phys], 0, 5, 8) < 0)
+	int pages = (Module->Disk[phys]->features & FEATURE_WII_USB) ? FAT_CACHE_PAGES_USB : FAT_CACHE_PAGES;
+	if (fatMount(Name, Module->Disk[phys], 0, pages, FAT_CACHE_SECTORS) < 0)
 		return Errors::DiskNotMounted;
 
 	strcpy(MountPoint, "/mnt/");
@@ -129,6 +139,12 @@ int FatHandler::Sync(FileInfo* file)
 	return FAT_Flush(((FatFileInfo*)file)->File);
 }
 
+int FatHandler::Reserve(FileInfo* file, u32 length)
+{
+	IdleCount = 0;
+	return FAT_Reserve(((FatFileInfo*)file)->File, length);
+}
+
 int FatHandler::Close(FileInfo* file)
 {
 	int ret = FAT_Close(((FatFileInfo*)file)->File);
@@ -235,4 +251,9 @@ int FatHandler::GetFreeSpace(u64 *free_bytes)
 	return ret;
 }
 
+int FatHandler::GetLookupStats(LookupStats* stats)
+{
+	return FAT_GetLookupStats(Name, &stats->Hits, &stats->Misses);
+}
+
 } }
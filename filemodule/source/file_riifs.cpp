@@ -118,6 +118,9 @@ namespace ProxiIOS { namespace Filesystem {
 		}
 
 		ServerVersion = ReceiveCommand(RII_HANDSHAKE);
+		// older servers refuse versions they don't know, ask again as 1.03
+		if (ServerVersion < 0 && SendCommand(RII_HANDSHAKE, (const u8*)RII_VERSION_LEGACY, strlen(RII_VERSION_LEGACY)))
+			ServerVersion = ReceiveCommand(RII_HANDSHAKE);
 		if (ServerVersion < RII_VERSION_RET) {
 			Unmount();
 			return Errors::DiskNotMounted;
@@ -198,12 +201,28 @@ namespace ProxiIOS { namespace Filesystem {
 
 	int RiiHandler::ReceiveCommand(int type, void* data, int size)
 	{
-		bool fail = false;
 		STACK_ALIGN(u32, message, 2, 32);
-		STACK_ALIGN(int, ret, 1, 32);
 		message[0] = RII_RECEIVE;
 		message[1] = type;
-		fail |= net_send(Socket, message, 0x08, 0) != 8;
+		if (net_send(Socket, message, 0x08, 0) != 8) {
+			IdleCount = 0;
+			return -1;
+		}
+
+		return ReceiveReply(data, size);
+	}
+
+	int RiiHandler::ReceiveReply(void* data, int size)
+	{
+		bool fail = false;
+		STACK_ALIGN(int, ret, 1, 32);
+
+		// replies to pipelined requests come first
+		while (PendingReplies > 0 && !fail) {
+			fail |= netrecv(Socket, (u8*)ret, 4, 0) != 4;
+			PendingReplies--;
+		}
+
 		*ret = 0;
 		if (!fail && size) {
 			if (data)
@@ -227,12 +246,65 @@ namespace ProxiIOS { namespace Filesystem {
 		return *ret;
 	}
 
+	// a command and all of its options in a single frame, no reply is read
+	bool RiiHandler::SendRequest(int type, const RiiOption* options, int count)
+	{
+		static u8 request[0x200] ATTRIBUTE_ALIGN(32);
+		u32 header[3] = { RII_COMPOUND, (u32)type, (u32)count };
+		int used = sizeof(header);
+		bool fail = false;
+
+		memcpy(request, header, sizeof(header));
+		for (int i = 0; i < count && !fail; i++) {
+			const RiiOption* option = options + i;
+			u32 option_header[2] = { (u32)option->Type, (u32)option->Size };
+			if (used + (int)sizeof(option_header) > (int)sizeof(request)) {
+				fail |= net_send(Socket, request, used, 0) != used;
+				used = 0;
+			}
+			memcpy(request + used, option_header, sizeof(option_header));
+			used += sizeof(option_header);
+			if (option->Size && option->Data) {
+				// big payloads (File_Write data) go out on their own
+				if (used + option->Size > (int)sizeof(request)) {
+					fail |= net_send(Socket, request, used, 0) != used;
+					if (!fail)
+						fail |= net_send(Socket, option->Data, option->Size, 0) != option->Size;
+					used = 0;
+				} else {
+					memcpy(request + used, option->Data, option->Size);
+					used += option->Size;
+				}
+			}
+#ifdef RIIFS_LOCAL_OPTIONS
+			// the server keeps these, so the cache has to as well
+			if (option->Size == 4 && option->Type > 0 && option->Type <= RII_OPTION_RENAME_DESTINATION) {
+				memcpy(&Options[option->Type - 1], option->Data, 4);
+				OptionsInit[option->Type - 1] = 1;
+			}
+#endif
+		}
+		if (!fail && used)
+			fail |= net_send(Socket, request, used, 0) != used;
+
+		IdleCount = 0;
+		return !fail;
+	}
+
+	int RiiHandler::Request(int type, const RiiOption* options, int count, void* data, int size)
+	{
+		if (!SendRequest(type, options, count))
+			return -1;
+		return ReceiveReply(data, size);
+	}
+
 	int RiiHandler::Unmount()
 	{
 		if (Socket >= 0) {
 			ReceiveCommand(RII_GOODBYE);
 			net_close(Socket);
 			IdleCount = -1;
+			PendingReplies = 0;
 			Socket = -1;
 		}
 		Dealloc(LogBuffer);
@@ -244,10 +316,15 @@ namespace ProxiIOS { namespace Filesystem {
 	FileInfo* RiiHandler::Open(const char* path, int mode)
 	{
 		RiiFileInfo* x;
-		SendCommand(RII_OPTION_PATH, path, strlen(path));
-		SendCommand(RII_OPTION_MODE, &mode, 4);
-
-		int ret = ReceiveCommand(RII_FILE_OPEN);
+		int ret;
+		if (Compound()) {
+			RiiOption options[2] = { { RII_OPTION_PATH, path, (int)strlen(path) }, { RII_OPTION_MODE, &mode, 4 } };
+			ret = Request(RII_FILE_OPEN, options, 2);
+		} else {
+			SendCommand(RII_OPTION_PATH, path, strlen(path));
+			SendCommand(RII_OPTION_MODE, &mode, 4);
+			ret = ReceiveCommand(RII_FILE_OPEN);
+		}
 		if (ret < 0)
 			return NULL;
 		x = new RiiFileInfo(this, ret);
@@ -258,6 +335,18 @@ namespace ProxiIOS { namespace Filesystem {
 	{
 		RiiFileInfo* info = (RiiFileInfo*)file;
 
+#ifdef RIIFS_LOCAL_SEEKING
+		// the position rides along with the read, no separate seek
+		if (Compound()) {
+			RiiOption options[3] = { { RII_OPTION_FILE, &info->File, 4 }, { RII_OPTION_LENGTH, &length, 4 }, { RII_OPTION_OFFSET, &info->Position, 8 } };
+			int ret = Request(RII_FILE_READ_AT, options, 3, buffer, length);
+			info->SeekDirty = false;
+			if (ret > 0)
+				info->Position += ret;
+			return ret;
+		}
+#endif
+
 		DIRTY_SEEK(info);
 
 		SendCommand(RII_OPTION_FILE, &info->File, 4);
@@ -274,6 +363,17 @@ namespace ProxiIOS { namespace Filesystem {
 	{
 		RiiFileInfo* info = (RiiFileInfo*)file;
 
+#ifdef RIIFS_LOCAL_SEEKING
+		if (Compound()) {
+			RiiOption options[3] = { { RII_OPTION_FILE, &info->File, 4 }, { RII_OPTION_DATA, buffer, length }, { RII_OPTION_OFFSET, &info->Position, 8 } };
+			int ret = Request(RII_FILE_WRITE_AT, options, 3);
+			info->SeekDirty = false;
+			if (ret > 0)
+				info->Position += ret;
+			return ret;
+		}
+#endif
+
 		DIRTY_SEEK(info);
 
 		SendCommand(RII_OPTION_FILE, &info->File, 4);
@@ -342,14 +442,27 @@ namespace ProxiIOS { namespace Filesystem {
 
 	int RiiHandler::Close(FileInfo* file)
 	{
-		SendCommand(RII_OPTION_FILE, &((RiiFileInfo*)file)->File, 4);
-		int ret = ReceiveCommand(RII_FILE_CLOSE);
+		int ret;
+		if (Compound()) {
+			// nobody checks what close returns, don't wait for it
+			RiiOption option = { RII_OPTION_FILE, &((RiiFileInfo*)file)->File, 4 };
+			ret = SendRequest(RII_FILE_CLOSE, &option, 1) ? 1 : -1;
+			if (ret > 0)
+				PendingReplies++;
+		} else {
+			SendCommand(RII_OPTION_FILE, &((RiiFileInfo*)file)->File, 4);
+			ret = ReceiveCommand(RII_FILE_CLOSE);
+		}
 		delete file;
 		return ret;
 	}
 
 	int RiiHandler::Stat(const char* path, Stats* st)
 	{
+		if (Compound()) {
+			RiiOption option = { RII_OPTION_PATH, path, (int)strlen(path) };
+			return Request(RII_FILE_STAT, &option, 1, st, sizeof(Stats));
+		}
 		SendCommand(RII_OPTION_PATH, path, strlen(path));
 		return ReceiveCommand(RII_FILE_STAT, st, sizeof(Stats));
 	}
@@ -387,7 +500,8 @@ namespace ProxiIOS { namespace Filesystem {
 			return null;
 		RiiFileInfo* dir = new RiiFileInfo(this, file);
 #ifdef RIIFS_LOCAL_DIRNEXT
-		if (dir && ServerVersion >= 0x02) {
+		// older servers report the same version but never answer NEXTDIR_CACHE
+		if (dir && Compound()) {
 			dir->DirCache = Memalign(32, RIIFS_LOCAL_DIRNEXT_SIZE);
 			if (dir->DirCache)
 				memset(dir->DirCache, 0, RIIFS_LOCAL_DIRNEXT_SIZE);
@@ -402,8 +516,8 @@ namespace ProxiIOS { namespace Filesystem {
 		if (dir->DirCache) {
 			int* entries = (int*)dir->DirCache;
 			if (!entries[0] || dir->Position >= (u32)entries[0]) {
-				SendCommand(RII_OPTION_FILE, &dir->File, 4);
-				int ret = ReceiveCommand(RII_FILE_NEXTDIR_CACHE, dir->DirCache, RIIFS_LOCAL_DIRNEXT_SIZE);
+				RiiOption option = { RII_OPTION_FILE, &dir->File, 4 };
+				int ret = Request(RII_FILE_NEXTDIR_CACHE, &option, 1, dir->DirCache, RIIFS_LOCAL_DIRNEXT_SIZE);
 				if (ret < 0) {
 					memset(dir->DirCache, 0, RIIFS_LOCAL_DIRNEXT_SIZE);
 					return -2;
@@ -459,8 +573,15 @@ namespace ProxiIOS { namespace Filesystem {
 	{
 		if (LogBuffer && LogSize>0)
 		{
-			SendCommand(RII_OPTION_DATA, LogBuffer, LogSize);
-			ReceiveCommand(RII_LOG);
+			if (Compound()) {
+				// the reply is collected with the next one that matters
+				RiiOption option = { RII_OPTION_DATA, LogBuffer, LogSize };
+				if (SendRequest(RII_LOG, &option, 1))
+					PendingReplies++;
+			} else {
+				SendCommand(RII_OPTION_DATA, LogBuffer, LogSize);
+				ReceiveCommand(RII_LOG);
+			}
 			// prevent the buffer from staying too big
 			if (LogSize > 2048)
 			{
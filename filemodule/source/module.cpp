@@ -258,6 +258,19 @@ namespace ProxiIOS { namespace Filesystem {
 					return Errors::NotMounted;
 				}
 				return Errors::Unrecognized;
+			case Ioctl::GetLookupStats:
+				if (message->ioctl.length_in==sizeof(u32) && message->ioctl.length_io==sizeof(LookupStats)) {
+					FilesystemHandler *system = Mounted[buffer_in[0]];
+					if (system) {
+						LookupStats stats;
+						int ret = system->GetLookupStats(&stats);
+						memcpy(message->ioctl.buffer_io, &stats, sizeof(LookupStats));
+						os_sync_after_write(message->ioctl.buffer_io, sizeof(LookupStats));
+						return ret;
+					}
+					return Errors::NotMounted;
+				}
+				return Errors::Unrecognized;
 #if 0 // testing only
 			case Ioctl::Context: {
 				static const char *exception_name[15] = {
@@ -364,6 +377,8 @@ namespace ProxiIOS { namespace Filesystem {
 				return file->System->Tell(file);
 			case Ioctl::Sync:
 				return file->System->Sync(file);
+			case Ioctl::Reserve:
+				return file->System->Reserve(file, (u32)message->seek.offset);
 			default:
 				return file->System->Seek(file, message->seek.offset, message->seek.origin);
 		}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <gctypes.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "riivolution.h"
+
+/* Lookup index over the disc's FST while patches are being applied.
+ * Every node is hashed by its full lowercase path, built up from its
+ * parent's hash, and by its lowercase name for lookups that don't give a
+ * path. Nodes created by patches only go into the index, in the place
+ * the FST keeps them (alphabetically among the parent's children), and the
+ * FST is written out once by Commit() instead of growing with each one.
+ * The DiscNodes handed out are copies owned by the index, so changes to
+ * them make it into the FST through Commit() as well.
+ */
+class FSTIndex
+{
+	private:
+		struct Entry {
+			DiscNode Node; // first, so a DiscNode* from the index leads back to its Entry
+			const char* Name;
+			int Index;
+			int Parent;
+			u32 PathHash;
+			u32 NameHash;
+			int NextPath;
+			int NextName;
+			int Created; // position in creation order, -1 for nodes that were in the FST
+			std::vector<int> Children;
+		};
+
+		std::deque<Entry> Entries;
+		std::deque<std::string> CreatedNames;
+		std::vector<int> CreatedOrder;
+		std::vector<int> PathBuckets;
+		std::vector<int> NameBuckets;
+		u32 BucketMask;
+
+		const DiscNode* Source;
+		u32 SourceSize;
+
+		static u32 Hash(u32 hash, const char* str, u32 length);
+		static Entry* EntryOf(DiscNode* node) { return (Entry*)(void*)node; }
+
+		void Insert(int index);
+		void Grow();
+		int FindChild(int parent, const char* name, u32 length);
+		bool Before(int a, int b);
+		void Flatten(int index, u32 parent, DiscNode* nodes, u32* count);
+	public:
+		FSTIndex();
+
+		bool Build(const DiscNode* fst, u32 size);
+		DiscNode* Find(const char* path);
+		DiscNode* FindName(const char* name);
+		DiscNode* FindChild(DiscNode* dir, const char* name);
+		DiscNode* Add(DiscNode* dir, const char* name, bool directory);
+		DiscNode* GetRoot() { return Entries.empty() ? NULL : &Entries[0].Node; }
+		bool Commit(DiscNode** fst, u32* size);
+};
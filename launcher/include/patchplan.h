@@ -0,0 +1,79 @@
+#pragma once
+
+#include <gccore.h>
+#include <files.h>
+
+#include <string>
+#include <vector>
+
+#include "sha1.h"
+
+/* What RVL_Patch() worked out for a disc, saved so the next launch with the
+ * same patches doesn't have to walk patch folders and rebuild the FST again.
+ * A plan holds the patched FST, every ioctl sent to the disc module and the
+ * files and folders the result depended on. It's only used again when the
+ * key (game, FST and resolved patches) matches and those files and folders
+ * still look the same.
+ */
+class PatchPlan
+{
+	public:
+		struct Operation {
+			u32 Ioctl;
+			s32 Result;
+			bool Vectored;
+			u32 Inputs;
+			u32 Count;
+			ioctlv Vectors[3];
+		};
+	private:
+		struct Header {
+			u32 Magic;
+			u32 Version;
+			u8 Key[20];
+			u32 Files;
+			u64 Shift;
+			u32 FSTSize;
+			u32 Dependencies;
+			u32 Operations;
+			u32 Length;
+			u32 Reserved[2];
+		};
+
+		SHA1_CTX KeyContext;
+		u8 Key[20];
+		std::vector<u8> DependencyData;
+		std::vector<u8> OperationData;
+		u32 DependencyCount;
+		u32 OperationCount;
+
+		u8* Data;
+		std::vector<Operation> Operations;
+
+		void AddDependency(u32 type, const char* path, const u8* digest);
+		void AddOperation(u32 ioctl, s32 result, bool vectored, u32 inputs, u32 count, const ioctlv* vectors);
+		bool CheckDependencies(const u8* data, u32 length, u32 count, u32* used);
+	public:
+		PatchPlan();
+		~PatchPlan();
+
+		void AddKey(const void* data, u32 length);
+		void AddKey(const std::string& str) { AddKey(str.c_str(), str.size() + 1); }
+		void AddKey(u32 value) { AddKey(&value, sizeof(value)); }
+		void FinishKey();
+
+		static void DigestEntry(SHA1_CTX* context, const char* name, const Stats* st);
+		void AddFile(const char* path, int result, const Stats* st);
+		void AddDirectory(const char* path, int result, SHA1_CTX* context);
+		void AddIoctl(u32 ioctl, s32 result, const void* in, u32 inlength, const void* out, u32 outlength);
+		void AddIoctlv(u32 ioctl, s32 result, u32 inputs, u32 outputs, const ioctlv* vectors);
+
+		bool Save(const char* path, const void* fst, u32 fstsize, u64 shift, u32 files);
+		bool Load(const char* path);
+
+		// after Load()
+		const void* GetFST();
+		u32 GetFSTSize();
+		u64 GetShift();
+		const std::vector<Operation>& GetOperations() { return Operations; }
+};
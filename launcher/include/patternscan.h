@@ -0,0 +1,61 @@
+#pragma once
+
+#include <gctypes.h>
+
+#include <vector>
+
+/* Finds every pattern the launcher patches with in one pass over a loaded
+ * section. The first SCAN_PREFIX_MAX bytes of each pattern are compiled into
+ * an Aho-Corasick automaton, stored as a dense table over the byte values the
+ * patterns use; the rest of a pattern and its alignment are checked when its
+ * prefix turns up. Patchers report what they write with Written(), and Find()
+ * still returns what a search from the start of the section would.
+ * Patterns aren't copied, they have to stay around while the scanner is used.
+ */
+class PatternScanner
+{
+	private:
+		struct Pattern {
+			const u8* Data;
+			u32 Length;
+			u32 Align;
+			u32 Prefix;
+			int Next; // next pattern whose prefix ends in the same state
+			std::vector<u32> Matches;
+			bool More; // matched more often than Matches holds
+		};
+
+		struct Range {
+			u32 Start;
+			u32 End;
+		};
+
+		std::vector<Pattern> Patterns;
+		std::vector<u16> Table; // States * ClassCount, bit 15 set if the state reports patterns
+		std::vector<int> Own; // first pattern ending in each state
+		std::vector<u16> Dict; // next state on the failure chain with patterns of its own
+		std::vector<Range> Writes;
+		u16 Classes[0x100]; // byte value to table column, 0 for bytes no prefix uses
+		u32 ClassCount;
+		bool Compiled;
+		bool Failed;
+
+		u8* Buffer;
+		u32 Length;
+
+		bool Compile();
+		bool Build(u32 prefix);
+		void Report(u32 state, u32 end);
+		bool Matches(const Pattern* pattern, u32 pos);
+		u32 Search(const Pattern* pattern, u32 start, u32 end);
+	public:
+		PatternScanner();
+
+		int Add(const void* data, u32 length, u32 align = 1);
+		void Scan(void* buffer, u32 length);
+		void* Find(int pattern);
+		void Written(const void* address, u32 length);
+
+		u8* GetBuffer() { return Buffer; }
+		u32 GetLength() { return Length; }
+};
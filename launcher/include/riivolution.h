@@ -33,6 +33,7 @@ int RVL_SetClusters(bool clusters);
 void RVL_SetAlwaysShift(bool shift);
 int RVL_Allocate(PatchType::Enum type, int num);
 int RVL_SetShiftBase(u64 shift);
+int RVL_SetFileHandles(int num);
 int RVL_AddFile(const char* filename);
 int RVL_AddFile(const char* filename, u64 identifier);
 int RVL_AddShift(u64 original, u64 offset, u32 length);
@@ -44,13 +45,17 @@ u64 RVL_GetShiftOffset(u32 length);
 DiscNode* RVL_FindNode(const char* fstname);
 
 struct RiiDisc;
+class PatternScanner;
 
 extern std::vector<int> Mounted;
 extern std::vector<int> ToMount;
 extern RiiDisc Disc;
 
 void RVL_Patch(RiiDisc* disc);
-void RVL_PatchMemory(RiiDisc* disc, void* memory = NULL, u32 length = 0);
+void RVL_PatchMemory(RiiDisc* disc);
+void RVL_AddMemorySearches(RiiDisc* disc, PatternScanner* scanner);
+void RVL_PatchMemory(PatternScanner* scanner);
+void RVL_ClearMemorySearches();
 void RVL_Unmount();
 
 static inline u64 RVL_GetShiftOffset() { return RVL_GetShiftOffset(0); }
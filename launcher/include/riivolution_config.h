@@ -142,10 +142,10 @@ struct RiiDisc
 
 void ParseXMLs(const char* rootpath, const char* rootfs, int fs, std::vector<RiiDisc>* discs);
 bool ParseXMLs(int mnt, std::vector<RiiDisc>* discs);
-bool ParseXML(const char* xmldata, int length, std::vector<RiiDisc>* discs, const char* rootpath, const char* rootfs, int fs);
+bool ParseXML(char* xmldata, int length, std::vector<RiiDisc>* discs, const char* rootpath, const char* rootfs, int fs);
 RiiDisc CombineDiscs(std::vector<RiiDisc>* discs);
 void ParseConfigXMLs(RiiDisc* disc);
-bool ParseConfigXML(const char* xmldata, int length, RiiDisc* disc);
+bool ParseConfigXML(char* xmldata, int length, RiiDisc* disc);
 void SaveConfigXML(RiiDisc* disc);
 
 std::string PathCombine(std::string path, std::string file);
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <gctypes.h>
+
+#include <vector>
+
+/* Pull parser for the Riivolution XMLs, read like libxml++'s TextReader.
+ * It works in place in the buffer it's given: names and attribute values
+ * are terminated and decoded (entities, and UTF-8 down to Latin-1) where
+ * they are, so nothing is allocated per node and everything handed out
+ * stays valid until the buffer is freed. Text, comments, CDATA and
+ * processing instructions are skipped; only elements are reported.
+ */
+class XMLReader
+{
+	public:
+		enum NodeType {
+			None = 0,
+			Element,
+			EndElement
+		};
+	private:
+		struct Attribute {
+			char* Name;
+			char* NameEnd;
+			char* Value;
+			char* ValueEnd;
+		};
+
+		char* Position;
+		char* End;
+		bool Latin1; // the document isn't UTF-8, values are left as they are
+		bool Failed;
+
+		NodeType Type;
+		const char* Name;
+		bool Empty;
+		std::vector<Attribute> Attributes;
+		std::vector<const char*> Open;
+
+		bool Skip(const char* terminator);
+		bool ReadTag();
+		void Decode(char* value, char* end);
+		void ReadDeclaration(const char* start);
+	public:
+		XMLReader(char* data, u32 length);
+
+		bool Read();
+
+		NodeType GetNodeType() { return Type; }
+		const char* GetName() { return Name; }
+		bool IsEmptyElement() { return Empty; }
+		const char* GetAttribute(const char* name);
+};
@@ -0,0 +1,364 @@
+/* scanbench - times the launcher's section patching on a PC
+ *
+ * Every section of a DOL is patched twice, the way ApplyBinaryPatches and
+ * the memory patches do it: once with a FindInBuffer search from the start
+ * of the section per pattern, as the launcher used to, and once with
+ * patternscan.cpp built unchanged. Search patches are cut from the DOL
+ * itself (so they match) or made up (so they don't), and ocarina patches
+ * from code followed by a blr. Both runs have to leave the same bytes.
+ *
+ * Usage: scanbench [-n patches] [-r runs] <dol>
+ *        scanbench -g <dol>
+ *
+ * -g writes a made up 4MB DOL of PowerPC-looking code and data, for when
+ * there's no dump of a game at hand.
+ */
+
+#include <patternscan.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <vector>
+
+using std::vector;
+
+#define BLR 0x4E800020
+
+struct Section
+{
+	u32 Address;
+	vector<u8> Data;
+};
+
+struct MemoryPatch
+{
+	vector<u8> Original; // what a search patch looks for, empty for ocarina
+	vector<u8> Value;
+	u32 Align;
+	bool Ocarina;
+	u32 Offset; // where an ocarina patch branches to
+};
+
+static const u32 SOStartupCode[] = { 0x28000021, 0x3A40FFE4 };
+static const u16 NWC24iCleanupSocketCode[] = { 0x7c65, 0x1b78, 0x3860, 0x0000, 0x3880, 0x0007, 0x4800 };
+
+static double Now()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static u32 Get32(const u8* p) { return ((u32)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+static void Put32(u8* p, u32 value) { p[0] = value >> 24; p[1] = value >> 16; p[2] = value >> 8; p[3] = value; }
+
+// one pattern at a time from the start, like the launcher's FindInBuffer
+class LinearFinder
+{
+	private:
+		struct Pattern {
+			const u8* Data;
+			u32 Length;
+			u32 Align;
+		};
+		vector<Pattern> Patterns;
+		u8* Buffer;
+		u32 Length;
+	public:
+		int Add(const void* data, u32 length, u32 align = 1)
+		{
+			Pattern pattern = { (const u8*)data, length, align };
+			Patterns.push_back(pattern);
+			return Patterns.size() - 1;
+		}
+		void Scan(void* buffer, u32 length) { Buffer = (u8*)buffer; Length = length; }
+		void* Find(int index)
+		{
+			const Pattern* pattern = &Patterns[index];
+			for (u32 pos = 0; pos + pattern->Length <= Length; pos += pattern->Align) {
+				if (!memcmp(Buffer + pos, pattern->Data, pattern->Length))
+					return Buffer + pos;
+			}
+			return NULL;
+		}
+		void Written(const void* address, u32 length) { }
+};
+
+struct Patterns
+{
+	int DIP;
+	int USBHID;
+	int SOStartup;
+	int NWC24iCleanupSocket;
+	vector<int> Memory;
+};
+
+template<class Finder> static void AddPatterns(Finder* finder, Patterns* patterns, vector<MemoryPatch>* memory)
+{
+	patterns->DIP = finder->Add("/dev/di", 7);
+	patterns->USBHID = finder->Add("/dev/usb/hid", 12);
+	patterns->SOStartup = finder->Add(SOStartupCode, sizeof(SOStartupCode));
+	patterns->NWC24iCleanupSocket = finder->Add(NWC24iCleanupSocketCode, sizeof(NWC24iCleanupSocketCode));
+	for (vector<MemoryPatch>::iterator patch = memory->begin(); patch != memory->end(); patch++) {
+		if (patch->Ocarina)
+			patterns->Memory.push_back(finder->Add(&patch->Value[0], patch->Value.size(), 4));
+		else
+			patterns->Memory.push_back(finder->Add(&patch->Original[0], patch->Original.size(), patch->Align));
+	}
+}
+
+// what ApplyBinaryPatches and RVL_PatchMemory do to a section
+template<class Finder> static void Patch(Finder* finder, Patterns* patterns, vector<MemoryPatch>* memory, Section* section)
+{
+	u8* mem = &section->Data[0];
+	u32 length = section->Data.size();
+	void* found;
+
+	finder->Scan(mem, length);
+
+	while ((found = finder->Find(patterns->DIP))) {
+		((u8*)found)[6] = 'o';
+		finder->Written((u8*)found + 6, 1);
+	}
+	while ((found = finder->Find(patterns->USBHID))) {
+		((u8*)found)[11] = '0';
+		finder->Written((u8*)found + 11, 1);
+	}
+	if ((found = finder->Find(patterns->SOStartup))) {
+		((u16*)found)[3] = 0;
+		finder->Written((u16*)found + 3, 2);
+	}
+	if ((found = finder->Find(patterns->NWC24iCleanupSocket))) {
+		Put32((u8*)found + 12, BLR);
+		finder->Written((u8*)found + 12, 4);
+	}
+
+	for (u32 i = 0; i < memory->size(); i++) {
+		MemoryPatch* patch = &(*memory)[i];
+		if (!(found = finder->Find(patterns->Memory[i])))
+			continue;
+		if (patch->Ocarina) {
+			u8* blr;
+			for (blr = (u8*)found; blr + 4 <= mem + length && Get32(blr) != BLR; blr += 4)
+				;
+			if (blr + 4 <= mem + length) {
+				Put32(blr, ((patch->Offset - (section->Address + (blr - mem))) & 0x03FFFFFC) | 0x48000000);
+				finder->Written(blr, 4);
+			}
+		} else {
+			memcpy(found, &patch->Value[0], patch->Value.size());
+			finder->Written(found, patch->Value.size());
+		}
+	}
+}
+
+static bool LoadDol(const char* path, vector<Section>* sections)
+{
+	FILE* file = fopen(path, "rb");
+	if (!file)
+		return false;
+	fseek(file, 0, SEEK_END);
+	vector<u8> dol(ftell(file));
+	fseek(file, 0, SEEK_SET);
+	bool ok = dol.size() >= 0x100 && fread(&dol[0], 1, dol.size(), file) == dol.size();
+	fclose(file);
+	if (!ok)
+		return false;
+
+	// 7 text then 11 data sections: file offsets, load addresses, sizes
+	for (int i = 0; i < 18; i++) {
+		u32 offset = Get32(&dol[i * 4]);
+		u32 address = Get32(&dol[0x48 + i * 4]);
+		u32 size = Get32(&dol[0x90 + i * 4]);
+		if (!size)
+			continue;
+		if (offset + size > dol.size() || offset + size < offset)
+			return false;
+		Section section;
+		section.Address = address;
+		section.Data.assign(dol.begin() + offset, dol.begin() + offset + size);
+		sections->push_back(section);
+	}
+	return !sections->empty();
+}
+
+static u32 RandomInstruction()
+{
+	// loads, stores, arithmetic, compares and branches with made up operands
+	static const u32 opcodes[] = { 0x80000000, 0x90000000, 0x38000000, 0x7C000214, 0x2C000000, 0x41820000, 0x48000001, 0xC0000000, 0x54000000, 0x60000000 };
+	u32 op = opcodes[rand() % (sizeof(opcodes) / sizeof(opcodes[0]))];
+	return op | (rand() & 0x03FFFFFC);
+}
+
+static int Generate(const char* path)
+{
+	const u32 textSize = 0x300000, dataSize = 0x100000;
+	vector<u8> dol(0x100 + textSize + dataSize, 0);
+	u8* text = &dol[0x100];
+	u8* data = text + textSize;
+	u32 i;
+
+	srand(1);
+	// functions: prologue, body, epilogue, blr
+	for (i = 0; i + 4 <= textSize; i += 4) {
+		u32 word;
+		switch (rand() % 40) {
+			case 0: word = 0x9421FF00 | (rand() & 0xF0); break; // stwu r1, -x(r1)
+			case 1: word = 0x7C0802A6; break; // mflr r0
+			case 2: word = BLR; break;
+			default: word = RandomInstruction(); break;
+		}
+		Put32(text + i, word);
+	}
+	// the code the launcher patches, once each
+	memcpy(text + 0x12340, SOStartupCode, sizeof(SOStartupCode));
+	memcpy(text + 0x23450, NWC24iCleanupSocketCode, sizeof(NWC24iCleanupSocketCode));
+
+	// strings and tables, with a few device names the launcher renames
+	for (i = 0; i < dataSize; i++)
+		data[i] = rand() % 3 ? 0 : 0x20 + rand() % 0x5F;
+	for (i = 0; i < 6; i++)
+		memcpy(data + 0x1000 + i * 0x8000, "/dev/di", 8);
+	memcpy(data + 0x40000, "/dev/usb/hid", 13);
+
+	Put32(&dol[0], 0x100);
+	Put32(&dol[0x48], 0x80004000);
+	Put32(&dol[0x90], textSize);
+	Put32(&dol[0x1C], 0x100 + textSize);
+	Put32(&dol[0x64], 0x80004000 + textSize);
+	Put32(&dol[0xAC], dataSize);
+
+	FILE* file = fopen(path, "wb");
+	if (!file || fwrite(&dol[0], 1, dol.size(), file) != dol.size()) {
+		perror(path);
+		return 1;
+	}
+	fclose(file);
+	printf("wrote %s, %u bytes of code and %u of data\n", path, textSize, dataSize);
+	return 0;
+}
+
+// patches like a mod's: most found in the code, some for another revision
+static void MakePatches(vector<Section>* sections, u32 count, vector<MemoryPatch>* memory)
+{
+	const Section* text = &(*sections)[0];
+	for (vector<Section>::const_iterator section = sections->begin(); section != sections->end(); section++) {
+		if (section->Data.size() > text->Data.size())
+			text = &*section;
+	}
+
+	srand(2);
+	for (u32 i = 0; i < count; i++) {
+		MemoryPatch patch;
+		u32 length = 8 + (rand() % 7) * 4;
+		u32 pos = (rand() % ((text->Data.size() - 0x100) / 4)) * 4;
+		patch.Align = 4;
+		patch.Ocarina = (i % 10) == 9;
+		patch.Offset = 0x80001800 + (i & 0xFF) * 0x10;
+		if (patch.Ocarina) {
+			patch.Value.assign(text->Data.begin() + pos, text->Data.begin() + pos + length);
+		} else {
+			patch.Original.assign(text->Data.begin() + pos, text->Data.begin() + pos + length);
+			if (i % 4 == 3)
+				patch.Original[rand() % length] ^= 0x5A;
+			if (i % 16 == 7)
+				patch.Align = 1;
+			for (u32 j = 0; j < length; j += 4) {
+				u8 word[4];
+				Put32(word, RandomInstruction());
+				patch.Value.insert(patch.Value.end(), word, word + 4);
+			}
+		}
+		memory->push_back(patch);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	u32 count = 300;
+	int runs = 5;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "g:n:r:")) != -1) {
+		switch (opt) {
+			case 'g':
+				return Generate(optarg);
+			case 'n':
+				count = strtoul(optarg, NULL, 0);
+				break;
+			case 'r':
+				runs = atoi(optarg);
+				break;
+			default:
+				optind = argc;
+				break;
+		}
+	}
+	if (optind != argc - 1) {
+		printf("Usage: scanbench [-n patches] [-r runs] <dol>\n       scanbench -g <dol>\n");
+		return 1;
+	}
+
+	vector<Section> sections;
+	if (!LoadDol(argv[optind], &sections)) {
+		printf("%s is not a DOL\n", argv[optind]);
+		return 1;
+	}
+	u32 total = 0;
+	for (vector<Section>::iterator section = sections.begin(); section != sections.end(); section++)
+		total += section->Data.size();
+
+	vector<MemoryPatch> memory;
+	MakePatches(&sections, count, &memory);
+	printf("%u sections, %u bytes, %u memory patches\n", (u32)sections.size(), total, count);
+
+	double linearTime = 0, scanTime = 0, compileTime = 0;
+	for (int run = 0; run < runs; run++) {
+		vector<Section> linearSections = sections;
+		vector<Section> scanSections = sections;
+		double start;
+
+		LinearFinder linear;
+		Patterns linearPatterns;
+		AddPatterns(&linear, &linearPatterns, &memory);
+		start = Now();
+		for (vector<Section>::iterator section = linearSections.begin(); section != linearSections.end(); section++)
+			Patch(&linear, &linearPatterns, &memory, &*section);
+		linearTime += Now() - start;
+
+		// the launcher builds the automaton for the first section and keeps it
+		PatternScanner scanner;
+		Patterns scanPatterns;
+		AddPatterns(&scanner, &scanPatterns, &memory);
+		start = Now();
+		scanner.Scan(NULL, 0);
+		compileTime += Now() - start;
+		for (vector<Section>::iterator section = scanSections.begin(); section != scanSections.end(); section++)
+			Patch(&scanner, &scanPatterns, &memory, &*section);
+		scanTime += Now() - start;
+
+		for (u32 i = 0; i < sections.size(); i++) {
+			if (linearSections[i].Data != scanSections[i].Data) {
+				printf("section %u at %08x patched differently\n", i, sections[i].Address);
+				return 1;
+			}
+		}
+		if (run == 0) {
+			u32 changed = 0;
+			for (u32 i = 0; i < sections.size(); i++) {
+				for (u32 j = 0; j < sections[i].Data.size(); j++)
+					changed += sections[i].Data[j] != scanSections[i].Data[j];
+			}
+			printf("%u bytes patched, the same both ways\n", changed);
+		}
+	}
+
+	printf("FindInBuffer per pattern: %8.2f ms\n", linearTime * 1000 / runs);
+	printf("one scan per section:     %8.2f ms (%.2f ms building the automaton), %.1fx faster\n",
+		scanTime * 1000 / runs, compileTime * 1000 / runs, linearTime / scanTime);
+	return 0;
+}
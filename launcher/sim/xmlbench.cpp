@@ -0,0 +1,358 @@
+/* xmlbench - times the launcher's Riivolution XML reading on a PC
+ *
+ * A patch XML is read twice the way ParseXML walks it: once with libxml++'s
+ * TextReader, as the launcher used to, and once with xmlreader.cpp built
+ * unchanged. Every element ParseXML looks at has the same attributes asked
+ * for and copied out, and both runs have to see the same names and values.
+ * Each run starts from its own copy of the file, like ParseXMLs reading it,
+ * and the peak of what's allocated on the heap (libxml2's included) is
+ * counted alongside the time.
+ *
+ * Usage: xmlbench [-r runs] <xml>
+ *        xmlbench -g [-n patches] <xml>
+ *
+ * -g writes a made up wiidisc XML with options, choices and patches full of
+ * file, folder and memory entries, for when there's no big pack at hand.
+ */
+
+#include <xmlreader.h>
+
+#include <libxml++/parsers/textreader.h>
+#include <libxml/xmlmemory.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <malloc.h>
+
+#include <new>
+#include <string>
+
+using std::string;
+
+static size_t HeapUsed;
+static size_t HeapPeak;
+
+static void* Allocated(void* ptr)
+{
+	if (ptr) {
+		HeapUsed += malloc_usable_size(ptr);
+		if (HeapUsed > HeapPeak)
+			HeapPeak = HeapUsed;
+	}
+	return ptr;
+}
+
+static void Freeing(void* ptr)
+{
+	if (ptr)
+		HeapUsed -= malloc_usable_size(ptr);
+}
+
+static void* CountedMalloc(size_t size) { return Allocated(malloc(size)); }
+static void CountedFree(void* ptr) { Freeing(ptr); free(ptr); }
+static char* CountedStrdup(const char* str) { return (char*)Allocated(strdup(str)); }
+static void* CountedRealloc(void* ptr, size_t size)
+{
+	Freeing(ptr);
+	void* ret = realloc(ptr, size);
+	Allocated(ret ? ret : ptr);
+	return ret;
+}
+
+void* operator new(size_t size)
+{
+	void* ptr = CountedMalloc(size ? size : 1);
+	if (!ptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* ptr) noexcept { CountedFree(ptr); }
+void operator delete[](void* ptr) noexcept { CountedFree(ptr); }
+void operator delete(void* ptr, size_t) noexcept { CountedFree(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { CountedFree(ptr); }
+
+static double Now()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// what ParseXML asks each element for
+struct ElementAttributes
+{
+	const char* Name;
+	const char* Attributes[10];
+};
+
+static const ElementAttributes Schema[] = {
+	{ "wiidisc", { "version", "root", "shiftfiles", "log" } },
+	{ "id", { "game", "developer", "disc", "version" } },
+	{ "region", { "type" } },
+	{ "network", { "protocol", "address", "port", "log", "freeze" } },
+	{ "macro", { "name", "id" } },
+	{ "section", { "name", "id" } },
+	{ "option", { "name", "id", "default" } },
+	{ "choice", { "name", "id" } },
+	{ "param", { "name", "value" } },
+	{ "patch", { "id", "root" } },
+	{ "file", { "resize", "create", "disc", "offset", "external", "fileoffset", "length" } },
+	{ "folder", { "create", "resize", "recursive", "length", "disc", "external" } },
+	{ "shift", { "source", "destination" } },
+	{ "savegame", { "external", "clone" } },
+	{ "dlc", { "external" } },
+	{ "memory", { "offset", "value", "valuefile", "original", "ocarina", "search", "align" } },
+};
+
+static u32 Hash(u32 hash, const char* str)
+{
+	for (; *str; str++)
+		hash = (hash ^ (u8)*str) * 0x01000193;
+	return (hash ^ 0xFF) * 0x01000193;
+}
+
+// the walk ParseXML does, each value copied into a string the way it's kept
+struct Result
+{
+	u32 Elements;
+	u32 Values;
+	u32 Hash;
+};
+
+template <class Reader> static void Walk(Reader& reader, Result* result)
+{
+	string attribute;
+
+	result->Elements = 0;
+	result->Values = 0;
+	result->Hash = 0x811C9DC5;
+
+	while (reader.Read()) {
+		if (!reader.IsElement())
+			continue;
+		result->Elements++;
+		for (u32 i = 0; i < sizeof(Schema) / sizeof(Schema[0]); i++) {
+			if (strcmp(reader.Name(), Schema[i].Name))
+				continue;
+			result->Hash = Hash(result->Hash, Schema[i].Name);
+			for (const char* const* name = Schema[i].Attributes; *name; name++) {
+				if (!reader.Attribute(*name, &attribute))
+					continue;
+				result->Hash = Hash(Hash(result->Hash, *name), attribute.c_str());
+				result->Values++;
+			}
+			break;
+		}
+	}
+}
+
+static string UTF8ToLatin1(string str)
+{
+	bool utf8 = false;
+	for (u32 i = 0; i < str.size(); i++) {
+		if (str[i] & 0x80) {
+			utf8 = true;
+			break;
+		}
+	}
+	if (!utf8)
+		return str;
+
+	string ret;
+	for (u32 i = 0; i < str.size(); i++) {
+		if (str[i] & 0x80) {
+			ret += ((str[i] & 0x1F) << 6) + (str[i + 1] & 0x3f);
+			i++;
+		} else
+			ret += str[i];
+	}
+	return ret;
+}
+
+// as the launcher used libxml++ before xmlreader.cpp
+class TextReaderWalk
+{
+	private:
+		xmlpp::TextReader Reader;
+		string Current;
+	public:
+		TextReaderWalk(const char* data, u32 length) : Reader((const unsigned char*)data, length) { }
+
+		bool Read() { return Reader.read(); }
+		bool IsElement() { return Reader.get_node_type() == xmlpp::TextReader::Element; }
+		const char* Name() { Current = Reader.get_name(); return Current.c_str(); }
+		bool Attribute(const char* name, string* value)
+		{
+			*value = UTF8ToLatin1(Reader.get_attribute(name));
+			return !value->empty();
+		}
+};
+
+class XMLReaderWalk
+{
+	private:
+		XMLReader Reader;
+	public:
+		XMLReaderWalk(char* data, u32 length) : Reader(data, length) { }
+
+		bool Read() { return Reader.Read(); }
+		bool IsElement() { return Reader.GetNodeType() == XMLReader::Element; }
+		const char* Name() { return Reader.GetName(); }
+		bool Attribute(const char* name, string* value)
+		{
+			const char* attribute = Reader.GetAttribute(name);
+			if (!attribute || !*attribute)
+				return false;
+			*value = attribute;
+			return true;
+		}
+};
+
+static void Generate(const char* path, u32 patches)
+{
+	FILE* out = fopen(path, "w");
+	if (!out) {
+		perror(path);
+		exit(1);
+	}
+
+	fprintf(out, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+	fprintf(out, "<!-- made up by xmlbench -->\n");
+	fprintf(out, "<wiidisc version=\"1\" root=\"/bench\" shiftfiles=\"true\">\n");
+	fprintf(out, "\t<id game=\"RMC\">\n\t\t<region type=\"E\" />\n\t\t<region type=\"P\" />\n\t</id>\n");
+	fprintf(out, "\t<options>\n\t\t<section name=\"Caf&#233; &amp; B\xC3\xA4r\">\n");
+	for (u32 i = 0; i < patches; i += 4) {
+		fprintf(out, "\t\t\t<option name=\"Option %u\" id=\"opt%u\" default=\"%u\">\n", i, i, i % 3);
+		for (u32 j = i; j < i + 4 && j < patches; j++) {
+			fprintf(out, "\t\t\t\t<choice name=\"Choice &quot;%u&quot;\">\n", j);
+			fprintf(out, "\t\t\t\t\t<patch id=\"patch%u\"><param name=\"dir\" value=\"d%u\" /></patch>\n", j, j);
+			fprintf(out, "\t\t\t\t</choice>\n");
+		}
+		fprintf(out, "\t\t\t</option>\n");
+	}
+	fprintf(out, "\t\t</section>\n\t</options>\n");
+
+	for (u32 i = 0; i < patches; i++) {
+		fprintf(out, "\t<patch id=\"patch%u\" root=\"/bench/{$dir}\">\n", i);
+		for (u32 j = 0; j < 12; j++)
+			fprintf(out, "\t\t<file disc=\"/Scene/UI/Menu%u_%u.szs\" external=\"files/menu%u_%u.szs\" create=\"%s\" resize=\"true\" />\n", i, j, i, j, j & 1 ? "true" : "false");
+		fprintf(out, "\t\t<folder external=\"Race/Course\" disc=\"/Race/Course\" create=\"true\" recursive=\"false\" />\n");
+		fprintf(out, "\t\t<savegame external=\"save/{$__gameid}\" clone=\"false\" />\n");
+		for (u32 j = 0; j < 16; j++) {
+			fprintf(out, "\t\t<memory offset=\"0x80%06X\" value=\"%08X%08X\" original=\"%08X\" />\n",
+				(i * 0x100 + j * 8) & 0xFFFFFF, rand(), rand(), rand());
+		}
+		fprintf(out, "\t\t<memory valuefile=\"code/patch%u.bin\" original=\"38000001\" search=\"true\" align=\"4\" />\n", i);
+		fprintf(out, "\t\t<![CDATA[ <memory offset=\"0x80000000\" value=\"00\" /> ]]>\n");
+		fprintf(out, "\t</patch>\n");
+	}
+	fprintf(out, "</wiidisc>\n");
+	fclose(out);
+}
+
+static char* Load(const char* path, u32* length)
+{
+	FILE* in = fopen(path, "rb");
+	if (!in) {
+		perror(path);
+		exit(1);
+	}
+	fseek(in, 0, SEEK_END);
+	*length = ftell(in);
+	fseek(in, 0, SEEK_SET);
+	char* data = (char*)malloc(*length);
+	if (fread(data, 1, *length, in) != *length) {
+		fprintf(stderr, "%s: short read\n", path);
+		exit(1);
+	}
+	fclose(in);
+	return data;
+}
+
+template <class Walker> static void Run(const char* title, const char* file, u32 length, int runs, Result* result)
+{
+	double best = 1e9;
+	size_t peak = 0;
+
+	for (int run = 0; run < runs; run++) {
+		HeapUsed = 0;
+		HeapPeak = 0;
+		double start = Now();
+		char* data = (char*)CountedMalloc(length);
+		memcpy(data, file, length);
+		{
+			Walker walker(data, length);
+			Walk(walker, result);
+		}
+		CountedFree(data);
+		double elapsed = Now() - start;
+		if (elapsed < best)
+			best = elapsed;
+		if (HeapPeak > peak)
+			peak = HeapPeak;
+	}
+
+	printf("%-12s %8.2f ms %10zu bytes peak  %u elements, %u values\n", title, best * 1000, peak, result->Elements, result->Values);
+}
+
+static void Usage()
+{
+	fprintf(stderr, "Usage: xmlbench [-r runs] <xml>\n       xmlbench -g [-n patches] <xml>\n");
+	exit(1);
+}
+
+int main(int argc, char** argv)
+{
+	bool generate = false;
+	u32 patches = 400;
+	int runs = 10;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "gn:r:")) != -1) {
+		switch (opt) {
+			case 'g':
+				generate = true;
+				break;
+			case 'n':
+				patches = strtoul(optarg, NULL, 0);
+				break;
+			case 'r':
+				runs = atoi(optarg);
+				break;
+			default:
+				Usage();
+		}
+	}
+	if (optind + 1 != argc || runs < 1)
+		Usage();
+
+	if (generate) {
+		Generate(argv[optind], patches);
+		return 0;
+	}
+
+	if (xmlMemSetup(CountedFree, CountedMalloc, CountedRealloc, CountedStrdup))
+		return 1;
+	xmlInitParser();
+
+	u32 length;
+	char* file = Load(argv[optind], &length);
+	printf("%s: %u bytes, best of %d\n", argv[optind], length, runs);
+
+	Result textreader, xmlreader;
+	Run<TextReaderWalk>("TextReader", file, length, runs, &textreader);
+	Run<XMLReaderWalk>("XMLReader", file, length, runs, &xmlreader);
+
+	free(file);
+	if (textreader.Elements != xmlreader.Elements || textreader.Hash != xmlreader.Hash) {
+		printf("MISMATCH: the readers disagree\n");
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,301 @@
+#include "fstindex.h"
+
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <malloc.h>
+
+using std::vector;
+
+#define FNV_OFFSET	0x811C9DC5
+#define FNV_PRIME	0x01000193
+
+FSTIndex::FSTIndex()
+{
+	BucketMask = 0;
+	Source = NULL;
+	SourceSize = 0;
+}
+
+// FNV-1a over the lowercase string, so it can be carried on from a parent's path
+u32 FSTIndex::Hash(u32 hash, const char* str, u32 length)
+{
+	for (u32 i = 0; i < length; i++)
+		hash = (hash ^ (u8)tolower((u8)str[i])) * FNV_PRIME;
+	return hash;
+}
+
+void FSTIndex::Insert(int index)
+{
+	Entry* entry = &Entries[index];
+	u32 length = strlen(entry->Name);
+
+	entry->NameHash = Hash(FNV_OFFSET, entry->Name, length);
+	entry->NextName = NameBuckets[entry->NameHash & BucketMask];
+	NameBuckets[entry->NameHash & BucketMask] = index;
+
+	// a path lookup only ever reaches the first of two children with the same name
+	entry->PathHash = Hash(Hash(Entries[entry->Parent].PathHash, "/", 1), entry->Name, length);
+	entry->NextPath = -1;
+	if (FindChild(entry->Parent, entry->Name, length) >= 0)
+		return;
+	entry->NextPath = PathBuckets[entry->PathHash & BucketMask];
+	PathBuckets[entry->PathHash & BucketMask] = index;
+}
+
+void FSTIndex::Grow()
+{
+	u32 buckets = 0x40;
+	while (buckets < Entries.size() * 2)
+		buckets <<= 1;
+	BucketMask = buckets - 1;
+	PathBuckets.assign(buckets, -1);
+	NameBuckets.assign(buckets, -1);
+
+	// in FST order, so the first of any duplicates gets in
+	for (u32 i = 1; i < Entries.size(); i++)
+		Insert(i);
+}
+
+bool FSTIndex::Build(const DiscNode* fst, u32 size)
+{
+	Entries.clear();
+	CreatedNames.clear();
+	CreatedOrder.clear();
+	Source = NULL;
+	SourceSize = 0;
+
+	if (!fst || size < sizeof(DiscNode) || !fst->Type || fst->Size * sizeof(DiscNode) > size)
+		return false;
+
+	const char* nametable = (const char*)(fst + fst->Size);
+	vector<int> dirs;
+	for (u32 i = 0; i < fst->Size; i++) {
+		Entry entry;
+		entry.Node = fst[i];
+		entry.Name = i ? nametable + entry.Node.GetNameOffset() : "";
+		entry.Index = i;
+		entry.Parent = -1;
+		entry.PathHash = FNV_OFFSET;
+		entry.NameHash = 0;
+		entry.NextPath = -1;
+		entry.NextName = -1;
+		entry.Created = -1;
+
+		// leave the directories that end before this node
+		while (dirs.size() > 1 && Entries[dirs.back()].Node.Size <= i)
+			dirs.pop_back();
+		if (i) {
+			entry.Parent = dirs.back();
+			Entries[entry.Parent].Children.push_back(i);
+		}
+		Entries.push_back(entry);
+		if (fst[i].Type)
+			dirs.push_back(i);
+	}
+
+	Source = fst;
+	SourceSize = size;
+	Grow();
+	return true;
+}
+
+int FSTIndex::FindChild(int parent, const char* name, u32 length)
+{
+	u32 hash = Hash(Hash(Entries[parent].PathHash, "/", 1), name, length);
+	for (int i = PathBuckets[hash & BucketMask]; i >= 0; i = Entries[i].NextPath) {
+		const Entry* entry = &Entries[i];
+		if (entry->PathHash == hash && entry->Parent == parent && !strncasecmp(entry->Name, name, length) && !entry->Name[length])
+			return i;
+	}
+
+	return -1;
+}
+
+DiscNode* FSTIndex::FindChild(DiscNode* dir, const char* name)
+{
+	int index = FindChild(EntryOf(dir)->Index, name, strlen(name));
+	return index < 0 ? NULL : &Entries[index].Node;
+}
+
+DiscNode* FSTIndex::Find(const char* path)
+{
+	if (Entries.empty() || path[0] != '/')
+		return NULL;
+
+	int dir = 0;
+	for (path++; dir >= 0; ) {
+		const char* slash = strchr(path, '/');
+		if (!slash)
+			break;
+		dir = FindChild(dir, path, slash - path);
+		path = slash + 1;
+	}
+	if (dir < 0)
+		return NULL;
+
+	int index = FindChild(dir, path, strlen(path));
+	return index < 0 ? NULL : &Entries[index].Node;
+}
+
+// whether a comes before b in the FST
+bool FSTIndex::Before(int a, int b)
+{
+	vector<int> pathA, pathB;
+	for (; a >= 0; a = Entries[a].Parent)
+		pathA.push_back(a);
+	for (; b >= 0; b = Entries[b].Parent)
+		pathB.push_back(b);
+
+	u32 i = pathA.size(), j = pathB.size();
+	while (i && j && pathA[i - 1] == pathB[j - 1]) {
+		i--;
+		j--;
+	}
+	if (!i)
+		return true; // a is b or one of its directories
+	if (!j)
+		return false;
+
+	const vector<int>& children = Entries[Entries[pathA[i - 1]].Parent].Children;
+	for (vector<int>::const_iterator child = children.begin(); child != children.end(); child++) {
+		if (*child == pathA[i - 1])
+			return true;
+		if (*child == pathB[j - 1])
+			return false;
+	}
+
+	return false;
+}
+
+DiscNode* FSTIndex::FindName(const char* name)
+{
+	if (Entries.empty())
+		return NULL;
+
+	u32 hash = Hash(FNV_OFFSET, name, strlen(name));
+	int found = -1;
+	for (int i = NameBuckets[hash & BucketMask]; i >= 0; i = Entries[i].NextName) {
+		if (Entries[i].NameHash == hash && !strcasecmp(Entries[i].Name, name) && (found < 0 || Before(i, found)))
+			found = i;
+	}
+
+	return found < 0 ? NULL : &Entries[found].Node;
+}
+
+DiscNode* FSTIndex::Add(DiscNode* dir, const char* name, bool directory)
+{
+	if (!dir->Type)
+		return NULL;
+
+	int parent = EntryOf(dir)->Index;
+	int index = Entries.size();
+
+	CreatedNames.push_back(name);
+
+	Entry entry;
+	entry.Node.Type = directory ? 1 : 0;
+	entry.Node.SetNameOffset(0);
+	entry.Node.DataOffset = 0;
+	entry.Node.Size = 0;
+	entry.Name = CreatedNames.back().c_str();
+	entry.Index = index;
+	entry.Parent = parent;
+	entry.Created = CreatedOrder.size();
+	Entries.push_back(entry);
+	CreatedOrder.push_back(index);
+
+	// before the first child that doesn't sort lower, like the FST has them
+	vector<int>& children = Entries[parent].Children;
+	vector<int>::iterator child;
+	for (child = children.begin(); child != children.end() && strcasecmp(name, Entries[*child].Name) > 0; child++)
+		;
+	children.insert(child, index);
+
+	if (Entries.size() * 2 > BucketMask + 1)
+		Grow();
+	else
+		Insert(index);
+
+	return &Entries[index].Node;
+}
+
+void FSTIndex::Flatten(int index, u32 parent, DiscNode* nodes, u32* count)
+{
+	const Entry* entry = &Entries[index];
+	u32 position = (*count)++;
+
+	nodes[position] = entry->Node;
+	if (!entry->Node.Type)
+		return;
+
+	for (vector<int>::const_iterator child = entry->Children.begin(); child != entry->Children.end(); child++)
+		Flatten(*child, position, nodes, count);
+
+	// directories hold their parent and the node after their last one
+	if (entry->Parent >= 0)
+		nodes[position].DataOffset = parent;
+	nodes[position].Size = *count;
+}
+
+bool FSTIndex::Commit(DiscNode** fst, u32* size)
+{
+	u32 i;
+
+	if (Entries.empty() || *fst != Source)
+		return false;
+
+	// nothing moved, only the nodes that were patched need copying back
+	if (CreatedOrder.empty()) {
+		for (i = 0; i < Entries.size(); i++)
+			(*fst)[i] = Entries[i].Node;
+		return true;
+	}
+
+	// the old name table down to its last name, then the new names in the order they came
+	u32 used = SourceSize;
+	for (; used > 0 && !((const u8*)Source)[used - 1]; used--)
+		;
+	used++;
+	u32 nametablesize = used - sizeof(DiscNode) * Source->Size;
+	u32 namesize = nametablesize;
+	for (i = 0; i < CreatedOrder.size(); i++)
+		namesize += strlen(Entries[CreatedOrder[i]].Name) + 1;
+
+	u32 newsize = sizeof(DiscNode) * Entries.size() + namesize;
+	if (newsize > SourceSize)
+		newsize = ROUND_UP(newsize, 0x100);
+	else
+		newsize = SourceSize;
+
+	// without room for the new FST at least keep what was patched
+	DiscNode* nodes = (DiscNode*)memalign(32, newsize);
+	if (!nodes) {
+		for (i = 0; i < Source->Size; i++)
+			(*fst)[i] = Entries[i].Node;
+		return false;
+	}
+	memset(nodes, 0, newsize);
+
+	char* nametable = (char*)(nodes + Entries.size());
+	memcpy(nametable, Source + Source->Size, nametablesize);
+	for (i = 0; i < CreatedOrder.size(); i++) {
+		Entry* entry = &Entries[CreatedOrder[i]];
+		entry->Node.SetNameOffset(nametablesize);
+		strcpy(nametable + nametablesize, entry->Name);
+		nametablesize += strlen(entry->Name) + 1;
+	}
+
+	u32 count = 0;
+	Flatten(0, 0, nodes, &count);
+
+	free(*fst);
+	*fst = nodes;
+	*size = newsize;
+	Source = nodes;
+	SourceSize = newsize;
+	Entries.clear();
+	CreatedNames.clear();
+	CreatedOrder.clear();
+	return true;
+}
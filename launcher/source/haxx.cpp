@@ -9,6 +9,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <files.h>
+#include <aes.h>
 #include <malloc.h>
 #include <stdlib.h>
 #include <ogc/machine/processor.h>
@@ -47,10 +48,6 @@ extern "C" {
 
 	extern const u8 root_dat[];
 
-	extern void gkey(int nb,int nk,const u8 *key);
-	extern void gentables(void);
-	extern void aes_set_key(u8 *key);
-	extern void aes_decrypt(u8 *iv, const u8 *inbuf, u8 *outbuf, unsigned long long len);
 }
 
 otp_t otp;
@@ -1285,8 +1282,7 @@ static int load_module_code(void *module_code, s32 module_size)
 		for (i=0; i < 32; i++)
 			printf("%02X", iv[i]);
 		printf("\n");
-		gentables();
-		gkey(4, 8, iv);
+		aes_set_key256(iv);
 		aes_decrypt(iv+16, ((u8*)module_code)+16, dec+16, module_size-16);
 	} else
 		dec = (u8*)module_code;
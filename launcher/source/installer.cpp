@@ -17,12 +17,7 @@
 
 #include "haxx.h"
 #include <files.h>
-
-extern "C" {
-	void aes_set_key(const u8 *key);
-	void aes_decrypt(u8 *iv, const u8 *inbuf, u8 *outbuf, unsigned long long len);
-	void aes_encrypt(u8 *iv, const u8 *inbuf, u8 *outbuf, unsigned long long len);
-}
+#include <aes.h>
 
 //#define NANOHTTP
 #define PATCHMII_HTTP
@@ -3,6 +3,7 @@
 #include "wdvd.h"
 #include "riivolution.h"
 #include "fwrite.h"
+#include "patternscan.h"
 #include <files.h>
 
 #include <ogc/lwp_watchdog.h>
@@ -107,6 +108,14 @@ bool disk_subsequent_reset = false;
 static u32 fstdata[0x40] ATTRIBUTE_ALIGN(32);
 static void *app_address = NULL;
 
+// what ApplyBinaryPatches looks for, in the scanner it shares with the memory patches
+static struct {
+	int DIP;
+	int USBHID;
+	int SOStartup;
+	int NWC24iCleanupSocket;
+} BinaryPatterns;
+
 static union {
 	u32 partition_info[24];
 	app_info app;
@@ -432,28 +441,49 @@ static void PatchReturnToMenu(s32 app_section_size, u64 titleID)
 	}
 }
 
-static inline void ApplyBinaryPatches(s32 app_section_size)
+static void AddBinaryPatterns(PatternScanner* scanner)
+{
+	BinaryPatterns.DIP = scanner->Add("/dev/di", 7);
+	BinaryPatterns.USBHID = scanner->Add("/dev/usb/hid", 12);
+	BinaryPatterns.SOStartup = scanner->Add(SOStartupCode, sizeof(SOStartupCode));
+	BinaryPatterns.NWC24iCleanupSocket = scanner->Add(NWC24iCleanupSocketCode, sizeof(NWC24iCleanupSocketCode));
+
+	RVL_AddMemorySearches(&Disc, scanner);
+}
+
+static inline void ApplyBinaryPatches(PatternScanner* scanner, s32 app_section_size)
 {
 	void* found;
 
+	// one pass over the section finds everything below and the memory patches
+	scanner->Scan(app_address, app_section_size);
+
 	// DIP
-	while ((found = FindInBuffer(app_address, app_section_size, "/dev/di", 7)))
+	while ((found = scanner->Find(BinaryPatterns.DIP))) {
 		((u8*)found)[6] = 'o'; // "/dev/di" to "/dev/do"
+		scanner->Written((u8*)found + 6, 1);
+	}
 
 	// USB_HID
-	while ((found = FindInBuffer(app_address, app_section_size, "/dev/usb/hid", 12)))
+	while ((found = scanner->Find(BinaryPatterns.USBHID))) {
 		((u8*)found)[11] = '0'; // "/dev/usb/hid" to "/dev/usb/hi0"
+		scanner->Written((u8*)found + 11, 1);
+	}
 
 //	while ((found = FindInBuffer(app_address, app_section_size, "/dev/net/ssl", 12)))
 //		((u8*)found)[11] = '0'; // "/dev/net/ssl" to "/dev/net/ss0"
 
 	// prevent NWC from failing to init or shutting down our sockets
 	if (ToMount.size()) {
-		if ((found = FindInBuffer(app_address, app_section_size, SOStartupCode, sizeof(SOStartupCode))))
+		if ((found = scanner->Find(BinaryPatterns.SOStartup))) {
 			((u16*)found)[3] = 0;
+			scanner->Written((u16*)found + 3, sizeof(u16));
+		}
 
-		if ((found = FindInBuffer(app_address, app_section_size, NWC24iCleanupSocketCode, sizeof(NWC24iCleanupSocketCode))))
+		if ((found = scanner->Find(BinaryPatterns.NWC24iCleanupSocket))) {
 			((u32*)found)[3] = 0x4E800020;
+			scanner->Written((u32*)found + 3, sizeof(u32));
+		}
 	}
 
 	// Apply fwrite patch
@@ -465,7 +495,7 @@ static inline void ApplyBinaryPatches(s32 app_section_size)
 	//	PatchReturnToMenu(app_section_size, 0x000100014a4f4449llu); // "JODI"
 	//	PatchReturnToMenu(app_section_size, 0x0001000152494956llu); // "RIIV"
 
-	RVL_PatchMemory(&Disc, app_address, app_section_size);
+	RVL_PatchMemory(scanner);
 }
 
 LauncherStatus::Enum Launcher_SetVideoMode()
@@ -514,6 +544,7 @@ LauncherStatus::Enum Launcher_RunApploader()
 	AppExit app_exit = NULL;
 	s32 app_section_size = 0;
 	s32 app_disc_offset = 0;
+	PatternScanner scanner;
 
 	settime(secs_to_ticks(time(NULL) - 946684800));
 
@@ -540,15 +571,19 @@ LauncherStatus::Enum Launcher_RunApploader()
 	app.start(&app_enter, &app_loader, &app_exit);
 	app_enter((AppReport)nullprintf);
 
+	AddBinaryPatterns(&scanner);
 	while (app_loader(&app_address, &app_section_size, &app_disc_offset)) {
-		if (WDVD_LowRead(app_address, app_section_size, (u64)app_disc_offset << 2))
+		if (WDVD_LowRead(app_address, app_section_size, (u64)app_disc_offset << 2)) {
+			RVL_ClearMemorySearches();
 			return LauncherStatus::ReadError;
-		ApplyBinaryPatches(app_section_size);
+		}
+		ApplyBinaryPatches(&scanner, app_section_size);
 		DCFlushRange(app_address, app_section_size);
 		app_address = NULL;
 		app_section_size = 0;
 		app_disc_offset = 0;
 	}
+	RVL_ClearMemorySearches();
 
 	// Fwrite patch needs to be fixed for SMG+SMG2
 // fwrite patch causes crashes if fwrite is used in a callback (RB1->USB device found)
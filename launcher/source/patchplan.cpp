@@ -0,0 +1,300 @@
+#include "patchplan.h"
+
+#include <string.h>
+#include <malloc.h>
+#include <sys/param.h>
+
+using std::vector;
+
+#define PLAN_MAGIC		0x52504C4E // "RPLN"
+#define PLAN_VERSION	1
+
+namespace Dependency { enum Enum {
+	File = 0,
+	Directory
+}; }
+
+struct DependencyHeader {
+	u32 Type;
+	u32 PathLength; // with the terminator, padded to 4 after it
+	u8 Digest[20];
+};
+
+struct OperationHeader {
+	u32 Ioctl;
+	s32 Result;
+	u32 Vectored;
+	u32 Inputs;
+	u32 Count;
+	u32 Lengths[3];
+};
+
+#define PLAN_VECTORS 3
+
+static void Append(vector<u8>* data, const void* source, u32 length, u32 align)
+{
+	data->insert(data->end(), (const u8*)source, (const u8*)source + length);
+	data->resize(ROUND_UP(data->size(), align), 0);
+}
+
+PatchPlan::PatchPlan()
+{
+	SHA1Init(&KeyContext);
+	memset(Key, 0, sizeof(Key));
+	DependencyCount = 0;
+	OperationCount = 0;
+	Data = NULL;
+}
+
+PatchPlan::~PatchPlan()
+{
+	free(Data);
+}
+
+void PatchPlan::AddKey(const void* data, u32 length)
+{
+	SHA1Update(&KeyContext, (u8*)data, length);
+}
+
+void PatchPlan::FinishKey()
+{
+	u32 version = PLAN_VERSION;
+	AddKey(&version, sizeof(version));
+	SHA1Final(Key, &KeyContext);
+}
+
+void PatchPlan::DigestEntry(SHA1_CTX* context, const char* name, const Stats* st)
+{
+	SHA1Update(context, (u8*)name, strlen(name) + 1);
+	SHA1Update(context, (u8*)st, sizeof(Stats));
+}
+
+void PatchPlan::AddDependency(u32 type, const char* path, const u8* digest)
+{
+	DependencyHeader header;
+	header.Type = type;
+	header.PathLength = strlen(path) + 1;
+	memcpy(header.Digest, digest, sizeof(header.Digest));
+	Append(&DependencyData, &header, sizeof(header), 1);
+	Append(&DependencyData, path, header.PathLength, 4);
+	DependencyCount++;
+}
+
+void PatchPlan::AddFile(const char* path, int result, const Stats* st)
+{
+	SHA1_CTX context;
+	u8 digest[20];
+
+	SHA1Init(&context);
+	SHA1Update(&context, (u8*)&result, sizeof(result));
+	if (!result)
+		DigestEntry(&context, "", st);
+	SHA1Final(digest, &context);
+	AddDependency(Dependency::File, path, digest);
+}
+
+// context has had DigestEntry() for everything the directory listed
+void PatchPlan::AddDirectory(const char* path, int result, SHA1_CTX* context)
+{
+	u8 digest[20];
+
+	SHA1Update(context, (u8*)&result, sizeof(result));
+	SHA1Final(digest, context);
+	AddDependency(Dependency::Directory, path, digest);
+}
+
+void PatchPlan::AddOperation(u32 ioctl, s32 result, bool vectored, u32 inputs, u32 count, const ioctlv* vectors)
+{
+	OperationHeader header;
+	u32 i;
+
+	memset(&header, 0, sizeof(header));
+	header.Ioctl = ioctl;
+	header.Result = result;
+	header.Vectored = vectored;
+	header.Inputs = inputs;
+	header.Count = MIN(count, PLAN_VECTORS);
+	for (i = 0; i < header.Count; i++)
+		header.Lengths[i] = vectors[i].len;
+
+	// the data is kept aligned for IOS
+	Append(&OperationData, &header, sizeof(header), 32);
+	for (i = 0; i < header.Count; i++)
+		Append(&OperationData, vectors[i].data, vectors[i].len, 32);
+	OperationCount++;
+}
+
+void PatchPlan::AddIoctl(u32 ioctl, s32 result, const void* in, u32 inlength, const void* out, u32 outlength)
+{
+	ioctlv vectors[2];
+	vectors[0].data = (void*)in;
+	vectors[0].len = inlength;
+	vectors[1].data = (void*)out;
+	vectors[1].len = outlength;
+	AddOperation(ioctl, result, false, 1, 2, vectors);
+}
+
+void PatchPlan::AddIoctlv(u32 ioctl, s32 result, u32 inputs, u32 outputs, const ioctlv* vectors)
+{
+	AddOperation(ioctl, result, true, inputs, inputs + outputs, vectors);
+}
+
+bool PatchPlan::Save(const char* path, const void* fst, u32 fstsize, u64 shift, u32 files)
+{
+	Header header;
+	memset(&header, 0, sizeof(header));
+	header.Magic = PLAN_MAGIC;
+	header.Version = PLAN_VERSION;
+	memcpy(header.Key, Key, sizeof(Key));
+	header.Files = files;
+	header.Shift = shift;
+	header.FSTSize = fstsize;
+	header.Dependencies = DependencyCount;
+	header.Operations = OperationCount;
+	header.Length = ROUND_UP(fstsize, 32) + ROUND_UP(DependencyData.size(), 32) + OperationData.size();
+
+	File_CreateFile(path);
+	int fd = File_Open(path, O_WRONLY | O_TRUNC);
+	if (fd < 0)
+		return false;
+
+	static const u8 padding[32] = { 0 };
+	bool written = File_Write(fd, &header, sizeof(header)) == sizeof(header) &&
+		File_Write(fd, fst, fstsize) == (int)fstsize &&
+		File_Write(fd, padding, ROUND_UP(fstsize, 32) - fstsize) == (int)(ROUND_UP(fstsize, 32) - fstsize);
+	if (written && DependencyData.size()) {
+		written = File_Write(fd, &DependencyData[0], DependencyData.size()) == (int)DependencyData.size() &&
+			File_Write(fd, padding, ROUND_UP(DependencyData.size(), 32) - DependencyData.size()) == (int)(ROUND_UP(DependencyData.size(), 32) - DependencyData.size());
+	}
+	if (written && OperationData.size())
+		written = File_Write(fd, &OperationData[0], OperationData.size()) == (int)OperationData.size();
+	File_Close(fd);
+
+	// a plan that didn't make it out whole mustn't be found next time
+	if (!written)
+		File_Delete(path);
+
+	return written;
+}
+
+bool PatchPlan::CheckDependencies(const u8* data, u32 length, u32 count, u32* used)
+{
+	u32 pos = 0;
+
+	for (u32 i = 0; i < count; i++) {
+		if (pos + sizeof(DependencyHeader) > length)
+			return false;
+		const DependencyHeader* header = (const DependencyHeader*)(data + pos);
+		const char* path = (const char*)(header + 1);
+		pos += sizeof(DependencyHeader) + ROUND_UP(header->PathLength, 4);
+		if (!header->PathLength || pos > length || path[header->PathLength - 1])
+			return false;
+
+		SHA1_CTX context;
+		u8 digest[20];
+		Stats st;
+		int result;
+
+		SHA1Init(&context);
+		if (header->Type == Dependency::File) {
+			result = File_Stat(path, &st);
+			SHA1Update(&context, (u8*)&result, sizeof(result));
+			if (!result)
+				DigestEntry(&context, "", &st);
+		} else if (header->Type == Dependency::Directory) {
+			char name[MAXPATHLEN];
+			int dir = File_OpenDir(path);
+			result = dir < 0 ? dir : 0;
+			if (dir >= 0) {
+				while (!File_NextDir(dir, name, &st))
+					DigestEntry(&context, name, &st);
+				File_CloseDir(dir);
+			}
+			SHA1Update(&context, (u8*)&result, sizeof(result));
+		} else
+			return false;
+		SHA1Final(digest, &context);
+
+		if (memcmp(digest, header->Digest, sizeof(digest)))
+			return false;
+	}
+
+	*used = ROUND_UP(pos, 32);
+	return true;
+}
+
+bool PatchPlan::Load(const char* path)
+{
+	Stats st;
+	free(Data);
+	Data = NULL;
+	Operations.clear();
+
+	if (File_Stat(path, &st) || st.Size < sizeof(Header))
+		return false;
+
+	int fd = File_Open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	Data = (u8*)memalign(32, ROUND_UP(st.Size, 32));
+	if (!Data) {
+		File_Close(fd);
+		return false;
+	}
+	int read = File_Read(fd, Data, st.Size);
+	File_Close(fd);
+
+	const Header* header = (const Header*)Data;
+	if (read != (int)st.Size || header->Magic != PLAN_MAGIC || header->Version != PLAN_VERSION ||
+		memcmp(header->Key, Key, sizeof(Key)) || header->Length != st.Size - sizeof(Header))
+		return false;
+
+	u8* data = Data + sizeof(Header);
+	u32 length = header->Length;
+	u32 pos = ROUND_UP(header->FSTSize, 32);
+	u32 used;
+	if (pos > length || !CheckDependencies(data + pos, length - pos, header->Dependencies, &used))
+		return false;
+	pos += used;
+
+	for (u32 i = 0; i < header->Operations; i++) {
+		if (pos + sizeof(OperationHeader) > length)
+			return false;
+		const OperationHeader* opheader = (const OperationHeader*)(data + pos);
+		pos += ROUND_UP(sizeof(OperationHeader), 32);
+		if (opheader->Count > PLAN_VECTORS)
+			return false;
+
+		Operation operation;
+		operation.Ioctl = opheader->Ioctl;
+		operation.Result = opheader->Result;
+		operation.Vectored = opheader->Vectored;
+		operation.Inputs = opheader->Inputs;
+		operation.Count = opheader->Count;
+		for (u32 j = 0; j < opheader->Count; j++) {
+			operation.Vectors[j].data = opheader->Lengths[j] ? data + pos : NULL;
+			operation.Vectors[j].len = opheader->Lengths[j];
+			pos += ROUND_UP(opheader->Lengths[j], 32);
+		}
+		if (pos > length)
+			return false;
+		Operations.push_back(operation);
+	}
+
+	return true;
+}
+
+const void* PatchPlan::GetFST()
+{
+	return Data + sizeof(Header);
+}
+
+u32 PatchPlan::GetFSTSize()
+{
+	return ((const Header*)Data)->FSTSize;
+}
+
+u64 PatchPlan::GetShift()
+{
+	return ((const Header*)Data)->Shift;
+}
@@ -0,0 +1,239 @@
+#include "patternscan.h"
+
+#include <string.h>
+
+using std::vector;
+
+#define SCAN_PREFIX_MAX	16			// longest prefix put in the automaton, the rest is compared
+#define SCAN_TABLE_MAX	0x80000		// table entries (1MB), prefixes get shorter to fit
+#define SCAN_STATES_MAX	0x7FFF
+#define SCAN_REPORT		0x8000
+#define SCAN_MATCHES	8			// matches kept per pattern, past that Find() searches on
+#define NO_MATCH		0xFFFFFFFF
+
+PatternScanner::PatternScanner()
+{
+	ClassCount = 0;
+	Compiled = false;
+	Failed = false;
+	Buffer = NULL;
+	Length = 0;
+}
+
+int PatternScanner::Add(const void* data, u32 length, u32 align)
+{
+	if (!data || !length || !align)
+		return -1;
+
+	Pattern pattern;
+	pattern.Data = (const u8*)data;
+	pattern.Length = length;
+	pattern.Align = align;
+	pattern.Prefix = 0;
+	pattern.Next = -1;
+	pattern.More = false;
+	Patterns.push_back(pattern);
+
+	Compiled = false;
+	Failed = false;
+	return Patterns.size() - 1;
+}
+
+bool PatternScanner::Build(u32 prefix)
+{
+	u32 states = 1;
+	u32 count = 1;
+	u32 i, j;
+
+	// only the byte values some prefix uses get a column
+	memset(Classes, 0, sizeof(Classes));
+	ClassCount = 1;
+	for (i = 0; i < Patterns.size(); i++) {
+		Pattern* pattern = &Patterns[i];
+		pattern->Prefix = pattern->Length < prefix ? pattern->Length : prefix;
+		for (j = 0; j < pattern->Prefix; j++) {
+			if (!Classes[pattern->Data[j]])
+				Classes[pattern->Data[j]] = ClassCount++;
+		}
+		states += pattern->Prefix;
+	}
+	if (states > SCAN_STATES_MAX || states * ClassCount > SCAN_TABLE_MAX)
+		return false;
+
+	// the trie, 0 is the root and can't be anyone's child
+	Table.assign(states * ClassCount, 0);
+	Own.assign(states, -1);
+	Dict.assign(states, 0);
+	for (i = 0; i < Patterns.size(); i++) {
+		Pattern* pattern = &Patterns[i];
+		u32 state = 0;
+		for (j = 0; j < pattern->Prefix; j++) {
+			u16* next = &Table[state * ClassCount + Classes[pattern->Data[j]]];
+			if (!*next)
+				*next = count++;
+			state = *next;
+		}
+		pattern->Next = Own[state];
+		Own[state] = i;
+	}
+
+	// breadth first, so a state's failure (always shallower) is done before it
+	vector<u16> fail(count, 0);
+	vector<u16> queue;
+	queue.reserve(count);
+	for (i = 0; i < ClassCount; i++) {
+		if (Table[i])
+			queue.push_back(Table[i]);
+	}
+	for (i = 0; i < queue.size(); i++) {
+		u32 state = queue[i];
+		u16* row = &Table[state * ClassCount];
+		const u16* failRow = &Table[fail[state] * ClassCount];
+		Dict[state] = Own[fail[state]] >= 0 ? fail[state] : Dict[fail[state]];
+		for (j = 0; j < ClassCount; j++) {
+			if (row[j]) {
+				fail[row[j]] = failRow[j];
+				queue.push_back(row[j]);
+			} else
+				row[j] = failRow[j];
+		}
+	}
+
+	for (i = 0; i < Table.size(); i++) {
+		if (Own[Table[i]] >= 0 || Dict[Table[i]])
+			Table[i] |= SCAN_REPORT;
+	}
+
+	return true;
+}
+
+bool PatternScanner::Compile()
+{
+	for (u32 prefix = SCAN_PREFIX_MAX; prefix; prefix >>= 1) {
+		if (Build(prefix))
+			return true;
+	}
+
+	Table.clear();
+	Own.clear();
+	Dict.clear();
+	return false;
+}
+
+bool PatternScanner::Matches(const Pattern* pattern, u32 pos)
+{
+	return pos + pattern->Length <= Length && !memcmp(Buffer + pos, pattern->Data, pattern->Length);
+}
+
+u32 PatternScanner::Search(const Pattern* pattern, u32 start, u32 end)
+{
+	u32 misaligned = start % pattern->Align;
+	if (misaligned)
+		start += pattern->Align - misaligned;
+
+	for (; start < end; start += pattern->Align) {
+		if (Buffer[start] == pattern->Data[0] && Matches(pattern, start))
+			return start;
+	}
+
+	return NO_MATCH;
+}
+
+void PatternScanner::Report(u32 state, u32 end)
+{
+	for (u32 s = Own[state] >= 0 ? state : Dict[state]; s; s = Dict[s]) {
+		for (int i = Own[s]; i >= 0; i = Patterns[i].Next) {
+			Pattern* pattern = &Patterns[i];
+			u32 pos = end - pattern->Prefix;
+			if (pattern->More || pos % pattern->Align || !Matches(pattern, pos))
+				continue;
+			if (pattern->Matches.size() < SCAN_MATCHES)
+				pattern->Matches.push_back(pos);
+			else
+				pattern->More = true;
+		}
+	}
+}
+
+void PatternScanner::Scan(void* buffer, u32 length)
+{
+	Buffer = (u8*)buffer;
+	Length = length;
+	Writes.clear();
+	for (vector<Pattern>::iterator pattern = Patterns.begin(); pattern != Patterns.end(); pattern++) {
+		pattern->Matches.clear();
+		pattern->More = false;
+	}
+
+	if (!Compiled && !Failed) {
+		Compiled = Compile();
+		Failed = !Compiled;
+	}
+	if (!Compiled || Patterns.empty())
+		return;
+
+	const u16* table = &Table[0];
+	const u16* classes = Classes;
+	u32 classCount = ClassCount;
+	u32 state = 0;
+	for (u32 i = 0; i < length; i++) {
+		u32 next = table[state * classCount + classes[Buffer[i]]];
+		state = next & ~SCAN_REPORT;
+		if (next & SCAN_REPORT)
+			Report(state, i + 1);
+	}
+}
+
+void* PatternScanner::Find(int index)
+{
+	if (index < 0 || (u32)index >= Patterns.size() || !Buffer)
+		return NULL;
+
+	const Pattern* pattern = &Patterns[index];
+	u32 found = NO_MATCH;
+	u32 i;
+
+	// too many patterns to build the automaton, search like there isn't one
+	if (!Compiled) {
+		found = Search(pattern, 0, Length);
+		return found == NO_MATCH ? NULL : Buffer + found;
+	}
+
+	// the first match from the scan that hasn't been written over since
+	for (i = 0; i < pattern->Matches.size() && found == NO_MATCH; i++) {
+		u32 pos = pattern->Matches[i];
+		vector<Range>::const_iterator write;
+		for (write = Writes.begin(); write != Writes.end(); write++) {
+			if (write->Start < pos + pattern->Length && pos < write->End)
+				break;
+		}
+		if (write == Writes.end())
+			found = pos;
+	}
+	if (found == NO_MATCH && pattern->More)
+		found = Search(pattern, pattern->Matches.back() + 1, Length);
+
+	// anything new has to overlap a write
+	for (vector<Range>::const_iterator write = Writes.begin(); write != Writes.end(); write++) {
+		u32 start = write->Start + 1 > pattern->Length ? write->Start + 1 - pattern->Length : 0;
+		u32 end = write->End < found ? write->End : found;
+		if (start < end) {
+			u32 pos = Search(pattern, start, end);
+			if (pos < found)
+				found = pos;
+		}
+	}
+
+	return found == NO_MATCH ? NULL : Buffer + found;
+}
+
+void PatternScanner::Written(const void* address, u32 length)
+{
+	if ((const u8*)address < Buffer || (const u8*)address >= Buffer + Length || !length)
+		return;
+
+	Range write;
+	write.Start = (const u8*)address - Buffer;
+	write.End = write.Start + length < Length ? write.Start + length : Length;
+	Writes.push_back(write);
+}
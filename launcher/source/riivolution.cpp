@@ -2,6 +2,9 @@
 #include "riivolution.h"
 #include "riivolution_config.h"
 #include "launcher.h"
+#include "patternscan.h"
+#include "fstindex.h"
+#include "patchplan.h"
 
 #include <sys/param.h>
 #include <unistd.h>
@@ -21,6 +24,9 @@ static DiscNode* fst = NULL;
 static bool shiftfiles = false;
 static u64 shift = 0;
 static u32 fstsize;
+static int addedfiles = 0;
+static FSTIndex* fstindex = NULL; // only while a disc's patches are applied
+static PatchPlan* plan = NULL; // records what the disc's patches send to the module
 map<int, bool> UsedFilesystems;
 
 namespace Ioctl { enum Enum {
@@ -33,11 +39,22 @@ namespace Ioctl { enum Enum {
 	SetFileProvider	= 0xC7,
 	SetShiftBase	= 0xC8,
 	BanTitle		= 0xC9,
-	DLC				= 0xCA
+	DLC				= 0xCA,
+	SetFileHandles	= 0xCB
 }; }
 
 static u32 ioctlbuffer[0x08] ATTRIBUTE_ALIGN(32);
 
+#define PLAN_PATH (RIIVOLUTION_PATH "/temp")
+
+static int RVL_Ioctl(Ioctl::Enum ioctl, void* in, u32 inlength, void* out, u32 outlength)
+{
+	int ret = IOS_Ioctl(fd, ioctl, in, inlength, out, outlength);
+	if (plan)
+		plan->AddIoctl(ioctl, ret, in, inlength, out, outlength);
+	return ret;
+}
+
 DiscNode* DiscNode::GetParent()
 {
 	u32 offset = this - fst;
@@ -132,14 +149,26 @@ int RVL_Allocate(PatchType::Enum type, int num)
 	return IOS_Ioctl(fd, Ioctl::Allocate, ioctlbuffer, 8, NULL, 0);
 }
 
+int RVL_SetFileHandles(int num)
+{
+	ioctlbuffer[0] = num;
+	return IOS_Ioctl(fd, Ioctl::SetFileHandles, ioctlbuffer, 4, NULL, 0);
+}
+
 int RVL_AddFile(const char* filename)
 {
-	return IOS_Ioctl(fd, Ioctl::AddFile, (void*)filename, strlen(filename) + 1, NULL, 0);
+	int ret = RVL_Ioctl(Ioctl::AddFile, (void*)filename, strlen(filename) + 1, NULL, 0);
+	if (ret >= 0)
+		addedfiles++;
+	return ret;
 }
 
 int RVL_AddFile(const char* filename, u64 identifier)
 {
-	return IOS_Ioctl(fd, Ioctl::AddFile, (void*)filename, strlen(filename) + 1, &identifier, 8);
+	int ret = RVL_Ioctl(Ioctl::AddFile, (void*)filename, strlen(filename) + 1, &identifier, 8);
+	if (ret >= 0)
+		addedfiles++;
+	return ret;
 }
 
 int RVL_AddShift(u64 original, u64 offset, u32 length)
@@ -149,7 +178,7 @@ int RVL_AddShift(u64 original, u64 offset, u32 length)
 	ioctlbuffer[2] = original;
 	ioctlbuffer[3] = offset >> 32;
 	ioctlbuffer[4] = offset;
-	return IOS_Ioctl(fd, Ioctl::AddShift, ioctlbuffer, 0x20, NULL, 0);
+	return RVL_Ioctl(Ioctl::AddShift, ioctlbuffer, 0x20, NULL, 0);
 }
 
 int RVL_AddPatch(int file, u64 offset, u32 fileoffset, u32 length)
@@ -159,7 +188,7 @@ int RVL_AddPatch(int file, u64 offset, u32 fileoffset, u32 length)
 	ioctlbuffer[2] = offset >> 32;
 	ioctlbuffer[3] = offset;
 	ioctlbuffer[4] = length;
-	return IOS_Ioctl(fd, Ioctl::AddPatch, ioctlbuffer, 0x20, NULL, 0);
+	return RVL_Ioctl(Ioctl::AddPatch, ioctlbuffer, 0x20, NULL, 0);
 }
 
 int RVL_AddEmu(const char* nandpath, const char* external, int clone)
@@ -171,7 +200,10 @@ int RVL_AddEmu(const char* nandpath, const char* external, int clone)
 	vec[1].len = strlen(external)+1;
 	vec[2].data = &clone;
 	vec[2].len = sizeof(int);
-	return IOS_Ioctlv(fd, Ioctl::AddEmu, 3, 0, vec);
+	int ret = IOS_Ioctlv(fd, Ioctl::AddEmu, 3, 0, vec);
+	if (plan)
+		plan->AddIoctlv(Ioctl::AddEmu, ret, 3, 0, vec);
+	return ret;
 }
 
 int RVL_BanDLC(u32 title)
@@ -186,7 +218,7 @@ int RVL_BanDLC(u32 title)
 
 int RVL_DLC(const char* path)
 {
-	return IOS_Ioctl(fd, Ioctl::DLC, (void*)path, strlen(path) + 1, NULL, 0);
+	return RVL_Ioctl(Ioctl::DLC, (void*)path, strlen(path) + 1, NULL, 0);
 }
 
 u64 RVL_GetShiftOffset(u32 length)
@@ -235,9 +267,14 @@ DiscNode* RVL_FindNode(const char* fstname)
 			return &maindol;
 		}
 
+		if (fstindex)
+			return fstindex->FindName(fstname);
 		return RVL_FindNode(fst, fstname, true);
 	}
 
+	if (fstindex)
+		return fstindex->Find(fstname);
+
 	char namebuffer[MAXPATHLEN];
 	char* name = namebuffer;
 	strcpy(name, fstname + 1);
@@ -365,19 +402,28 @@ static DiscNode* RVL_CreateNode(string path, u32 length)
 	char* name = namebuffer;
 	strcpy(name, path.c_str() + 1);
 
-	DiscNode* root = fst;
+	DiscNode* root = fstindex ? fstindex->GetRoot() : fst;
 	while (root) {
 		char* slash = strchr(name, '/');
 		if (!slash) {
-			if (strlen(name))
+			if (!strlen(name))
+				break;
+			if (!fstindex)
 				return RVL_CreateFileNode(root, name, length);
-			break;
+			DiscNode* node = fstindex->Add(root, name, false);
+			if (!node)
+				return NULL;
+			node->Size = length;
+			node->DataOffset = RVL_GetShiftOffset(length) >> 2;
+			return node;
 		}
 
 		*slash = '\0';
-		DiscNode* newroot = RVL_FindNode(root, name);
+		DiscNode* newroot = fstindex ? fstindex->FindChild(root, name) : RVL_FindNode(root, name);
 		if (newroot)
 			root = newroot;
+		else if (fstindex)
+			root = fstindex->Add(root, name, true);
 		else
 			root = RVL_CreateDirectoryNode(root, name);
 		name = slash + 1;
@@ -419,7 +465,10 @@ static void RVL_Patch(RiiFilePatch* file, string commonfs, bool stat=false, u64
 
 	if (!stat && file->Length == 0) {
 		Stats st;
-		if (!File_Stat(external.c_str(), &st) && !(st.Mode & S_IFDIR)) {
+		int ret = File_Stat(external.c_str(), &st);
+		if (plan)
+			plan->AddFile(external.c_str(), ret, &st);
+		if (!ret && !(st.Mode & S_IFDIR)) {
 			file->Length = st.Size - file->FileOffset;
 			stat = true;
 			externalid = st.Identifier;
@@ -458,11 +507,17 @@ static void RVL_Patch(RiiFolderPatch* folder, string commonfs)
 		external = external.substr(commonfs.size());
 
 	char fdirname[MAXPATHLEN];
+	SHA1_CTX listing;
+	SHA1Init(&listing);
 	int fdir = File_OpenDir(external.c_str());
-	if (fdir < 0)
+	if (fdir < 0) {
+		if (plan)
+			plan->AddDirectory(external.c_str(), fdir, &listing);
 		return;
+	}
 	Stats stats;
 	while (!File_NextDir(fdir, fdirname, &stats)) {
+		PatchPlan::DigestEntry(&listing, fdirname, &stats);
 		if (fdirname[0] == '.')
 			continue;
 		if (stats.Mode & S_IFDIR) {
@@ -485,6 +540,10 @@ static void RVL_Patch(RiiFolderPatch* folder, string commonfs)
 		}
 	}
 	File_CloseDir(fdir);
+
+	// adding, removing or replacing anything in here means patching again
+	if (plan)
+		plan->AddDirectory(external.c_str(), 0, &listing);
 }
 
 static void RVL_Patch(RiiSavegamePatch* save, string commonfs)
@@ -507,57 +566,229 @@ static void RVL_Patch(RiiDLCPatch* DLC, string commonfs)
 	RVL_DLC(external.c_str());
 }
 
-static void ApplyParams(std::string* str, map<string, string>* params)
+// The params a patch sees, looked up through its option, choice and patch reference without copying them
+struct ParamFrames
 {
-	bool found = false;
-	string::size_type pos;
-	while ((pos = str->find("{$")) != string::npos) {
-		string::size_type pend = str->find("}", pos);
-		string paramname = str->substr(pos + 2, pend - pos - 2);
-		map<string, string>::iterator param = params->find(paramname);
-		if (param == params->end())
-			paramname = "";
-		else
-			paramname = param->second;
-		*str = str->substr(0, pos) + paramname + str->substr(pend + 1);
-		found = true;
+	const map<string, string>* Frames[4];
+	u32 Count;
+
+	const string* Find(const string& name) const
+	{
+		// the first frame with it wins, like inserting them into one map in this order did
+		for (u32 i = 0; i < Count; i++) {
+			map<string, string>::const_iterator param = Frames[i]->find(name);
+			if (param != Frames[i]->end())
+				return &param->second;
+		}
+		return NULL;
 	}
+};
+
+// how deep params that refer to other params are expanded, so a cycle can't recurse forever
+#define PARAM_DEPTH 8
+
+static string ApplyParams(const string& str, const ParamFrames* params, int depth = 0)
+{
+	string::size_type pos = str.find("{$");
+	if (pos == string::npos)
+		return str;
+
+	string ret;
+	string::size_type last = 0;
+	for (; pos != string::npos; pos = str.find("{$", last)) {
+		string::size_type pend = str.find("}", pos);
+		if (pend == string::npos)
+			break;
+		ret.append(str, last, pos - last);
+		const string* param = params->Find(str.substr(pos + 2, pend - pos - 2));
+		if (param)
+			ret += depth < PARAM_DEPTH ? ApplyParams(*param, params, depth + 1) : *param;
+		last = pend + 1;
+	}
+	ret.append(str, last, string::npos);
+	return ret;
 }
 
-static void RVL_Patch(RiiPatch* patch, map<string, string>* params, string commonfs)
+// An enabled choice's patch with its params applied, worked out once for the disc
+struct ResolvedPatch
 {
-	for (vector<RiiFilePatch>::iterator file = patch->Files.begin(); file != patch->Files.end(); file++) {
-		RiiFilePatch temp = *file;
-		ApplyParams(&temp.External, params);
-		ApplyParams(&temp.Disc, params);
-		RVL_Patch(&temp, commonfs);
+	RiiPatch* Patch;
+	RiiChoice* Choice;
+	vector<RiiFilePatch> Files;
+	vector<RiiFolderPatch> Folders;
+	RiiSavegamePatch Savegame;
+	RiiDLCPatch DLC;
+	vector<string> ValueFiles; // one for each of Patch->Memory
+};
+
+static vector<ResolvedPatch> ResolvedPatches;
+static RiiDisc* ResolvedDisc = NULL;
+
+static void RVL_ResolvePatch(ResolvedPatch* resolved, const ParamFrames* params)
+{
+	RiiPatch* patch = resolved->Patch;
+
+	resolved->Files = patch->Files;
+	for (vector<RiiFilePatch>::iterator file = resolved->Files.begin(); file != resolved->Files.end(); file++) {
+		file->External = ApplyParams(file->External, params);
+		file->Disc = ApplyParams(file->Disc, params);
 	}
-	for (vector<RiiFolderPatch>::iterator folder = patch->Folders.begin(); folder != patch->Folders.end(); folder++) {
-		RiiFolderPatch temp = *folder;
-		ApplyParams(&temp.External, params);
-		ApplyParams(&temp.Disc, params);
-		RVL_Patch(&temp, commonfs);
+	resolved->Folders = patch->Folders;
+	for (vector<RiiFolderPatch>::iterator folder = resolved->Folders.begin(); folder != resolved->Folders.end(); folder++) {
+		folder->External = ApplyParams(folder->External, params);
+		folder->Disc = ApplyParams(folder->Disc, params);
 	}
-	for (vector<RiiShiftPatch>::iterator shift = patch->Shifts.begin(); shift != patch->Shifts.end(); shift++) {
-		RVL_Patch(&*shift);
+	resolved->Savegame = patch->Savegame;
+	resolved->Savegame.External = ApplyParams(patch->Savegame.External, params);
+	resolved->DLC.External = ApplyParams(patch->DLC.External, params);
+	for (vector<RiiMemoryPatch>::iterator memory = patch->Memory.begin(); memory != patch->Memory.end(); memory++)
+		resolved->ValueFiles.push_back(ApplyParams(memory->ValueFile, params));
+}
+
+// Flattens the enabled choices into the patches they use, in the order they're applied
+static void RVL_ResolvePatches(RiiDisc* disc)
+{
+	if (ResolvedDisc == disc)
+		return;
+
+	ResolvedPatches.clear();
+	ResolvedDisc = disc;
+
+	map<string, string> defaults;
+	char sng_id[9];
+	sprintf(sng_id, "%08X", otp.ng_id);
+	defaults["__ngid"] = string(sng_id);
+	defaults["__gameid"] = string((char*)MEM_BASE, 3);
+	defaults["__region"] = string((char*)MEM_BASE + 3, 1);
+	defaults["__maker"] = string((char*)MEM_BASE + 4, 2);
+
+	for (vector<RiiSection>::iterator section = disc->Sections.begin(); section != disc->Sections.end(); section++) {
+		for (vector<RiiOption>::iterator option = section->Options.begin(); option != section->Options.end(); option++) {
+			if (option->Default == 0)
+				continue;
+			RiiChoice* choice = &option->Choices[option->Default - 1];
+
+			ParamFrames params;
+			params.Frames[0] = &defaults;
+			params.Frames[1] = &option->Params;
+			params.Frames[2] = &choice->Params;
+			params.Count = 3;
+
+			for (vector<RiiChoice::Patch>::iterator patch = choice->Patches.begin(); patch != choice->Patches.end(); patch++) {
+				map<string, RiiPatch>::iterator currentpatch = disc->Patches.find(patch->ID);
+				if (currentpatch == disc->Patches.end())
+					continue;
+
+				// the reference's own params only last for this patch
+				params.Frames[3] = &patch->Params;
+				params.Count = 4;
+
+				ResolvedPatches.push_back(ResolvedPatch());
+				ResolvedPatch* resolved = &ResolvedPatches.back();
+				resolved->Patch = &currentpatch->second;
+				resolved->Choice = choice;
+				RVL_ResolvePatch(resolved, &params);
+
+				params.Count = 3;
+			}
+		}
 	}
-	if (patch->Savegame.External.size()) {
-		ApplyParams(&patch->Savegame.External, params);
+}
+
+static void RVL_Patch(ResolvedPatch* patch, const string& commonfs)
+{
+	for (vector<RiiFilePatch>::iterator file = patch->Files.begin(); file != patch->Files.end(); file++)
+		RVL_Patch(&*file, commonfs);
+	for (vector<RiiFolderPatch>::iterator folder = patch->Folders.begin(); folder != patch->Folders.end(); folder++)
+		RVL_Patch(&*folder, commonfs);
+	for (vector<RiiShiftPatch>::iterator shift = patch->Patch->Shifts.begin(); shift != patch->Patch->Shifts.end(); shift++)
+		RVL_Patch(&*shift);
+	if (patch->Savegame.External.size())
 		RVL_Patch(&patch->Savegame, commonfs);
-	}
-	if (patch->DLC.External.size()) {
-		ApplyParams(&patch->DLC.External, params);
+	if (patch->DLC.External.size())
 		RVL_Patch(&patch->DLC, commonfs);
+}
+
+// everything RVL_Patch(ResolvedPatch*) goes by
+static void RVL_AddPlanKey(ResolvedPatch* patch, PatchPlan* plan)
+{
+	plan->AddKey(patch->Files.size());
+	for (vector<RiiFilePatch>::iterator file = patch->Files.begin(); file != patch->Files.end(); file++) {
+		plan->AddKey(file->External);
+		plan->AddKey(file->Disc);
+		plan->AddKey(file->Resize | file->Create << 1);
+		plan->AddKey(file->Offset);
+		plan->AddKey(file->FileOffset);
+		plan->AddKey(file->Length);
+	}
+	plan->AddKey(patch->Folders.size());
+	for (vector<RiiFolderPatch>::iterator folder = patch->Folders.begin(); folder != patch->Folders.end(); folder++) {
+		plan->AddKey(folder->External);
+		plan->AddKey(folder->Disc);
+		plan->AddKey(folder->Resize | folder->Create << 1 | folder->Recursive << 2);
+		plan->AddKey(folder->Length);
+	}
+	plan->AddKey(patch->Patch->Shifts.size());
+	for (vector<RiiShiftPatch>::iterator shift = patch->Patch->Shifts.begin(); shift != patch->Patch->Shifts.end(); shift++) {
+		plan->AddKey(shift->Source);
+		plan->AddKey(shift->Destination);
 	}
+	plan->AddKey(patch->Savegame.External);
+	plan->AddKey(patch->Savegame.Clone);
+	plan->AddKey(patch->DLC.External);
 }
 
-#define ADD_DEFAULT_PARAMS(params) { \
-	char sng_id[9]; \
-	sprintf(sng_id, "%08X", otp.ng_id); \
-	params["__ngid"] = string(sng_id); \
-	params["__gameid"] = string((char*)MEM_BASE, 3); \
-	params["__region"] = string((char*)MEM_BASE + 3, 1); \
-	params["__maker"] = string((char*)MEM_BASE + 4, 2); \
+// Sends what a saved plan recorded to the module and takes its FST, if the plan is still good
+static bool RVL_ReplayPlan(PatchPlan* patchplan, const char* path)
+{
+	if (!fst || !patchplan->Load(path))
+		return false;
+
+	DiscNode* newfst = (DiscNode*)memalign(32, patchplan->GetFSTSize());
+	if (!newfst)
+		return false;
+	memcpy(newfst, patchplan->GetFST(), patchplan->GetFSTSize());
+
+	// patches name files by what AddFile returned when the plan was made
+	map<s32, s32> files;
+	const vector<PatchPlan::Operation>& operations = patchplan->GetOperations();
+	for (vector<PatchPlan::Operation>::const_iterator operation = operations.begin(); operation != operations.end(); operation++) {
+		ioctlv vectors[3];
+		memcpy(vectors, operation->Vectors, sizeof(vectors));
+		if (operation->Ioctl == Ioctl::AddPatch && vectors[0].len == 0x20) {
+			memcpy(ioctlbuffer, vectors[0].data, 0x20);
+			map<s32, s32>::iterator file = files.find(ioctlbuffer[0]);
+			if (file != files.end())
+				ioctlbuffer[0] = file->second;
+			vectors[0].data = ioctlbuffer;
+		}
+
+		int ret;
+		if (operation->Vectored)
+			ret = IOS_Ioctlv(fd, operation->Ioctl, operation->Inputs, operation->Count - operation->Inputs, vectors);
+		else
+			ret = IOS_Ioctl(fd, operation->Ioctl, vectors[0].data, vectors[0].len, vectors[1].data, vectors[1].len);
+
+		// a file that won't open any more would leave patches pointing at nothing, so stop and patch
+		// the disc normally; what was already sent is sent again the same way, only the plan goes
+		if (ret < 0 && operation->Result >= 0 && (operation->Ioctl == Ioctl::AddFile || operation->Ioctl == Ioctl::AddPatch)) {
+			free(newfst);
+			File_Delete(path);
+			return false;
+		}
+
+		if (operation->Ioctl == Ioctl::AddFile) {
+			files[operation->Result] = ret;
+			if (ret >= 0)
+				addedfiles++;
+		}
+	}
+
+	free(fst);
+	fst = newfst;
+	fstsize = patchplan->GetFSTSize();
+	shift = patchplan->GetShift();
+	return true;
 }
 
 void RVL_Patch(RiiDisc* disc)
@@ -565,22 +796,14 @@ void RVL_Patch(RiiDisc* disc)
 	// Search for a common filesystem so we can optimize memory
 	string filesystem;
 
-	for (vector<RiiSection>::iterator section = disc->Sections.begin(); section != disc->Sections.end(); section++) {
-		for (vector<RiiOption>::iterator option = section->Options.begin(); option != section->Options.end(); option++) {
-			if (!option->Default)
-				continue;
-			RiiChoice* choice = &option->Choices[option->Default - 1];
+	// the choices may have changed since the memory patches last looked
+	ResolvedDisc = NULL;
+	RVL_ResolvePatches(disc);
 
-			for (vector<RiiChoice::Patch>::iterator patch = choice->Patches.begin(); patch != choice->Patches.end(); patch++) {
-				map<string, RiiPatch>::iterator currentpatch = disc->Patches.find(patch->ID);
-				if (currentpatch->second.Files.size() || currentpatch->second.Folders.size() ||
-					currentpatch->second.Savegame.External.size() || currentpatch->second.DLC.External.size()) {
-					// Only keep the filesystem mounted if a patch that needs to be running during the game is using it
-					UsedFilesystems[choice->Filesystem] = true;
-					break;
-				}
-			}
-		}
+	for (vector<ResolvedPatch>::iterator patch = ResolvedPatches.begin(); patch != ResolvedPatches.end(); patch++) {
+		// Only keep the filesystem mounted if a patch that needs to be running during the game is using it
+		if (patch->Files.size() || patch->Folders.size() || patch->Savegame.External.size() || patch->DLC.External.size())
+			UsedFilesystems[patch->Choice->Filesystem] = true;
 	}
 
 	if (UsedFilesystems.size() == 1) {
@@ -592,33 +815,49 @@ void RVL_Patch(RiiDisc* disc)
 		}
 	}
 
-	for (vector<RiiSection>::iterator section = disc->Sections.begin(); section != disc->Sections.end(); section++) {
-		for (vector<RiiOption>::iterator option = section->Options.begin(); option != section->Options.end(); option++) {
-			if (option->Default == 0)
-				continue;
-			map<string, string> params;
-			ADD_DEFAULT_PARAMS(params);
-			params.insert(option->Params.begin(), option->Params.end());
-			RiiChoice* choice = &option->Choices[option->Default - 1];
-			params.insert(choice->Params.begin(), choice->Params.end());
-			u32 end = params.size();
-			for (vector<RiiChoice::Patch>::iterator patch = choice->Patches.begin(); patch != choice->Patches.end(); patch++) {
-				map<string, RiiPatch>::iterator currentpatch = disc->Patches.find(patch->ID);
-				if (currentpatch != disc->Patches.end()) {
-					params.insert(patch->Params.begin(), patch->Params.end());
-
-					RVL_Patch(&currentpatch->second, &params, filesystem);
+	// the same disc with the same patches comes out the same, unless their files changed
+	PatchPlan patchplan;
+	patchplan.AddKey(MEM_BASE, 8);
+	patchplan.AddKey(fstsize);
+	if (fst)
+		patchplan.AddKey(fst, fstsize);
+	patchplan.AddKey(&shift, sizeof(shift));
+	patchplan.AddKey(shiftfiles);
+	patchplan.AddKey(filesystem);
+	for (vector<ResolvedPatch>::iterator patch = ResolvedPatches.begin(); patch != ResolvedPatches.end(); patch++)
+		RVL_AddPlanKey(&*patch, &patchplan);
+	patchplan.FinishKey();
+
+	char planpath[MAXPATHLEN];
+	snprintf(planpath, sizeof(planpath), "%s/%.6s.plan", PLAN_PATH, (const char*)MEM_BASE);
+	if (!RVL_ReplayPlan(&patchplan, planpath)) {
+		int startfiles = addedfiles;
+		plan = &patchplan;
+
+		// look nodes up and create them in an index, the FST is rewritten once afterwards
+		FSTIndex index;
+		if (index.Build(fst, fstsize))
+			fstindex = &index;
+
+		for (vector<ResolvedPatch>::iterator patch = ResolvedPatches.begin(); patch != ResolvedPatches.end(); patch++)
+			RVL_Patch(&*patch, filesystem);
+
+		if (fstindex) {
+			fstindex->Commit(&fst, &fstsize);
+			fstindex = NULL;
+		}
 
-					if (patch->Params.size()) {
-						map<string, string>::iterator endi = params.begin();
-						for (u32 i = 0; i < end; i++) // Fucking iterator needs operator+()
-							endi++;
-						params.erase(endi, patch->Params.end());
-					}
-				}
-			}
+		plan = NULL;
+		if (fst) {
+			File_CreateDir(RIIVOLUTION_PATH);
+			File_CreateDir(PLAN_PATH);
+			patchplan.Save(planpath, fst, fstsize, shift, addedfiles - startfiles);
 		}
 	}
+
+	// keep a handle open for every file the game can stream from, the module caps it
+	if (addedfiles)
+		RVL_SetFileHandles(addedfiles);
 }
 
 void RVL_Unmount()
@@ -688,7 +927,7 @@ static void* FindInBuffer(void* memory, void* end, void* pattern, int patternlen
 
 	return NULL;
 }
-static void RVL_Patch(RiiMemoryPatch* memory, map<string, string>* params)
+static void RVL_Patch(RiiMemoryPatch* memory, const string& valuefile, void* data)
 {
 	if (memory->Ocarina || (memory->Search && !memory->Original) || !memory->Offset || !memory->GetLength())
 		return;
@@ -706,8 +945,6 @@ static void RVL_Patch(RiiMemoryPatch* memory, map<string, string>* params)
 	if (memory->Original && memcmp((void*)memory->Offset, memory->Original, memory->GetLength()))
 		return;
 
-	string valuefile = memory->ValueFile;
-	ApplyParams(&valuefile, params);
 	void* value = memory->GetValue(valuefile);
 	if (value) {
 		memcpy((void*)memory->Offset, value, memory->GetLength());
@@ -717,67 +954,101 @@ static void RVL_Patch(RiiMemoryPatch* memory, map<string, string>* params)
 	}
 }
 
-static void RVL_Patch(RiiMemoryPatch* memory, map<string, string>* params, void* mem, u32 length)
+// Search and ocarina patches, looked for in every section the apploader loads
+struct MemorySearch
 {
+	RiiMemoryPatch* Memory;
+	void* Value;
+	int Pattern;
+};
+
+static vector<MemorySearch> MemorySearches;
+
+static void RVL_AddMemorySearch(RiiMemoryPatch* memory, const string& valuefile, void* data)
+{
+	PatternScanner* scanner = (PatternScanner*)data;
+
 	if ((!memory->Ocarina && !memory->Search) || (memory->Search && !memory->Align) || (memory->Ocarina && !memory->Offset) || !memory->GetLength())
 		return;
 
 	memory->Offset = (int)MEM_PHYSICAL_OR_K0(memory->Offset);
 
-	string valuefile = memory->ValueFile;
-	ApplyParams(&valuefile, params);
-	void* value = memory->GetValue(valuefile);
-	if (!value)
+	MemorySearch search;
+	search.Memory = memory;
+	search.Value = memory->GetValue(valuefile);
+	if (!search.Value)
+		return;
+
+	if (memory->Ocarina)
+		search.Pattern = scanner->Add(search.Value, memory->GetLength(), 4);
+	else
+		search.Pattern = scanner->Add(memory->Original, memory->Length, memory->Align);
+	if (search.Pattern < 0) {
+		if (!memory->Value)
+			free(search.Value);
+		return;
+	}
+
+	MemorySearches.push_back(search);
+}
+
+static void RVL_PatchMemory(MemorySearch* search, PatternScanner* scanner)
+{
+	RiiMemoryPatch* memory = search->Memory;
+	u8* mem = scanner->GetBuffer();
+	u32 length = scanner->GetLength();
+
+	void* found = scanner->Find(search->Pattern);
+	if (!found)
 		return;
 
 	if (memory->Ocarina) {
-		void* ocarina = FindInBuffer(mem, (u8*)mem + length, value, memory->GetLength(), 4);
-		if (ocarina) {
-			u32* blr;
-			for (blr = (u32*)ocarina; (u8*)blr < (u8*)mem + length && *blr != 0x4E800020; blr++)
-				;
-			if ((u8*)blr < (u8*)mem + length)
-				*blr = ((memory->Offset - (int)blr) & 0x03FFFFFC) | 0x48000000;
+		u32* blr;
+		for (blr = (u32*)found; (u8*)blr < mem + length && *blr != 0x4E800020; blr++)
+			;
+		if ((u8*)blr < mem + length) {
+			*blr = ((memory->Offset - (int)blr) & 0x03FFFFFC) | 0x48000000;
+			scanner->Written(blr, sizeof(*blr));
 		}
 	} else /* if (memory->Search) */ {
-		void* ret = FindInBuffer(mem, (u8*)mem + length, memory->Original, memory->Length, memory->Align);
-		if (ret)
-			memcpy(ret, value, memory->GetLength());
+		memcpy(found, search->Value, memory->GetLength());
+		scanner->Written(found, memory->GetLength());
 	}
+}
 
-	if (!memory->Value)
-		free(value);
+// Walks the enabled choices' memory patches with their value files' params applied
+static void RVL_ForEachMemoryPatch(RiiDisc* disc, void (*callback)(RiiMemoryPatch*, const string&, void*), void* data)
+{
+	RVL_ResolvePatches(disc);
+
+	for (vector<ResolvedPatch>::iterator patch = ResolvedPatches.begin(); patch != ResolvedPatches.end(); patch++) {
+		for (u32 i = 0; i < patch->Patch->Memory.size(); i++)
+			callback(&patch->Patch->Memory[i], patch->ValueFiles[i], data);
+	}
 }
 
-void RVL_PatchMemory(RiiDisc* disc, void* memory, u32 length)
+void RVL_PatchMemory(RiiDisc* disc)
 {
-	for (vector<RiiSection>::iterator section = disc->Sections.begin(); section != disc->Sections.end(); section++) {
-		for (vector<RiiOption>::iterator option = section->Options.begin(); option != section->Options.end(); option++) {
-			if (option->Default == 0)
-				continue;
-			map<string, string> params;
-			ADD_DEFAULT_PARAMS(params);
-			params.insert(option->Params.begin(), option->Params.end());
-			RiiChoice* choice = &option->Choices[option->Default - 1];
-			params.insert(choice->Params.begin(), choice->Params.end());
-			u32 end = params.size();
+	RVL_ForEachMemoryPatch(disc, RVL_Patch, NULL);
+}
 
-			for (vector<RiiChoice::Patch>::iterator patch = choice->Patches.begin(); patch != choice->Patches.end(); patch++) {
-				params.insert(patch->Params.begin(), patch->Params.end());
-				RiiPatch* mem = &disc->Patches[patch->ID];
-				for (vector<RiiMemoryPatch>::iterator mempatch = mem->Memory.begin(); mempatch != mem->Memory.end(); mempatch++) {
-					if (memory)
-						RVL_Patch(&*mempatch, &params, memory, length);
-					else
-						RVL_Patch(&*mempatch, &params);
-				}
-				if (patch->Params.size()) {
-					map<string, string>::iterator endi = params.begin();
-					for (u32 i = 0; i < end; i++) // Fucking iterator needs operator+()
-						endi++;
-					params.erase(endi, patch->Params.end());
-				}
-			}
-		}
+void RVL_AddMemorySearches(RiiDisc* disc, PatternScanner* scanner)
+{
+	RVL_ClearMemorySearches();
+	RVL_ForEachMemoryPatch(disc, RVL_AddMemorySearch, scanner);
+}
+
+void RVL_PatchMemory(PatternScanner* scanner)
+{
+	for (vector<MemorySearch>::iterator search = MemorySearches.begin(); search != MemorySearches.end(); search++)
+		RVL_PatchMemory(&*search, scanner);
+}
+
+void RVL_ClearMemorySearches()
+{
+	for (vector<MemorySearch>::iterator search = MemorySearches.begin(); search != MemorySearches.end(); search++) {
+		if (!search->Memory->Value)
+			free(search->Value);
 	}
+	MemorySearches.clear();
 }
@@ -17,23 +17,23 @@ using std::map;
 #endif
 
 #include <libxml++/libxml++.h>
-#include <libxml++/parsers/textreader.h>
 using namespace xmlpp;
 
+#include "xmlreader.h"
+
 #define RIIVOLUTION_CONFIG_PATH (RIIVOLUTION_PATH "/config")
 
-#define ELEMENT_START(str) if (reader.get_node_type() == TextReader::Element && !reader.get_name().compare(str))
-#define ELEMENT_END(str) if (reader.get_node_type() == TextReader::EndElement && !reader.get_name().compare(str))
-#define ELEMENT_ATTRIBUTE(str, condition) attribute = UTF8ToLatin1(reader.get_attribute(str)); if (!attribute.empty() && (condition))
-#define ELEMENT_LOOP if (!reader.is_empty_element()) while (reader.read())
-#define ELEMENT_VALUE() UTF8ToLatin1(reader.get_value())
-#define ELEMENT_BOOL() !strcasecmp(attribute.c_str(), "yes") || !strcasecmp(attribute.c_str(), "true")
-static s64 ELEMENT_INT(string str)
+#define ELEMENT_START(str) if (reader.GetNodeType() == XMLReader::Element && !strcmp(reader.GetName(), str))
+#define ELEMENT_END(str) if (reader.GetNodeType() == XMLReader::EndElement && !strcmp(reader.GetName(), str))
+#define ELEMENT_ATTRIBUTE(str, condition) attribute = reader.GetAttribute(str); if (attribute && *attribute && (condition))
+#define ELEMENT_LOOP if (!reader.IsEmptyElement()) while (reader.Read())
+#define ELEMENT_BOOL() (!strcasecmp(attribute, "yes") || !strcasecmp(attribute, "true"))
+static s64 ELEMENT_INT(const char* str)
 {
-	if (str.compare(0, 2, "0x"))
-		return strtoll(str.c_str(), NULL, 10);
+	if (strncmp(str, "0x", 2))
+		return strtoll(str, NULL, 10);
 	else
-		return strtoll(str.c_str() + 2, NULL, 16);
+		return strtoll(str + 2, NULL, 16);
 }
 
 static void HexToBytes(void* mem, const char* source)
@@ -54,30 +54,6 @@ static void HexToBytes(void* mem, const char* source)
     }
 }
 
-static string UTF8ToLatin1(string str)
-{
-	// Bleh, maybe we should only bother running this when the encoding has been specified as latin-1
-	bool utf8 = false;
-	for (u32 i = 0; i < str.size(); i++) {
-		if (str[i] & 0x80) {
-			utf8 = true;
-			break;
-		}
-	}
-	if (!utf8)
-		return str;
-
-	string ret;
-	for (u32 i = 0; i < str.size(); i++) {
-		if (str[i] & 0x80) {
-			ret += ((str[i] & 0x1F) << 6) + (str[i + 1] & 0x3f);
-			i++;
-		} else
-			ret += str[i];
-	}
-	return ret;
-}
-
 string PathCombine(string path, string file)
 {
 	if (path.empty())
@@ -162,17 +138,17 @@ bool ParseXMLs(int mnt, vector<RiiDisc>* discs)
 	return true;
 }
 
-bool ParseXML(const char* xmldata, int length, vector<RiiDisc>* discs, const char* rootpath, const char* rootfs, int fs)
+bool ParseXML(char* xmldata, int length, vector<RiiDisc>* discs, const char* rootpath, const char* rootfs, int fs)
 {
 	TRIM_XML();
 
 	RiiDisc disc;
 
 	string xmlroot = rootpath;
-	TextReader reader((const u8*)xmldata, length);
-	string attribute;
+	XMLReader reader(xmldata, length);
+	const char* attribute;
 
-	while (reader.read()) {
+	while (reader.Read()) {
 		ELEMENT_START("wiidisc")
 			ELEMENT_ATTRIBUTE("version", ELEMENT_INT(attribute) == 1)
 				goto versionisvalid;
@@ -194,9 +170,9 @@ versionisvalid:
 		}
 
 		ELEMENT_START("id") {
-			ELEMENT_ATTRIBUTE("game", memcmp(MEM_BASE, attribute.c_str(), attribute.length()))
+			ELEMENT_ATTRIBUTE("game", memcmp(MEM_BASE, attribute, strlen(attribute)))
 				return false;
-			ELEMENT_ATTRIBUTE("developer", memcmp(MEM_BASE + 4, attribute.c_str(), attribute.length()))
+			ELEMENT_ATTRIBUTE("developer", memcmp(MEM_BASE + 4, attribute, strlen(attribute)))
 				return false;
 			ELEMENT_ATTRIBUTE("disc", (u8)ELEMENT_INT(attribute) != *(MEM_BASE + 6))
 				return false;
@@ -328,7 +304,7 @@ versionisvalid:
 									ELEMENT_ATTRIBUTE("name", true)
 										choice.Name = attribute;
 									ELEMENT_ATTRIBUTE("id", true)
-										choice.ID = rootpath + attribute;
+										choice.ID = rootpath + string(attribute);
 									else
 										choice.ID = rootpath + option.ID + choice.Name;
 
@@ -341,7 +317,7 @@ versionisvalid:
 										ELEMENT_START("patch") {
 											RiiChoice::Patch patch;
 											ELEMENT_ATTRIBUTE("id", true)
-												patch.ID = rootpath + attribute;
+												patch.ID = rootpath + string(attribute);
 
 											ELEMENT_LOOP {
 												ELEMENT_END("patch")
@@ -372,7 +348,7 @@ versionisvalid:
 			string patchroot = xmlroot;
 
 			ELEMENT_ATTRIBUTE("id", true)
-				id = rootpath + attribute;
+				id = rootpath + string(attribute);
 			ELEMENT_ATTRIBUTE("root", true)
 				patchroot = AbsolutePathCombine(xmlroot, attribute, rootfs);
 
@@ -460,22 +436,22 @@ versionisvalid:
 					ELEMENT_ATTRIBUTE("valuefile", true)
 						memory.ValueFile = AbsolutePathCombine(patchroot, attribute, rootfs);
 					ELEMENT_ATTRIBUTE("value", true) {
-						if (!attribute.compare(0, 2, "0x"))
-							attribute = attribute.substr(2);
-						int length = attribute.size() / 2;
+						if (!strncmp(attribute, "0x", 2))
+							attribute += 2;
+						int length = strlen(attribute) / 2;
 						memory.Value = new u8[length];
 						if (memory.Value) {
-							HexToBytes(memory.Value, attribute.c_str());
+							HexToBytes(memory.Value, attribute);
 							memory.Length = length;
 						}
 					}
 					ELEMENT_ATTRIBUTE("original", true) {
-						if (!attribute.compare(0, 2, "0x"))
-							attribute = attribute.substr(2);
-						int length = attribute.size() / 2;
+						if (!strncmp(attribute, "0x", 2))
+							attribute += 2;
+						int length = strlen(attribute) / 2;
 						memory.Original = new u8[length];
 						if (memory.Original) {
-							HexToBytes(memory.Original, attribute.c_str());
+							HexToBytes(memory.Original, attribute);
 							if (!memory.Length)
 								memory.Length = length;
 						}
@@ -599,15 +575,15 @@ void ParseXMLs(const char* rootpath, const char* rootfs, int fs, vector<RiiDisc>
 }
 
 struct RiiConfig { string ID; int Default; };
-bool ParseConfigXML(const char* xmldata, int length, RiiDisc* disc)
+bool ParseConfigXML(char* xmldata, int length, RiiDisc* disc)
 {
 	TRIM_XML();
 
 	vector<RiiConfig> config;
-	TextReader reader((const u8*)xmldata, length);
-	string attribute;
+	XMLReader reader(xmldata, length);
+	const char* attribute;
 
-	while (reader.read()) {
+	while (reader.Read()) {
 		ELEMENT_START("riivolution")
 			ELEMENT_ATTRIBUTE("version", ELEMENT_INT(attribute) == 2)
 				goto versionisvalid;
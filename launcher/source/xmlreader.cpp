@@ -0,0 +1,249 @@
+#include "xmlreader.h"
+
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+
+static inline bool IsSpace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static inline bool IsNameEnd(char c)
+{
+	return IsSpace(c) || c == '/' || c == '>' || c == '=';
+}
+
+XMLReader::XMLReader(char* data, u32 length)
+{
+	Position = data;
+	End = data + length;
+	Latin1 = false;
+	Failed = false;
+	Type = None;
+	Name = "";
+	Empty = false;
+}
+
+// Moves past the next terminator, false if the document ends first
+bool XMLReader::Skip(const char* terminator)
+{
+	u32 length = strlen(terminator);
+	for (; Position + length <= End; Position++) {
+		if (!memcmp(Position, terminator, length)) {
+			Position += length;
+			return true;
+		}
+	}
+
+	Position = End;
+	return false;
+}
+
+// <?xml ... encoding="..."?>, the only thing taken from it is whether to leave values alone
+void XMLReader::ReadDeclaration(const char* start)
+{
+	if (Position - start < 5 || strncmp(start, "?xml", 4) || !IsSpace(start[4]))
+		return;
+
+	for (const char* pos = start; pos + 8 < Position; pos++) {
+		if (strncmp(pos, "encoding", 8))
+			continue;
+		for (pos += 8; pos < Position && *pos != '"' && *pos != '\''; pos++)
+			;
+		if (pos + 5 < Position)
+			Latin1 = strncasecmp(pos + 1, "utf-8", 5) && strncasecmp(pos + 1, "utf8", 4);
+		return;
+	}
+}
+
+// Entities and character references, newlines and tabs as spaces, UTF-8 as Latin-1 the way it always was
+void XMLReader::Decode(char* value, char* end)
+{
+	char* out = value;
+	char* in = value;
+
+	while (in < end) {
+		char c = *in;
+		if (c == '&') {
+			char* semicolon = (char*)memchr(in, ';', end - in);
+			if (semicolon) {
+				const char* entity = in + 1;
+				u32 length = semicolon - entity;
+				int code = -1;
+				if (length == 2 && !strncmp(entity, "lt", 2))
+					code = '<';
+				else if (length == 2 && !strncmp(entity, "gt", 2))
+					code = '>';
+				else if (length == 3 && !strncmp(entity, "amp", 3))
+					code = '&';
+				else if (length == 4 && !strncmp(entity, "quot", 4))
+					code = '"';
+				else if (length == 4 && !strncmp(entity, "apos", 4))
+					code = '\'';
+				else if (length > 2 && entity[0] == '#' && entity[1] == 'x')
+					code = strtoul(entity + 2, NULL, 16);
+				else if (length > 1 && entity[0] == '#')
+					code = strtoul(entity + 1, NULL, 10);
+				if (code >= 0) {
+					*out++ = (char)code;
+					in = semicolon + 1;
+					continue;
+				}
+			}
+		} else if (c == '\r') {
+			*out++ = ' ';
+			if (++in < end && *in == '\n')
+				in++;
+			continue;
+		} else if (c == '\n' || c == '\t') {
+			*out++ = ' ';
+			in++;
+			continue;
+		} else if ((c & 0x80) && !Latin1 && in + 1 < end) {
+			*out++ = ((c & 0x1F) << 6) + (in[1] & 0x3F);
+			in += 2;
+			continue;
+		}
+
+		*out++ = c;
+		in++;
+	}
+
+	*out = '\0';
+}
+
+// Position is just past the '<'
+bool XMLReader::ReadTag()
+{
+	bool end = Position < End && *Position == '/';
+	if (end)
+		Position++;
+
+	char* name = Position;
+	while (Position < End && !IsNameEnd(*Position))
+		Position++;
+	char* nameend = Position;
+	if (nameend == name)
+		return false;
+
+	Empty = false;
+	while (true) {
+		while (Position < End && IsSpace(*Position))
+			Position++;
+		if (Position >= End)
+			return false;
+		if (*Position == '>') {
+			Position++;
+			break;
+		}
+		if (*Position == '/' && !end) {
+			if (Position + 1 >= End || Position[1] != '>')
+				return false;
+			Empty = true;
+			Position += 2;
+			break;
+		}
+		if (end)
+			return false;
+
+		Attribute attribute;
+		attribute.Name = Position;
+		while (Position < End && !IsNameEnd(*Position))
+			Position++;
+		attribute.NameEnd = Position;
+		while (Position < End && IsSpace(*Position))
+			Position++;
+		if (attribute.NameEnd == attribute.Name || Position >= End || *Position != '=')
+			return false;
+		for (Position++; Position < End && IsSpace(*Position); Position++)
+			;
+		if (Position >= End || (*Position != '"' && *Position != '\''))
+			return false;
+		attribute.Value = Position + 1;
+		attribute.ValueEnd = (char*)memchr(attribute.Value, *Position, End - attribute.Value);
+		if (!attribute.ValueEnd)
+			return false;
+		Position = attribute.ValueEnd + 1;
+		Attributes.push_back(attribute);
+	}
+
+	// the whole tag has been looked at, so it can be terminated and decoded
+	*nameend = '\0';
+	for (std::vector<Attribute>::iterator attribute = Attributes.begin(); attribute != Attributes.end(); attribute++) {
+		*attribute->NameEnd = '\0';
+		Decode(attribute->Value, attribute->ValueEnd);
+	}
+	Name = name;
+
+	if (end) {
+		if (Open.empty() || strcmp(Open.back(), name))
+			return false;
+		Open.pop_back();
+		Type = EndElement;
+	} else {
+		Type = Element;
+		if (!Empty)
+			Open.push_back(name);
+	}
+
+	return true;
+}
+
+bool XMLReader::Read()
+{
+	Attributes.clear();
+
+	while (!Failed && Position < End) {
+		char* tag = (char*)memchr(Position, '<', End - Position);
+		if (!tag || tag + 1 >= End)
+			break;
+		Position = tag + 1;
+
+		if (*Position == '?') {
+			const char* start = Position;
+			if (!Skip("?>"))
+				break;
+			ReadDeclaration(start);
+		} else if (End - Position >= 3 && !strncmp(Position, "!--", 3)) {
+			if (!Skip("-->"))
+				break;
+		} else if (End - Position >= 8 && !strncmp(Position, "![CDATA[", 8)) {
+			if (!Skip("]]>"))
+				break;
+		} else if (*Position == '!') {
+			// <!DOCTYPE ...>, with anything in brackets
+			int depth = 0;
+			for (; Position < End; Position++) {
+				if (*Position == '[')
+					depth++;
+				else if (*Position == ']')
+					depth--;
+				else if (*Position == '>' && depth <= 0)
+					break;
+			}
+			if (Position >= End)
+				break;
+			Position++;
+		} else if (ReadTag())
+			return true;
+		else
+			Failed = true;
+	}
+
+	Type = None;
+	Name = "";
+	Empty = false;
+	Attributes.clear();
+	return false;
+}
+
+const char* XMLReader::GetAttribute(const char* name)
+{
+	for (std::vector<Attribute>::iterator attribute = Attributes.begin(); attribute != Attributes.end(); attribute++) {
+		if (!strcmp(attribute->Name, name))
+			return attribute->Value;
+	}
+
+	return NULL;
+}
@@ -0,0 +1,445 @@
+#include <gctypes.h>
+#include <string.h>
+
+#include "aes.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define AES_AESNI
+#include <cpuid.h>
+#include <wmmintrin.h>
+#define AESNI_FUNCTION __attribute__((target("aes,sse2")))
+#endif
+
+#define AES_MAXROUNDS 14
+
+#define ROTR8(x) (((x) >> 8) | ((x) << 24))
+#define ROTR16(x) (((x) >> 16) | ((x) << 16))
+#define ROTR24(x) (((x) >> 24) | ((x) << 8))
+
+// words are big endian whatever the CPU is, so the tables work the same everywhere
+#define GET32(p) (((u32)(p)[0] << 24) | ((u32)(p)[1] << 16) | ((u32)(p)[2] << 8) | (u32)(p)[3])
+#define PUT32(p, v) do { (p)[0] = (u8)((v) >> 24); (p)[1] = (u8)((v) >> 16); (p)[2] = (u8)((v) >> 8); (p)[3] = (u8)(v); } while (0)
+
+static u8 sbox[256];
+static u8 inv_sbox[256];
+// one column of a round each: sbox then MixColumns, inv_sbox then InvMixColumns
+static u32 te[256];
+static u32 td[256];
+static int tables_ready = 0;
+
+static u32 enc_keys[4 * (AES_MAXROUNDS + 1)];
+static u32 dec_keys[4 * (AES_MAXROUNDS + 1)];
+static int rounds = 0;
+static int backend = -1;
+
+#ifdef AES_AESNI
+static u8 aesni_enc_keys[AES_MAXROUNDS + 1][16] __attribute__((aligned(16)));
+static u8 aesni_dec_keys[AES_MAXROUNDS + 1][16] __attribute__((aligned(16)));
+#endif
+
+static u8 xtime(u8 a)
+{
+	return (u8)((a << 1) ^ ((a & 0x80) ? 0x1B : 0));
+}
+
+static u8 mul(u8 a, u8 b)
+{
+	u8 ret = 0;
+	while (b) {
+		if (b & 1)
+			ret ^= a;
+		a = xtime(a);
+		b >>= 1;
+	}
+	return ret;
+}
+
+static void gentables(void)
+{
+	u8 pow[256], log[256];
+	u8 x = 1;
+	int i;
+
+	if (tables_ready)
+		return;
+
+	// 3 generates the field, walking its powers gives logs for the inverses
+	for (i = 0; i < 255; i++) {
+		pow[i] = x;
+		log[x] = (u8)i;
+		x ^= xtime(x);
+	}
+
+	for (i = 0; i < 256; i++) {
+		u8 inv = i ? pow[(255 - log[i]) % 255] : 0;
+		u8 s = inv;
+		int j;
+		for (j = 1; j < 5; j++)
+			s ^= (u8)((inv << j) | (inv >> (8 - j)));
+		s ^= 0x63;
+		sbox[i] = s;
+		inv_sbox[s] = (u8)i;
+	}
+
+	for (i = 0; i < 256; i++) {
+		u8 s = sbox[i];
+		u8 si = inv_sbox[i];
+		te[i] = ((u32)xtime(s) << 24) | ((u32)s << 16) | ((u32)s << 8) | (u32)(xtime(s) ^ s);
+		td[i] = ((u32)mul(si, 0x0E) << 24) | ((u32)mul(si, 0x09) << 16) | ((u32)mul(si, 0x0D) << 8) | (u32)mul(si, 0x0B);
+	}
+
+	tables_ready = 1;
+}
+
+static u32 sub_word(u32 w)
+{
+	return ((u32)sbox[w >> 24] << 24) | ((u32)sbox[(w >> 16) & 0xFF] << 16) | ((u32)sbox[(w >> 8) & 0xFF] << 8) | sbox[w & 0xFF];
+}
+
+// InvMixColumns on a round key word, td has inv_sbox in it so sbox first cancels that out
+static u32 inv_mix_word(u32 w)
+{
+	return td[sbox[w >> 24]] ^ ROTR8(td[sbox[(w >> 16) & 0xFF]]) ^ ROTR16(td[sbox[(w >> 8) & 0xFF]]) ^ ROTR24(td[sbox[w & 0xFF]]);
+}
+
+#ifdef AES_AESNI
+static int aesni_supported(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+	return (ecx & bit_AES) && (edx & bit_SSE2);
+}
+
+AESNI_FUNCTION static void aesni_set_keys(void)
+{
+	int i;
+
+	for (i = 0; i <= rounds; i++) {
+		PUT32(aesni_enc_keys[i], enc_keys[i * 4]);
+		PUT32(aesni_enc_keys[i] + 4, enc_keys[i * 4 + 1]);
+		PUT32(aesni_enc_keys[i] + 8, enc_keys[i * 4 + 2]);
+		PUT32(aesni_enc_keys[i] + 12, enc_keys[i * 4 + 3]);
+	}
+
+	// aesdec wants the same equivalent inverse cipher keys the tables use
+	memcpy(aesni_dec_keys[0], aesni_enc_keys[rounds], 16);
+	for (i = 1; i < rounds; i++)
+		_mm_store_si128((__m128i *)aesni_dec_keys[i], _mm_aesimc_si128(_mm_load_si128((const __m128i *)aesni_enc_keys[rounds - i])));
+	memcpy(aesni_dec_keys[rounds], aesni_enc_keys[0], 16);
+}
+#endif
+
+static void set_key(const u8 *key, int nk)
+{
+	u32 rcon = 1;
+	int i, words;
+
+	gentables();
+	if (backend < 0) {
+		backend = AES_BACKEND_TABLES;
+#ifdef AES_AESNI
+		if (aesni_supported())
+			backend = AES_BACKEND_AESNI;
+#endif
+	}
+
+	rounds = nk + 6;
+	words = 4 * (rounds + 1);
+	for (i = 0; i < nk; i++)
+		enc_keys[i] = GET32(key + i * 4);
+	for (; i < words; i++) {
+		u32 temp = enc_keys[i - 1];
+		if (i % nk == 0) {
+			temp = sub_word((temp << 8) | (temp >> 24)) ^ (rcon << 24);
+			rcon = xtime((u8)rcon);
+		} else if (nk > 6 && i % nk == 4)
+			temp = sub_word(temp);
+		enc_keys[i] = enc_keys[i - nk] ^ temp;
+	}
+
+	// the decryption keys go backwards, with InvMixColumns on all but the first and last
+	for (i = 0; i <= rounds; i++) {
+		int j;
+		for (j = 0; j < 4; j++) {
+			u32 w = enc_keys[(rounds - i) * 4 + j];
+			dec_keys[i * 4 + j] = (i && i < rounds) ? inv_mix_word(w) : w;
+		}
+	}
+
+#ifdef AES_AESNI
+	if (backend == AES_BACKEND_AESNI)
+		aesni_set_keys();
+#endif
+}
+
+void aes_set_key(const u8 *key)
+{
+	set_key(key, 4);
+}
+
+void aes_set_key256(const u8 *key)
+{
+	set_key(key, 8);
+}
+
+static void encrypt_block(u32 *s)
+{
+	const u32 *rk = enc_keys;
+	u32 s0 = s[0] ^ rk[0], s1 = s[1] ^ rk[1], s2 = s[2] ^ rk[2], s3 = s[3] ^ rk[3];
+	u32 t0, t1, t2, t3;
+	int r;
+
+	for (r = 1; r < rounds; r++) {
+		rk += 4;
+		t0 = te[s0 >> 24] ^ ROTR8(te[(s1 >> 16) & 0xFF]) ^ ROTR16(te[(s2 >> 8) & 0xFF]) ^ ROTR24(te[s3 & 0xFF]) ^ rk[0];
+		t1 = te[s1 >> 24] ^ ROTR8(te[(s2 >> 16) & 0xFF]) ^ ROTR16(te[(s3 >> 8) & 0xFF]) ^ ROTR24(te[s0 & 0xFF]) ^ rk[1];
+		t2 = te[s2 >> 24] ^ ROTR8(te[(s3 >> 16) & 0xFF]) ^ ROTR16(te[(s0 >> 8) & 0xFF]) ^ ROTR24(te[s1 & 0xFF]) ^ rk[2];
+		t3 = te[s3 >> 24] ^ ROTR8(te[(s0 >> 16) & 0xFF]) ^ ROTR16(te[(s1 >> 8) & 0xFF]) ^ ROTR24(te[s2 & 0xFF]) ^ rk[3];
+		s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+	}
+
+	// no MixColumns in the last round
+	rk += 4;
+	s[0] = (((u32)sbox[s0 >> 24] << 24) | ((u32)sbox[(s1 >> 16) & 0xFF] << 16) | ((u32)sbox[(s2 >> 8) & 0xFF] << 8) | sbox[s3 & 0xFF]) ^ rk[0];
+	s[1] = (((u32)sbox[s1 >> 24] << 24) | ((u32)sbox[(s2 >> 16) & 0xFF] << 16) | ((u32)sbox[(s3 >> 8) & 0xFF] << 8) | sbox[s0 & 0xFF]) ^ rk[1];
+	s[2] = (((u32)sbox[s2 >> 24] << 24) | ((u32)sbox[(s3 >> 16) & 0xFF] << 16) | ((u32)sbox[(s0 >> 8) & 0xFF] << 8) | sbox[s1 & 0xFF]) ^ rk[2];
+	s[3] = (((u32)sbox[s3 >> 24] << 24) | ((u32)sbox[(s0 >> 16) & 0xFF] << 16) | ((u32)sbox[(s1 >> 8) & 0xFF] << 8) | sbox[s2 & 0xFF]) ^ rk[3];
+}
+
+static void decrypt_block(u32 *s)
+{
+	const u32 *rk = dec_keys;
+	u32 s0 = s[0] ^ rk[0], s1 = s[1] ^ rk[1], s2 = s[2] ^ rk[2], s3 = s[3] ^ rk[3];
+	u32 t0, t1, t2, t3;
+	int r;
+
+	for (r = 1; r < rounds; r++) {
+		rk += 4;
+		t0 = td[s0 >> 24] ^ ROTR8(td[(s3 >> 16) & 0xFF]) ^ ROTR16(td[(s2 >> 8) & 0xFF]) ^ ROTR24(td[s1 & 0xFF]) ^ rk[0];
+		t1 = td[s1 >> 24] ^ ROTR8(td[(s0 >> 16) & 0xFF]) ^ ROTR16(td[(s3 >> 8) & 0xFF]) ^ ROTR24(td[s2 & 0xFF]) ^ rk[1];
+		t2 = td[s2 >> 24] ^ ROTR8(td[(s1 >> 16) & 0xFF]) ^ ROTR16(td[(s0 >> 8) & 0xFF]) ^ ROTR24(td[s3 & 0xFF]) ^ rk[2];
+		t3 = td[s3 >> 24] ^ ROTR8(td[(s2 >> 16) & 0xFF]) ^ ROTR16(td[(s1 >> 8) & 0xFF]) ^ ROTR24(td[s0 & 0xFF]) ^ rk[3];
+		s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+	}
+
+	rk += 4;
+	s[0] = (((u32)inv_sbox[s0 >> 24] << 24) | ((u32)inv_sbox[(s3 >> 16) & 0xFF] << 16) | ((u32)inv_sbox[(s2 >> 8) & 0xFF] << 8) | inv_sbox[s1 & 0xFF]) ^ rk[0];
+	s[1] = (((u32)inv_sbox[s1 >> 24] << 24) | ((u32)inv_sbox[(s0 >> 16) & 0xFF] << 16) | ((u32)inv_sbox[(s3 >> 8) & 0xFF] << 8) | inv_sbox[s2 & 0xFF]) ^ rk[1];
+	s[2] = (((u32)inv_sbox[s2 >> 24] << 24) | ((u32)inv_sbox[(s1 >> 16) & 0xFF] << 16) | ((u32)inv_sbox[(s0 >> 8) & 0xFF] << 8) | inv_sbox[s3 & 0xFF]) ^ rk[2];
+	s[3] = (((u32)inv_sbox[s3 >> 24] << 24) | ((u32)inv_sbox[(s2 >> 16) & 0xFF] << 16) | ((u32)inv_sbox[(s1 >> 8) & 0xFF] << 8) | inv_sbox[s0 & 0xFF]) ^ rk[3];
+}
+
+// whole blocks, the ciphertext is read before the same block is written so in and out can be the same
+static void tables_decrypt(u8 *iv, const u8 *in, u8 *out, unsigned long long blocks)
+{
+	u32 v0 = GET32(iv), v1 = GET32(iv + 4), v2 = GET32(iv + 8), v3 = GET32(iv + 12);
+	u32 s[4], c0, c1, c2, c3;
+
+	for (; blocks; blocks--, in += 16, out += 16) {
+		s[0] = c0 = GET32(in);
+		s[1] = c1 = GET32(in + 4);
+		s[2] = c2 = GET32(in + 8);
+		s[3] = c3 = GET32(in + 12);
+		decrypt_block(s);
+		PUT32(out, s[0] ^ v0);
+		PUT32(out + 4, s[1] ^ v1);
+		PUT32(out + 8, s[2] ^ v2);
+		PUT32(out + 12, s[3] ^ v3);
+		v0 = c0; v1 = c1; v2 = c2; v3 = c3;
+	}
+
+	PUT32(iv, v0);
+	PUT32(iv + 4, v1);
+	PUT32(iv + 8, v2);
+	PUT32(iv + 12, v3);
+}
+
+static void tables_encrypt(u8 *iv, const u8 *in, u8 *out, unsigned long long blocks)
+{
+	u32 s[4];
+
+	s[0] = GET32(iv);
+	s[1] = GET32(iv + 4);
+	s[2] = GET32(iv + 8);
+	s[3] = GET32(iv + 12);
+	for (; blocks; blocks--, in += 16, out += 16) {
+		s[0] ^= GET32(in);
+		s[1] ^= GET32(in + 4);
+		s[2] ^= GET32(in + 8);
+		s[3] ^= GET32(in + 12);
+		encrypt_block(s);
+		PUT32(out, s[0]);
+		PUT32(out + 4, s[1]);
+		PUT32(out + 8, s[2]);
+		PUT32(out + 12, s[3]);
+	}
+
+	PUT32(iv, s[0]);
+	PUT32(iv + 4, s[1]);
+	PUT32(iv + 8, s[2]);
+	PUT32(iv + 12, s[3]);
+}
+
+#ifdef AES_AESNI
+// CBC decryption doesn't chain, so four blocks go through the rounds together
+AESNI_FUNCTION static void aesni_decrypt(u8 *iv, const u8 *in, u8 *out, unsigned long long blocks)
+{
+	const __m128i *keys = (const __m128i *)aesni_dec_keys;
+	__m128i prev = _mm_loadu_si128((const __m128i *)iv);
+	int r;
+
+	for (; blocks >= 4; blocks -= 4, in += 64, out += 64) {
+		__m128i c0 = _mm_loadu_si128((const __m128i *)in);
+		__m128i c1 = _mm_loadu_si128((const __m128i *)(in + 16));
+		__m128i c2 = _mm_loadu_si128((const __m128i *)(in + 32));
+		__m128i c3 = _mm_loadu_si128((const __m128i *)(in + 48));
+		__m128i b0 = _mm_xor_si128(c0, keys[0]);
+		__m128i b1 = _mm_xor_si128(c1, keys[0]);
+		__m128i b2 = _mm_xor_si128(c2, keys[0]);
+		__m128i b3 = _mm_xor_si128(c3, keys[0]);
+		for (r = 1; r < rounds; r++) {
+			b0 = _mm_aesdec_si128(b0, keys[r]);
+			b1 = _mm_aesdec_si128(b1, keys[r]);
+			b2 = _mm_aesdec_si128(b2, keys[r]);
+			b3 = _mm_aesdec_si128(b3, keys[r]);
+		}
+		b0 = _mm_aesdeclast_si128(b0, keys[rounds]);
+		b1 = _mm_aesdeclast_si128(b1, keys[rounds]);
+		b2 = _mm_aesdeclast_si128(b2, keys[rounds]);
+		b3 = _mm_aesdeclast_si128(b3, keys[rounds]);
+		_mm_storeu_si128((__m128i *)out, _mm_xor_si128(b0, prev));
+		_mm_storeu_si128((__m128i *)(out + 16), _mm_xor_si128(b1, c0));
+		_mm_storeu_si128((__m128i *)(out + 32), _mm_xor_si128(b2, c1));
+		_mm_storeu_si128((__m128i *)(out + 48), _mm_xor_si128(b3, c2));
+		prev = c3;
+	}
+
+	for (; blocks; blocks--, in += 16, out += 16) {
+		__m128i c = _mm_loadu_si128((const __m128i *)in);
+		__m128i b = _mm_xor_si128(c, keys[0]);
+		for (r = 1; r < rounds; r++)
+			b = _mm_aesdec_si128(b, keys[r]);
+		b = _mm_aesdeclast_si128(b, keys[rounds]);
+		_mm_storeu_si128((__m128i *)out, _mm_xor_si128(b, prev));
+		prev = c;
+	}
+
+	_mm_storeu_si128((__m128i *)iv, prev);
+}
+
+AESNI_FUNCTION static void aesni_encrypt(u8 *iv, const u8 *in, u8 *out, unsigned long long blocks)
+{
+	const __m128i *keys = (const __m128i *)aesni_enc_keys;
+	__m128i b = _mm_loadu_si128((const __m128i *)iv);
+	int r;
+
+	for (; blocks; blocks--, in += 16, out += 16) {
+		b = _mm_xor_si128(b, _mm_loadu_si128((const __m128i *)in));
+		b = _mm_xor_si128(b, keys[0]);
+		for (r = 1; r < rounds; r++)
+			b = _mm_aesenc_si128(b, keys[r]);
+		b = _mm_aesenclast_si128(b, keys[rounds]);
+		_mm_storeu_si128((__m128i *)out, b);
+	}
+
+	_mm_storeu_si128((__m128i *)iv, b);
+}
+#endif
+
+// CBC mode decryption
+void aes_decrypt(u8 *iv, const u8 *inbuf, u8 *outbuf, unsigned long long len)
+{
+	unsigned long long blocks = len / 16;
+	u32 fraction = (u32)(len % 16);
+
+#ifdef AES_AESNI
+	if (backend == AES_BACKEND_AESNI)
+		aesni_decrypt(iv, inbuf, outbuf, blocks);
+	else
+#endif
+		tables_decrypt(iv, inbuf, outbuf, blocks);
+
+	if (fraction) {
+		u8 block[16];
+		u32 s[4];
+		u32 i;
+
+		memset(block, 0, sizeof(block));
+		memcpy(block, inbuf + blocks * 16, fraction);
+		for (i = 0; i < 4; i++)
+			s[i] = GET32(block + i * 4);
+		decrypt_block(s);
+		for (i = 0; i < fraction; i++)
+			outbuf[blocks * 16 + i] = iv[i] ^ (u8)(s[i / 4] >> (24 - (i % 4) * 8));
+		memcpy(iv, block, sizeof(block));
+	}
+}
+
+// CBC mode encryption
+void aes_encrypt(u8 *iv, const u8 *inbuf, u8 *outbuf, unsigned long long len)
+{
+	unsigned long long blocks = len / 16;
+	u32 fraction = (u32)(len % 16);
+
+#ifdef AES_AESNI
+	if (backend == AES_BACKEND_AESNI)
+		aesni_encrypt(iv, inbuf, outbuf, blocks);
+	else
+#endif
+		tables_encrypt(iv, inbuf, outbuf, blocks);
+
+	if (fraction) {
+		u8 block[16];
+		u32 s[4];
+		u32 i;
+
+		memset(block, 0, sizeof(block));
+		for (i = 0; i < fraction; i++)
+			block[i] = inbuf[blocks * 16 + i] ^ iv[i];
+		for (i = 0; i < 4; i++)
+			s[i] = GET32(block + i * 4);
+		encrypt_block(s);
+		for (i = 0; i < 4; i++) {
+			PUT32(iv + i * 4, s[i]);
+			PUT32(outbuf + blocks * 16 + i * 4, s[i]);
+		}
+	}
+}
+
+int aes_get_backend(void)
+{
+	return backend;
+}
+
+int aes_set_backend(int which)
+{
+	if (which < 0 || which >= AES_BACKENDS)
+		return -1;
+#ifdef AES_AESNI
+	if (which == AES_BACKEND_AESNI && !aesni_supported())
+		return -1;
+#else
+	if (which == AES_BACKEND_AESNI)
+		return -1;
+#endif
+
+	backend = which;
+#ifdef AES_AESNI
+	if (backend == AES_BACKEND_AESNI && rounds)
+		aesni_set_keys();
+#endif
+	return 0;
+}
+
+const char *aes_backend_name(int which)
+{
+	switch (which) {
+		case AES_BACKEND_TABLES:
+			return "tables";
+		case AES_BACKEND_AESNI:
+			return "aes-ni";
+	}
+
+	return "unknown";
+}
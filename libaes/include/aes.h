@@ -0,0 +1,37 @@
+#pragma once
+
+/* AES in CBC mode, shared by the launcher, rawksd, the disc module and
+ * stripios. There's one key at a time, set with aes_set_key (128 bit) or
+ * aes_set_key256, and the IV is updated so calls can be chained. Buffers
+ * can be decrypted or encrypted in place, and decrypting can also write
+ * below the input in the same buffer (each block is read before anything
+ * at or past it is written). A length that isn't a multiple of 16 is
+ * padded with zeroes; encrypting always writes the whole last block.
+ *
+ * The cipher is done with 32-bit lookup tables, or with AES-NI on x86
+ * CPUs that have it. The best one is picked the first time a key is set,
+ * aes_set_backend switches to another.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum {
+	AES_BACKEND_TABLES = 0,
+	AES_BACKEND_AESNI,
+	AES_BACKENDS
+};
+
+void aes_set_key(const u8 *key);
+void aes_set_key256(const u8 *key);
+void aes_decrypt(u8 *iv, const u8 *inbuf, u8 *outbuf, unsigned long long len);
+void aes_encrypt(u8 *iv, const u8 *inbuf, u8 *outbuf, unsigned long long len);
+
+int aes_get_backend(void);
+int aes_set_backend(int backend); // < 0 if this CPU can't use it
+const char *aes_backend_name(int backend);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,198 @@
+/* aesbench - checks and times libaes's backends on a PC
+ *
+ * Every backend this CPU has is run through the FIPS-197 example vectors
+ * for 128 and 256 bit keys, then has to decrypt and encrypt the same
+ * clusters (and odd lengths, for the zero padding) the same as the lookup
+ * tables do. Then each one decrypts 0x7C00 byte cluster payloads in place,
+ * the way the disc module and rawksd use it, and encrypts them again, and
+ * the speed of both is reported.
+ *
+ * Usage: aesbench [-m megabytes]
+ */
+
+#include <gctypes.h>
+#include <aes.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#define CLUSTER_DATA 0x7C00
+
+static const u8 fips_plain[16] = {
+	0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF
+};
+static const u8 fips_cipher128[16] = {
+	0x69, 0xC4, 0xE0, 0xD8, 0x6A, 0x7B, 0x04, 0x30, 0xD8, 0xCD, 0xB7, 0x80, 0x70, 0xB4, 0xC5, 0x5A
+};
+static const u8 fips_cipher256[16] = {
+	0x8E, 0xA2, 0xB7, 0xCA, 0x51, 0x67, 0x45, 0xBF, 0xEA, 0xFC, 0x49, 0x90, 0x4B, 0x49, 0x60, 0x89
+};
+
+static double Now()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void Fill(u8 *data, u32 length)
+{
+	u32 i;
+	for (i = 0; i < length; i++)
+		data[i] = rand();
+}
+
+static void SetKey(const u8 *key, int bits)
+{
+	if (bits == 256)
+		aes_set_key256(key);
+	else
+		aes_set_key(key);
+}
+
+static int CheckVector(int bits, const u8 *expected)
+{
+	u8 key[32], iv[16], block[16];
+	int i;
+
+	for (i = 0; i < 32; i++)
+		key[i] = i;
+	SetKey(key, bits);
+
+	memset(iv, 0, sizeof(iv));
+	aes_encrypt(iv, fips_plain, block, 16);
+	if (memcmp(block, expected, 16) || memcmp(iv, expected, 16))
+		return -1;
+
+	memset(iv, 0, sizeof(iv));
+	aes_decrypt(iv, block, block, 16);
+	if (memcmp(block, fips_plain, 16) || memcmp(iv, expected, 16))
+		return -1;
+
+	return 0;
+}
+
+// decrypt and encrypt with the backend, against what the tables make of the same
+static int CheckBackend(int backend, int bits, const u8 *key, const u8 *data, u32 length)
+{
+	static u8 expected[CLUSTER_DATA + 16], got[CLUSTER_DATA + 16];
+	u8 expectediv[16], iv[16];
+
+	aes_set_backend(AES_BACKEND_TABLES);
+	SetKey(key, bits);
+	memset(expectediv, 0x5A, sizeof(expectediv));
+	aes_decrypt(expectediv, data, expected, length);
+
+	aes_set_backend(backend);
+	SetKey(key, bits);
+	memset(iv, 0x5A, sizeof(iv));
+	memcpy(got, data, length);
+	aes_decrypt(iv, got, got, length);
+	if (memcmp(got, expected, length) || memcmp(iv, expectediv, 16))
+		return -1;
+
+	aes_set_backend(AES_BACKEND_TABLES);
+	SetKey(key, bits);
+	memset(expectediv, 0xA5, sizeof(expectediv));
+	memset(expected, 0, sizeof(expected));
+	aes_encrypt(expectediv, data, expected, length);
+
+	aes_set_backend(backend);
+	SetKey(key, bits);
+	memset(iv, 0xA5, sizeof(iv));
+	memset(got, 0, sizeof(got));
+	memcpy(got, data, length);
+	aes_encrypt(iv, got, got, length);
+	if (memcmp(got, expected, (length + 15) & ~15) || memcmp(iv, expectediv, 16))
+		return -1;
+
+	return 0;
+}
+
+static void Time(int backend, u8 *data, u32 clusters)
+{
+	u8 key[16], iv[16];
+	double start, decrypt, encrypt;
+	u32 i;
+
+	Fill(key, sizeof(key));
+	aes_set_backend(backend);
+	aes_set_key(key);
+
+	start = Now();
+	for (i = 0; i < clusters; i++) {
+		memset(iv, 0, sizeof(iv));
+		aes_decrypt(iv, data + i * CLUSTER_DATA, data + i * CLUSTER_DATA, CLUSTER_DATA);
+	}
+	decrypt = Now() - start;
+
+	start = Now();
+	for (i = 0; i < clusters; i++) {
+		memset(iv, 0, sizeof(iv));
+		aes_encrypt(iv, data + i * CLUSTER_DATA, data + i * CLUSTER_DATA, CLUSTER_DATA);
+	}
+	encrypt = Now() - start;
+
+	printf("%-8s decrypt %8.1f MB/s  encrypt %8.1f MB/s\n", aes_backend_name(backend),
+		clusters * (double)CLUSTER_DATA / decrypt / 1e6, clusters * (double)CLUSTER_DATA / encrypt / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+	static const u32 lengths[] = { 16, 48, 64, 80, 33, 7, CLUSTER_DATA };
+	u32 megabytes = 64;
+	u32 clusters, i;
+	int backend, opt, failed = 0;
+	u8 *data;
+
+	while ((opt = getopt(argc, argv, "m:")) != -1) {
+		switch (opt) {
+			case 'm':
+				megabytes = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				fprintf(stderr, "Usage: aesbench [-m megabytes]\n");
+				return 1;
+		}
+	}
+
+	clusters = megabytes * 1000000 / CLUSTER_DATA + 1;
+	data = (u8 *)malloc(clusters * CLUSTER_DATA);
+	if (!data)
+		return 1;
+
+	for (backend = 0; backend < AES_BACKENDS; backend++) {
+		if (aes_set_backend(backend) < 0) {
+			printf("%-8s not on this CPU\n", aes_backend_name(backend));
+			continue;
+		}
+
+		if (CheckVector(128, fips_cipher128) || CheckVector(256, fips_cipher256)) {
+			printf("%-8s FAILED the FIPS-197 vectors\n", aes_backend_name(backend));
+			failed = 1;
+			continue;
+		}
+
+		for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+			u8 key[32];
+			Fill(key, sizeof(key));
+			Fill(data, lengths[i]);
+			if (CheckBackend(backend, 128, key, data, lengths[i]) || CheckBackend(backend, 256, key, data, lengths[i])) {
+				printf("%-8s FAILED against the tables with %u bytes\n", aes_backend_name(backend), lengths[i]);
+				failed = 1;
+				break;
+			}
+		}
+		if (i < sizeof(lengths) / sizeof(lengths[0]))
+			continue;
+
+		Fill(data, clusters * CLUSTER_DATA);
+		Time(backend, data, clusters);
+	}
+
+	free(data);
+	return failed;
+}
@@ -12,7 +12,7 @@
 /* Stack align */
 #define STACK_ALIGN(type, name, cnt, alignment) \
 	u8 _al__##name[(sizeof(type)*(cnt)) + (alignment)]; \
-	type *name = (type*)ROUND_UP(_al__##name, alignment)
+	type *name = (type*)(((unsigned long)_al__##name + (alignment)-1)&~((unsigned long)(alignment)-1))
 
 #define SWAP32(a) ((((u32)(a) >> 24) & 0x000000FF) | (((u32)(a) >> 8)  & 0x0000FF00)|\
                   (((u32)(a) << 8)  & 0x00FF0000) | (((u32)(a) << 24) & 0xFF000000))
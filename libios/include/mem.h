@@ -18,13 +18,13 @@ u32 HeapInfo();
 	inline void* operator new(size_t size) {
 		return Alloc(size);
 	}
-	inline void operator delete(void* data) {
+	inline void operator delete(void* data) throw() {
 		Dealloc(data);
 	}
 	inline void* operator new[](size_t size) {
 		return Alloc(size);
 	}
-	inline void operator delete[](void* data) {
+	inline void operator delete[](void* data) throw() {
 		Dealloc(data);
 	}
 #endif
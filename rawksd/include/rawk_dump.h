@@ -30,9 +30,15 @@
 #define READ_ERROR			-2
 #define WRITE_ERROR			-3
 #define BEGIN_ERROR			-4
+#define NO_MORE_FILES		-5
 
 #define DEVICE_NONE			-1
 
+// the remaining time is worked out from the copy rate over the last
+// RATE_SAMPLES samples, taken RATE_SAMPLE_MS apart
+#define RATE_SAMPLES		16
+#define RATE_SAMPLE_MS		500
+
 int get_disc();
 void close_disc();
 u64 get_space(int device, int init=1);
@@ -52,10 +58,12 @@ struct rip_state {
 	char dir_name[50];
 	DIR *d;
 	int file_index;
-	time_t start;
-	time_t switch_time;
 	u64 device_free_space;
 	const char *out_filename;
+	u64 rate_time[RATE_SAMPLES];
+	u64 rate_bytes[RATE_SAMPLES];
+	int rate_first;
+	int rate_count;
 };
 
 u64 begin_rip(struct rip_state *rs,int disc);
@@ -36,7 +36,7 @@ misrepresented as being the original software.
 #include <unistd.h>
 
 #include "fst.h"
-#include "rijndael.h"
+#include <aes.h>
 #include "wdvd.h"
 
 #define DEVICE_NAME "fst"
@@ -46,12 +46,15 @@ misrepresented as being the original software.
 
 #define DIR_SEPARATOR '/'
 #define SECTOR_SIZE 0x800
-#define BUFFER_SIZE 0x8000
+#define READ_CLUSTERS 16 // a read covering whole clusters gets up to this many from the disc at once
+#define AESCACHE_CLUSTERS 4
+#define AESCACHE_FREE ((u64)-1)
 
 #define CLUSTER_HEADER_SIZE 0x400
 #define ENCRYPTED_CLUSTER_SIZE 0x8000
 #define PLAINTEXT_CLUSTER_SIZE (ENCRYPTED_CLUSTER_SIZE - CLUSTER_HEADER_SIZE)
 #define AES_BLOCK_SIZE 16
+#define READ_BUFFER_SIZE (READ_CLUSTERS * ENCRYPTED_CLUSTER_SIZE)
 #define ROUNDDOWN32(v) (((u32)(v)-0x1f)&~0x1f)
 
 typedef struct {
@@ -100,8 +103,13 @@ typedef struct {
     bool inUse;
 } DIR_STATE_STRUCT;
 
+typedef struct {
+    u64 offset;
+    u32 last_use;
+    u8 *data;
+} AESCACHE_ENTRY;
+
 static u8 *read_buffer=NULL;
-static u8 cluster_buffer[ENCRYPTED_CLUSTER_SIZE] __attribute__((aligned(32)));
 
 static DIR_ENTRY *root = NULL;
 static DIR_ENTRY *current = NULL;
@@ -109,9 +117,9 @@ static PARTITION *partitions = NULL;
 static u64 last_access = 0;
 static s32 dotab_device = -1;
 
-static u8 aescache[PLAINTEXT_CLUSTER_SIZE] __attribute__((aligned(32)));
-static u64 aescache_start = 0;
-static u64 aescache_end = 0;
+// the last few clusters decrypted for reads that only wanted part of them, by their offset on the disc
+static AESCACHE_ENTRY aescache[AESCACHE_CLUSTERS];
+static u32 aescache_clock = 0;
 
 static bool is_dir(DIR_ENTRY *entry) {
     return entry->flags & FLAG_DIR;
@@ -205,8 +213,8 @@ static int _FST_close_r(struct _reent *r, int fd) {
 static int _read(void *ptr, u64 offset, u32 len) {
     u32 sector = offset / SECTOR_SIZE;
     u32 sector_offset = offset % SECTOR_SIZE;
-    len = MIN(BUFFER_SIZE - sector_offset, len);
-    if (WDVD_LowReadSectors(read_buffer, BUFFER_SIZE / SECTOR_SIZE, sector)) {
+    len = MIN(READ_BUFFER_SIZE - sector_offset, len);
+    if (WDVD_LowReadSectors(read_buffer, (sector_offset + len + SECTOR_SIZE - 1) / SECTOR_SIZE, sector)) {
         last_access = gettime();
         return -1;
     }
@@ -223,22 +231,66 @@ static u64 plaintext_to_cipher(u64 offset) {
     return offset / PLAINTEXT_CLUSTER_SIZE * ENCRYPTED_CLUSTER_SIZE + (offset % PLAINTEXT_CLUSTER_SIZE) + CLUSTER_HEADER_SIZE;
 }
 
-static bool read_and_decrypt_cluster(aeskey title_key, u8 *buf, u64 offset, u32 offset_from_cluster, u32 len) {
-    u64 cache_start = cipher_to_plaintext(offset + offset_from_cluster);
-    u64 cache_end = cipher_to_plaintext(offset + offset_from_cluster + len);
-    if (aescache_end && cache_start >= aescache_start && cache_end <= aescache_end) {
-        memcpy(buf, aescache + (cache_start - aescache_start), len);
-        return true;
-    }
-    u32 bytes_read = _read(buf, offset, ENCRYPTED_CLUSTER_SIZE);
-    if (bytes_read != ENCRYPTED_CLUSTER_SIZE) return false;
-    u8 *iv = buf + 0x3d0;
-    u8 *inbuf = buf + CLUSTER_HEADER_SIZE;
+// count clusters starting at offset, read from the disc together and decrypted one after the other into buf,
+// with tail the cluster after them comes in the same read and is decrypted into that cache entry
+static bool read_and_decrypt_clusters(aeskey title_key, u8 *buf, u64 offset, u32 count, AESCACHE_ENTRY *tail) {
+    if (tail) {
+        tail->offset = AESCACHE_FREE;
+        tail->last_use = 0;
+    }
+    if (WDVD_LowReadSectors(read_buffer, (count + (tail ? 1 : 0)) * (ENCRYPTED_CLUSTER_SIZE / SECTOR_SIZE), offset / SECTOR_SIZE)) {
+        last_access = gettime();
+        return false;
+    }
+    last_access = gettime();
     aes_set_key(title_key);
-    aes_decrypt(iv, inbuf, aescache, PLAINTEXT_CLUSTER_SIZE);
-    aescache_start = cipher_to_plaintext(offset + CLUSTER_HEADER_SIZE);
-    aescache_end = aescache_start + PLAINTEXT_CLUSTER_SIZE;
-    memcpy(buf, aescache + offset_from_cluster - CLUSTER_HEADER_SIZE, len);
+    u32 i;
+    for (i = 0; i < count; i++) {
+        u8 *cluster = read_buffer + i * ENCRYPTED_CLUSTER_SIZE;
+        u8 *iv = cluster + 0x3d0;
+        aes_decrypt(iv, cluster + CLUSTER_HEADER_SIZE, buf + i * PLAINTEXT_CLUSTER_SIZE, PLAINTEXT_CLUSTER_SIZE);
+    }
+    if (tail) {
+        u8 *cluster = read_buffer + count * ENCRYPTED_CLUSTER_SIZE;
+        aes_decrypt(cluster + 0x3d0, cluster + CLUSTER_HEADER_SIZE, tail->data, PLAINTEXT_CLUSTER_SIZE);
+        tail->offset = offset + count * ENCRYPTED_CLUSTER_SIZE;
+        tail->last_use = ++aescache_clock;
+    }
+    return true;
+}
+
+static AESCACHE_ENTRY *aescache_find(u64 offset) {
+    u32 i;
+    for (i = 0; i < AESCACHE_CLUSTERS; i++) {
+        if (aescache[i].offset == offset) {
+            aescache[i].last_use = ++aescache_clock;
+            return aescache + i;
+        }
+    }
+    return NULL;
+}
+
+static AESCACHE_ENTRY *aescache_oldest(void) {
+    AESCACHE_ENTRY *entry = aescache;
+    u32 i;
+    for (i = 1; i < AESCACHE_CLUSTERS; i++) {
+        if (aescache[i].last_use < entry->last_use) entry = aescache + i;
+    }
+    return entry;
+}
+
+static u8 *decrypted_cluster(aeskey title_key, u64 offset) {
+    AESCACHE_ENTRY *entry = aescache_find(offset);
+    if (entry) return entry->data;
+    entry = aescache_oldest();
+    if (!read_and_decrypt_clusters(title_key, NULL, offset, 0, entry)) return NULL;
+    return entry->data;
+}
+
+static bool read_and_decrypt_cluster(aeskey title_key, u8 *buf, u64 offset, u32 offset_from_cluster, u32 len) {
+    u8 *cluster = decrypted_cluster(title_key, offset);
+    if (!cluster) return false;
+    memcpy(buf, cluster + offset_from_cluster - CLUSTER_HEADER_SIZE, len);
     return true;
 }
 
@@ -269,16 +321,37 @@ static int _FST_read_r(struct _reent *r, int fd, char *ptr, size_t len) {
             return -1;
         }
     } else {
-        u64 offset_from_data = plaintext_to_cipher((file->entry->offset << 2LL) + file->offset);
-        u64 cluster_offset_from_data = (offset_from_data / ENCRYPTED_CLUSTER_SIZE) * ENCRYPTED_CLUSTER_SIZE;
-        u32 offset_from_cluster = offset_from_data % ENCRYPTED_CLUSTER_SIZE;
-        len = MIN(ENCRYPTED_CLUSTER_SIZE - offset_from_cluster, len);
-        u64 data_offset = (partition->offset << 2LL) + (partition->partition_info.data_offset << 2LL);
-        if (!read_and_decrypt_cluster(partition->key, cluster_buffer, data_offset + cluster_offset_from_data, offset_from_cluster, len)) {
-            r->_errno = EIO;
-            return -1;
+        u64 data_offset = ((u64)partition->offset << 2) + ((u64)partition->partition_info.data_offset << 2);
+        u64 plaintext_offset = ((u64)file->entry->offset << 2) + file->offset;
+        size_t done = 0;
+        while (done < len) {
+            u64 cluster_offset = data_offset + plaintext_offset / PLAINTEXT_CLUSTER_SIZE * ENCRYPTED_CLUSTER_SIZE;
+            u32 offset_from_cluster = plaintext_offset % PLAINTEXT_CLUSTER_SIZE;
+            u32 clusters = (len - done) / PLAINTEXT_CLUSTER_SIZE;
+            size_t chunk;
+            if (!offset_from_cluster && clusters && !aescache_find(cluster_offset)) {
+                // whole clusters are decrypted straight into ptr
+                clusters = MIN(clusters, READ_CLUSTERS);
+                // a request ending part way into the next cluster gets it with the same disc command
+                AESCACHE_ENTRY *tail = NULL;
+                if (clusters < READ_CLUSTERS && len - done > clusters * PLAINTEXT_CLUSTER_SIZE &&
+                    !aescache_find(cluster_offset + clusters * ENCRYPTED_CLUSTER_SIZE))
+                    tail = aescache_oldest();
+                if (!read_and_decrypt_clusters(partition->key, (u8 *)ptr + done, cluster_offset, clusters, tail)) {
+                    r->_errno = EIO;
+                    return -1;
+                }
+                chunk = clusters * PLAINTEXT_CLUSTER_SIZE;
+            } else {
+                chunk = MIN(PLAINTEXT_CLUSTER_SIZE - offset_from_cluster, len - done);
+                if (!read_and_decrypt_cluster(partition->key, (u8 *)ptr + done, cluster_offset, offset_from_cluster + CLUSTER_HEADER_SIZE, chunk)) {
+                    r->_errno = EIO;
+                    return -1;
+                }
+            }
+            done += chunk;
+            plaintext_offset += chunk;
         }
-        memcpy(ptr, cluster_buffer, len);
     }
     file->offset += len;
     return len;
@@ -770,7 +843,7 @@ u64 FST_Mount() {
 
 		_CPU_ISR_Disable(level);
 
-		read_buffer = (u8*)ROUNDDOWN32(((u32)SYS_GetArena2Hi() - BUFFER_SIZE));
+		read_buffer = (u8*)ROUNDDOWN32(((u32)SYS_GetArena2Hi() - READ_BUFFER_SIZE - AESCACHE_CLUSTERS * PLAINTEXT_CLUSTER_SIZE));
 		if ((u32)read_buffer < (u32)SYS_GetArena2Lo()) {
 			_CPU_ISR_Restore(level);
 			return 0;
@@ -778,6 +851,9 @@ u64 FST_Mount() {
 
 		SYS_SetArena2Hi(read_buffer);
 		_CPU_ISR_Restore(level);
+		u32 i;
+		for (i = 0; i < AESCACHE_CLUSTERS; i++)
+			aescache[i].data = read_buffer + READ_BUFFER_SIZE + i * PLAINTEXT_CLUSTER_SIZE;
 	}
 
     FST_Unmount();
@@ -810,7 +886,11 @@ bool FST_Unmount() {
     partitions = NULL;
 
 	current = root;
-    aescache_end = 0;
+    u32 i;
+    for (i = 0; i < AESCACHE_CLUSTERS; i++) {
+        aescache[i].offset = AESCACHE_FREE;
+        aescache[i].last_use = 0;
+    }
     last_access = 0;
     if (dotab_device >= 0) {
         dotab_device = -1;
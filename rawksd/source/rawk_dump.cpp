@@ -9,6 +9,10 @@
 #include <unistd.h>
 #include <time.h>
 #include <dirent.h>
+#include <ogc/lwp.h>
+#include <ogc/mutex.h>
+#include <ogc/cond.h>
+#include <ogc/lwp_watchdog.h>
 
 #include "rawk_dump.h"
 
@@ -19,6 +23,7 @@
 #endif
 
 #include <string.h>
+#include <malloc.h>
 
 #define MAX_PATH 128
 
@@ -27,11 +32,29 @@
 #define RIP_OPTIONAL		2
 #define RIP_CREATE_ONLY		4
 
+// chunks in flight between the disc reader thread and the writer
+#define DUMP_BUFFERS		4
+#define DUMP_CHUNK			(BUFFER_SIZE*8)
+// below the main thread, so a finished write is followed by the next one at once
+#define READER_PRIORITY		60
+#define READER_STACK		0x8000
+
 struct dump_files {
 	const char *name;
 	int type;
 };
 
+// a chunk of a file read from the disc, waiting to be written
+struct dump_buffer {
+	void *data;
+	s32 length;
+	// the chunk starts a new file (it may hold no data at all)
+	bool new_file;
+	u64 file_size;
+	char file_name[32];
+	char out_filename[MAX_PATH];
+};
+
 struct disc_info {
 	const char *disc_name;
 	const char *dump_path;
@@ -161,9 +184,24 @@ static const char *disc_prefix[] = {
 	NULL
 };
 
-static s32 hId = -1;
 static char default_path[MAX_PATH*2] = {0};
-static void *copy_buf = NULL;
+
+/* The reader thread owns the disc side of rip_state (f_in, d, dir_name,
+ * file_index) and fills the ring in order, process_rip writes it out in the
+ * same order. ring_filled and ring_emptied only ever count up, the reader
+ * waits while all DUMP_BUFFERS are full and the writer while none are.
+ */
+static struct dump_buffer ring[DUMP_BUFFERS];
+static u32 ring_filled = 0;
+static u32 ring_emptied = 0;
+static bool reader_stop = false;
+static mutex_t ring_lock = LWP_MUTEX_NULL;
+static cond_t ring_cond = LWP_COND_NULL;
+static lwp_t reader_thread = LWP_THREAD_NULL;
+static char out_path[MAX_PATH];
+
+static bool start_reader(struct rip_state *rs);
+static void stop_reader();
 
 void File_Chdir(const char *path) {
 	if (path==NULL)
@@ -278,14 +316,36 @@ void close_disc()
 	FST_Unmount();
 }
 
-void update_time(u64 total, u64 current, time_t start, int *h, int *m, int *s)
+// false until there's been time to measure a rate
+bool update_time(struct rip_state *rs, int *h, int *m, int *s)
 {
-	time_t time_so_far = time(0) - start;
-	time_t estimated = (u64)time_so_far*total / current;
-	time_t est = (estimated>time_so_far) ? (estimated - time_so_far):1;
+	u64 now = gettime();
+	int last = (rs->rate_first + rs->rate_count - 1) % RATE_SAMPLES;
+
+	if (rs->rate_count==0 || ticks_to_millisecs(diff_ticks(rs->rate_time[last], now)) >= RATE_SAMPLE_MS)
+	{
+		if (rs->rate_count==RATE_SAMPLES)
+			rs->rate_first = (rs->rate_first+1) % RATE_SAMPLES;
+		else
+			rs->rate_count++;
+		last = (rs->rate_first + rs->rate_count - 1) % RATE_SAMPLES;
+		rs->rate_time[last] = now;
+		rs->rate_bytes[last] = rs->current;
+	}
+
+	// the rate since the oldest sample still in the window
+	u64 ms = ticks_to_millisecs(diff_ticks(rs->rate_time[rs->rate_first], now));
+	u64 bytes = rs->current - rs->rate_bytes[rs->rate_first];
+	if (ms==0 || bytes==0)
+		return false;
+
+	u64 est = (rs->current<rs->total) ? (rs->total - rs->current)*ms / bytes / 1000 : 0;
+	if (est==0)
+		est = 1;
 	*h = est / 3600;
 	*m = (est/60)%60;
 	*s = est % 60;
+	return true;
 }
 
 u64 space_needed(struct rip_state *rs, int disc)
@@ -413,7 +473,6 @@ bool prepare_device(struct rip_state *rs, int device)
 			rs->f_out=-1;
 		}
 		// shutdown old device
-		rs->switch_time = time(0);
 		rs->out_device = DEVICE_NONE;
 		rs->device_free_space = 0;
 	}
@@ -454,7 +513,7 @@ bool prepare_device(struct rip_state *rs, int device)
 					rs->out_device = device;
 					rs->device_free_space = get_space(device, 0);
 					// ignore the time taken to remount/prepare
-					rs->start += time(0) - rs->switch_time;
+					rs->rate_count = 0;
 					return true;
 				}
 			}
@@ -478,19 +537,32 @@ u64 begin_rip(struct rip_state *rs,int disc)
 	rs->disc = disc;
 	rs->disc_name = discs[disc].disc_name;
 	rs->total = space_needed(rs, disc);
-	rs->start = rs->switch_time = time(NULL);
+
+	if (rs->total && !start_reader(rs))
+		return 0;
 
 	return rs->total;
 }
 
-bool get_next(struct rip_state *rs, int dirs_only=0)
+// unbuffered, so each DUMP_CHUNK fread reaches the disc driver as one read
+// instead of a refill per st_blksize
+static FILE* open_input(const char *filename)
+{
+	FILE *f = fopen(filename, "rb");
+	if (f)
+		setvbuf(f, NULL, _IONBF, 0);
+	return f;
+}
+
+// opens the next file on the disc and describes it in buf, called by the reader thread
+bool get_next(struct rip_state *rs, struct dump_buffer *buf, int dirs_only=0)
 {
 	printf("get_next\n");
 	int j;
 	struct stat st;
 	const char **excl = discs[rs->disc].exclusions;
 	const struct dump_files *files = discs[rs->disc].rip_files;
-	static char full_filename[MAX_PATH];
+	char full_filename[MAX_PATH];
 	struct dirent *ent;
 
 	if (rs->f_in)
@@ -499,13 +571,6 @@ bool get_next(struct rip_state *rs, int dirs_only=0)
 		rs->f_in = NULL;
 	}
 
-	if (rs->f_out>=0)
-	{
-		File_Close(rs->f_out);
-		rs->f_out = -1;
-	}
-
-
 	while (rs->d && (ent = readdir(rs->d)))
 	{
 		printf("found %s\n", ent->d_name);
@@ -528,18 +593,14 @@ bool get_next(struct rip_state *rs, int dirs_only=0)
 					continue;
 				}
 			}
-			rs->bytes_in_current_file = st.st_size;
-			rs->offset_in_current_file = 0;
-			strncpy(rs->file_name, ent->d_name, 31);
+			buf->file_size = st.st_size;
+			buf->file_name[31] = 0;
+			strncpy(buf->file_name, ent->d_name, 31);
 			printf("opening %s for reading\n", full_filename);
-			rs->f_in = fopen(full_filename, "rb");
-			snprintf(full_filename, MAX_PATH-1, "%s/%s", files[rs->file_index].name, ent->d_name);
-			printf("opening %s for writing\n", full_filename);
-			rs->f_out = File_OpenPath(full_filename, O_CREAT|O_TRUNC|O_WRONLY);
-			if (rs->f_in==NULL || rs->f_out<0)
-				return false;
-			rs->out_filename = full_filename;
-			return true;
+			rs->f_in = open_input(full_filename);
+			buf->out_filename[MAX_PATH-1] = 0;
+			snprintf(buf->out_filename, MAX_PATH-1, "%s/%s", files[rs->file_index].name, ent->d_name);
+			return rs->f_in!=NULL;
 		}
 	}
 
@@ -572,7 +633,7 @@ bool get_next(struct rip_state *rs, int dirs_only=0)
 		}
 		else
 		{
-			File_CreateDirPath(files[rs->file_index].name);
+			// prepare_device has already created it on the output device
 			if (files[rs->file_index].type&RIP_CREATE_ONLY || dirs_only)
 			{
 				printf("create directory\n");
@@ -585,10 +646,10 @@ bool get_next(struct rip_state *rs, int dirs_only=0)
 				strncpy(rs->dir_name, full_filename, 31);
 			}
 		}
-		return get_next(rs);
+		return get_next(rs, buf);
 	}
 	else if (dirs_only)
-		return get_next(rs);
+		return get_next(rs, buf);
 
 	for (j=0; disc_prefix[j]!=NULL; j++)
 	{
@@ -608,36 +669,130 @@ bool get_next(struct rip_state *rs, int dirs_only=0)
 	if (st.st_size==0)
 	{
 		if (files[rs->file_index].type&RIP_OPTIONAL)
-			return get_next(rs);
+			return get_next(rs, buf);
 		else
 			return false;
 	}
-	rs->bytes_in_current_file = st.st_size;
-	rs->offset_in_current_file = 0;
-	rs->f_in = fopen(full_filename, "rb");
-	rs->f_out = File_OpenPath(files[rs->file_index].name, O_CREAT|O_TRUNC|O_WRONLY);
-	rs->out_filename = files[rs->file_index].name;
-	strncpy(rs->file_name, strrchr(full_filename, '/')+1, 31);
+	buf->file_size = st.st_size;
+	rs->f_in = open_input(full_filename);
+	buf->out_filename[MAX_PATH-1] = 0;
+	strncpy(buf->out_filename, files[rs->file_index].name, MAX_PATH-1);
+	buf->file_name[31] = 0;
+	strncpy(buf->file_name, strrchr(full_filename, '/')+1, 31);
 	if (rs->f_in==NULL)
 	{
 		printf("Couldn't open input file\n");
 		return false;
 	}
-	if (rs->f_out<0)
+
+	printf("Got next input file\n");
+	return true;
+}
+
+static void *dump_reader(void *arg)
+{
+	struct rip_state *rs = (struct rip_state*)arg;
+	u64 offset = 0, size = 0;
+
+	while (true)
 	{
-		printf("Couldn't open output file\n");
-		return false;
+		LWP_MutexLock(ring_lock);
+		while (ring_filled-ring_emptied==DUMP_BUFFERS && !reader_stop)
+			LWP_CondWait(ring_cond, ring_lock);
+		bool stop = reader_stop;
+		LWP_MutexUnlock(ring_lock);
+		if (stop)
+			break;
+
+		struct dump_buffer *buf = &ring[ring_filled%DUMP_BUFFERS];
+		buf->new_file = false;
+		buf->length = 0;
+		if (offset >= size)
+		{
+			// get_next also fails once it has run off the end of the list
+			if (!get_next(rs, buf))
+				buf->length = discs[rs->disc].rip_files[rs->file_index].name ? READ_ERROR : NO_MORE_FILES;
+			else
+			{
+				buf->new_file = true;
+				size = buf->file_size;
+				offset = 0;
+			}
+		}
+
+		if (buf->length==0 && offset<size)
+		{
+			buf->length = fread(buf->data, 1, MIN(DUMP_CHUNK, size-offset), rs->f_in);
+			if (buf->length<=0)
+				buf->length = READ_ERROR;
+			else
+				offset += buf->length;
+		}
+
+		LWP_MutexLock(ring_lock);
+		ring_filled++;
+		LWP_CondBroadcast(ring_cond);
+		LWP_MutexUnlock(ring_lock);
+
+		// nothing gets read after an error or the last file, the writer stops when it reaches it
+		if (buf->length<0)
+			break;
 	}
 
-	printf("Got next output file\n");
+	return NULL;
+}
+
+static bool start_reader(struct rip_state *rs)
+{
+	// whatever was set up before a failure is undone by stop_reader
+	ring_filled = ring_emptied = 0;
+	reader_stop = false;
+	if (LWP_MutexInit(&ring_lock, false)<0)
+	{
+		ring_lock = LWP_MUTEX_NULL;
+		return false;
+	}
+	if (LWP_CondInit(&ring_cond)<0)
+	{
+		ring_cond = LWP_COND_NULL;
+		return false;
+	}
+	if (LWP_CreateThread(&reader_thread, dump_reader, rs, NULL, READER_STACK, READER_PRIORITY)<0)
+	{
+		reader_thread = LWP_THREAD_NULL;
+		return false;
+	}
 	return true;
 }
 
+static void stop_reader()
+{
+	if (reader_thread!=LWP_THREAD_NULL)
+	{
+		LWP_MutexLock(ring_lock);
+		reader_stop = true;
+		LWP_CondBroadcast(ring_cond);
+		LWP_MutexUnlock(ring_lock);
+		LWP_JoinThread(reader_thread, NULL);
+		reader_thread = LWP_THREAD_NULL;
+	}
+	if (ring_cond!=LWP_COND_NULL)
+	{
+		LWP_CondDestroy(ring_cond);
+		ring_cond = LWP_COND_NULL;
+	}
+	if (ring_lock!=LWP_MUTEX_NULL)
+	{
+		LWP_MutexDestroy(ring_lock);
+		ring_lock = LWP_MUTEX_NULL;
+	}
+}
+
 s64 process_rip(struct rip_state *rs)
 {
 	//printf("process_rip\n");
-	s64 readed;
-	if (rs==NULL)
+	s32 written;
+	if (rs==NULL || reader_thread==LWP_THREAD_NULL)
 		return BEGIN_ERROR;
 
 	if (rs->out_device==DEVICE_NONE)
@@ -653,49 +808,65 @@ s64 process_rip(struct rip_state *rs)
 			return WRITE_ERROR;
 	}
 
-	if (rs->offset_in_current_file >= rs->bytes_in_current_file)
-	{
-		if (!get_next(rs))
-			return READ_ERROR;
+	LWP_MutexLock(ring_lock);
+	while (ring_filled==ring_emptied)
+		LWP_CondWait(ring_cond, ring_lock);
+	LWP_MutexUnlock(ring_lock);
 
-#if 0 // can't happen, the device has already been checked to make sure it is big enough for everything
-		rs->device_free_space = get_space(rs->out_device, 0);
-		printf("free space: %llu, needed: %llu\n", rs->device_free_space, rs->bytes_in_current_file);
+	struct dump_buffer *buf = &ring[ring_emptied%DUMP_BUFFERS];
+	if (buf->length<0)
+		return buf->length;
 
-		if ((rs->bytes_in_current_file+MIN_FREE_SPACE) >= rs->device_free_space)
+	if (buf->new_file)
+	{
+		if (rs->f_out>=0)
+			File_Close(rs->f_out);
+		strcpy(out_path, buf->out_filename);
+		rs->out_filename = out_path;
+		printf("opening %s for writing\n", out_path);
+		rs->f_out = File_OpenPath(out_path, O_CREAT|O_TRUNC|O_WRONLY);
+		if (rs->f_out<0)
 		{
-			printf("Not enough space on current disc\n");
-			if (rs->f_out>=0)
-			{
-				File_Close(rs->f_out);
-				rs->f_out = -1;
-				File_Delete(rs->out_filename);
-			}
-			prepare_device(rs, DEVICE_NONE);
-			return DEVICE_FULL;
+			printf("Couldn't open output file\n");
+			return WRITE_ERROR;
 		}
-#endif
+		// link all its clusters now instead of one at a time as it's written
+		File_Reserve(rs->f_out, buf->file_size);
+		strcpy(rs->file_name, buf->file_name);
+		rs->bytes_in_current_file = buf->file_size;
+		rs->offset_in_current_file = 0;
+		// modify .bik version
+		if (buf->length>=4 && strcasestr(rs->file_name, ".bik") && !memcmp(buf->data, "BIKi", 4))
+			memcpy(buf->data, "RAWK", 4);
 	}
 
-	readed=fread(copy_buf, 1, MIN(BUFFER_SIZE*2,rs->bytes_in_current_file-rs->offset_in_current_file), rs->f_in);
-	if (readed>0)
+	written = buf->length;
+	if (written>0 && written != File_Write(rs->f_out, buf->data, written))
+	{
+		printf("Write error\n");
+		return WRITE_ERROR;
+	}
+
+	LWP_MutexLock(ring_lock);
+	ring_emptied++;
+	LWP_CondBroadcast(ring_cond);
+	LWP_MutexUnlock(ring_lock);
+
+	if (written>0)
 	{
 		int h, m, s;
-		// modify .bik version
-		if (rs->offset_in_current_file==0 && strcasestr(rs->file_name, ".bik") && !memcmp(copy_buf, "BIKi", 4))
-			memcpy(copy_buf, "RAWK", 4);
-		if (readed != File_Write(rs->f_out, copy_buf, readed))
-		{
-			printf("Write error\n");
-			return WRITE_ERROR;
-		}
-		rs->current += readed;
-		rs->offset_in_current_file += readed;
-		rs->device_free_space -= readed;
-		update_time(rs->total, rs->current, rs->start, &h, &m, &s);
+		rs->current += written;
+		rs->offset_in_current_file += written;
+		rs->device_free_space -= written;
 		sprintf(rs->status_text, "\n\n%.29s %02d%%\n", rs->file_name, (u32)((u64)100*rs->offset_in_current_file/rs->bytes_in_current_file));
-		sprintf(rs->status_text+strlen(rs->status_text), "%llu of %llu bytes copied.\n\nApproximately ", \
+		sprintf(rs->status_text+strlen(rs->status_text), "%llu of %llu bytes copied.\n\n", \
 			rs->offset_in_current_file, rs->bytes_in_current_file);
+		if (!update_time(rs, &h, &m, &s))
+		{
+			strcat(rs->status_text, "Estimating time remaining.");
+			return written;
+		}
+		strcat(rs->status_text, "Approximately ");
 		if (h>1)
 			sprintf(rs->status_text+strlen(rs->status_text), "%d hours, ", h);
 		else if (h)
@@ -709,10 +880,8 @@ s64 process_rip(struct rip_state *rs)
 		else
 			sprintf(rs->status_text+strlen(rs->status_text), "1 second ");
 		strcat(rs->status_text, "remaining.");
-		return readed;
 	}
-	else
-		return READ_ERROR;
+	return written;
 }
 
 void end_rip(struct rip_state *rs)
@@ -721,6 +890,9 @@ void end_rip(struct rip_state *rs)
 	if (rs==NULL)
 		return;
 
+	// the disc side belongs to the reader until it has stopped
+	stop_reader();
+
 	if (rs->d)
 		closedir(rs->d);
 
@@ -733,15 +905,26 @@ void end_rip(struct rip_state *rs)
 
 static struct rip_state rs;
 
+static bool have_buffers()
+{
+	for (int i=0; i<DUMP_BUFFERS; i++)
+	{
+		if (ring[i].data==NULL)
+			return false;
+	}
+	return true;
+}
+
 MenuDump::MenuDump(GuiWindow *_Main) :
 RawkMenu(NULL, "\nInitializing.....", "Reading Disc"),
 Main(_Main)
 {
-	if (hId <0)
-		hId = iosCreateHeap(BUFFER_SIZE*2+64);
-
-	if (hId>=0 && copy_buf==NULL)
-		copy_buf = iosAlloc(hId, BUFFER_SIZE*2);
+	// far too big for the IPC heap, File_Write takes any 32 byte aligned buffer
+	for (int i=0; i<DUMP_BUFFERS; i++)
+	{
+		if (ring[i].data==NULL)
+			ring[i].data = memalign(32, DUMP_CHUNK);
+	}
 
 	if (disk_subsequent_reset && default_mount>=0)
 		WDVD_Reset();
@@ -773,7 +956,7 @@ RawkMenu* MenuDump::Process()
 	switch (state) {
 		case RIP_BEGIN: {
 			int disc;
-			if (copy_buf==NULL) {
+			if (!have_buffers()) {
 				state = RIP_ABORT;
 				msg_index = ABORT_MEM;
 				break;
@@ -828,10 +1011,12 @@ RawkMenu* MenuDump::Process()
 		case RIP_RIPPING: {
 			s64 bytes_read = process_rip(&rs);
 			if (bytes_read>0) {
-				space -= bytes_read;
 				HaltGui();
 				popup_text[1]->SetText(rs.status_text);
 				ResumeGui();
+			} else if (bytes_read==NO_MORE_FILES) {
+				// not when the bytes run out, empty files may still follow the last one
+				state = RIP_DONE;
 			} else if (bytes_read<0) {
 				state = RIP_ABORT;
 				switch(bytes_read) {
@@ -848,8 +1033,6 @@ RawkMenu* MenuDump::Process()
 				}
 				break;
 			}
-			if (space<=0)
-				state = RIP_DONE;
 			break;
 		}
 		case RIP_DONE:
@@ -25,35 +25,19 @@
 static list<Connection*> Connections;
 static OSLock ConnectionsLock;
 
-vector<string> Stat::IDs;
+FileIdTable Stat::IDs;
+PageCache Connection::Cache;
 const string Connection::FileIdPath = "/mnt/identifier";
 
-static void AcceptClient(string Root, TcpClient *client)
-{
-	void *new_thread = NULL;
-	Connection *connection = new Connection(Root, client);
-	if (connection)
-		new_thread = Thread_Create((void*)connection->Run, connection);
-	
-	if (new_thread==NULL)
-	{
-		connection->DebugPrint("Couldn't create thread, closing connection");
-		delete connection;
-		return;
-	}
-	connection->DebugPrint("Connection Established");
-	GetLock(ConnectionsLock);
-	Connections.push_back(connection);
-	ReleaseLock(ConnectionsLock);
-	Thread_Start(new_thread);
-}
-
 static void THREAD TimeoutThread(void* _listener)
 {
 	TcpListener *listener = (TcpListener*)_listener;
 	while (true)
 	{
 		listener->CheckForBroadcast();
+		string report = Connection::Cache.Report();
+		if (!report.empty())
+			Log.Print(LogLevel::Ops, report);
 		GetLock(ConnectionsLock);
 		for (list<Connection*>::iterator iter=Connections.begin(); iter != Connections.end(); ++iter)
 		{
@@ -63,8 +47,9 @@ static void THREAD TimeoutThread(void* _listener)
 			{
 				ostringstream dprint;
 				dprint << "Ping Timeout (" << diff << " seconds)";
-				(*iter)->DebugPrint(dprint.str());
-				(*iter)->Close();
+				(*iter)->Print(LogLevel::Ops, dprint.str());
+				// the reactor notices the shutdown and reaps the connection
+				(*iter)->Client->Close();
 			}
 		}
 		ReleaseLock(ConnectionsLock);
@@ -75,6 +60,27 @@ int main(int argc, char* argv[])
 {
 	string Root;
 	int port = 1137;
+	int workers = 4;
+	LogLevel::Enum level = LogLevel::Ops;
+	string trace_file;
+
+	// --log=<level> and --trace=<file> can go anywhere, the rest is positional
+	vector<char*> args;
+	for (int i=0; i < argc; i++)
+	{
+		string arg = argv[i];
+		if (!arg.compare(0, 6, "--log=")) {
+			if (!Logger::ParseLevel(arg.substr(6), level)) {
+				cout << "Unknown log level " << arg.substr(6) << " (off, ops or debug), aborting..." << endl;
+				return -1;
+			}
+		} else if (!arg.compare(0, 8, "--trace="))
+			trace_file = arg.substr(8);
+		else
+			args.push_back(argv[i]);
+	}
+	argc = (int)args.size();
+	argv = &args[0];
 
 	if (argc > 1)
 		Root = argv[1];
@@ -90,6 +96,19 @@ int main(int argc, char* argv[])
 	if (argc > 2)
 		port = atoi(argv[2]);
 
+	if (argc > 3)
+		workers = MAX(atoi(argv[3]), 1);
+
+	if (argc > 4 && !Stat::IDs.Load(argv[4])) {
+		cout << "Couldn't open identifier file " << argv[4] << ", aborting..." << endl;
+		return -1;
+	}
+
+	if (!Log.Start(level, trace_file)) {
+		cout << "Couldn't start logging to " << trace_file << ", aborting..." << endl;
+		return -1;
+	}
+
 	NetworkInit();
 	ConnectionsLock = CreateLock();
 
@@ -100,17 +119,161 @@ int main(int argc, char* argv[])
 		return -1;
 	}
 
+	if (!Connection::Cache.Start(PAGE_CACHE_SIZE, PREFETCH_THREADS)) {
+		cout << "Couldn't start prefetch threads, aborting..." << endl;
+		delete listener;
+		return -1;
+	}
+
+	Reactor *reactor = new Reactor(Root, listener);
+	if (!reactor->Start(workers)) {
+		cout << "Couldn't start reactor, aborting..." << endl;
+		delete reactor;
+		delete listener;
+		return -1;
+	}
+
 	void *timeout = Thread_Create((void*)TimeoutThread, listener);
 	Thread_Start(timeout);
 
 	cout << "RiiFS C++ Server is now ready for connections on " << listener->LocalEndPoint << endl;
 
-	while(true)
-		AcceptClient(Root, listener->AcceptTcpClient());
+	reactor->Run();
 
 	return 0;
 }
 
+Reactor::Reactor(string root, TcpListener *_listener) :
+poll(NULL),
+listener(_listener),
+Root(root)
+{
+	queue_lock = CreateLock();
+	queue_sem = CreateSem();
+}
+
+bool Reactor::Start(int workers)
+{
+	poll = Poll_Create();
+	if (poll==NULL || !Poll_Add(poll, listener->Socket(), NULL))
+		return false;
+
+	for (int i=0; i < workers; i++) {
+		void *thread = Thread_Create((void*)Worker, this);
+		if (thread==NULL)
+			return false;
+		Thread_Start(thread);
+	}
+
+	return true;
+}
+
+void Reactor::Run()
+{
+	PollEvent events[MAX_EVENTS];
+	while (true)
+	{
+		int count = Poll_Wait(poll, events, MAX_EVENTS);
+		for (int i=0; i < count; i++)
+		{
+			if (events[i].Context == NULL)
+				Accept();
+			else
+				HandleEvent((Connection*)events[i].Context, events[i]);
+		}
+	}
+}
+
+void Reactor::Accept()
+{
+	TcpClient *client;
+	while ((client = listener->AcceptTcpClient()) != NULL)
+	{
+		Connection *connection = new Connection(Root, client);
+		if (!Poll_Add(poll, client->Socket(), connection))
+		{
+			connection->Print(LogLevel::Ops, "Couldn't watch socket, closing connection");
+			delete connection;
+			continue;
+		}
+		connection->Print(LogLevel::Ops, "Connection Established");
+		GetLock(ConnectionsLock);
+		Connections.push_back(connection);
+		ReleaseLock(ConnectionsLock);
+	}
+}
+
+// hand a connection with buffered actions to the worker pool (StateLock must be held)
+void Reactor::Dispatch(Connection *connection)
+{
+	connection->Busy = true;
+	GetLock(queue_lock);
+	queue.push_back(connection);
+	ReleaseLock(queue_lock);
+	PostSem(queue_sem);
+}
+
+// re-arm the socket for whatever the connection waits on (StateLock must be held)
+void Reactor::Update(Connection *connection)
+{
+	TcpClient *client = connection->Client;
+	// a partial request has to be read in whole however big it is
+	bool read = client->Connected && !connection->Closing && (client->Available() < TCP_INPUT_MAX || !connection->ActionReady());
+	bool write = client->Pending() || connection->Finished();
+	Poll_Modify(poll, client->Socket(), connection, read, write);
+}
+
+void Reactor::HandleEvent(Connection *connection, PollEvent &event)
+{
+	TcpClient *client = connection->Client;
+
+	if (event.Read || event.Error)
+		client->Receive();
+	if (event.Write || event.Error)
+		client->Flush();
+
+	GetLock(connection->StateLock);
+	if (!connection->Busy && client->Connected && !connection->Closing && connection->ActionReady())
+		Dispatch(connection);
+
+	if (connection->Finished()) {
+		ReleaseLock(connection->StateLock);
+		Poll_Remove(poll, client->Socket());
+		delete connection;
+		return;
+	}
+
+	Update(connection);
+	ReleaseLock(connection->StateLock);
+}
+
+void Reactor::Worker(void *_p)
+{
+	Reactor *reactor = (Reactor*)_p;
+	while (true)
+	{
+		WaitSem(reactor->queue_sem);
+		GetLock(reactor->queue_lock);
+		Connection *connection = reactor->queue.front();
+		reactor->queue.pop_front();
+		ReleaseLock(reactor->queue_lock);
+
+		GetLock(connection->StateLock);
+		while (connection->Client->Connected && !connection->Closing && connection->ActionReady())
+		{
+			ReleaseLock(connection->StateLock);
+			bool more = connection->WaitForAction();
+			GetLock(connection->StateLock);
+			if (!more)
+				connection->Closing = true;
+		}
+		connection->Busy = false;
+		// the reactor flushes the replies, or reaps the connection if it's done
+		reactor->Update(connection);
+		ReleaseLock(connection->StateLock);
+	}
+}
+
 FileInfo::FileInfo(string path) :
 FullName(path),
 Length(0),
@@ -125,10 +288,14 @@ Exists(false)
 	Name = path.substr(path.find_last_of("/")+1);
 }
 
-TcpClient::TcpClient(SOCKET s, string ep)
+TcpClient::TcpClient(SOCKET s, unsigned int address, unsigned short port) :
+sock(s),
+inpos(0),
+Address(address),
+Port(port)
 {
-	RemoteEndPoint= ep;
-	sock = s;
+	RemoteEndPoint = ip_to_string(address, port);
+	lock = CreateLock();
 	Connected = true;
 }
 
@@ -139,6 +306,10 @@ TcpClient::~TcpClient()
 		Close();
 	}
 	closesocket(sock);
+	for (list<Segment>::iterator iter=out.begin(); iter != out.end(); ++iter)
+		if (iter->type == Segment::File)
+			File_Close(iter->fd);
+	DestroyLock(lock);
 }
 
 void TcpClient::Close()
@@ -151,74 +322,208 @@ void TcpClient::Close()
 
 int TcpClient::Read(void *data, int len)
 {
-	if (!len || !Connected)
-		return 0;
-	int ret = recv(sock, (char*)data, len, 0);
-	if (ret <= 0)
-	{
-		Connected = false;
+	if (len <= 0)
 		return 0;
+	GetLock(lock);
+	len = MIN(len, (int)(inbuf.size()-inpos));
+	if (len > 0) {
+		memcpy(data, &inbuf[inpos], len);
+		inpos += len;
 	}
-	return ret;
+	ReleaseLock(lock);
+	return len;
+}
+
+// the Buffer segment at the end of the output queue (lock must be held)
+vector<char>& TcpClient::OutBuffer()
+{
+	if (out.empty() || out.back().type != Segment::Buffer) {
+		out.push_back(Segment());
+		out.back().type = Segment::Buffer;
+		out.back().pos = 0;
+		// reuse the last flushed buffer's allocation
+		out.back().data.swap(spare);
+	}
+	return out.back().data;
 }
 
 int TcpClient::Write(void *data, int len)
 {
-	if (!len || !Connected)
+	if (len <= 0 || !Connected)
 		return 0;
-	int ret = send(sock, (const char*)data, len, 0);
-	if (ret <= 0)
-	{
-		Connected = false;
+	GetLock(lock);
+	// small writes (Stat, Return) pile onto the last buffer
+	vector<char> &data_buf = OutBuffer();
+	data_buf.insert(data_buf.end(), (char*)data, (char*)data+len);
+	out.back().length = data_buf.size();
+	ReleaseLock(lock);
+	return len;
+}
+
+// read up to len bytes from fd's current position into the output buffer
+int TcpClient::WriteFromFile(int fd, int len)
+{
+	if (len <= 0 || !Connected)
 		return 0;
-	}
-	return ret;
+	GetLock(lock);
+	vector<char> &data_buf = OutBuffer();
+	size_t start = data_buf.size();
+	data_buf.resize(start + len);
+	int ret = File_Read(fd, &data_buf[start], len);
+	data_buf.resize(start + MAX(ret, 0));
+	out.back().length = data_buf.size();
+	ReleaseLock(lock);
+	return MAX(ret, 0);
 }
 
-int TcpClient::Read(ofstream *dst, int len)
+// queue len bytes of fd from offset, sent straight from the file by the reactor
+int TcpClient::SendFile(int fd, u64 offset, int len)
 {
-	u64 read = 0;
-	while (read < len) {
-		int ret = 0;
-		ret = Read(buffer, MIN(TCP_BUFFER_LEN, len-read));
-		if (ret <= 0)
-			break;
+	if (len <= 0 || !Connected)
+		return 0;
+	// the client may close its file before the reactor gets to this
+	int file = File_Dup(fd);
+	if (file < 0)
+		return 0;
+	GetLock(lock);
+	out.push_back(Segment());
+	out.back().type = Segment::File;
+	out.back().fd = file;
+	out.back().offset = offset;
+	out.back().length = len;
+	out.back().pos = 0;
+	ReleaseLock(lock);
+	return len;
+}
 
-		dst->write(buffer, ret);
+void TcpClient::Pad(int len)
+{
+	if (len <= 0 || !Connected)
+		return;
+	GetLock(lock);
+	out.push_back(Segment());
+	out.back().type = Segment::Zero;
+	out.back().length = len;
+	out.back().pos = 0;
+	ReleaseLock(lock);
+}
 
-		read += (u64)read;
+// pull what the socket has into the input buffer, stopping once TCP_INPUT_MAX
+// is waiting, false on disconnect
+bool TcpClient::Receive()
+{
+	char data[TCP_RECV_LEN];
+	while (Connected) {
+		int ret = recv(sock, data, sizeof(data), 0);
+		if (ret < 0 && WOULD_BLOCK)
+			return true;
+		if (ret <= 0) {
+			Connected = false;
+			break;
+		}
+		GetLock(lock);
+		// drop consumed data before growing
+		if (inpos && inpos*2 >= inbuf.size()) {
+			inbuf.erase(inbuf.begin(), inbuf.begin()+inpos);
+			inpos = 0;
+		}
+		inbuf.insert(inbuf.end(), data, data+ret);
+		bool full = inbuf.size()-inpos >= TCP_INPUT_MAX;
+		ReleaseLock(lock);
+		if (full)
+			return true;
 	}
-
-	return (int)read;
+	return false;
 }
 
-int TcpClient::Write(ifstream *src, int len)
+// send as much of one segment as the socket takes
+int TcpClient::FlushSegment(Segment &seg)
 {
-	u64 read=0;
-	while (read < len) {
-		int ret;
-		src->read(buffer, MIN(TCP_BUFFER_LEN, len-read));
-		ret = src->gcount();
-
-		Write(buffer, ret);
+	static const char zeroes[0x4000] = {0};
+	int len = (int)MIN(seg.length - seg.pos, (u64)0x40000000);
 
-		read += ret;
+	switch (seg.type)
+	{
+		case Segment::Buffer:
+			return send(sock, &seg.data[seg.pos], len, 0);
+		case Segment::File: {
+			int ret = Socket_SendFile(sock, seg.fd, seg.offset + seg.pos, len);
+			// file got shorter since the read was answered, zero-fill the rest
+			if (ret == 0) {
+				File_Close(seg.fd);
+				seg.type = Segment::Zero;
+				return FlushSegment(seg);
+			}
+			return ret;
+		}
+		default:
+			return send(sock, zeroes, MIN(len, (int)sizeof(zeroes)), 0);
+	}
+}
 
-		if (!(*src))
+// send as much of the output queue as the socket takes, false on disconnect
+bool TcpClient::Flush()
+{
+	bool ret = true;
+	GetLock(lock);
+	while (!out.empty()) {
+		Segment &seg = out.front();
+		if (seg.pos == seg.length) {
+			if (seg.type == Segment::File)
+				File_Close(seg.fd);
+			else if (seg.type == Segment::Buffer && seg.data.capacity() > spare.capacity()) {
+				seg.data.clear();
+				spare.swap(seg.data);
+			}
+			out.pop_front();
+			continue;
+		}
+		int sent = FlushSegment(seg);
+		if (sent < 0 && WOULD_BLOCK)
 			break;
+		if (sent <= 0) {
+			Connected = false;
+			ret = false;
+			break;
+		}
+		seg.pos += sent;
 	}
+	if (!Connected) {
+		for (list<Segment>::iterator iter=out.begin(); iter != out.end(); ++iter)
+			if (iter->type == Segment::File)
+				File_Close(iter->fd);
+		out.clear();
+	}
+	ReleaseLock(lock);
+	return ret;
+}
 
-	return (int)read;
+int TcpClient::Available()
+{
+	GetLock(lock);
+	int ret = (int)(inbuf.size()-inpos);
+	ReleaseLock(lock);
+	return ret;
 }
 
-void TcpClient::Pad(int len)
+bool TcpClient::Peek(void *data, int offset, int len)
 {
-	memset(buffer, 0, TCP_BUFFER_LEN);
-	while (len>0) {
-		int to_send = MIN(TCP_BUFFER_LEN, len);
-		Write(buffer, to_send);
-		len -= to_send;
+	bool ret = false;
+	GetLock(lock);
+	if (inbuf.size()-inpos >= (size_t)(offset+len)) {
+		memcpy(data, &inbuf[inpos+offset], len);
+		ret = true;
 	}
+	ReleaseLock(lock);
+	return ret;
+}
+
+bool TcpClient::Pending()
+{
+	GetLock(lock);
+	bool ret = !out.empty();
+	ReleaseLock(lock);
+	return ret;
 }
 
 TcpListener::TcpListener(int _port) : port(_port)
@@ -231,6 +536,8 @@ TcpListener::TcpListener(int _port) : port(_port)
 	saddr.sin_addr.s_addr = htonl(INADDR_ANY);
 
 	listen_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	int reuse = 1;
+	setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, (char*)&reuse, sizeof(reuse));
 	bind(listen_socket, (SOCKADDR*)&saddr, sizeof(saddr));
 	if (getsockname(listen_socket, (SOCKADDR*)&saddr, &host_len)==0 && host_len>0) {
 		port = ntohs(saddr.sin_port);
@@ -256,6 +563,9 @@ int TcpListener::Start()
 	if (bind(locate_socket, (SOCKADDR*)&saddr, sizeof(saddr)) < 0)
 		return -1;
 
+	// the reactor accepts until the backlog is empty
+	Socket_SetNonBlocking(listen_socket);
+
 	return listen(listen_socket, SOMAXCONN); // listen returns SOCKET_ERROR(-1) on error
 }
 
@@ -286,7 +596,9 @@ void TcpListener::CheckForBroadcast()
 		{
 			// reply with the actual server port
 			unsigned int nport = htonl(port);
-			cout << "Broadcast ping from " << ip_to_string(ntohl(saddr.sin_addr.s_addr), ntohs(saddr.sin_port)) << ", replying with port " << port << endl;
+			ostringstream dprint;
+			dprint << "Broadcast ping, replying with port " << port;
+			Log.Print(LogLevel::Ops, dprint.str(), ntohl(saddr.sin_addr.s_addr), ntohs(saddr.sin_port));
 			memcpy(data, &nport, sizeof(int));
 			host_len = sendto(locate_socket, data, sizeof(data), 0, (SOCKADDR*)&saddr, host_len);
 		}
@@ -303,15 +615,12 @@ TcpClient* TcpListener::AcceptTcpClient()
 	if (new_sock < 0)
 		return NULL;
 
-	return new TcpClient(new_sock, ip_to_string(ntohl(host.sin_addr.s_addr), ntohs(host.sin_port)));
-}
-
-void Thread_Sleep(int secs)
-{
-	struct timeval timeout;
-	timeout.tv_sec = secs;
-	timeout.tv_usec = 0;
-	select(0, NULL, NULL, NULL, &timeout);
+	Socket_SetNonBlocking(new_sock);
+	// replies go out as several sends (data, then the return value), don't let
+	// Nagle hold the last one back waiting for an ACK
+	int nodelay = 1;
+	setsockopt(new_sock, IPPROTO_TCP, TCP_NODELAY, (char*)&nodelay, sizeof(nodelay));
+	return new TcpClient(new_sock, ntohl(host.sin_addr.s_addr), ntohs(host.sin_port));
 }
 
 string ip_to_string(unsigned int hostip, unsigned short port)
@@ -321,13 +630,66 @@ string ip_to_string(unsigned int hostip, unsigned short port)
 	return ep.str();
 }
 
+FileIdTable::FileIdTable()
+{
+	lock = CreateLock();
+}
+
+FileIdTable::~FileIdTable()
+{
+	DestroyLock(lock);
+}
+
+// read back ids from a previous run and keep appending new ones
+bool FileIdTable::Load(string filename)
+{
+	ifstream saved(filename.c_str());
+	string path;
+	GetLock(lock);
+	while (getline(saved, path))
+	{
+		if (ids.insert(unordered_map<string, u64>::value_type(path, paths.size())).second)
+			paths.push_back(path);
+	}
+	store.open(filename.c_str(), ios_base::out | ios_base::app);
+	bool ret = store.good();
+	ReleaseLock(lock);
+	return ret;
+}
+
+u64 FileIdTable::Get(const string &path)
+{
+	GetLock(lock);
+	unordered_map<string, u64>::iterator iter = ids.find(path);
+	u64 id;
+	if (iter != ids.end())
+		id = iter->second;
+	else
+	{
+		id = paths.size();
+		ids.insert(unordered_map<string, u64>::value_type(path, id));
+		paths.push_back(path);
+		if (store.is_open())
+			store << path << endl;
+	}
+	ReleaseLock(lock);
+	return id;
+}
+
+bool FileIdTable::Lookup(u64 id, string &path)
+{
+	GetLock(lock);
+	bool ret = id < paths.size();
+	if (ret)
+		path = paths[(size_t)id];
+	ReleaseLock(lock);
+	return ret;
+}
+
 Stat::Stat(FileInfo file)
 {
 	Device = 0;
-	vector<string>::iterator iter = find(IDs.begin(), IDs.end(), file.FullName);
-	Identifier = iter - IDs.begin();
-	if (iter == IDs.end())
-		IDs.push_back(file.FullName);
+	Identifier = IDs.Get(file.FullName);
 	Size = file.Length;
 	Mode = S_IFREG;
 	Name = file.Name;
@@ -342,46 +704,90 @@ Stat::Stat(DirectoryInfo* directory)
 	Name = directory->Name;
 }
 
-void Stat::Write(TcpClient *Client)
+// pack into the big endian Stats layout the client expects
+void Stat::Write(unsigned char *data)
 {
 	u64 beIdentifier = be64((unsigned char*)&Identifier);
 	u64 beSize = be64((unsigned char*)&Size);
 	int beDevice = be32((unsigned char*)&Device);
 	int beMode = be32((unsigned char*)&Mode);
-	Client->Write(&beIdentifier);
-	Client->Write(&beSize);
-	Client->Write(&beDevice);
-	Client->Write(&beMode);
+	memcpy(data, &beIdentifier, 8);
+	memcpy(data+8, &beSize, 8);
+	memcpy(data+16, &beDevice, 4);
+	memcpy(data+20, &beMode, 4);
+}
+
+void Stat::Write(TcpClient *Client)
+{
+	unsigned char data[Size_Packed];
+	Write(data);
+	Client->Write(data, sizeof(data));
 }
 
 Connection::Connection(string root, TcpClient *client) :
 Root(root),
-Client(client)
+Client(client),
+Busy(false),
+Closing(false)
 {
 	OpenFileFD = 1;
 	LastPing = time(NULL);
-	Name = Client->RemoteEndPoint;
+	memset(&Op, 0, sizeof(Op));
+	StateLock = CreateLock();
 }
 
 Connection::~Connection()
 {
 	GetLock(ConnectionsLock);
 	Close();
-	DebugPrint("Disconnected.");
+	Print(LogLevel::Ops, "Disconnected.");
 	Connections.remove(this);
 	ReleaseLock(ConnectionsLock);
 	delete Client;
+	DestroyLock(StateLock);
 }
 
-void Connection::Run(void *_p)
+// true when a complete action is buffered, so WaitForAction won't run dry
+bool Connection::ActionReady()
 {
-	Connection *p = (Connection*)_p;
-	while (p->Client && p->Client->Connected)
+	unsigned char header[12];
+	if (!Client->Peek(header, 0, 4))
+		return false;
+
+	switch (be32(header))
 	{
-		if (!p->WaitForAction())
-			break;
+		case Action::Send: {
+			if (!Client->Peek(header, 0, 12))
+				return false;
+			int length = (int)be32(header+8);
+			return length <= 0 || Client->Available() >= 12 + length;
+		}
+		case Action::Receive:
+			return Client->Available() >= 8;
+		case Action::Compound: {
+			// walk the option headers until the whole frame is known to be here
+			if (!Client->Peek(header, 0, 12))
+				return false;
+			int count = (int)be32(header+8);
+			int offset = 12;
+			for (int i=0; i < count; i++)
+			{
+				if (!Client->Peek(header, offset, 8))
+					return false;
+				int length = (int)be32(header+4);
+				offset += 8 + MAX(length, 0);
+			}
+			return Client->Available() >= offset;
+		}
+		default:
+			return true;
 	}
-	delete p;
+}
+
+// nothing left to do but free the connection (StateLock must be held)
+bool Connection::Finished()
+{
+	return !Busy && (Closing || !Client->Connected) && !Client->Pending();
 }
 
 vector<unsigned char> Connection::GetData(int size)
@@ -418,8 +824,9 @@ string Connection::GetPath(vector<unsigned char> data)
 		u64 id;
 		istringstream filename(path.substr(FileIdPath.length()+1, 16));
 		filename >> hex >> id;
-		if (Stat::IDs.size() > (int)id)
-			return Stat::IDs[(int)id];
+		string id_path;
+		if (Stat::IDs.Lookup(id, id_path))
+			return id_path;
 	}
 	if (path[0] == '/')
 		path = path.substr(1);
@@ -443,38 +850,132 @@ int Connection::GetFD()
 	return -1;
 }
 
-void Connection::DebugPrint(string text)
+void Connection::Print(LogLevel::Enum level, const string &text)
+{
+	Log.Print(level, text, Client->Address, Client->Port);
+}
+
+// start logging an op, Return finishes the record with the result
+void Connection::Trace(int command, int fd, u64 arg0, u64 arg1, const string &text, const string &second)
 {
-	char time_string[100];
-	time_t now = time(NULL);
-	struct tm *tm_now = localtime(&now);
-	strftime(time_string, sizeof(time_string)-1, "%m/%d/%Y %I:%M:%S %p", tm_now);
-	cout << '[' << time_string << ']' << " - " << Name << " - " << text << endl;
+	if (!Log.Wants(LogLevel::Ops))
+		return;
+	Op.Time = Clock_Now();
+	Op.Address = Client->Address;
+	Op.Port = Client->Port;
+	Op.Kind = LogRecord::Op;
+	Op.Level = LogLevel::Ops;
+	Op.Command = command;
+	Op.File = fd;
+	Op.Args[0] = arg0;
+	Op.Args[1] = arg1;
+	Logger::SetText(Op, text, second);
 }
 
 void Connection::Close()
 {
-	for (map<int, fstream*>::iterator iter=OpenFiles.begin(); iter != OpenFiles.end(); iter++)
-	{
-		iter->second->close();
-		delete iter->second;
-	}
+	for (map<int, OpenFile>::iterator iter=OpenFiles.begin(); iter != OpenFiles.end(); iter++)
+		File_Close(iter->second.Handle);
 	OpenFiles.clear();
 	Client->Close();
 }
 
+static void put_be32(unsigned char *data, int value)
+{
+	value = be32((unsigned char*)&value);
+	memcpy(data, &value, 4);
+}
+
+/* Pack as many directory entries as fit into one DIRNEXT_CACHE_SIZE
+ * reply: entry count, name offsets, Stats, then the names. If the listing
+ * ends in this batch a final entry with offset -1 marks the end so the
+ * client doesn't have to ask again.
+ */
+bool Connection::FillDirCache(pair<vector<Stat>, int> &dir, unsigned char *cache)
+{
+	vector<Stat> &stats = dir.first;
+	size_t first = dir.second;
+	size_t count = 0;
+	int names = 0;
+
+	// 4 bytes for the count, 4+Size_Packed per entry plus its name
+	while (first + count < stats.size())
+	{
+		int size = 4 + (int)(count+1) * (4+Stat::Size_Packed) + names + (int)stats[first+count].Name.length() + 1;
+		if (size > DIRNEXT_CACHE_SIZE)
+			break;
+		names += stats[first+count].Name.length() + 1;
+		count++;
+	}
+
+	bool end = first + count == stats.size() &&
+		4 + (int)(count+1) * (4+Stat::Size_Packed) + names <= DIRNEXT_CACHE_SIZE;
+	int entries = (int)count + (end ? 1 : 0);
+
+	// a name too long to ever fit, don't loop on it forever
+	if (entries == 0)
+		return false;
+
+	unsigned char *offsets = cache + 4;
+	unsigned char *stattable = offsets + entries * 4;
+	char *nametable = (char*)(stattable + entries * Stat::Size_Packed);
+	int name_offset = 0;
+
+	put_be32(cache, entries);
+	for (size_t i=0; i < count; i++)
+	{
+		Stat &st = stats[first+i];
+		put_be32(offsets + i*4, name_offset);
+		st.Write(stattable + i*Stat::Size_Packed);
+		strcpy(nametable + name_offset, st.Name.c_str());
+		name_offset += st.Name.length() + 1;
+	}
+	if (end)
+	{
+		put_be32(offsets + count*4, -1);
+		Stat().Write(stattable + count*Stat::Size_Packed);
+	}
+
+	dir.second += count;
+	return true;
+}
+
+/* Map ARM open modes to OS flags the way the old fstream based code
+ * interpreted them: no O_CREAT means the file is read, writing without
+ * reading truncates unless appending.
+ */
+int Connection::OpenFlags(int mode)
+{
+	bool in = !(mode & ARM_O_CREAT);
+	bool out = (mode & O_RDWR) || (mode & O_WRONLY);
+	bool trunc = (mode & ARM_O_TRUNC) != 0;
+	bool append = !trunc && (mode & ARM_O_APPEND);
+
+	if (!out)
+		return (in && !trunc && !append) ? O_RDONLY|O_BINARY : -1;
+	if (!in)
+		return O_WRONLY|O_CREAT|O_BINARY|(append ? O_APPEND : O_TRUNC);
+	if (trunc)
+		return O_RDWR|O_CREAT|O_TRUNC|O_BINARY;
+	if (append)
+		return O_RDWR|O_CREAT|O_APPEND|O_BINARY;
+	return O_RDWR|O_BINARY;
+}
+
 void Connection::Return(int value)
 {
-	ostringstream s;
-	s << "\tReturn " << value;
-	DebugPrint(s.str());
+	if (Op.Kind == LogRecord::Op) {
+		Op.Result = value;
+		Op.Elapsed = (unsigned int)(Clock_Now() - Op.Time);
+		Log.Write(Op);
+		Op.Kind = LogRecord::Message;
+	}
 	value = be32(((unsigned char*)&value));
 	Client->Write(&value);
 }
 
 bool Connection::WaitForAction()
 {
-	ostringstream dprint;
 	Action::Enum action = (Action::Enum)GetBE32();
 	if (Client==NULL || !Client->Connected)
 		return false;
@@ -491,338 +992,361 @@ bool Connection::WaitForAction()
 
 			Options[option] = data;
 
-			if (option == Option::Ping)
-				DebugPrint("Ping()");
+			if (Log.Wants(LogLevel::Debug)) {
+				Trace(option, -1, length);
+				Op.Kind = LogRecord::Option;
+				Op.Level = LogLevel::Debug;
+				Log.Write(Op);
+				Op.Kind = LogRecord::Message;
+			}
 
 			break;
 		}
-		case Action::Receive: {
+		case Action::Receive:
+			return RunCommand((Command::Enum)GetBE32());
+		case Action::Compound: {
+			// the options for a command and the command itself in one frame
 			Command::Enum command = (Command::Enum)GetBE32();
-			switch (command)
+			int count = GetBE32();
+			for (int i=0; i < count; i++)
 			{
-				case Command::Handshake: {
-					string clientversion((char*)&(Options[Option::Handshake][0]));
-					dprint << "Handshake: Client Version \"" << clientversion << "\"";
-					DebugPrint(dprint.str());
-
-					if (clientversion == "1.03")
-						Return(ServerVersion);
-					else if (clientversion == "1.02")
-						Return(3);
-					else
-						Return(-1);
+				Option::Enum option = (Option::Enum)GetBE32();
+				int length = GetBE32();
+				vector<unsigned char> data;
+				if (length >= 0)
+					data = GetData(length);
+				Options[option] = data;
+			}
+			return RunCommand(command);
+		}
+		default:
+			return true;
+	}
+	return true;
+}
 
-					break;
-				}
-				case Command::Goodbye: {
-					DebugPrint("Goodbye");
-					Return(1);
+bool Connection::RunCommand(Command::Enum command)
+{
+	// positioned reads/writes are a seek followed by the plain command
+	if (command == Command::FileReadAt || command == Command::FileWriteAt)
+	{
+		int fd = GetFD();
+		u64 offset = 0;
+		if (Options[Option::Offset].size()>=8)
+			offset = be64(&Options[Option::Offset][0]);
+		if (OpenFiles.count(fd))
+			File_Seek(OpenFiles[fd].Handle, offset, SEEK_SET);
+		command = command == Command::FileReadAt ? Command::FileRead : Command::FileWrite;
+	}
 
-					return false;
-				}
-				case Command::Log: {
-					dprint << "Log: " << &(Options[Option::Data][0]);
-					DebugPrint(dprint.str());
-					Return(1);
-					break;
-				}
-				case Command::FileOpen: {
-					string path = GetPath();
-					int mode = 0;
-					if (Options[Option::Mode].size()>=4)
-						mode = be32(Options[Option::Mode]);
-
-					dprint << "File_Open(\"" << path << "\", " << showbase << hex << mode << dec << noshowbase << ");";
-					DebugPrint(dprint.str());
-
-					int fd = -1;
-					ios_base::openmode fmode = ios_base::binary;
-					if (!(mode & ARM_O_CREAT))
-						fmode |= ios_base::in;
-					if (mode&O_RDWR || mode&O_WRONLY)
-						fmode |= ios_base::out;
-
-					if (mode & ARM_O_TRUNC)
-						fmode |= ios_base::trunc;
-					else if (mode & ARM_O_APPEND)
-						fmode |= ios_base::app;
-
-					fstream *new_stream = new fstream(path.c_str(), fmode);
-					if (new_stream->fail())
-						delete new_stream;
-					else
-					{
-						fd = OpenFileFD++;
-						OpenFiles.insert(map<int, fstream*>::value_type(int(fd), new_stream));
-					}
-
-					Return(fd);
-					break;
-				}
-				case Command::FileRead: {
-					int ret = 0;
-					int fd = GetFD();
-					int length=0;
-					if (Options[Option::Length].size()>=4)
-						length = be32(Options[Option::Length]);
-					dprint << "File_Read(" << fd << ", " << length << ");";
-					DebugPrint(dprint.str());
-					if (OpenFiles.count(fd)) {
-						// pointless seek in case last op was a write
-						OpenFiles[fd]->seekg(OpenFiles[fd]->tellg(), ios::beg);
-						ret = Client->Write((ifstream*)OpenFiles[fd], length);
-					}
-					if (ret < length)
-						Client->Pad(length - ret);
-					Return(ret);
-					break;
-				}
-				case Command::FileWrite: {
-					int fd  = GetFD();
-					int length = Options[Option::Data].size()-1;
-					dprint << "File_Write(" << fd << ", " << length << ");";
-					DebugPrint(dprint.str());
-					if (length<=0 || !OpenFiles.count(fd))
-						Return(0);
-					else
-					{
-						// pointless seek in case last op was a read
-						OpenFiles[fd]->seekg(OpenFiles[fd]->tellg(), ios::beg);
-						OpenFiles[fd]->write((char*)&Options[Option::Data][0], length);
-						if (OpenFiles[fd]->bad()) {
-							Return(0);
-							OpenFiles[fd]->clear();
-						}
-						else
-							Return(length);
-					}
-					break;
-				}
-				case Command::FileSeek: {
-					int fd = GetFD();
-					fstream::off_type where=0;
-					ios_base::seekdir whence = ios_base::cur;
-					if (Options[Option::SeekWhere].size()<4 || Options[Option::SeekWhence].size()<4)
-						fd = -1;
-					else {
-						where = (int)be32(Options[Option::SeekWhere]);
-						switch(be32(Options[Option::SeekWhence])) {
-							case 0:
-								whence = ios_base::beg;
-								break;
-							case 2:
-								whence = ios_base::end;
-								break;
-							//case 1:
-							default:
-								whence = ios_base::cur;
-						}
-					}
-					dprint << "File_Seek(" << fd << ", " << where << ", " << whence << ");";
-					DebugPrint(dprint.str());
-					if (!OpenFiles.count(fd))
-						Return(-1);
-					else
-					{
-						// set the read pointer, it might fail if file is write only
-						// in that case set the write pointer
-						if (OpenFiles[fd]->seekg(where, whence).fail()) {
-							OpenFiles[fd]->clear();
-							OpenFiles[fd]->seekp(where, whence);
-						}
-						Return(OpenFiles[fd]->fail() ? -1 : 0);
-						OpenFiles[fd]->clear();
-					}
-					break;
-				}
-				case Command::FileTell: {
-					int fd = GetFD();
-					dprint << "File_Tell(" << fd << ");";
-					DebugPrint(dprint.str());
-					if (!OpenFiles.count(fd))
-						Return(-1);
-					else
-						// tellp for writing position
-						Return((int)OpenFiles[fd]->tellg());
-					break;
-				}
-				case Command::FileSync: {
-					int fd = GetFD();
-					dprint << "File_Sync(" << fd << ");";
-					DebugPrint(dprint.str());
-					if (!OpenFiles.count(fd))
-						Return(-1);
-					else
-					{
-						OpenFiles[fd]->flush();
-						Return(1);
-					}
-					break;
-				}
-				case Command::FileClose: {
-					int fd = GetFD();
-					dprint << "File_Close(" << fd << ");";
-					DebugPrint(dprint.str());
-					if (!OpenFiles.count(fd))
-						Return(0);
-					else
-					{
-						OpenFiles[fd]->close();
-						delete OpenFiles[fd];
-						OpenFiles.erase(fd);
-						Return(1);
-					}
-					break;
-				}
-				case Command::FileStat: {
-					string path = GetPath();
-					dprint << "File_Stat(\"" << path << "\");";
-					DebugPrint(dprint.str());
-
-					FileInfo file(path);
-					if (!file.Exists) {
-						DirectoryInfo *dir = CreateDirectoryInfo(path);
-						if (!dir->Exists) {
-							Stat empty;
-							empty.Write(Client);
-							Return(-1);
-						} else {
-							Stat st(dir);
-							st.Write(Client);
-							Return(0);
-						}
-						delete dir;
-					} else {
-						Stat st(file);
-						st.Write(Client);
-						Return(0);
-					}
-					break;
-				}
-				case Command::FileCreate: {
-					string path = GetPath();
-					dprint << "File_Create(\"" << path << "\");";
-					DebugPrint(dprint.str());
-					FileInfo file(path);
-					if (!file.Exists) {
-						ofstream f(path.c_str(), ios_base::out);
-						if (!f) {
-							Return(0);
-							break;
-						}
-						else
-							f.close();
-					}
-					Return(1);
-					break;
+	switch (command)
+	{
+		case Command::Handshake: {
+			string clientversion((char*)&(Options[Option::Handshake][0]));
+			Trace(Command::Handshake, -1, 0, 0, clientversion);
+
+			if (clientversion == "1.04")
+				Return(ServerVersion);
+			else if (clientversion == "1.03")
+				Return(4);
+			else if (clientversion == "1.02")
+				Return(3);
+			else
+				Return(-1);
+
+			break;
+		}
+		case Command::Goodbye: {
+			Trace(Command::Goodbye, -1);
+			Return(1);
+
+			return false;
+		}
+		case Command::Log: {
+			Trace(Command::Log, -1, 0, 0, (char*)&(Options[Option::Data][0]));
+			Return(1);
+			break;
+		}
+		case Command::FileOpen: {
+			string path = GetPath();
+			int mode = 0;
+			if (Options[Option::Mode].size()>=4)
+				mode = be32(Options[Option::Mode]);
+
+			Trace(Command::FileOpen, -1, mode, 0, path);
+
+			int fd = -1;
+			int flags = OpenFlags(mode);
+			int file = flags < 0 ? -1 : File_Open(path.c_str(), flags, 0666);
+			if (file >= 0)
+			{
+				fd = OpenFileFD++;
+				OpenFiles.insert(map<int, OpenFile>::value_type(fd, OpenFile(file, (flags & O_ACCMODE) != O_WRONLY, path)));
+			}
+
+			Return(fd);
+			break;
+		}
+		case Command::FileRead: {
+			int ret = 0;
+			int fd = GetFD();
+			int length=0;
+			if (Options[Option::Length].size()>=4)
+				length = be32(Options[Option::Length]);
+			Trace(Command::FileRead, fd, length);
+			if (OpenFiles.count(fd) && OpenFiles[fd].Readable && length > 0) {
+				int file = OpenFiles[fd].Handle;
+				u64 pos = File_Seek(file, 0, SEEK_CUR);
+				Op.Args[1] = pos;
+				// larger reads already skip the copy with sendfile()
+				int cached = length < SENDFILE_MIN ? Cache.Read(OpenFiles[fd], pos, length, Client) : -1;
+				struct stat st;
+				if (cached >= 0) {
+					ret = cached;
+					File_Seek(file, pos + ret, SEEK_SET);
 				}
-				case Command::FileDelete: {
-					string path = GetPath();
-					dprint << "File_Delete(\"" << path << "\");";
-					DebugPrint(dprint.str());
-					Return (!remove(path.c_str()));
-					break;
+				else if (length < SENDFILE_MIN)
+					ret = Client->WriteFromFile(file, length);
+				else if (File_Stat(file, &st)==0) {
+					// the reply length has to be known before the data goes out
+					if ((u64)st.st_size > pos)
+						ret = (int)MIN((u64)length, (u64)st.st_size - pos);
+					ret = Client->SendFile(file, pos, ret);
+					File_Seek(file, pos + ret, SEEK_SET);
 				}
-				case Command::FileRename: {
-					string source = GetPath(Options[Option::RenameSource]);
-					string dest = GetPath(Options[Option::RenameDestination]);
-					dprint << "File_Rename(\"" << source << "\", \"" << dest << "\");";
-					DebugPrint(dprint.str());
-					FileInfo file(source);
-					if (!file.Exists)
-						Return(0);
-					else {
-						rename(source.c_str(), dest.c_str());
-						Return(1);
-					}
-					break;
+			}
+			if (ret < length)
+				Client->Pad(length - ret);
+			Return(ret);
+			break;
+		}
+		case Command::FileWrite: {
+			int fd  = GetFD();
+			int length = Options[Option::Data].size()-1;
+			Trace(Command::FileWrite, fd, length);
+			if (length<=0 || !OpenFiles.count(fd))
+				Return(0);
+			else
+			{
+				int written = 0;
+				while (written < length) {
+					int ret = File_Write(OpenFiles[fd].Handle, (char*)&Options[Option::Data][written], length-written);
+					if (ret <= 0)
+						break;
+					written += ret;
 				}
-				case Command::FileCreateDir: {
-					string path = GetPath();
-					dprint << "File_CreateDir(\"" + path + "\");";
-					DebugPrint(dprint.str());
-					DirectoryInfo* dir = CreateDirectoryInfo(path);
-					if (!dir->Exists)
-						Return(!mkdir(path.c_str()));
-					else
-						Return(1);
-					delete dir;
-					break;
+				if (written > 0) {
+					Cache.Invalidate(OpenFiles[fd].Key);
+					OpenFiles[fd].Refresh();
 				}
-				case Command::FileOpenDir: {
-					string path = GetPath();
-					dprint << "File_OpenDir(\"" << path << "\");";
-					DebugPrint(dprint.str());
-					DirectoryInfo* dir = CreateDirectoryInfo(path);
-
-					if (!dir->Exists)
-						Return(-1);
-					else {
-						int fd = OpenFileFD++;
-						vector<Stat> stats;
-						Stat stat = dir->GetNext();
-						while (stat.Mode & S_IFREG)
-						{
-							stats.push_back(stat);
-							stat = dir->GetNext();
-						}
-						pair<vector<Stat>, int> p(stats, 0);
-						OpenDirs.insert(map<int, pair<vector<Stat>, int> >::value_type(fd, p));
-
-						Return (fd);
-					}
-					delete dir;
-					break;
+				Return(written < length ? 0 : length);
+			}
+			break;
+		}
+		case Command::FileSeek: {
+			int fd = GetFD();
+			int where=0;
+			int whence = SEEK_CUR;
+			if (Options[Option::SeekWhere].size()<4 || Options[Option::SeekWhence].size()<4)
+				fd = -1;
+			else {
+				where = (int)be32(Options[Option::SeekWhere]);
+				switch(be32(Options[Option::SeekWhence])) {
+					case 0:
+						whence = SEEK_SET;
+						break;
+					case 2:
+						whence = SEEK_END;
+						break;
+					//case 1:
+					default:
+						whence = SEEK_CUR;
 				}
-				case Command::FileCloseDir: {
-					int fd = GetFD();
-					dprint << "File_CloseDir(" << fd << ");";
-					DebugPrint(dprint.str());
-
-					if (!OpenDirs.count(fd))
-						Return(-1);
-					else {
-						OpenDirs[fd].first.clear();
-						OpenDirs.erase(fd);
-						Return(1);
-					}
-					break;
+			}
+			Trace(Command::FileSeek, fd, where, whence);
+			if (!OpenFiles.count(fd))
+				Return(-1);
+			else
+				Return(File_Seek(OpenFiles[fd].Handle, where, whence) < 0 ? -1 : 0);
+			break;
+		}
+		case Command::FileTell: {
+			int fd = GetFD();
+			Trace(Command::FileTell, fd);
+			if (!OpenFiles.count(fd))
+				Return(-1);
+			else
+				Return((int)File_Seek(OpenFiles[fd].Handle, 0, SEEK_CUR));
+			break;
+		}
+		case Command::FileSync: {
+			int fd = GetFD();
+			Trace(Command::FileSync, fd);
+			// writes go straight to the OS, nothing is buffered here
+			if (!OpenFiles.count(fd))
+				Return(-1);
+			else
+				Return(1);
+			break;
+		}
+		case Command::FileClose: {
+			int fd = GetFD();
+			Trace(Command::FileClose, fd);
+			if (!OpenFiles.count(fd))
+				Return(0);
+			else
+			{
+				File_Close(OpenFiles[fd].Handle);
+				OpenFiles.erase(fd);
+				Return(1);
+			}
+			break;
+		}
+		case Command::FileStat: {
+			string path = GetPath();
+			Trace(Command::FileStat, -1, 0, 0, path);
+
+			FileInfo file(path);
+			if (!file.Exists) {
+				DirectoryInfo *dir = CreateDirectoryInfo(path);
+				if (!dir->Exists) {
+					Stat empty;
+					empty.Write(Client);
+					Return(-1);
+				} else {
+					Stat st(dir);
+					st.Write(Client);
+					Return(0);
 				}
-				case Command::FileNextDirPath: {
-					char pathbuf[MAXPATHLEN] = {0};
-					int fd = GetFD();
-					dprint << "File_NextDir(" << fd << ");";
-					DebugPrint(dprint.str());
-					if (!OpenDirs.count(fd) || OpenDirs[fd].second >= OpenDirs[fd].first.size()) {
-						Client->Write(pathbuf, sizeof(pathbuf));
-						Return(-1);
-					} else {
-						string name = OpenDirs[fd].first[OpenDirs[fd].second].Name;
-						strcpy(pathbuf, name.c_str());
-						Client->Write(pathbuf, sizeof(pathbuf));
-						Return(name.length());
-					}
+				delete dir;
+			} else {
+				Stat st(file);
+				st.Write(Client);
+				Return(0);
+			}
+			break;
+		}
+		case Command::FileCreate: {
+			string path = GetPath();
+			Trace(Command::FileCreate, -1, 0, 0, path);
+			FileInfo file(path);
+			if (!file.Exists) {
+				ofstream f(path.c_str(), ios_base::out);
+				if (!f) {
+					Return(0);
 					break;
 				}
-				case Command::FileNextDirStat: {
-					int fd = GetFD();
-					if (!OpenDirs.count(fd)) {
-						Stat s;
-						s.Write(Client);
-						Return(1);
-					} else {
-						OpenDirs[fd].first[OpenDirs[fd].second++].Write(Client);
-						Return(0);
-					}
-					break;
+				else
+					f.close();
+			}
+			Return(1);
+			break;
+		}
+		case Command::FileDelete: {
+			string path = GetPath();
+			Trace(Command::FileDelete, -1, 0, 0, path);
+			Return (!remove(path.c_str()));
+			break;
+		}
+		case Command::FileRename: {
+			string source = GetPath(Options[Option::RenameSource]);
+			string dest = GetPath(Options[Option::RenameDestination]);
+			Trace(Command::FileRename, -1, 0, 0, source, dest);
+			FileInfo file(source);
+			if (!file.Exists)
+				Return(0);
+			else {
+				rename(source.c_str(), dest.c_str());
+				Return(1);
+			}
+			break;
+		}
+		case Command::FileCreateDir: {
+			string path = GetPath();
+			Trace(Command::FileCreateDir, -1, 0, 0, path);
+			DirectoryInfo* dir = CreateDirectoryInfo(path);
+			if (!dir->Exists)
+				Return(!mkdir(path.c_str()));
+			else
+				Return(1);
+			delete dir;
+			break;
+		}
+		case Command::FileOpenDir: {
+			string path = GetPath();
+			Trace(Command::FileOpenDir, -1, 0, 0, path);
+			DirectoryInfo* dir = CreateDirectoryInfo(path);
+
+			if (!dir->Exists)
+				Return(-1);
+			else {
+				int fd = OpenFileFD++;
+				vector<Stat> stats;
+				Stat stat = dir->GetNext();
+				while (stat.Mode & S_IFREG)
+				{
+					stats.push_back(stat);
+					stat = dir->GetNext();
 				}
-				default:
-					break;
+				pair<vector<Stat>, int> p(stats, 0);
+				OpenDirs.insert(map<int, pair<vector<Stat>, int> >::value_type(fd, p));
+
+				Return (fd);
 			}
+			delete dir;
+			break;
+		}
+		case Command::FileCloseDir: {
+			int fd = GetFD();
+			Trace(Command::FileCloseDir, fd);
+
+			if (!OpenDirs.count(fd))
+				Return(-1);
+			else {
+				OpenDirs[fd].first.clear();
+				OpenDirs.erase(fd);
+				Return(1);
+			}
+			break;
+		}
+		case Command::FileNextDirPath: {
+			char pathbuf[MAXPATHLEN] = {0};
+			int fd = GetFD();
+			Trace(Command::FileNextDirPath, fd);
+			if (!OpenDirs.count(fd) || OpenDirs[fd].second >= OpenDirs[fd].first.size()) {
+				Client->Write(pathbuf, sizeof(pathbuf));
+				Return(-1);
+			} else {
+				string name = OpenDirs[fd].first[OpenDirs[fd].second].Name;
+				strcpy(pathbuf, name.c_str());
+				Client->Write(pathbuf, sizeof(pathbuf));
+				Return(name.length());
+			}
+			break;
+		}
+		case Command::FileNextDirStat: {
+			int fd = GetFD();
+			if (!OpenDirs.count(fd)) {
+				Stat s;
+				s.Write(Client);
+				Return(1);
+			} else {
+				OpenDirs[fd].first[OpenDirs[fd].second++].Write(Client);
+				Return(0);
+			}
+			break;
+		}
+		case Command::FileNextDirCache: {
+			vector<unsigned char> cache(DIRNEXT_CACHE_SIZE, 0);
+			int fd = GetFD();
+			Trace(Command::FileNextDirCache, fd);
+			int ret = (OpenDirs.count(fd) && FillDirCache(OpenDirs[fd], &cache[0])) ? 0 : -1;
+			Client->Write(&cache[0], cache.size());
+			Return(ret);
 			break;
 		}
 		default:
-			return true;
+			break;
 	}
 	return true;
 }
@@ -38,43 +38,81 @@
 #include <list>
 #include <utility>
 #include <map>
+#include <unordered_map>
 
 #ifdef _WIN32
 
 #define WIN32_LEAN_AND_MEAN
+// sockets one select() can watch, Poll_Add refuses any more
+#define FD_SETSIZE 1024
 #include <windows.h>
 #include <direct.h>
+#include <io.h>
 #include <winsock2.h>
 
 #define THREAD __stdcall
 #define getcwd _getcwd
 #define stat _stat
 #define mkdir _mkdir
+#define O_ACCMODE (_O_RDONLY|_O_WRONLY|_O_RDWR)
 #define MIN(a, b) min(a, b)
+#define MAX(a, b) max(a, b)
 #define MSG_TOO_BIG (WSAGetLastError()==WSAEMSGSIZE)
+#define WOULD_BLOCK (WSAGetLastError()==WSAEWOULDBLOCK)
+
+#if _MSC_VER < 1600
+using std::tr1::unordered_map;
+#endif
 
 typedef unsigned __int64 u64;
 typedef HANDLE OSLock;
+typedef HANDLE OSSem;
 typedef int socklen_t;
 
+// file handles, as functions so members like f.close() keep their names
+static inline int File_Open(const char *path, int flags, int mode) { return _open(path, flags, mode); }
+static inline int File_Read(int fd, void *buf, int len) { return _read(fd, buf, len); }
+static inline int File_Write(int fd, const void *buf, int len) { return _write(fd, buf, len); }
+static inline int File_Close(int fd) { return _close(fd); }
+static inline int File_Dup(int fd) { return _dup(fd); }
+static inline __int64 File_Seek(int fd, __int64 offset, int whence) { return _lseeki64(fd, offset, whence); }
+static inline int File_Stat(int fd, struct _stat *st) { return _fstat(fd, st); }
+
 #else
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
 
 #define THREAD
 #define mkdir(a) mkdir(a, 0777)
 #define MIN(a,b) (((a) < (b)) ? (a) : (b))
+#define MAX(a,b) (((a) > (b)) ? (a) : (b))
 #define MSG_TOO_BIG 0
+#define WOULD_BLOCK (errno==EAGAIN || errno==EWOULDBLOCK)
 #define closesocket close
+#define O_BINARY 0
 
 typedef unsigned long long u64;
 typedef void* OSLock;
+typedef void* OSSem;
 typedef int SOCKET;
 typedef struct sockaddr_in SOCKADDR_IN;
 typedef struct sockaddr SOCKADDR;
 
+static inline int File_Open(const char *path, int flags, int mode) { return open(path, flags, mode); }
+static inline int File_Read(int fd, void *buf, int len) { return read(fd, buf, len); }
+static inline int File_Write(int fd, const void *buf, int len) { return write(fd, buf, len); }
+static inline int File_Close(int fd) { return close(fd); }
+static inline int File_Dup(int fd) { return dup(fd); }
+static inline long long File_Seek(int fd, long long offset, int whence) { return lseek(fd, offset, whence); }
+static inline int File_Stat(int fd, struct stat *st) { return fstat(fd, st); }
+
 #endif
 
 #if defined(__BYTE_ORDER) && __BYTE_ORDER == __BIG_ENDIAN
@@ -112,27 +150,78 @@ public:
 
 DirectoryInfo* CreateDirectoryInfo(string);
 
-// 2MB buffer
-#define TCP_BUFFER_LEN 0x400*0x400*2
-
+// size of a single recv() from a client socket
+#define TCP_RECV_LEN 0x10000
+// input buffered for a client before the reactor stops reading its socket
+#define TCP_INPUT_MAX 0x100000
+#ifdef _WIN32
+// a dup()ed CRT handle shares its file pointer, so reading a queued range
+// from the reactor would race the worker's reads: always copy
+#define SENDFILE_MIN 0x7FFFFFFF
+#else
+// smaller reads are cheaper to copy than to set up a sendfile() for
+#define SENDFILE_MIN 0x10000
+#endif
+// memory for pages read ahead of the clients
+#define PAGE_CACHE_SIZE 0x4000000
+#define PREFETCH_THREADS 2
+
+/* Clients are driven by the Reactor: it fills the input buffer as data
+ * arrives, up to TCP_INPUT_MAX while a whole request is already waiting,
+ * and drains the output queue when the socket is writable.
+ * Read/Write only ever touch the buffers so Connection::WaitForAction
+ * never blocks on the network.
+ */
 class TcpClient
 {
 private:
-	char buffer[TCP_BUFFER_LEN];
+	// a piece of queued output: buffered bytes, a file range or zero fill
+	struct Segment
+	{
+		enum Type
+		{
+			Buffer,
+			File,
+			Zero
+		} type;
+		vector<char> data;
+		int fd;
+		u64 offset;
+		u64 length;
+		u64 pos;
+	};
+
 	SOCKET sock;
+	OSLock lock;
+	vector<char> inbuf;
+	size_t inpos;
+	list<Segment> out;
+	vector<char> spare;
+	vector<char>& OutBuffer();
+	int FlushSegment(Segment&);
 public:
 	bool Connected;
 	string RemoteEndPoint;
+	unsigned int Address;
+	unsigned short Port;
 
-	TcpClient(SOCKET s, string ep);
+	TcpClient(SOCKET s, unsigned int address, unsigned short port);
 	~TcpClient();
 	void Close();
+	SOCKET Socket() { return sock; }
 	int Read(void *data, int len);
 	int Write(void *data, int len);
-	int Read(ofstream*, int);
-	int Write(ifstream*, int);
+	int WriteFromFile(int fd, int len);
+	int SendFile(int fd, u64 offset, int len);
 	template<class Type> int Write(Type *a)	{return Write((void*)a, sizeof(Type));}
 	void Pad(int len);
+
+	// reactor side
+	bool Receive();
+	bool Flush();
+	int Available();
+	bool Peek(void *data, int offset, int len);
+	bool Pending();
 };
 
 class TcpListener
@@ -148,15 +237,40 @@ public:
 	int Start();
 	void CheckForBroadcast();
 	TcpClient *AcceptTcpClient();
+	SOCKET Socket() { return listen_socket; }
+};
+
+typedef void* OSPoll;
+
+struct PollEvent
+{
+	void *Context;
+	bool Read;
+	bool Write;
+	bool Error;
 };
 
 void NetworkInit();
-void Thread_Sleep(int);
+void Socket_SetNonBlocking(SOCKET);
+int Socket_SendFile(SOCKET, int fd, u64 offset, int len);
+void Thread_Sleep(int ms);
 void *Thread_Create(void*, void*);
 void Thread_Start(void*);
 OSLock CreateLock();
 void GetLock(OSLock);
 void ReleaseLock(OSLock);
+void DestroyLock(OSLock);
+OSSem CreateSem();
+void PostSem(OSSem);
+void WaitSem(OSSem);
+OSPoll Poll_Create();
+bool Poll_Add(OSPoll, SOCKET, void*);
+bool Poll_Modify(OSPoll, SOCKET, void*, bool read, bool write);
+void Poll_Remove(OSPoll, SOCKET);
+int Poll_Wait(OSPoll, PollEvent*, int max);
+long Atomic_Add(volatile long*, long);
+long Atomic_CompareExchange(volatile long*, long exchange, long comparand);
+u64 Clock_Now();
 string ip_to_string(unsigned int ip, unsigned short port);
 
 class Action
@@ -164,8 +278,9 @@ class Action
 public:
 	enum Enum
 	{
-		Send	= 0x01,
-		Receive = 0x02
+		Send		= 0x01,
+		Receive		= 0x02,
+		Compound	= 0x03
 	};
 };
 
@@ -184,6 +299,7 @@ public:
 		SeekWhence			= 0x07,
 		RenameSource		= 0x08,
 		RenameDestination	= 0x09,
+		Offset				= 0x0A,
 		Ping				= 0x10
 	};
 };
@@ -208,6 +324,8 @@ public:
 		FileCreate			= 0x18,
 		FileDelete			= 0x19,
 		FileRename			= 0x1A,
+		FileReadAt			= 0x1B,
+		FileWriteAt			= 0x1C,
 
 		FileCreateDir		= 0x20,
 		FileOpenDir			= 0x21,
@@ -216,6 +334,133 @@ public:
 		FileNextDirStat		= 0x24,
 		FileNextDirCache	= 0x25
 	};
+
+	static const char *Name(int command)
+	{
+		switch (command)
+		{
+			case Command::Handshake:		return "Handshake";
+			case Command::Goodbye:			return "Goodbye";
+			case Command::Log:				return "Log";
+			case Command::FileOpen:			return "File_Open";
+			case Command::FileRead:			return "File_Read";
+			case Command::FileWrite:		return "File_Write";
+			case Command::FileSeek:			return "File_Seek";
+			case Command::FileTell:			return "File_Tell";
+			case Command::FileSync:			return "File_Sync";
+			case Command::FileClose:		return "File_Close";
+			case Command::FileStat:			return "File_Stat";
+			case Command::FileCreate:		return "File_Create";
+			case Command::FileDelete:		return "File_Delete";
+			case Command::FileRename:		return "File_Rename";
+			case Command::FileCreateDir:	return "File_CreateDir";
+			case Command::FileOpenDir:		return "File_OpenDir";
+			case Command::FileCloseDir:		return "File_CloseDir";
+			case Command::FileNextDirPath:	return "File_NextDir";
+			case Command::FileNextDirCache:	return "File_NextDirCache";
+			default:						return "Unknown";
+		}
+	}
+};
+
+class LogLevel
+{
+public:
+	enum Enum
+	{
+		Off		= 0,
+		Ops		= 1,
+		Debug	= 2
+	};
+};
+
+/* One log entry. Filled in on the hot path with nothing but copies, the
+ * flusher turns it into text. The same layout (host byte order) is what
+ * gets written to a trace file, behind a TRACE_MAGIC header holding the
+ * format version and sizeof(LogRecord).
+ */
+struct LogRecord
+{
+	enum Kind
+	{
+		Message		= 0x00,
+		Op			= 0x01,
+		Option		= 0x02
+	};
+
+	u64 Time;				// microseconds since the epoch, when the op started
+	unsigned int Elapsed;	// microseconds until it returned
+	unsigned int Address;	// client, 0 for the server itself
+	unsigned short Port;
+	unsigned char Kind;
+	unsigned char Level;
+	int Command;			// Command::Enum for ops, Option::Enum for options
+	int File;
+	int Result;
+	u64 Args[2];			// lengths, positions, seek where/whence, open mode
+	char Text[80];			// path(s), NUL separated, or the message
+};
+
+#define TRACE_MAGIC "RIIFSTRC"
+#define TRACE_VERSION 1
+
+/* Log entries go through a fixed ring that any thread can add to without
+ * taking a lock; a background thread formats them for the console and
+ * appends ops to the trace file. If the flusher falls behind entries are
+ * dropped and counted instead of blocking the client.
+ */
+class Logger
+{
+private:
+	static const int RING_SIZE = 0x1000;
+	struct Slot
+	{
+		volatile long Sequence;
+		LogRecord Record;
+	};
+
+	Slot ring[RING_SIZE];
+	volatile long head;
+	long tail;
+	volatile long dropped;
+	ofstream trace;
+
+	static void THREAD Flusher(void*);
+	void Format(const LogRecord&);
+public:
+	LogLevel::Enum Level;
+	bool Tracing;
+
+	Logger();
+	bool Start(LogLevel::Enum, string trace_file);
+	static bool ParseLevel(string, LogLevel::Enum&);
+	// ops are wanted for the trace file even with the console quiet
+	bool Wants(LogLevel::Enum level) { return Level >= level || (level == LogLevel::Ops && Tracing); }
+	void Write(const LogRecord&);
+	void Print(LogLevel::Enum, const string&, unsigned int address=0, unsigned short port=0);
+	static void SetText(LogRecord&, const string&, const string &second="");
+};
+
+extern Logger Log;
+
+/* Identifiers handed out in Stats, used by the client to reopen files
+ * through /mnt/identifier/<id>. Lookups go both ways: path->id through
+ * the hash, id->path through the dense vector. When a store file is
+ * given every new path is appended to it, so ids survive a restart.
+ */
+class FileIdTable
+{
+private:
+	OSLock lock;
+	unordered_map<string, u64> ids;
+	vector<string> paths;
+	ofstream store;
+public:
+	FileIdTable();
+	~FileIdTable();
+	bool Load(string);
+	u64 Get(const string&);
+	bool Lookup(u64, string&);
 };
 
 class Stat
@@ -226,43 +471,163 @@ public:
 	u64 Size;
 	int Mode;
 	u64 Identifier;
-	static vector<string> IDs;
+	static FileIdTable IDs;
+	static const int Size_Packed = 24;
 
 	Stat() : Device(0),Size(0),Mode(0),Identifier(0) {}
 	Stat(FileInfo);
 	Stat(DirectoryInfo*);
+	void Write(unsigned char*);
 	void Write(TcpClient*);
 };
 
+// identifies one page of one version of a file in the PageCache
+struct PageKey
+{
+	u64 Device;
+	u64 Inode;
+	u64 MTime;
+	u64 Size;
+	u64 Page;
+};
+
+bool operator==(const PageKey&, const PageKey&);
+
+struct PageKeyHash
+{
+	size_t operator()(const PageKey&) const;
+};
+
+class OpenFile
+{
+public:
+	int Handle;
+	bool Readable;
+	string Path;
+	PageKey Key;
+	// where the next read starts if the client keeps reading sequentially
+	u64 NextRead;
+	// end of the range already handed to the prefetch threads
+	u64 ReadAheadEnd;
+	int Sequential;
+
+	OpenFile() : Handle(-1),Readable(false) {}
+	OpenFile(int handle, bool readable, string path);
+	void Refresh();
+};
+
+/* Pages of recently read files, shared by all connections. Once a file is
+ * being read sequentially the next READAHEAD chunks are loaded by the
+ * prefetch threads, so by the time the client asks for them FileRead can
+ * answer from memory instead of waiting on the disk. Pages still being
+ * loaded are kept as placeholders so a range is only requested once.
+ */
+class PageCache
+{
+private:
+	struct Page
+	{
+		PageKey Key;
+		u64 Serial;
+		bool Ready;
+		vector<char> Data;
+		list<Page*>::iterator LRU;
+	};
+	struct Job
+	{
+		string Path;
+		vector<pair<PageKey, u64> > Pages;
+	};
+
+	OSLock lock;
+	OSSem sem;
+	unordered_map<PageKey, Page*, PageKeyHash> pages;
+	list<Page*> lru;
+	list<Job> jobs;
+	size_t capacity;
+	u64 serial;
+	u64 hits;
+	u64 misses;
+	u64 prefetched;
+	u64 reported;
+
+	static void THREAD Prefetcher(void*);
+	Page* Insert(const PageKey&);
+	void Erase(Page*);
+	void ReadAhead(OpenFile&, u64 offset, int length);
+public:
+	static const int PAGE_SIZE = 0x10000;
+	static const int READAHEAD = 8;
+
+	PageCache();
+	bool Start(size_t size, int threads);
+	int Read(OpenFile&, u64 offset, int length, TcpClient*);
+	void Invalidate(const PageKey&);
+	string Report();
+};
+
 class Connection
 {
 private:
 	static const string FileIdPath;
-	static const int ServerVersion = 0x04;
+	static const int ServerVersion = 0x05;
 	static const int MAXPATHLEN = 1024;
 	static const int DIRNEXT_CACHE_SIZE = 0x1000;
 public:
+	static PageCache Cache;
 	string Root;
 	map<Option::Enum, vector<unsigned char> > Options;
-	map<int, fstream*> OpenFiles;
+	map<int, OpenFile> OpenFiles;
 	map<int, pair<vector<Stat>, int> > OpenDirs;
 	int OpenFileFD;
 
 	time_t LastPing;
-	string Name;
 
 	TcpClient *Client;
+	// the op being run, logged by Return
+	LogRecord Op;
+	OSLock StateLock;
+	bool Busy;
+	bool Closing;
 
 	Connection(string, TcpClient*);
 	~Connection();
-	static void THREAD Run(void*);
+	bool ActionReady();
+	bool Finished();
 	vector<unsigned char> GetData(int);
 	string GetPath();
 	string GetPath(vector<unsigned char>);
 	unsigned int GetBE32();
 	int GetFD();
-	void DebugPrint(string);
+	static int OpenFlags(int);
+	bool FillDirCache(pair<vector<Stat>, int>&, unsigned char*);
+	void Print(LogLevel::Enum, const string&);
+	void Trace(int command, int fd, u64 arg0=0, u64 arg1=0, const string &text="", const string &second="");
 	void Close();
 	void Return(int);
 	bool WaitForAction();
+	bool RunCommand(Command::Enum);
+};
+
+class Reactor
+{
+private:
+	static const int MAX_EVENTS = 64;
+
+	OSPoll poll;
+	TcpListener *listener;
+	string Root;
+	list<Connection*> queue;
+	OSLock queue_lock;
+	OSSem queue_sem;
+public:
+	Reactor(string root, TcpListener*);
+	bool Start(int workers);
+	void Run();
+private:
+	static void THREAD Worker(void*);
+	void Accept();
+	void Dispatch(Connection*);
+	void Update(Connection*);
+	void HandleEvent(Connection*, PollEvent&);
 };
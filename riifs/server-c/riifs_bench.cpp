@@ -0,0 +1,174 @@
+/*
+ * RiiFS server-c read benchmark
+ *
+ * This file is part of RiiFS server-c.
+ *
+ * server-c is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * server-c is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with server-c; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Reads a file from a running server the same way the Wii client does
+ * (File option, Length option, FileRead) and reports throughput. Given
+ * the server's pid it also reports the CPU time the server spent per GB,
+ * taken from /proc, so builds can be compared against each other.
+ *
+ * Usage: riifs_bench <host> <port> <path> [chunk size] [passes] [server pid]
+ */
+
+#include "riifs.h"
+
+#include <netdb.h>
+#include <sys/time.h>
+
+static int sock;
+
+static bool SendAll(const void *data, int len)
+{
+	const char *p = (const char*)data;
+	while (len > 0) {
+		int ret = send(sock, p, len, 0);
+		if (ret <= 0)
+			return false;
+		p += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+static bool RecvAll(void *data, int len)
+{
+	char *p = (char*)data;
+	while (len > 0) {
+		int ret = recv(sock, p, len, 0);
+		if (ret <= 0)
+			return false;
+		p += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+static bool SendOption(int option, const void *data, int len)
+{
+	unsigned int message[3] = {htonl(Action::Send), htonl(option), htonl(len)};
+	return SendAll(message, sizeof(message)) && SendAll(data, len);
+}
+
+static bool SendInt(int option, int value)
+{
+	value = htonl(value);
+	return SendOption(option, &value, 4);
+}
+
+static int ReceiveCommand(int command, void *data=NULL, int len=0)
+{
+	unsigned int message[2] = {htonl(Action::Receive), htonl(command)};
+	int ret;
+	if (!SendAll(message, sizeof(message)) || (len && !RecvAll(data, len)) || !RecvAll(&ret, 4))
+		return -1;
+	return (int)ntohl(ret);
+}
+
+// utime+stime of a process in clock ticks
+static u64 ProcessTicks(int pid)
+{
+	char path[64];
+	sprintf(path, "/proc/%d/stat", pid);
+	ifstream stat(path);
+	string field;
+	u64 utime = 0, stime = 0;
+	// skip pid, comm (no spaces in "riifs") and the 11 fields before utime
+	for (int i=0; i < 13 && stat >> field; i++);
+	stat >> utime >> stime;
+	return utime + stime;
+}
+
+static double Now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 4) {
+		cout << "Usage: riifs_bench <host> <port> <path> [chunk size] [passes] [server pid]" << endl;
+		return -1;
+	}
+
+	int chunk = argc > 4 ? atoi(argv[4]) : 0x8000;
+	int passes = argc > 5 ? atoi(argv[5]) : 1;
+	int pid = argc > 6 ? atoi(argv[6]) : 0;
+
+	struct hostent *host = gethostbyname(argv[1]);
+	if (host == NULL) {
+		cout << "Couldn't resolve " << argv[1] << endl;
+		return -1;
+	}
+
+	SOCKADDR_IN saddr;
+	memset(&saddr, 0, sizeof(saddr));
+	saddr.sin_family = AF_INET;
+	saddr.sin_port = htons(atoi(argv[2]));
+	memcpy(&saddr.sin_addr, host->h_addr_list[0], sizeof(saddr.sin_addr));
+
+	sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	int nodelay = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char*)&nodelay, sizeof(nodelay));
+	if (connect(sock, (SOCKADDR*)&saddr, sizeof(saddr)) < 0) {
+		cout << "Couldn't connect to " << argv[1] << ':' << argv[2] << endl;
+		return -1;
+	}
+
+	if (!SendOption(Option::Handshake, "1.03", 4) || ReceiveCommand(Command::Handshake) < 0) {
+		cout << "Handshake failed" << endl;
+		return -1;
+	}
+
+	vector<char> buffer(chunk);
+	u64 total = 0;
+	u64 ticks = pid ? ProcessTicks(pid) : 0;
+	double start = Now();
+
+	for (int pass=0; pass < passes; pass++) {
+		SendOption(Option::Path, argv[3], strlen(argv[3]));
+		SendInt(Option::Mode, 0);
+		int fd = ReceiveCommand(Command::FileOpen);
+		if (fd < 0) {
+			cout << "Couldn't open " << argv[3] << endl;
+			return -1;
+		}
+
+		SendInt(Option::File, fd);
+		SendInt(Option::Length, chunk);
+		int ret;
+		while ((ret = ReceiveCommand(Command::FileRead, &buffer[0], chunk)) > 0)
+			total += ret;
+
+		ReceiveCommand(Command::FileClose);
+	}
+
+	double elapsed = Now() - start;
+	ticks = pid ? ProcessTicks(pid) - ticks : 0;
+	ReceiveCommand(Command::Goodbye);
+	closesocket(sock);
+
+	double mb = total / (1024.0 * 1024.0);
+	cout << "Read " << mb << " MB in " << elapsed << " s (" << (mb / elapsed) << " MB/s, chunk " << chunk << ")" << endl;
+	if (pid && total)
+		cout << "Server CPU: " << (ticks * 1000.0 / sysconf(_SC_CLK_TCK)) / (total / (1024.0 * 1024.0 * 1024.0)) << " ms/GB" << endl;
+
+	return 0;
+}
@@ -0,0 +1,299 @@
+/*
+ * RiiFS server-c read-ahead page cache
+ *
+ * This file is part of RiiFS server-c.
+ *
+ * server-c is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * server-c is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with server-c; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "riifs.h"
+
+bool operator==(const PageKey &a, const PageKey &b)
+{
+	return a.Page==b.Page && a.Inode==b.Inode && a.Device==b.Device && a.MTime==b.MTime && a.Size==b.Size;
+}
+
+size_t PageKeyHash::operator()(const PageKey &key) const
+{
+	u64 hash = (key.Inode * 0x9E3779B97F4A7C15ULL) ^ key.Page;
+	hash = (hash * 0x9E3779B97F4A7C15ULL) ^ key.Device ^ (key.MTime << 20) ^ key.Size;
+	return (size_t)(hash ^ (hash >> 32));
+}
+
+OpenFile::OpenFile(int handle, bool readable, string path) :
+Handle(handle),
+Readable(readable),
+Path(path),
+NextRead(0),
+ReadAheadEnd(0),
+Sequential(0)
+{
+	Refresh();
+}
+
+// pick up the file's current identity, pages of older versions won't match it
+void OpenFile::Refresh()
+{
+	struct stat st;
+	memset(&Key, 0, sizeof(Key));
+	if (File_Stat(Handle, &st)!=0)
+		return;
+
+	Key.Device = st.st_dev;
+#ifdef _WIN32
+	// no inode numbers, the identifier table gives every path its own
+	Key.Inode = Stat::IDs.Get(Path);
+#else
+	Key.Inode = st.st_ino;
+#endif
+	Key.MTime = st.st_mtime;
+	Key.Size = st.st_size;
+}
+
+PageCache::PageCache() :
+capacity(0),
+serial(0),
+hits(0),
+misses(0),
+prefetched(0),
+reported(0)
+{
+	lock = CreateLock();
+	sem = CreateSem();
+}
+
+bool PageCache::Start(size_t size, int threads)
+{
+	capacity = size / PAGE_SIZE;
+	for (int i=0; i < threads; i++) {
+		void *thread = Thread_Create((void*)Prefetcher, this);
+		if (thread==NULL)
+			return false;
+		Thread_Start(thread);
+	}
+	return true;
+}
+
+// a placeholder for a page about to be loaded, NULL if the cache is full of them (lock must be held)
+PageCache::Page* PageCache::Insert(const PageKey &key)
+{
+	// evict the least recently used pages, pages still loading stay
+	list<Page*>::iterator iter = lru.end();
+	while (pages.size() >= capacity && iter != lru.begin())
+	{
+		Page *page = *--iter;
+		if (page->Ready) {
+			++iter;
+			Erase(page);
+		}
+	}
+	if (pages.size() >= capacity)
+		return NULL;
+
+	Page *page = new Page;
+	page->Key = key;
+	page->Serial = serial++;
+	page->Ready = false;
+	page->LRU = lru.insert(lru.begin(), page);
+	pages.insert(unordered_map<PageKey, Page*, PageKeyHash>::value_type(key, page));
+	return page;
+}
+
+// (lock must be held)
+void PageCache::Erase(Page *page)
+{
+	lru.erase(page->LRU);
+	pages.erase(page->Key);
+	delete page;
+}
+
+// count sequential reads and queue the pages the next READAHEAD of them need (lock must be held)
+void PageCache::ReadAhead(OpenFile &file, u64 offset, int length)
+{
+	file.Sequential = offset == file.NextRead ? file.Sequential+1 : 0;
+	file.NextRead = offset + length;
+	if (file.Sequential == 0) {
+		file.ReadAheadEnd = 0;
+		return;
+	}
+
+	// never more than a quarter of the cache for one file
+	u64 window = MIN((u64)length * READAHEAD, (u64)(capacity / 4) * PAGE_SIZE);
+	u64 start = offset + length;
+	// top up in batches once half the window has been used
+	if (file.ReadAheadEnd > start + window / 2)
+		return;
+	u64 end = MIN(start + window, file.Key.Size);
+	start = MAX(start, file.ReadAheadEnd);
+	file.ReadAheadEnd = end;
+
+	Job job;
+	PageKey key = file.Key;
+	for (key.Page = start / PAGE_SIZE; key.Page * PAGE_SIZE < end; key.Page++)
+	{
+		if (pages.count(key))
+			continue;
+		Page *page = Insert(key);
+		if (page == NULL)
+			break;
+		job.Pages.push_back(make_pair(key, page->Serial));
+	}
+
+	if (job.Pages.empty())
+		return;
+	job.Path = file.Path;
+	jobs.push_back(job);
+	PostSem(sem);
+}
+
+/* Answer a read at offset from the cache and note the access for the
+ * read-ahead. Returns the number of bytes written to the client, or -1 if
+ * any page of the range is missing so the caller has to go to the disk.
+ */
+int PageCache::Read(OpenFile &file, u64 offset, int length, TcpClient *client)
+{
+	if (capacity == 0)
+		return -1;
+
+	GetLock(lock);
+	ReadAhead(file, offset, length);
+
+	int ret = -1;
+	vector<Page*> found;
+	if (offset < file.Key.Size)
+	{
+		u64 end = MIN(offset + length, file.Key.Size);
+		PageKey key = file.Key;
+		for (key.Page = offset / PAGE_SIZE; key.Page * PAGE_SIZE < end; key.Page++)
+		{
+			unordered_map<PageKey, Page*, PageKeyHash>::iterator iter = pages.find(key);
+			if (iter == pages.end() || !iter->second->Ready) {
+				found.clear();
+				break;
+			}
+			found.push_back(iter->second);
+		}
+
+		for (size_t i=0; i < found.size(); i++)
+		{
+			Page *page = found[i];
+			u64 start = page->Key.Page * PAGE_SIZE;
+			u64 from = MAX(offset, start) - start;
+			u64 to = MIN(end - start, (u64)page->Data.size());
+			ret = MAX(ret, 0);
+			if (to > from)
+				ret += client->Write(&page->Data[(size_t)from], (int)(to - from));
+			lru.splice(lru.begin(), lru, page->LRU);
+			// the file was shorter than its size when the page was read
+			if (to < MIN(end - start, (u64)PAGE_SIZE))
+				break;
+		}
+	}
+
+	if (ret < 0)
+		misses++;
+	else
+		hits++;
+	ReleaseLock(lock);
+	return ret;
+}
+
+// drop every page of a file that was written to
+void PageCache::Invalidate(const PageKey &key)
+{
+	GetLock(lock);
+	unordered_map<PageKey, Page*, PageKeyHash>::iterator iter = pages.begin();
+	while (iter != pages.end())
+	{
+		Page *page = iter->second;
+		if (page->Key.Device == key.Device && page->Key.Inode == key.Inode) {
+			lru.erase(page->LRU);
+			iter = pages.erase(iter);
+			delete page;
+		} else
+			++iter;
+	}
+	ReleaseLock(lock);
+}
+
+// one line of statistics for the log, empty if nothing was read since the last one
+string PageCache::Report()
+{
+	ostringstream s;
+	GetLock(lock);
+	if (hits + misses != reported) {
+		reported = hits + misses;
+		s << "Page cache: " << hits << " hits, " << misses << " misses (" << (int)(hits * 100 / reported) << "%), ";
+		s << (prefetched >> 20) << " MB prefetched, " << pages.size() << '/' << capacity << " pages";
+	}
+	ReleaseLock(lock);
+	return s.str();
+}
+
+void PageCache::Prefetcher(void *_p)
+{
+	PageCache *cache = (PageCache*)_p;
+	while (true)
+	{
+		Job job;
+		WaitSem(cache->sem);
+		GetLock(cache->lock);
+		job.Path.swap(cache->jobs.front().Path);
+		job.Pages.swap(cache->jobs.front().Pages);
+		cache->jobs.pop_front();
+		ReleaseLock(cache->lock);
+
+		// a handle of our own so the client's file position doesn't move,
+		// it has to still be the version the pages were asked for
+		const PageKey &first = job.Pages[0].first;
+		struct stat st;
+		int file = File_Open(job.Path.c_str(), O_RDONLY|O_BINARY, 0);
+		if (file >= 0 && (File_Stat(file, &st)!=0 || (u64)st.st_size != first.Size || (u64)st.st_mtime != first.MTime)) {
+			File_Close(file);
+			file = -1;
+		}
+
+		for (size_t i=0; i < job.Pages.size(); i++)
+		{
+			const PageKey &key = job.Pages[i].first;
+			vector<char> data(PAGE_SIZE);
+			int ret = 0;
+			if (file >= 0 && File_Seek(file, key.Page * PAGE_SIZE, SEEK_SET) >= 0) {
+				int got;
+				while (ret < PAGE_SIZE && (got = File_Read(file, &data[ret], PAGE_SIZE-ret)) > 0)
+					ret += got;
+			}
+
+			GetLock(cache->lock);
+			unordered_map<PageKey, Page*, PageKeyHash>::iterator iter = cache->pages.find(key);
+			// skip pages dropped or replaced while this one was read
+			if (iter != cache->pages.end() && iter->second->Serial == job.Pages[i].second) {
+				Page *page = iter->second;
+				if (ret <= 0)
+					cache->Erase(page);
+				else {
+					data.resize(ret);
+					page->Data.swap(data);
+					page->Ready = true;
+					cache->prefetched += ret;
+				}
+			}
+			ReleaseLock(cache->lock);
+		}
+
+		if (file >= 0)
+			File_Close(file);
+	}
+}
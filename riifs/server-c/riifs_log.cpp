@@ -0,0 +1,232 @@
+/*
+ * RiiFS server-c logging
+ *
+ * This file is part of RiiFS server-c.
+ *
+ * server-c is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * server-c is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with server-c; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "riifs.h"
+
+Logger Log;
+
+Logger::Logger() :
+head(0),
+tail(0),
+dropped(0),
+Level(LogLevel::Ops),
+Tracing(false)
+{
+	for (int i=0; i < RING_SIZE; i++)
+		ring[i].Sequence = i;
+}
+
+bool Logger::Start(LogLevel::Enum level, string trace_file)
+{
+	Level = level;
+	if (!trace_file.empty()) {
+		trace.open(trace_file.c_str(), ios_base::out | ios_base::binary | ios_base::trunc);
+		if (!trace)
+			return false;
+		unsigned int header[2] = {TRACE_VERSION, sizeof(LogRecord)};
+		trace.write(TRACE_MAGIC, 8);
+		trace.write((char*)header, sizeof(header));
+		Tracing = true;
+	}
+
+	void *thread = Thread_Create((void*)Flusher, this);
+	if (thread==NULL)
+		return false;
+	Thread_Start(thread);
+	return true;
+}
+
+bool Logger::ParseLevel(string name, LogLevel::Enum &level)
+{
+	if (name == "off")
+		level = LogLevel::Off;
+	else if (name == "ops")
+		level = LogLevel::Ops;
+	else if (name == "debug")
+		level = LogLevel::Debug;
+	else
+		return false;
+	return true;
+}
+
+// copy text into the record, keeping the ends of paths if they don't fit
+void Logger::SetText(LogRecord &record, const string &text, const string &second)
+{
+	bool tail = record.Kind == LogRecord::Op;
+	size_t room = second.empty() ? sizeof(record.Text)-1 : sizeof(record.Text)/2-1;
+	size_t length = MIN(text.length(), room);
+	memcpy(record.Text, text.data() + (tail ? text.length()-length : 0), length);
+	record.Text[length] = '\0';
+	if (!second.empty()) {
+		char *dest = record.Text + length + 1;
+		size_t second_length = MIN(second.length(), room);
+		memcpy(dest, second.data() + (tail ? second.length()-second_length : 0), second_length);
+		dest[second_length] = '\0';
+	}
+}
+
+// claim the next free slot and fill it in, never waits for the flusher
+void Logger::Write(const LogRecord &record)
+{
+	long pos = head;
+	while (true)
+	{
+		Slot &slot = ring[pos & (RING_SIZE-1)];
+		long diff = Atomic_Add(&slot.Sequence, 0) - pos;
+		if (diff == 0) {
+			long current = Atomic_CompareExchange(&head, pos+1, pos);
+			if (current == pos) {
+				slot.Record = record;
+				// publish it
+				Atomic_Add(&slot.Sequence, 1);
+				return;
+			}
+			pos = current;
+		} else if (diff < 0) {
+			Atomic_Add(&dropped, 1);
+			return;
+		} else
+			pos = head;
+	}
+}
+
+void Logger::Print(LogLevel::Enum level, const string &text, unsigned int address, unsigned short port)
+{
+	if (!Wants(level))
+		return;
+	LogRecord record;
+	memset(&record, 0, sizeof(record));
+	record.Time = Clock_Now();
+	record.Address = address;
+	record.Port = port;
+	record.Kind = LogRecord::Message;
+	record.Level = level;
+	SetText(record, text);
+	Write(record);
+}
+
+// turn a record into the console line the old synchronous log printed
+void Logger::Format(const LogRecord &record)
+{
+	static time_t last = 0;
+	static char time_string[100];
+	time_t now = (time_t)(record.Time / 1000000);
+	if (now != last) {
+		struct tm *tm_now = localtime(&now);
+		strftime(time_string, sizeof(time_string)-1, "%m/%d/%Y %I:%M:%S %p", tm_now);
+		last = now;
+	}
+
+	cout << '[' << time_string << "] - ";
+	if (record.Address || record.Port)
+		cout << ip_to_string(record.Address, record.Port) << " - ";
+
+	const char *second = record.Text + strlen(record.Text) + 1;
+	switch (record.Kind)
+	{
+		case LogRecord::Message:
+			cout << record.Text;
+			break;
+		case LogRecord::Option:
+			if (record.Command == Option::Ping)
+				cout << "Ping()";
+			else
+				cout << "Option(" << record.Command << ", " << record.Args[0] << " bytes)";
+			break;
+		case LogRecord::Op:
+			switch (record.Command)
+			{
+				case Command::Handshake:
+					cout << "Handshake: Client Version \"" << record.Text << "\"";
+					break;
+				case Command::Goodbye:
+					cout << "Goodbye";
+					break;
+				case Command::Log:
+					cout << "Log: " << record.Text;
+					break;
+				case Command::FileOpen:
+					cout << "File_Open(\"" << record.Text << "\", " << showbase << hex << record.Args[0] << dec << noshowbase << ");";
+					break;
+				case Command::FileRead:
+				case Command::FileWrite:
+					cout << Command::Name(record.Command) << '(' << record.File << ", " << record.Args[0] << ");";
+					break;
+				case Command::FileSeek:
+					cout << "File_Seek(" << record.File << ", " << (int)record.Args[0] << ", " << (int)record.Args[1] << ");";
+					break;
+				case Command::FileStat:
+				case Command::FileCreate:
+				case Command::FileDelete:
+				case Command::FileCreateDir:
+				case Command::FileOpenDir:
+					cout << Command::Name(record.Command) << "(\"" << record.Text << "\");";
+					break;
+				case Command::FileRename:
+					cout << "File_Rename(\"" << record.Text << "\", \"" << second << "\");";
+					break;
+				default:
+					cout << Command::Name(record.Command) << '(' << record.File << ");";
+					break;
+			}
+			cout << " = " << record.Result;
+			break;
+	}
+	cout << '\n';
+}
+
+void Logger::Flusher(void *_p)
+{
+	Logger *logger = (Logger*)_p;
+	while (true)
+	{
+		int count = 0;
+		while (true)
+		{
+			Slot &slot = logger->ring[logger->tail & (RING_SIZE-1)];
+			if (Atomic_Add(&slot.Sequence, 0) != logger->tail + 1)
+				break;
+			LogRecord record = slot.Record;
+			// hand the slot back for the next time around the ring
+			Atomic_Add(&slot.Sequence, RING_SIZE-1);
+			logger->tail++;
+
+			if (record.Kind == LogRecord::Op && logger->Tracing)
+				logger->trace.write((char*)&record, sizeof(record));
+			if (record.Level <= logger->Level)
+				logger->Format(record);
+			count++;
+		}
+
+		long lost = Atomic_Add(&logger->dropped, 0);
+		if (lost) {
+			Atomic_Add(&logger->dropped, -lost);
+			cout << "Log is falling behind, dropped " << lost << " entries" << '\n';
+			count++;
+		}
+
+		if (count) {
+			cout.flush();
+			if (logger->Tracing)
+				logger->trace.flush();
+		} else
+			Thread_Sleep(20);
+	}
+}
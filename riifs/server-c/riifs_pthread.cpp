@@ -21,12 +21,56 @@
 #include "riifs.h"
 
 #include <pthread.h>
+#include <semaphore.h>
 #include <dirent.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 void NetworkInit()
 {
 }
 
+void Socket_SetNonBlocking(SOCKET s)
+{
+	int flags = fcntl(s, F_GETFL, 0);
+	fcntl(s, F_SETFL, flags | O_NONBLOCK);
+}
+
+int Socket_SendFile(SOCKET s, int fd, u64 offset, int len)
+{
+#ifdef __linux__
+	off_t off = (off_t)offset;
+	return (int)sendfile(s, fd, &off, len);
+#else
+	char buffer[0x10000];
+	int ret = (int)pread(fd, buffer, MIN(len, (int)sizeof(buffer)), (off_t)offset);
+	if (ret <= 0)
+		return ret;
+	return (int)send(s, buffer, ret, 0);
+#endif
+}
+
+void Thread_Sleep(int ms) {
+	usleep(ms * 1000);
+}
+
+long Atomic_Add(volatile long *value, long add) {
+	return __sync_fetch_and_add(value, add);
+}
+
+long Atomic_CompareExchange(volatile long *value, long exchange, long comparand) {
+	return __sync_val_compare_and_swap(value, comparand, exchange);
+}
+
+u64 Clock_Now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (u64)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
 OSLock CreateLock() {
 	pthread_mutex_t *lock = (pthread_mutex_t*)malloc(sizeof(pthread_mutex_t));
 	if (lock)
@@ -42,6 +86,86 @@ void ReleaseLock(OSLock lock) {
 	pthread_mutex_unlock((pthread_mutex_t*)lock);
 }
 
+void DestroyLock(OSLock lock) {
+	if (lock) {
+		pthread_mutex_destroy((pthread_mutex_t*)lock);
+		free(lock);
+	}
+}
+
+OSSem CreateSem() {
+	sem_t *sem = (sem_t*)malloc(sizeof(sem_t));
+	if (sem && sem_init(sem, 0, 0)) {
+		free(sem);
+		sem = NULL;
+	}
+	return sem;
+}
+
+void PostSem(OSSem sem) {
+	sem_post((sem_t*)sem);
+}
+
+void WaitSem(OSSem sem) {
+	while (sem_wait((sem_t*)sem) && errno==EINTR);
+}
+
+OSPoll Poll_Create() {
+	int *epfd = (int*)malloc(sizeof(int));
+	if (epfd) {
+		*epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (*epfd < 0) {
+			free(epfd);
+			epfd = NULL;
+		}
+	}
+	return epfd;
+}
+
+#define POLL_FD(p) (*(int*)(p))
+
+bool Poll_Add(OSPoll poll, SOCKET s, void *context) {
+	return Poll_Modify(poll, s, context, true, false);
+}
+
+bool Poll_Modify(OSPoll poll, SOCKET s, void *context, bool read, bool write) {
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.data.ptr = context;
+
+	// epoll always reports hangups, so an idle socket has to leave the set
+	// or a dead client spins the reactor until its last request finishes
+	if (!read && !write) {
+		Poll_Remove(poll, s);
+		return true;
+	}
+
+	if (read)
+		ev.events |= EPOLLIN | EPOLLRDHUP;
+	if (write)
+		ev.events |= EPOLLOUT;
+
+	if (epoll_ctl(POLL_FD(poll), EPOLL_CTL_MOD, s, &ev)==0)
+		return true;
+	return errno==ENOENT && epoll_ctl(POLL_FD(poll), EPOLL_CTL_ADD, s, &ev)==0;
+}
+
+void Poll_Remove(OSPoll poll, SOCKET s) {
+	epoll_ctl(POLL_FD(poll), EPOLL_CTL_DEL, s, NULL);
+}
+
+int Poll_Wait(OSPoll poll, PollEvent *events, int max) {
+	struct epoll_event ev[64];
+	int count = epoll_wait(POLL_FD(poll), ev, MIN(max, 64), -1);
+	for (int i=0; i < count; i++) {
+		events[i].Context = ev[i].data.ptr;
+		events[i].Read = (ev[i].events & (EPOLLIN|EPOLLRDHUP)) != 0;
+		events[i].Write = (ev[i].events & EPOLLOUT) != 0;
+		events[i].Error = (ev[i].events & (EPOLLERR|EPOLLHUP)) != 0;
+	}
+	return MAX(count, 0);
+}
+
 typedef struct {
 	pthread_mutex_t thread_start;
 	void (*thread_func)(void*);
@@ -115,10 +239,7 @@ public:
 		st.Name = ent->d_name;
 
 		if (!(sta.st_mode & S_IFDIR)) {
-			vector<string>::iterator iter = find(st.IDs.begin(), st.IDs.end(), path);
-			st.Identifier = iter - st.IDs.begin();
-			if (iter == st.IDs.end())
-				st.IDs.push_back(path);
+			st.Identifier = st.IDs.Get(path);
 			st.Size = sta.st_size;
 		}
 
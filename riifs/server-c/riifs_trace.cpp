@@ -0,0 +1,98 @@
+/*
+ * RiiFS server-c trace reader
+ *
+ * This file is part of RiiFS server-c.
+ *
+ * server-c is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * server-c is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with server-c; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Reads a trace written by riifs --trace=<file>. By default every op is
+ * printed as one tab separated line (start time in microseconds, client,
+ * command, file, both arguments, result, microseconds taken, paths), ready
+ * for sort/awk. With -s it prints a summary per command instead: count,
+ * bytes moved by reads and writes, and mean/max time taken.
+ *
+ * Usage: riifs_trace [-s] <trace file>
+ */
+
+#include "riifs.h"
+
+struct Summary
+{
+	u64 Count;
+	u64 Bytes;
+	u64 Elapsed;
+	unsigned int Slowest;
+	Summary() : Count(0),Bytes(0),Elapsed(0),Slowest(0) {}
+};
+
+int main(int argc, char *argv[])
+{
+	bool summary = argc > 2 && !strcmp(argv[1], "-s");
+	if (argc < 2 || (argc > 2 && !summary)) {
+		cout << "Usage: riifs_trace [-s] <trace file>" << endl;
+		return -1;
+	}
+
+	ifstream trace(argv[argc-1], ios_base::in | ios_base::binary);
+	char magic[8];
+	unsigned int header[2];
+	if (!trace.read(magic, sizeof(magic)) || !trace.read((char*)header, sizeof(header)) ||
+		memcmp(magic, TRACE_MAGIC, sizeof(magic)) || header[0] != TRACE_VERSION || header[1] != sizeof(LogRecord)) {
+		cout << argv[argc-1] << " isn't a trace from this version of the server" << endl;
+		return -1;
+	}
+
+	map<int, Summary> commands;
+	LogRecord record;
+	while (trace.read((char*)&record, sizeof(record)))
+	{
+		record.Text[sizeof(record.Text)-1] = '\0';
+		if (summary) {
+			Summary &s = commands[record.Command];
+			s.Count++;
+			if ((record.Command == Command::FileRead || record.Command == Command::FileWrite) && record.Result > 0)
+				s.Bytes += record.Result;
+			s.Elapsed += record.Elapsed;
+			s.Slowest = MAX(s.Slowest, record.Elapsed);
+			continue;
+		}
+
+		cout << record.Time << '\t' << ip_to_string(record.Address, record.Port) << '\t' << Command::Name(record.Command) << '\t';
+		cout << record.File << '\t' << record.Args[0] << '\t' << record.Args[1] << '\t' << record.Result << '\t' << record.Elapsed << '\t' << record.Text;
+		if (record.Command == Command::FileRename)
+			cout << '\t' << record.Text + strlen(record.Text) + 1;
+		cout << '\n';
+	}
+
+	if (summary) {
+		cout << "command\tcount\tbytes\tmean us\tmax us" << endl;
+		for (map<int, Summary>::iterator iter=commands.begin(); iter != commands.end(); ++iter)
+		{
+			Summary &s = iter->second;
+			cout << Command::Name(iter->first) << '\t' << s.Count << '\t' << s.Bytes << '\t';
+			cout << s.Elapsed / s.Count << '\t' << s.Slowest << endl;
+		}
+	}
+
+	return 0;
+}
+
+string ip_to_string(unsigned int hostip, unsigned short port)
+{
+	ostringstream ep;
+	ep << (hostip>>24) << '.' << ((hostip>>16)&0xFF) << '.' << ((hostip>>8)&0xFF) << '.' << (hostip&0xFF) << ':' << port;
+	return ep.str();
+}
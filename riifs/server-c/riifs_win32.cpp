@@ -30,6 +30,43 @@ void NetworkInit()
 	WSAStartup(MAKEWORD(2,2), &wsadata);
 }
 
+void Socket_SetNonBlocking(SOCKET s)
+{
+	u_long nonblocking = 1;
+	ioctlsocket(s, FIONBIO, &nonblocking);
+}
+
+// no sendfile(), and SENDFILE_MIN keeps file ranges out of the output queue
+int Socket_SendFile(SOCKET s, int fd, u64 offset, int len)
+{
+	WSASetLastError(WSAEOPNOTSUPP);
+	return -1;
+}
+
+void Thread_Sleep(int ms)
+{
+	Sleep(ms);
+}
+
+long Atomic_Add(volatile long *value, long add)
+{
+	return InterlockedExchangeAdd(value, add);
+}
+
+long Atomic_CompareExchange(volatile long *value, long exchange, long comparand)
+{
+	return InterlockedCompareExchange(value, exchange, comparand);
+}
+
+// FILETIME counts 100ns intervals from 1601
+u64 Clock_Now()
+{
+	FILETIME ft;
+	GetSystemTimeAsFileTime(&ft);
+	u64 time = ((u64)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+	return (time - 116444736000000000ULL) / 10;
+}
+
 OSLock CreateLock()
 {
 	return CreateMutex(NULL, FALSE, NULL);
@@ -44,6 +81,175 @@ void ReleaseLock(OSLock lock)
 	ReleaseMutex(lock);
 }
 
+void DestroyLock(OSLock lock)
+{
+	CloseHandle(lock);
+}
+
+OSSem CreateSem()
+{
+	return CreateSemaphore(NULL, 0, LONG_MAX, NULL);
+}
+
+void PostSem(OSSem sem)
+{
+	ReleaseSemaphore(sem, 1, NULL);
+}
+
+void WaitSem(OSSem sem)
+{
+	WaitForSingleObject(sem, INFINITE);
+}
+
+/* No epoll here, so the reactor gets a select() loop over the registered
+*  sockets. Workers re-arm sockets from other threads, and a change made
+*  while the reactor sits in select() writes a byte to a loopback socket in
+*  its read set so it starts over with the new set straight away.
+*/
+struct Win32Poll
+{
+	struct Entry
+	{
+		void *Context;
+		bool Read;
+		bool Write;
+	};
+	OSLock lock;
+	map<SOCKET, Entry> sockets;
+	// a UDP socket connected to itself
+	SOCKET wake;
+	bool waiting;
+};
+
+OSPoll Poll_Create()
+{
+	Win32Poll *poll = new Win32Poll;
+	struct sockaddr_in addr;
+	int len = sizeof(addr);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+
+	poll->wake = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (poll->wake == INVALID_SOCKET)
+	{
+		delete poll;
+		return NULL;
+	}
+	if (bind(poll->wake, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR ||
+		getsockname(poll->wake, (struct sockaddr*)&addr, &len) == SOCKET_ERROR ||
+		connect(poll->wake, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR)
+	{
+		closesocket(poll->wake);
+		delete poll;
+		return NULL;
+	}
+	Socket_SetNonBlocking(poll->wake);
+
+	poll->lock = CreateLock();
+	poll->waiting = false;
+	return poll;
+}
+
+// poll->lock must be held
+static void Poll_Wake(Win32Poll *poll)
+{
+	if (poll->waiting)
+	{
+		poll->waiting = false;
+		send(poll->wake, "", 1, 0);
+	}
+}
+
+bool Poll_Add(OSPoll _poll, SOCKET s, void *context)
+{
+	Win32Poll *poll = (Win32Poll*)_poll;
+	// select() can't watch more than FD_SETSIZE, the wake socket included
+	GetLock(poll->lock);
+	bool full = (int)poll->sockets.size()+1 >= FD_SETSIZE;
+	ReleaseLock(poll->lock);
+	if (full)
+		return false;
+	return Poll_Modify(poll, s, context, true, false);
+}
+
+bool Poll_Modify(OSPoll _poll, SOCKET s, void *context, bool read, bool write)
+{
+	Win32Poll *poll = (Win32Poll*)_poll;
+	Win32Poll::Entry entry = {context, read, write};
+	GetLock(poll->lock);
+	poll->sockets[s] = entry;
+	Poll_Wake(poll);
+	ReleaseLock(poll->lock);
+	return true;
+}
+
+void Poll_Remove(OSPoll _poll, SOCKET s)
+{
+	Win32Poll *poll = (Win32Poll*)_poll;
+	GetLock(poll->lock);
+	poll->sockets.erase(s);
+	Poll_Wake(poll);
+	ReleaseLock(poll->lock);
+}
+
+int Poll_Wait(OSPoll _poll, PollEvent *events, int max)
+{
+	Win32Poll *poll = (Win32Poll*)_poll;
+	fd_set to_read, to_write, to_except;
+	char drain[16];
+	int count = 1;
+
+	FD_ZERO(&to_read);
+	FD_ZERO(&to_write);
+	FD_ZERO(&to_except);
+	FD_SET(poll->wake, &to_read);
+
+	GetLock(poll->lock);
+	for (map<SOCKET, Win32Poll::Entry>::iterator iter=poll->sockets.begin(); iter != poll->sockets.end() && count < FD_SETSIZE; ++iter, ++count)
+	{
+		if (iter->second.Read)
+			FD_SET(iter->first, &to_read);
+		if (iter->second.Write)
+			FD_SET(iter->first, &to_write);
+		FD_SET(iter->first, &to_except);
+	}
+	// a change from here on has to wake the select() below
+	poll->waiting = true;
+	ReleaseLock(poll->lock);
+
+	int ret = select(0, &to_read, &to_write, &to_except, NULL);
+
+	GetLock(poll->lock);
+	poll->waiting = false;
+	ReleaseLock(poll->lock);
+	if (ret <= 0)
+		return 0;
+
+	if (FD_ISSET(poll->wake, &to_read))
+	{
+		while (recv(poll->wake, drain, sizeof(drain), 0) > 0)
+			;
+	}
+
+	count = 0;
+	GetLock(poll->lock);
+	for (map<SOCKET, Win32Poll::Entry>::iterator iter=poll->sockets.begin(); iter != poll->sockets.end() && count < max; ++iter)
+	{
+		PollEvent event = {iter->second.Context,
+			FD_ISSET(iter->first, &to_read)!=0,
+			FD_ISSET(iter->first, &to_write)!=0,
+			FD_ISSET(iter->first, &to_except)!=0};
+		if (event.Read || event.Write || event.Error)
+			events[count++] = event;
+	}
+	ReleaseLock(poll->lock);
+
+	return count;
+}
+
 void *Thread_Create(void* start, void* arg)
 {
 	// start might not return an unsigned int, but no matter
@@ -119,10 +325,7 @@ Stat Win32DirectoryInfo::GetNext()
 		st.Mode |= S_IFDIR;
 	else {
 		string path = Parent + "/" + Name + "/" + st.Name;
-		vector<string>::iterator iter = find(st.IDs.begin(), st.IDs.end(), path);
-		st.Identifier = iter - st.IDs.begin();
-		if (iter == st.IDs.end())
-			st.IDs.push_back(path);
+		st.Identifier = st.IDs.Get(path);
 		st.Size = ((u64)FindFileData.nFileSizeHigh << 32) + FindFileData.nFileSizeLow;
 	}
 
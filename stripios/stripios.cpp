@@ -115,9 +115,7 @@ void putbe32(void* pvoid, u32 val)
 	p[3] = val >> 0;
 }
 
-void aes_encrypt(u8 *iv, const u8 *inbuf, u8 *outbuf, u32 len);
-void gkey(int nb,int nk,const u8 *key);
-void gentables(void);
+#include <aes.h>
 
 static inline int bn_compare(const u8 *a, const u8 *b, const u32 n)
 {
@@ -243,8 +241,7 @@ s32 main(s32 argc, char* argv[])
 	for (i=0; i < 32; i++)
 		printf("%02X", aes_key[i]);
 	printf("\n");
-	gentables();
-	gkey(4, 8, aes_key);
+	aes_set_key256(aes_key);
 	memcpy(aes_iv, aes_key+16, 16);
 
 	if (fin == 0 || fout == 0)